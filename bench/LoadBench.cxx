@@ -0,0 +1,1150 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A load generator for a running uoproxy: it plays a fake shard
+ * (login server and game server, which pushes a configurable stream
+ * of mobile, container and speech packets to every game connection)
+ * and a number of simulated clients which log in through the proxy,
+ * optionally with several clients ("heads") attached to each
+ * account.  It reports the throughput, the latency from the fake
+ * shard to the clients and, if the pid of the proxy is known, its
+ * memory and CPU usage per connection.
+ *
+ * uoproxy must be configured with "server 127.0.0.1:PORT" (the port
+ * of "-l").
+ */
+
+#include "PacketLengths.hxx"
+#include "PacketStructs.hxx"
+#include "PacketType.hxx"
+#include "PVersion.hxx"
+#include "Compression.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * The world traffic is generated in steps of this duration.
+ */
+static constexpr auto TICK = std::chrono::milliseconds(10);
+
+/**
+ * All clients must be in game after this duration.
+ */
+static constexpr unsigned LOGIN_TIMEOUT = 30;
+
+struct Options {
+    const char *proxy = "127.0.0.1:2593";
+    unsigned login_port = 12593;
+    unsigned accounts = 10;
+    unsigned heads = 1;
+    unsigned duration = 10;
+    unsigned rate = 100;
+    unsigned mobiles = 30;
+    unsigned containers = 5;
+    unsigned items = 10;
+    pid_t proxy_pid = 0;
+};
+
+static void
+usage()
+{
+    fprintf(stderr,
+            "usage: load-bench [-p HOST:PORT] [-l PORT] [-n ACCOUNTS] [-a HEADS]\n"
+            "                  [-d SECONDS] [-r RATE] [-m MOBILES] [-c CONTAINERS]\n"
+            "                  [-i ITEMS] [-P PID]\n"
+            "\n"
+            " -p  the address of uoproxy (default 127.0.0.1:2593)\n"
+            " -l  the port of the fake login server (default 12593); the\n"
+            "     game server listens on the next port\n"
+            " -n  the number of accounts, i.e. game connections (default 10)\n"
+            " -a  the number of clients attached to each account (default 1)\n"
+            " -d  the duration of the measurement in seconds (default 10)\n"
+            " -r  world packets per second per game connection (default 100)\n"
+            " -m  mobiles around each player (default 30)\n"
+            " -c  containers around each player (default 5)\n"
+            " -i  items per container (default 10)\n"
+            " -P  the pid of uoproxy, for memory and CPU usage\n");
+}
+
+static unsigned
+parse_unsigned(const char *s, unsigned min, unsigned max)
+{
+    char *endptr;
+    unsigned long value = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != 0 || value < min || value > max) {
+        fprintf(stderr, "invalid value: %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+
+    return (unsigned)value;
+}
+
+static void
+parse_cmdline(Options &options, int argc, char **argv)
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "p:l:n:a:d:r:m:c:i:P:h")) != -1) {
+        switch (ch) {
+        case 'p':
+            options.proxy = optarg;
+            break;
+
+        case 'l':
+            options.login_port = parse_unsigned(optarg, 1, 0xfffe);
+            break;
+
+        case 'n':
+            options.accounts = parse_unsigned(optarg, 1, 0xffff);
+            break;
+
+        case 'a':
+            options.heads = parse_unsigned(optarg, 1, 64);
+            break;
+
+        case 'd':
+            options.duration = parse_unsigned(optarg, 1, 86400);
+            break;
+
+        case 'r':
+            options.rate = parse_unsigned(optarg, 0, 100000);
+            break;
+
+        case 'm':
+            options.mobiles = parse_unsigned(optarg, 1, 0xffff);
+            break;
+
+        case 'c':
+            options.containers = parse_unsigned(optarg, 1, 0xff);
+            break;
+
+        case 'i':
+            options.items = parse_unsigned(optarg, 1, 0xff);
+            break;
+
+        case 'P':
+            options.proxy_pid = parse_unsigned(optarg, 1, 0x7fffffff);
+            break;
+
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct sockaddr_in
+parse_ipv4(const char *host_and_port)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+
+    const char *colon = strchr(host_and_port, ':');
+    const std::string host = colon != nullptr
+        ? std::string(host_and_port, colon)
+        : std::string(host_and_port);
+
+    if (inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1) {
+        fprintf(stderr, "not an IPv4 address: %s\n", host_and_port);
+        exit(EXIT_FAILURE);
+    }
+
+    sin.sin_port = htons(colon != nullptr
+                         ? parse_unsigned(colon + 1, 1, 0xffff)
+                         : 2593);
+    return sin;
+}
+
+/**
+ * Counters of the measurement phase.
+ */
+struct LoadStats {
+    uint64_t server_packets = 0, server_bytes = 0;
+    uint64_t client_packets = 0, client_bytes = 0;
+
+    /**
+     * Shard-to-client latencies of the speech packets in
+     * nanoseconds.
+     */
+    std::vector<uint64_t> latencies;
+
+    unsigned errors = 0;
+};
+
+static Clock::time_point start_time;
+
+static uint64_t
+now_ns() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
+}
+
+/**
+ * Make the account name unique per index.
+ */
+static void
+format_credentials(UO::CredentialsFragment &credentials, unsigned account)
+{
+    memset(&credentials, 0, sizeof(credentials));
+    snprintf(credentials.username, sizeof(credentials.username),
+             "bench%u", account);
+    strcpy(credentials.password, "bench");
+}
+
+static bool
+parse_account(const UO::CredentialsFragment &credentials, unsigned &account)
+{
+    char username[sizeof(credentials.username) + 1];
+    memcpy(username, credentials.username, sizeof(credentials.username));
+    username[sizeof(credentials.username)] = 0;
+
+    return sscanf(username, "bench%u", &account) == 1;
+}
+
+/**
+ * Pull the next complete packet from the buffer.
+ *
+ * @return the packet (which stays in the buffer until
+ * evbuffer_drain() is called), or nullptr if it is incomplete;
+ * throws on a malformed packet
+ */
+static const uint8_t *
+next_packet(struct evbuffer *input, size_t &length_r)
+{
+    const size_t available = evbuffer_get_length(input);
+    if (available == 0)
+        return nullptr;
+
+    const uint8_t *header = evbuffer_pullup(input, std::min<size_t>(available, 3));
+    const size_t length = get_packet_length(PROTOCOL_UNKNOWN, header, available);
+    if (length == PACKET_LENGTH_INVALID) {
+        fprintf(stderr, "malformed packet 0x%02x\n", header[0]);
+        return nullptr;
+    }
+
+    if (length == 0 || length > available)
+        return nullptr;
+
+    length_r = length;
+    return evbuffer_pullup(input, length);
+}
+
+/**
+ * One game connection accepted by the fake game server.
+ */
+class ShardConnection {
+    const Options &options;
+    LoadStats &stats;
+    struct bufferevent *const bev;
+
+    unsigned account;
+    bool seed_received = false, in_game = false;
+
+    struct event *tick_event = nullptr;
+    double budget = 0;
+    unsigned step = 0;
+
+    uint32_t player_serial;
+
+public:
+    ShardConnection(const Options &_options, LoadStats &_stats,
+                    struct event_base *base, evutil_socket_t fd) noexcept
+        :options(_options), stats(_stats),
+         bev(bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)) {
+        bufferevent_setcb(bev, ReadCallback, nullptr, EventCallback, this);
+        bufferevent_enable(bev, EV_READ|EV_WRITE);
+    }
+
+    ~ShardConnection() noexcept {
+        if (tick_event != nullptr)
+            event_free(tick_event);
+        bufferevent_free(bev);
+    }
+
+    ShardConnection(const ShardConnection &) = delete;
+    ShardConnection &operator=(const ShardConnection &) = delete;
+
+private:
+    uint32_t MobileSerial(unsigned i) const noexcept {
+        return ((account + 1) << 12) | (i + 1);
+    }
+
+    uint32_t ContainerSerial(unsigned i) const noexcept {
+        return 0x40000000 | (account << 12) | (i << 8);
+    }
+
+    void SendCompressed(const ConstBuffer<void> *packets, size_t n) noexcept;
+
+    void SendCompressed(const void *data, size_t length) noexcept {
+        const ConstBuffer<void> packet(data, length);
+        SendCompressed(&packet, 1);
+    }
+
+    void SendWorld() noexcept;
+    void OnTick() noexcept;
+    bool OnPacket(const uint8_t *data, size_t length) noexcept;
+
+    static void ReadCallback(struct bufferevent *bev, void *ctx) noexcept;
+    static void EventCallback(struct bufferevent *bev, short events,
+                              void *ctx) noexcept;
+    static void TickCallback(evutil_socket_t, short, void *ctx) noexcept;
+};
+
+void
+ShardConnection::SendCompressed(const ConstBuffer<void> *packets,
+                                size_t n) noexcept
+{
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i)
+        total += uo_compress_bound(packets[i].size);
+
+    std::unique_ptr<unsigned char[]> buffer(new unsigned char[total]);
+    const ssize_t nbytes = uo_compress_batch(buffer.get(), total, packets, n);
+    if (nbytes < 0)
+        abort();
+
+    bufferevent_write(bev, buffer.get(), nbytes);
+}
+
+void
+ShardConnection::SendWorld() noexcept
+{
+    player_serial = 0x100000 + account;
+
+    struct uo_packet_start start;
+    memset(&start, 0, sizeof(start));
+    start.cmd = PCK_Start;
+    start.serial = player_serial;
+    start.body = 0x190;
+    start.x = 1000;
+    start.y = 1000;
+    start.map_width = 6144;
+    start.map_height = 4096;
+
+    struct uo_packet_mobile_update update;
+    memset(&update, 0, sizeof(update));
+    update.cmd = PCK_MobileUpdate;
+    update.serial = player_serial;
+    update.body = 0x190;
+    update.x = 1000;
+    update.y = 1000;
+
+    const struct uo_packet_login_complete complete{PCK_ReDrawAll};
+
+    SendCompressed(&start, sizeof(start));
+    SendCompressed(&update, sizeof(update));
+    SendCompressed(&complete, sizeof(complete));
+
+    for (unsigned i = 0; i < options.mobiles; ++i) {
+        struct uo_packet_mobile_incoming p;
+        memset(&p, 0, sizeof(p));
+        p.cmd = PCK_MobileIncoming;
+        /* no equipment: the item list is just the terminating zero
+           serial */
+        p.length = sizeof(p) - sizeof(p.items) + 4;
+        p.serial = MobileSerial(i);
+        p.body = 0x190;
+        p.x = 1000 + i % 16;
+        p.y = 1000 + i / 16;
+        p.notoriety = 1;
+        SendCompressed(&p, p.length);
+    }
+
+    for (unsigned i = 0; i < options.containers; ++i) {
+        /* the short form of WorldItem, without the optional
+           properties */
+        struct {
+            uint8_t cmd;
+            PackedBE16 length;
+            PackedBE32 serial;
+            PackedBE16 item_id;
+            PackedBE16 x, y;
+            int8_t z;
+        } p;
+        static_assert(sizeof(p) == 14);
+
+        p.cmd = PCK_WorldItem;
+        p.length = sizeof(p);
+        p.serial = ContainerSerial(i);
+        p.item_id = 0xe75;
+        p.x = 1000 + i;
+        p.y = 999;
+        p.z = 0;
+        SendCompressed(&p, sizeof(p));
+    }
+
+    in_game = true;
+
+    const auto tv = std::chrono::duration_cast<std::chrono::microseconds>(TICK);
+    const struct timeval timeout{0, (suseconds_t)tv.count()};
+    tick_event = event_new(bufferevent_get_base(bev), -1, EV_PERSIST,
+                           TickCallback, this);
+    event_add(tick_event, &timeout);
+}
+
+inline void
+ShardConnection::OnTick() noexcept
+{
+    budget += options.rate * std::chrono::duration<double>(TICK).count();
+
+    /* don't pile up more if the proxy does not keep up */
+    if (evbuffer_get_length(bufferevent_get_output(bev)) > 256 * 1024)
+        return;
+
+    std::vector<ConstBuffer<void>> packets;
+
+    struct uo_packet_mobile_moving moving[64];
+    struct uo_packet_container_update updates[64];
+    struct {
+        struct uo_packet_speak_ascii base;
+        char text[32];
+    } speech[64];
+
+    unsigned n_moving = 0, n_updates = 0, n_speech = 0;
+
+    while (budget >= 1 && packets.size() < 64 * 3) {
+        budget -= 1;
+
+        switch (step++ % 3) {
+        case 0: {
+            const unsigned i = step % options.mobiles;
+            auto &p = moving[n_moving++];
+            memset(&p, 0, sizeof(p));
+            p.cmd = PCK_MobileMoving;
+            p.serial = MobileSerial(i);
+            p.body = 0x190;
+            p.x = 1000 + (step / 3) % 18;
+            p.y = 1000 + i / 16;
+            p.direction = 2;
+            p.notoriety = 1;
+            packets.emplace_back(&p, sizeof(p));
+            break;
+        }
+
+        case 1: {
+            const unsigned c = step % options.containers;
+            const unsigned i = (step / 3) % options.items;
+            auto &p = updates[n_updates++];
+            memset(&p, 0, sizeof(p));
+            p.cmd = PCK_ContainerUpdate;
+            p.item.serial = ContainerSerial(c) | (i + 1);
+            p.item.item_id = 0xeed;
+            p.item.amount = 1 + step % 100;
+            p.item.x = 40 + i;
+            p.item.y = 60;
+            p.item.parent_serial = ContainerSerial(c);
+            packets.emplace_back(&p, sizeof(p));
+            break;
+        }
+
+        case 2: {
+            /* the send time is the text, so the clients can measure
+               the latency */
+            auto &p = speech[n_speech++];
+            memset(&p, 0, sizeof(p));
+            p.base.cmd = PCK_SpeakAscii;
+            p.base.serial = MobileSerial(step % options.mobiles);
+            p.base.graphic = 0x190;
+            p.base.hue = 0x3b2;
+            p.base.font = 3;
+            strcpy(p.base.name, "bench");
+            const int n = snprintf(p.base.text, sizeof(p.text) + 1,
+                                   "%llu", (unsigned long long)now_ns());
+            const size_t length = sizeof(p.base) + n;
+            p.base.length = length;
+            packets.emplace_back(&p, length);
+            break;
+        }
+        }
+    }
+
+    if (packets.empty())
+        return;
+
+    for (const auto &i : packets)
+        stats.server_bytes += i.size;
+    stats.server_packets += packets.size();
+
+    SendCompressed(packets.data(), packets.size());
+}
+
+inline bool
+ShardConnection::OnPacket(const uint8_t *data, size_t length) noexcept
+{
+    switch (data[0]) {
+    case PCK_GameLogin: {
+        const auto &p = *(const struct uo_packet_game_login *)data;
+        if (!parse_account(p.credentials, account))
+            return false;
+
+        struct {
+            struct uo_packet_simple_character_list base;
+        } char_list;
+        memset(&char_list, 0, sizeof(char_list));
+        char_list.base.cmd = PCK_CharList;
+        char_list.base.length = sizeof(char_list);
+        char_list.base.character_count = 1;
+        strcpy(char_list.base.character_info[0].name, "bench");
+
+        SendCompressed(&char_list, sizeof(char_list));
+        return true;
+    }
+
+    case PCK_PlayCharacter:
+        if (!in_game)
+            SendWorld();
+        return true;
+
+    case PCK_Ping:
+        SendCompressed(data, length);
+        return true;
+
+    default:
+        return true;
+    }
+}
+
+void
+ShardConnection::ReadCallback(struct bufferevent *bev, void *ctx) noexcept
+{
+    auto &c = *(ShardConnection *)ctx;
+    auto *input = bufferevent_get_input(bev);
+
+    if (!c.seed_received) {
+        if (evbuffer_get_length(input) < 4)
+            return;
+
+        evbuffer_drain(input, 4);
+        c.seed_received = true;
+    }
+
+    size_t length;
+    const uint8_t *data;
+    while ((data = next_packet(input, length)) != nullptr) {
+        if (!c.OnPacket(data, length)) {
+            ++c.stats.errors;
+            delete &c;
+            return;
+        }
+
+        evbuffer_drain(input, length);
+    }
+}
+
+void
+ShardConnection::EventCallback(struct bufferevent *, short events,
+                               void *ctx) noexcept
+{
+    auto &c = *(ShardConnection *)ctx;
+
+    if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+        if (c.in_game)
+            ++c.stats.errors;
+
+        delete &c;
+    }
+}
+
+void
+ShardConnection::TickCallback(evutil_socket_t, short, void *ctx) noexcept
+{
+    auto &c = *(ShardConnection *)ctx;
+    c.OnTick();
+}
+
+/**
+ * A connection to the fake login server: it answers AccountLogin
+ * with a server list and PlayServer with a relay to the fake game
+ * server.
+ */
+class LoginConnection {
+    struct bufferevent *const bev;
+    const unsigned game_port;
+    bool seed_received = false;
+
+public:
+    LoginConnection(struct event_base *base, evutil_socket_t fd,
+                    unsigned _game_port) noexcept
+        :bev(bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)),
+         game_port(_game_port) {
+        bufferevent_setcb(bev, ReadCallback, nullptr, EventCallback, this);
+        bufferevent_enable(bev, EV_READ|EV_WRITE);
+    }
+
+    ~LoginConnection() noexcept {
+        bufferevent_free(bev);
+    }
+
+    LoginConnection(const LoginConnection &) = delete;
+    LoginConnection &operator=(const LoginConnection &) = delete;
+
+private:
+    void OnPacket(const uint8_t *data) noexcept;
+
+    static void ReadCallback(struct bufferevent *bev, void *ctx) noexcept;
+    static void EventCallback(struct bufferevent *bev, short events,
+                              void *ctx) noexcept;
+};
+
+inline void
+LoginConnection::OnPacket(const uint8_t *data) noexcept
+{
+    if (data[0] == PCK_AccountLogin) {
+        struct uo_packet_server_list p;
+        memset(&p, 0, sizeof(p));
+        p.cmd = PCK_ServerList;
+        p.length = sizeof(p);
+        p.unknown_0x5d = 0x5d;
+        p.num_game_servers = 1;
+        strcpy(p.game_servers[0].name, "bench");
+        p.game_servers[0].address = htonl(INADDR_LOOPBACK);
+        bufferevent_write(bev, &p, sizeof(p));
+    } else if (data[0] == PCK_PlayServer) {
+        struct uo_packet_relay p;
+        p.cmd = PCK_Relay;
+        p.ip = INADDR_LOOPBACK;
+        p.port = game_port;
+        p.auth_id = 0x42;
+        bufferevent_write(bev, &p, sizeof(p));
+    }
+}
+
+void
+LoginConnection::ReadCallback(struct bufferevent *bev, void *ctx) noexcept
+{
+    auto &c = *(LoginConnection *)ctx;
+    auto *input = bufferevent_get_input(bev);
+
+    if (!c.seed_received) {
+        if (evbuffer_get_length(input) < 4)
+            return;
+
+        evbuffer_drain(input, 4);
+        c.seed_received = true;
+    }
+
+    size_t length;
+    const uint8_t *data;
+    while ((data = next_packet(input, length)) != nullptr) {
+        c.OnPacket(data);
+        evbuffer_drain(input, length);
+    }
+}
+
+void
+LoginConnection::EventCallback(struct bufferevent *, short events,
+                               void *ctx) noexcept
+{
+    if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+        delete (LoginConnection *)ctx;
+}
+
+/**
+ * One simulated client.
+ */
+class BenchClient {
+    const Options &options;
+    LoadStats &stats;
+    struct bufferevent *const bev;
+
+    const unsigned account, head;
+
+    enum class State {
+        CONNECTING,
+        SERVER_LIST,
+        CHAR_LIST,
+        WORLD,
+        IN_GAME,
+        FAILED,
+    } state = State::CONNECTING;
+
+public:
+    BenchClient(const Options &_options, LoadStats &_stats,
+                struct event_base *base,
+                unsigned _account, unsigned _head) noexcept
+        :options(_options), stats(_stats),
+         bev(bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE)),
+         account(_account), head(_head) {
+        bufferevent_setcb(bev, ReadCallback, nullptr, EventCallback, this);
+        bufferevent_enable(bev, EV_READ|EV_WRITE);
+    }
+
+    ~BenchClient() noexcept {
+        bufferevent_free(bev);
+    }
+
+    BenchClient(const BenchClient &) = delete;
+    BenchClient &operator=(const BenchClient &) = delete;
+
+    unsigned GetAccount() const noexcept {
+        return account;
+    }
+
+    bool IsInGame() const noexcept {
+        return state == State::IN_GAME;
+    }
+
+    bool HasFailed() const noexcept {
+        return state == State::FAILED;
+    }
+
+    void Connect(const struct sockaddr_in &address) noexcept;
+
+private:
+    void Fail(const char *msg) noexcept;
+    void OnPacket(const uint8_t *data, size_t length) noexcept;
+
+    static void ReadCallback(struct bufferevent *bev, void *ctx) noexcept;
+    static void EventCallback(struct bufferevent *bev, short events,
+                              void *ctx) noexcept;
+};
+
+void
+BenchClient::Connect(const struct sockaddr_in &address) noexcept
+{
+    if (bufferevent_socket_connect(bev, (const struct sockaddr *)&address,
+                                   sizeof(address)) < 0) {
+        Fail("connect failed");
+        return;
+    }
+
+    const uint32_t seed = htonl(INADDR_LOOPBACK);
+    bufferevent_write(bev, &seed, sizeof(seed));
+
+    struct uo_packet_account_login p;
+    memset(&p, 0, sizeof(p));
+    p.cmd = PCK_AccountLogin;
+    format_credentials(p.credentials, account);
+    bufferevent_write(bev, &p, sizeof(p));
+
+    state = State::SERVER_LIST;
+}
+
+void
+BenchClient::Fail(const char *msg) noexcept
+{
+    if (state == State::FAILED)
+        return;
+
+    fprintf(stderr, "client %u/%u: %s\n", account, head, msg);
+    state = State::FAILED;
+    ++stats.errors;
+    bufferevent_disable(bev, EV_READ|EV_WRITE);
+}
+
+inline void
+BenchClient::OnPacket(const uint8_t *data, size_t length) noexcept
+{
+    switch (state) {
+    case State::CONNECTING:
+    case State::FAILED:
+        break;
+
+    case State::SERVER_LIST:
+        if (data[0] == PCK_ServerList) {
+            const struct uo_packet_play_server p{PCK_PlayServer, 0};
+            bufferevent_write(bev, &p, sizeof(p));
+
+            /* an attached client receives the world right away */
+            state = head == 0 ? State::CHAR_LIST : State::WORLD;
+        } else if (data[0] == PCK_AccountLoginReject)
+            Fail("login rejected");
+        break;
+
+    case State::CHAR_LIST:
+        if (data[0] == PCK_CharList) {
+            struct uo_packet_play_character p;
+            memset(&p, 0, sizeof(p));
+            p.cmd = PCK_PlayCharacter;
+            strcpy(p.name, "bench");
+            bufferevent_write(bev, &p, sizeof(p));
+            state = State::WORLD;
+        }
+        break;
+
+    case State::WORLD:
+        if (data[0] == PCK_Start || data[0] == PCK_ReDrawAll)
+            state = State::IN_GAME;
+        break;
+
+    case State::IN_GAME:
+        ++stats.client_packets;
+        stats.client_bytes += length;
+
+        if (data[0] == PCK_SpeakAscii &&
+            length > sizeof(struct uo_packet_speak_ascii)) {
+            const auto &p = *(const struct uo_packet_speak_ascii *)data;
+            char text[32];
+            const size_t n = std::min(length - sizeof(p) + 1,
+                                      sizeof(text) - 1);
+            memcpy(text, p.text, n);
+            text[n] = 0;
+
+            const uint64_t sent = strtoull(text, nullptr, 10);
+            const uint64_t now = now_ns();
+            if (sent > 0 && sent <= now)
+                stats.latencies.push_back(now - sent);
+        }
+
+        break;
+    }
+}
+
+void
+BenchClient::ReadCallback(struct bufferevent *bev, void *ctx) noexcept
+{
+    auto &c = *(BenchClient *)ctx;
+    auto *input = bufferevent_get_input(bev);
+
+    size_t length;
+    const uint8_t *data;
+    while ((data = next_packet(input, length)) != nullptr) {
+        c.OnPacket(data, length);
+        evbuffer_drain(input, length);
+    }
+
+    if (evbuffer_get_length(input) > 0 &&
+        get_packet_length(PROTOCOL_UNKNOWN,
+                          evbuffer_pullup(input, std::min<size_t>(evbuffer_get_length(input), 3)),
+                          evbuffer_get_length(input)) == PACKET_LENGTH_INVALID)
+        c.Fail("malformed packet");
+}
+
+void
+BenchClient::EventCallback(struct bufferevent *, short events,
+                           void *ctx) noexcept
+{
+    auto &c = *(BenchClient *)ctx;
+
+    if (events & BEV_EVENT_EOF)
+        c.Fail("connection closed by uoproxy");
+    else if (events & BEV_EVENT_ERROR)
+        c.Fail(strerror(EVUTIL_SOCKET_ERROR()));
+}
+
+struct ListenerContext {
+    const Options *options;
+    LoadStats *stats;
+    unsigned game_port;
+};
+
+static void
+login_accept_callback(struct evconnlistener *listener, evutil_socket_t fd,
+                      struct sockaddr *, int, void *ctx) noexcept
+{
+    auto &lc = *(ListenerContext *)ctx;
+    new LoginConnection(evconnlistener_get_base(listener), fd, lc.game_port);
+}
+
+static void
+game_accept_callback(struct evconnlistener *listener, evutil_socket_t fd,
+                     struct sockaddr *, int, void *ctx) noexcept
+{
+    auto &lc = *(ListenerContext *)ctx;
+    new ShardConnection(*lc.options, *lc.stats,
+                        evconnlistener_get_base(listener), fd);
+}
+
+static struct evconnlistener *
+listen_port(struct event_base *base, unsigned port,
+            evconnlistener_cb callback, void *ctx)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+
+    auto *listener = evconnlistener_new_bind(base, callback, ctx,
+                                             LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE,
+                                             1024,
+                                             (const struct sockaddr *)&sin,
+                                             sizeof(sin));
+    if (listener == nullptr) {
+        fprintf(stderr, "failed to listen on port %u: %s\n",
+                port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return listener;
+}
+
+/**
+ * Run the event loop for the specified duration.
+ */
+static void
+run_for(struct event_base *base, std::chrono::milliseconds duration)
+{
+    const auto tv = std::chrono::duration_cast<std::chrono::microseconds>(duration);
+    const struct timeval timeout{
+        time_t(tv.count() / 1000000),
+        suseconds_t(tv.count() % 1000000),
+    };
+    event_base_loopexit(base, &timeout);
+    event_base_dispatch(base);
+}
+
+struct ProcessUsage {
+    /**
+     * Resident set size in kB.
+     */
+    unsigned long rss = 0;
+
+    /**
+     * User plus system CPU time in seconds.
+     */
+    double cpu = 0;
+};
+
+static bool
+read_process_usage(pid_t pid, ProcessUsage &usage)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr)
+        if (sscanf(line, "VmRSS: %lu", &usage.rss) == 1)
+            break;
+    fclose(file);
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    file = fopen(path, "r");
+    if (file == nullptr)
+        return false;
+
+    char buffer[1024];
+    const size_t nbytes = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[nbytes] = 0;
+
+    /* skip "pid (comm) "; the name may contain spaces */
+    const char *p = strrchr(buffer, ')');
+    unsigned long utime, stime;
+    if (p == nullptr ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        return false;
+
+    usage.cpu = double(utime + stime) / sysconf(_SC_CLK_TCK);
+    return true;
+}
+
+static double
+self_cpu()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double
+percentile_ms(const std::vector<uint64_t> &sorted, unsigned p)
+{
+    if (sorted.empty())
+        return 0;
+
+    const size_t i = std::min(sorted.size() - 1, sorted.size() * p / 100);
+    return sorted[i] / 1e6;
+}
+
+static size_t
+count_in_game(const std::vector<std::unique_ptr<BenchClient>> &clients)
+{
+    return std::count_if(clients.begin(), clients.end(),
+                         [](const auto &c){ return c->IsInGame(); });
+}
+
+int
+main(int argc, char **argv)
+{
+    Options options;
+    parse_cmdline(options, argc, argv);
+
+    signal(SIGPIPE, SIG_IGN);
+    start_time = Clock::now();
+
+    const auto proxy_address = parse_ipv4(options.proxy);
+
+    struct event_base *base = event_base_new();
+    LoadStats stats;
+
+    ListenerContext lc{&options, &stats, options.login_port + 1};
+    auto *login_listener = listen_port(base, options.login_port,
+                                       login_accept_callback, &lc);
+    auto *game_listener = listen_port(base, options.login_port + 1,
+                                      game_accept_callback, &lc);
+
+    ProcessUsage idle_usage;
+    if (options.proxy_pid > 0 &&
+        !read_process_usage(options.proxy_pid, idle_usage)) {
+        fprintf(stderr, "failed to read the usage of process %d\n",
+                (int)options.proxy_pid);
+        return EXIT_FAILURE;
+    }
+
+    /* log in the first head of each account, then attach the
+       others */
+
+    std::vector<std::unique_ptr<BenchClient>> clients;
+    clients.reserve(options.accounts * options.heads);
+
+    const auto login_start = Clock::now();
+    const auto login_deadline = login_start + std::chrono::seconds(LOGIN_TIMEOUT);
+
+    for (unsigned head = 0; head < options.heads; ++head) {
+        const size_t first = clients.size();
+        for (unsigned account = 0; account < options.accounts; ++account) {
+            clients.emplace_back(std::make_unique<BenchClient>(options, stats,
+                                                               base,
+                                                               account, head));
+            clients.back()->Connect(proxy_address);
+        }
+
+        while (true) {
+            run_for(base, std::chrono::milliseconds(50));
+
+            size_t done = 0;
+            for (size_t i = first; i < clients.size(); ++i)
+                if (clients[i]->IsInGame() || clients[i]->HasFailed())
+                    ++done;
+
+            if (done == clients.size() - first)
+                break;
+
+            if (Clock::now() >= login_deadline) {
+                fprintf(stderr, "timeout while logging in\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    const std::chrono::duration<double> login_duration = Clock::now() - login_start;
+    const size_t in_game = count_in_game(clients);
+    if (in_game == 0) {
+        fprintf(stderr, "no client is in game\n");
+        return EXIT_FAILURE;
+    }
+
+    /* let the initial world settle, then measure */
+
+    run_for(base, std::chrono::milliseconds(500));
+
+    ProcessUsage before;
+    if (options.proxy_pid > 0)
+        read_process_usage(options.proxy_pid, before);
+
+    const double self_before = self_cpu();
+
+    stats = LoadStats();
+    stats.latencies.reserve(size_t(options.rate) * options.duration *
+                            options.accounts * options.heads / 3 + 1);
+    const auto measure_start = Clock::now();
+
+    run_for(base, std::chrono::seconds(options.duration));
+
+    const std::chrono::duration<double> elapsed = Clock::now() - measure_start;
+    const double self_after = self_cpu();
+    ProcessUsage after;
+    if (options.proxy_pid > 0)
+        read_process_usage(options.proxy_pid, after);
+
+    /* report */
+
+    const double seconds = elapsed.count();
+    printf("%-24s %10u accounts, %zu of %zu clients in game\n", "connections",
+           options.accounts, in_game, clients.size());
+    printf("%-24s %10.2f s\n", "login", login_duration.count());
+    printf("%-24s %10.0f packets/s %10.2f MB/s\n", "shard -> proxy",
+           stats.server_packets / seconds, stats.server_bytes / seconds / 1e6);
+    printf("%-24s %10.0f packets/s %10.2f MB/s\n", "proxy -> clients",
+           stats.client_packets / seconds, stats.client_bytes / seconds / 1e6);
+
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    printf("%-24s %10.3f p50 %8.3f p90 %8.3f p99 %8.3f max (ms, %zu samples)\n",
+           "forwarding latency",
+           percentile_ms(stats.latencies, 50),
+           percentile_ms(stats.latencies, 90),
+           percentile_ms(stats.latencies, 99),
+           stats.latencies.empty() ? 0. : stats.latencies.back() / 1e6,
+           stats.latencies.size());
+
+    if (options.proxy_pid > 0) {
+        const long rss_delta = long(after.rss) - long(idle_usage.rss);
+        printf("%-24s %10lu kB idle %10.1f kB per account %8.1f kB per client\n",
+               "proxy RSS", idle_usage.rss,
+               double(rss_delta) / options.accounts,
+               double(rss_delta) / clients.size());
+
+        const double cpu = (after.cpu - before.cpu) / seconds;
+        printf("%-24s %10.1f %% total %10.3f %% per account %8.3f %% per client\n",
+               "proxy CPU", cpu * 100,
+               cpu * 100 / options.accounts,
+               cpu * 100 / clients.size());
+    }
+
+    /* if the load generator itself is saturated, it distorts the
+       latencies */
+    const double self = (self_after - self_before) / seconds;
+    printf("%-24s %10.1f %%%s\n", "load-bench CPU", self * 100,
+           self > 0.9 ? " (saturated, results are not reliable)" : "");
+
+    printf("%-24s %10u\n", "errors", stats.errors);
+
+    clients.clear();
+    evconnlistener_free(game_listener);
+    evconnlistener_free(login_listener);
+    event_base_free(base);
+
+    return stats.errors > 0 ? 2 : EXIT_SUCCESS;
+}
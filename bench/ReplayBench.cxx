@@ -0,0 +1,614 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Replay a recorded packet stream through the hot paths (Huffman
+ * codec, packet framing, world model and attach snapshots) without
+ * any network I/O, and report their throughput.
+ *
+ * The input file contains the raw TCP payload of one direction of a
+ * game connection: either the stream from the server (compressed
+ * with "-c", or already decompressed), or the (decrypted) stream
+ * from the client, starting with the 4 byte seed.  Alternatively, it
+ * is a capture file (see Capture.hxx), from which the packets of one
+ * connection are replayed.
+ */
+
+#include "Compression.hxx"
+#include "PacketLengths.hxx"
+#include "PacketStructs.hxx"
+#include "PacketType.hxx"
+#include "VerifyPacket.hxx"
+#include "World.hxx"
+#include "Bridge.hxx"
+#include "AttachSnapshot.hxx"
+#include "Capture.hxx"
+#include "Log.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Results are summed up here, so the compiler cannot optimise the
+ * benchmarked calls away.
+ */
+static volatile size_t sink;
+
+struct Options {
+    enum protocol_version protocol = PROTOCOL_7;
+    bool compressed = false;
+    bool from_client = false;
+    unsigned iterations = 20;
+    uint32_t connection_id = 0;
+    const char *path = nullptr;
+};
+
+static void
+usage()
+{
+    fprintf(stderr,
+            "usage: replay-bench [-c] [-C] [-p PROTOCOL] [-n ITERATIONS] [-i ID] FILE\n"
+            "\n"
+            " -c  the stream from the server is compressed\n"
+            " -C  this is the stream from the client\n"
+            " -p  the protocol version: 5, 6, 6.0.5, 6.0.14 or 7 (default)\n"
+            " -n  repeat each stage this number of times (default 20)\n"
+            " -i  the connection id in a capture file\n");
+}
+
+static enum protocol_version
+parse_protocol(const char *s)
+{
+    static constexpr struct {
+        const char *name;
+        enum protocol_version protocol;
+    } names[] = {
+        { "5", PROTOCOL_5 },
+        { "6", PROTOCOL_6 },
+        { "6.0.5", PROTOCOL_6_0_5 },
+        { "6.0.14", PROTOCOL_6_0_14 },
+        { "7", PROTOCOL_7 },
+    };
+
+    for (const auto &i : names)
+        if (strcmp(s, i.name) == 0)
+            return i.protocol;
+
+    fprintf(stderr, "unknown protocol version: %s\n", s);
+    exit(EXIT_FAILURE);
+}
+
+static void
+parse_cmdline(Options &options, int argc, char **argv)
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "cCp:n:i:h")) != -1) {
+        switch (ch) {
+        case 'c':
+            options.compressed = true;
+            break;
+
+        case 'C':
+            options.from_client = true;
+            break;
+
+        case 'p':
+            options.protocol = parse_protocol(optarg);
+            break;
+
+        case 'n':
+            options.iterations = strtoul(optarg, nullptr, 10);
+            if (options.iterations == 0) {
+                fprintf(stderr, "invalid number of iterations\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'i':
+            options.connection_id = strtoul(optarg, nullptr, 10);
+            break;
+
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.compressed && options.from_client) {
+        fprintf(stderr, "the stream from the client is never compressed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    options.path = argv[optind];
+}
+
+static std::vector<uint8_t>
+load_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t buffer[65536];
+    size_t nbytes;
+    while ((nbytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + nbytes);
+
+    fclose(file);
+    return data;
+}
+
+static bool
+is_capture(const std::vector<uint8_t> &data)
+{
+    return data.size() >= sizeof(CaptureFileHeader) &&
+        memcmp(data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0;
+}
+
+/**
+ * Concatenate the packets of one connection and direction from a
+ * capture file.  If no connection id was specified, pick the first
+ * one with packets in that direction.
+ */
+static std::vector<uint8_t>
+extract_capture(Options &options, const std::vector<uint8_t> &data)
+{
+    const auto direction = options.from_client
+        ? PacketDirection::FROM_CLIENT
+        : PacketDirection::FROM_SERVER;
+
+    CaptureFileHeader file_header;
+    memcpy(&file_header, data.data(), sizeof(file_header));
+    if (file_header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "unsupported capture version %u\n",
+                (unsigned)file_header.version);
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<uint8_t> result;
+    size_t n_records = 0;
+
+    size_t position = sizeof(file_header);
+    while (data.size() - position >= sizeof(CaptureRecordHeader)) {
+        CaptureRecordHeader header;
+        memcpy(&header, data.data() + position, sizeof(header));
+        position += sizeof(header);
+
+        if (header.length > data.size() - position) {
+            fprintf(stderr, "truncated capture record\n");
+            break;
+        }
+
+        if (header.direction == uint8_t(direction) &&
+            options.connection_id == 0)
+            options.connection_id = header.connection_id;
+
+        if (header.direction == uint8_t(direction) &&
+            header.connection_id == options.connection_id) {
+            const uint8_t *p = data.data() + position;
+            result.insert(result.end(), p, p + header.length);
+            ++n_records;
+        }
+
+        position += header.length;
+    }
+
+    printf("%-20s %10zu records of connection %u\n", "capture",
+           n_records, (unsigned)options.connection_id);
+    return result;
+}
+
+static void
+report(const char *stage, unsigned iterations, Clock::duration duration,
+       size_t bytes, size_t items, const char *unit)
+{
+    const double seconds = std::chrono::duration<double>(duration).count()
+        / iterations;
+
+    printf("%-20s %10.1f MB/s %14.0f %s/s\n", stage,
+           seconds > 0 ? bytes / seconds / 1e6 : 0.,
+           seconds > 0 ? items / seconds : 0., unit);
+}
+
+/*
+ * Stages
+ *
+ */
+
+using DecompressFunction = ssize_t (*)(struct uo_decompression *de,
+                                       unsigned char *dest, size_t dest_max_len,
+                                       const unsigned char *src, size_t src_len);
+
+/**
+ * Decompress the whole stream, feeding it to the decoder in chunks
+ * of the size uoproxy reads from a socket.
+ */
+static std::vector<uint8_t>
+decompress_stream(DecompressFunction f, const std::vector<uint8_t> &src)
+{
+    static constexpr size_t CHUNK = 4096;
+
+    /* the shortest code has 2 bits */
+    std::vector<uint8_t> dest(src.size() * 4 + 64);
+    size_t fill = 0;
+
+    struct uo_decompression de;
+    uo_decompression_init(&de);
+
+    for (size_t position = 0; position < src.size(); position += CHUNK) {
+        const size_t n = std::min(CHUNK, src.size() - position);
+        const ssize_t nbytes = f(&de, dest.data() + fill, dest.size() - fill,
+                                 src.data() + position, n);
+        if (nbytes < 0) {
+            fprintf(stderr, "decompression failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        fill += nbytes;
+    }
+
+    dest.resize(fill);
+    return dest;
+}
+
+static std::vector<uint8_t>
+bench_decompress(const Options &options, const char *stage,
+                 DecompressFunction f, const std::vector<uint8_t> &src)
+{
+    std::vector<uint8_t> result;
+
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < options.iterations; ++i) {
+        result = decompress_stream(f, src);
+        sink += result.size();
+    }
+
+    report(stage, options.iterations, Clock::now() - start,
+           src.size(), result.size(), "bytes out");
+    return result;
+}
+
+/**
+ * Split the stream into packets.
+ */
+static std::vector<ConstBuffer<void>>
+split_packets(const Options &options, const std::vector<uint8_t> &data)
+{
+    std::vector<ConstBuffer<void>> packets;
+    PacketBatch batch;
+
+    size_t position = 0;
+    while (position < data.size()) {
+        frame_packets(options.protocol, data.data() + position,
+                      data.size() - position, batch);
+        if (batch.n == 0) {
+            fprintf(stderr, "malformed packet 0x%02x at offset %zu; "
+                    "ignoring the rest of the stream\n",
+                    data[position], position);
+            break;
+        }
+
+        for (size_t i = 0; i < batch.n; ++i) {
+            packets.emplace_back(data.data() + position, batch.lengths[i]);
+            position += batch.lengths[i];
+        }
+    }
+
+    return packets;
+}
+
+static std::vector<ConstBuffer<void>>
+bench_parse(const Options &options, const std::vector<uint8_t> &data)
+{
+    std::vector<ConstBuffer<void>> packets;
+
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < options.iterations; ++i) {
+        packets = split_packets(options, data);
+        sink += packets.size();
+    }
+
+    report("parse", options.iterations, Clock::now() - start,
+           data.size(), packets.size(), "packets");
+    return packets;
+}
+
+static void
+bench_compress(const Options &options,
+               const std::vector<ConstBuffer<void>> &packets)
+{
+    size_t total = 0, max_length = 0;
+    for (const auto &p : packets) {
+        total += p.size;
+        max_length = std::max(max_length, p.size);
+    }
+
+    std::vector<uint8_t> dest(uo_compress_bound(max_length));
+    size_t compressed = 0;
+
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < options.iterations; ++i) {
+        compressed = 0;
+        for (const auto &p : packets) {
+            const ssize_t nbytes = uo_compress(dest.data(), dest.size(),
+                                               (const unsigned char *)p.data,
+                                               p.size);
+            if (nbytes < 0) {
+                fprintf(stderr, "compression failed\n");
+                exit(EXIT_FAILURE);
+            }
+
+            compressed += nbytes;
+        }
+
+        sink += compressed;
+    }
+
+    report("compress", options.iterations, Clock::now() - start,
+           total, packets.size(), "packets");
+
+    if (total > 0)
+        printf("%-20s %10.3f\n", "compression ratio",
+               double(compressed) / double(total));
+}
+
+/**
+ * Apply a packet from the server to the world, like the handlers in
+ * SHandler.cxx do (without forwarding anything to clients).
+ */
+static void
+apply_packet(World &world, enum protocol_version protocol,
+             const void *data, size_t length)
+{
+    switch (*(const uint8_t *)data) {
+    case PCK_MobileStatus:
+        world.Apply(*(const struct uo_packet_mobile_status *)data);
+        break;
+
+    case PCK_WorldItem:
+        world.Apply(*(const struct uo_packet_world_item *)data);
+        break;
+
+    case PCK_WorldItem7:
+        if (length == sizeof(struct uo_packet_world_item_7))
+            world.Apply(*(const struct uo_packet_world_item_7 *)data);
+        break;
+
+    case PCK_Start:
+        if (length == sizeof(world.packet_start))
+            memcpy(&world.packet_start, data, length);
+        break;
+
+    case PCK_Delete:
+        if (length == sizeof(struct uo_packet_delete))
+            world.RemoveSerial(((const struct uo_packet_delete *)data)->serial);
+        break;
+
+    case PCK_MobileUpdate:
+        if (length == sizeof(struct uo_packet_mobile_update))
+            world.Apply(*(const struct uo_packet_mobile_update *)data);
+        break;
+
+    case PCK_ContainerOpen:
+        if (protocol >= PROTOCOL_7) {
+            if (length == sizeof(struct uo_packet_container_open_7))
+                world.Apply(*(const struct uo_packet_container_open_7 *)data);
+        } else if (length == sizeof(struct uo_packet_container_open))
+            world.Apply(*(const struct uo_packet_container_open *)data);
+        break;
+
+    case PCK_ContainerUpdate:
+        if (protocol < PROTOCOL_6) {
+            if (length == sizeof(struct uo_packet_container_update)) {
+                struct uo_packet_container_update_6 p6;
+                container_update_5_to_6(&p6, (const struct uo_packet_container_update *)data);
+                world.Apply(p6);
+            }
+        } else if (length == sizeof(struct uo_packet_container_update_6))
+            world.Apply(*(const struct uo_packet_container_update_6 *)data);
+        break;
+
+    case PCK_Equip:
+        if (length == sizeof(struct uo_packet_equip))
+            world.Apply(*(const struct uo_packet_equip *)data);
+        break;
+
+    case PCK_ContainerContent:
+        if (packet_verify_container_content((const struct uo_packet_container_content *)data, length)) {
+            static uint8_t buffer[0x10000];
+            if (container_content_5_to_6(buffer, sizeof(buffer),
+                                         (const struct uo_packet_container_content *)data) > 0)
+                world.Apply(*(const struct uo_packet_container_content_6 *)buffer);
+        } else if (packet_verify_container_content_6((const struct uo_packet_container_content_6 *)data, length))
+            world.Apply(*(const struct uo_packet_container_content_6 *)data);
+        break;
+
+    case PCK_PersonalLightLevel:
+        if (length == sizeof(world.packet_personal_light_level)) {
+            auto p = (const struct uo_packet_personal_light_level *)data;
+            if (world.packet_start.serial == p->serial)
+                world.packet_personal_light_level = *p;
+        }
+        break;
+
+    case PCK_GlobalLightLevel:
+        if (length == sizeof(world.packet_global_light_level))
+            memcpy(&world.packet_global_light_level, data, length);
+        break;
+
+    case PCK_Target:
+        if (length == sizeof(world.packet_target))
+            memcpy(&world.packet_target, data, length);
+        break;
+
+    case PCK_WarMode:
+        if (length == sizeof(world.packet_war_mode))
+            memcpy(&world.packet_war_mode, data, length);
+        break;
+
+    case PCK_Season:
+        if (length == sizeof(world.packet_season))
+            memcpy(&world.packet_season, data, length);
+        break;
+
+    case PCK_ZoneChange:
+        if (length == sizeof(struct uo_packet_zone_change))
+            world.Apply(*(const struct uo_packet_zone_change *)data);
+        break;
+
+    case PCK_MobileMoving:
+        if (length == sizeof(struct uo_packet_mobile_moving))
+            world.Apply(*(const struct uo_packet_mobile_moving *)data);
+        break;
+
+    case PCK_MobileIncoming:
+        {
+            auto p = (const struct uo_packet_mobile_incoming *)data;
+            if (length >= sizeof(*p) - sizeof(p->items))
+                world.Apply(*p);
+        }
+        break;
+
+    case PCK_Extended:
+        if (length >= sizeof(struct uo_packet_extended)) {
+            auto p = (const struct uo_packet_extended *)data;
+            if (p->extended_cmd == 0x0008 &&
+                length <= sizeof(world.packet_map_change))
+                memcpy(&world.packet_map_change, data, length);
+            else if (p->extended_cmd == 0x0018 &&
+                     length <= sizeof(world.packet_map_patches))
+                memcpy(&world.packet_map_patches, data, length);
+        }
+        break;
+    }
+}
+
+static void
+replay_world(World &world, const Options &options,
+             const std::vector<ConstBuffer<void>> &packets)
+{
+    for (const auto &p : packets)
+        apply_packet(world, options.protocol, p.data, p.size);
+}
+
+static void
+bench_world(const Options &options,
+            const std::vector<ConstBuffer<void>> &packets)
+{
+    size_t total = 0;
+    for (const auto &p : packets)
+        total += p.size;
+
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < options.iterations; ++i) {
+        auto world = std::make_unique<World>();
+        replay_world(*world, options, packets);
+        sink += world->items_by_serial.size() + world->mobiles_by_serial.size();
+    }
+
+    report("world", options.iterations, Clock::now() - start,
+           total, packets.size(), "packets");
+}
+
+static void
+bench_attach(const Options &options,
+             const std::vector<ConstBuffer<void>> &packets)
+{
+    auto world = std::make_unique<World>();
+    replay_world(*world, options, packets);
+
+    printf("%-20s %10zu items %8zu mobiles\n", "world size",
+           world->items_by_serial.size(), world->mobiles_by_serial.size());
+
+    std::shared_ptr<const AttachSnapshot> snapshot;
+
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < options.iterations; ++i) {
+        snapshot = attach_make_snapshot(*world, 0, options.protocol);
+        sink += snapshot->compressed.size();
+    }
+
+    report("attach snapshot", options.iterations, Clock::now() - start,
+           snapshot->raw.size(), 1, "snapshots");
+}
+
+int
+main(int argc, char **argv)
+{
+    Options options;
+    parse_cmdline(options, argc, argv);
+
+    /* silence the world model */
+    verbose = 0;
+
+    std::vector<uint8_t> data = load_file(options.path);
+    printf("%-20s %10zu bytes\n", "input", data.size());
+
+    if (is_capture(data)) {
+        if (options.compressed) {
+            fprintf(stderr, "captured packets are not compressed\n");
+            return EXIT_FAILURE;
+        }
+
+        data = extract_capture(options, data);
+    } else if (options.from_client) {
+        if (data.size() < 4) {
+            fprintf(stderr, "the stream is too short\n");
+            return EXIT_FAILURE;
+        }
+
+        /* skip the seed */
+        data.erase(data.begin(), data.begin() + 4);
+    }
+
+    if (options.compressed) {
+        bench_decompress(options, "decompress bitwise",
+                         uo_decompress_bitwise, data);
+        data = bench_decompress(options, "decompress",
+                                uo_decompress, data);
+    }
+
+    const auto packets = bench_parse(options, data);
+
+    if (!options.from_client) {
+        bench_compress(options, packets);
+        bench_world(options, packets);
+        bench_attach(options, packets);
+    }
+
+    return EXIT_SUCCESS;
+}
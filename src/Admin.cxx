@@ -0,0 +1,710 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Admin.hxx"
+#include "Instance.hxx"
+#include "Connection.hxx"
+#include "LinkedServer.hxx"
+#include "WorkerPool.hxx"
+#include "Server.hxx"
+#include "Stats.hxx"
+#include "EventBase.hxx"
+#include "NetUtil.hxx"
+#include "Config.hxx"
+#include "Log.hxx"
+#include "util/Compiler.h"
+
+#include <algorithm>
+#include <memory>
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+static constexpr auto METRICS_INTERVAL = std::chrono::seconds(1);
+
+/**
+ * Close admin connections which have not completed their request (or
+ * not read the response) after this number of seconds.
+ */
+static constexpr struct timeval ADMIN_TIMEOUT{10, 0};
+
+static constexpr size_t MAX_REQUEST = 4096;
+static constexpr unsigned MAX_ADMIN_CONNECTIONS = 16;
+
+/*
+ * Publishing the metrics of a worker
+ *
+ */
+
+static uint64_t
+ToNS(StatsClock::duration d) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+static std::string
+GetAccount(const Connection &c) noexcept
+{
+    const auto &username = c.credentials.username;
+    return std::string(username, strnlen(username, sizeof(username)));
+}
+
+static void
+instance_update_metrics(Instance &instance, uint64_t lag_ns)
+{
+    WorkerMetrics m;
+    m.event_loop_lag_ns = lag_ns;
+    m.reconnects_queued = instance.reconnect_scheduler.GetQueuedCount();
+    m.reconnects_in_flight = instance.reconnect_scheduler.GetInFlightCount();
+
+    for (const auto &c : instance.connections) {
+        WorkerMetrics::ConnectionInfo ci;
+        ci.account = GetAccount(c);
+        ci.character = c.character_index;
+        ci.clients = ci.zombies = 0;
+        ci.in_game = c.IsInGame();
+        ci.items = c.client.world.items_by_serial.size();
+        ci.mobiles = c.client.world.mobiles_by_serial.size();
+        ci.memory = c.GetMemoryUsage();
+        ci.reconnecting = c.reconnect_ticket.state != ReconnectTicket::State::NONE;
+        ci.reconnect_attempts = c.reconnect_ticket.attempts;
+
+        for (unsigned i = 0; i < 3; ++i) {
+            const unsigned p = WorkerMetrics::LATENCY_QUANTILES[i];
+            ci.rtt_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(c.upstream_rtt.Percentile(p)).count();
+            ci.forward_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(c.forward_latency.Percentile(p)).count();
+        }
+
+        for (const auto &ls : c.servers) {
+            if (ls.IsZombie()) {
+                ++ci.zombies;
+                continue;
+            }
+
+            ++ci.clients;
+
+            if (ls.server != nullptr)
+                m.clients.push_back({ci.account, ls.id,
+                                     uo_server_output_size(ls.server),
+                                     ls.congested});
+        }
+
+        m.connections.push_back(std::move(ci));
+    }
+
+    const std::lock_guard<std::mutex> lock(instance.metrics_mutex);
+    instance.metrics = std::move(m);
+}
+
+static void
+instance_schedule_metrics(Instance &instance, StatsClock::time_point now)
+{
+    instance.metrics_due = now + METRICS_INTERVAL;
+
+    static constexpr struct timeval tv{
+        std::chrono::seconds(METRICS_INTERVAL).count(), 0,
+    };
+    event_add(&instance.metrics_event, &tv);
+}
+
+static void
+metrics_timer_callback(int, short, void *ctx) noexcept
+{
+    auto &instance = *(Instance *)ctx;
+
+    const auto now = StatsClock::now();
+    const uint64_t lag_ns = now > instance.metrics_due
+        ? ToNS(now - instance.metrics_due)
+        : 0;
+    thread_stats().event_loop_lag.Record(lag_ns);
+
+    instance_update_metrics(instance, lag_ns);
+    instance_schedule_metrics(instance, now);
+}
+
+void
+instance_setup_metrics(Instance *instance)
+{
+    if (instance->config.admin_address == nullptr)
+        return;
+
+    thread_evtimer_set(&instance->metrics_event,
+                       metrics_timer_callback, instance);
+    instance->metrics_enabled = true;
+
+    instance_update_metrics(*instance, 0);
+    instance_schedule_metrics(*instance, StatsClock::now());
+}
+
+/*
+ * Rendering
+ *
+ */
+
+gcc_printf(2, 3)
+static void
+AppendF(std::string &out, const char *fmt, ...)
+{
+    char buffer[512];
+
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        out.append(buffer, std::min(size_t(n), sizeof(buffer) - 1));
+}
+
+static void
+AppendFamily(std::string &out, const char *name, const char *type,
+             const char *help)
+{
+    AppendF(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Escape a string for use as a label value.
+ */
+static std::string
+EscapeLabel(const std::string &src)
+{
+    std::string dest;
+    dest.reserve(src.size());
+
+    for (char ch : src) {
+        switch (ch) {
+        case '\\':
+            dest += "\\\\";
+            break;
+
+        case '"':
+            dest += "\\\"";
+            break;
+
+        case '\n':
+            dest += "\\n";
+            break;
+
+        default:
+            dest += ch;
+        }
+    }
+
+    return dest;
+}
+
+/**
+ * @param labels a comma-separated list of labels, or an empty string
+ * @param scale the factor which converts the recorded values to the
+ * exported unit
+ */
+static void
+AppendHistogram(std::string &out, const char *name, const char *labels,
+                const StatsHistogramSnapshot &h, double scale)
+{
+    const char *comma = *labels != 0 ? "," : "";
+
+    /* bucket i holds the (integer) values up to 2^(i+1)-1; the last
+       one is open-ended and is only covered by "+Inf" */
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i + 1 < StatsHistogram::N_BUCKETS; ++i) {
+        cumulative += h.buckets[i];
+        const double le = double((uint64_t(2) << i) - 1) * scale;
+        AppendF(out, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n",
+                name, labels, comma, le, cumulative);
+    }
+
+    AppendF(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+            name, labels, comma, h.count);
+
+    if (*labels != 0) {
+        AppendF(out, "%s_sum{%s} %.9g\n", name, labels, double(h.sum) * scale);
+        AppendF(out, "%s_count{%s} %" PRIu64 "\n", name, labels, h.count);
+    } else {
+        AppendF(out, "%s_sum %.9g\n", name, double(h.sum) * scale);
+        AppendF(out, "%s_count %" PRIu64 "\n", name, h.count);
+    }
+}
+
+static constexpr double NS_TO_S = 1e-9;
+
+static constexpr const char *direction_names[] = {
+    "from_server", "to_server", "from_client", "to_client",
+};
+
+static_assert(std::size(direction_names) == size_t(PacketDirection::COUNT));
+
+static void
+RenderStats(std::string &out, const StatsSnapshot &s)
+{
+    AppendFamily(out, "uoproxy_packets_total", "counter",
+                 "Packets by direction and opcode.");
+    for (size_t d = 0; d < size_t(PacketDirection::COUNT); ++d)
+        for (unsigned cmd = 0; cmd < 0x100; ++cmd)
+            if (s.packets[d][cmd].packets > 0)
+                AppendF(out, "uoproxy_packets_total{direction=\"%s\",opcode=\"0x%02x\"} %" PRIu64 "\n",
+                        direction_names[d], cmd, s.packets[d][cmd].packets);
+
+    AppendFamily(out, "uoproxy_packet_bytes_total", "counter",
+                 "Uncompressed packet bytes by direction and opcode.");
+    for (size_t d = 0; d < size_t(PacketDirection::COUNT); ++d)
+        for (unsigned cmd = 0; cmd < 0x100; ++cmd)
+            if (s.packets[d][cmd].packets > 0)
+                AppendF(out, "uoproxy_packet_bytes_total{direction=\"%s\",opcode=\"0x%02x\"} %" PRIu64 "\n",
+                        direction_names[d], cmd, s.packets[d][cmd].bytes);
+
+    AppendFamily(out, "uoproxy_packet_handler_seconds_total", "counter",
+                 "Time spent handling received packets, by opcode.");
+    for (const auto d : {PacketDirection::FROM_SERVER, PacketDirection::FROM_CLIENT})
+        for (unsigned cmd = 0; cmd < 0x100; ++cmd)
+            if (s.packets[size_t(d)][cmd].packets > 0)
+                AppendF(out, "uoproxy_packet_handler_seconds_total{direction=\"%s\",opcode=\"0x%02x\"} %.9g\n",
+                        direction_names[size_t(d)], cmd,
+                        double(s.packets[size_t(d)][cmd].handler_ns) * NS_TO_S);
+
+    AppendFamily(out, "uoproxy_handler_duration_seconds", "histogram",
+                 "Duration of packet handlers.");
+    AppendHistogram(out, "uoproxy_handler_duration_seconds",
+                    "handler=\"server\"",
+                    s.timers[size_t(StatsTimer::SERVER_HANDLER)], NS_TO_S);
+    AppendHistogram(out, "uoproxy_handler_duration_seconds",
+                    "handler=\"client\"",
+                    s.timers[size_t(StatsTimer::CLIENT_HANDLER)], NS_TO_S);
+
+    AppendFamily(out, "uoproxy_codec_duration_seconds", "histogram",
+                 "Duration of Huffman compression calls.");
+    AppendHistogram(out, "uoproxy_codec_duration_seconds",
+                    "op=\"compress\"",
+                    s.timers[size_t(StatsTimer::COMPRESS)], NS_TO_S);
+    AppendHistogram(out, "uoproxy_codec_duration_seconds",
+                    "op=\"decompress\"",
+                    s.timers[size_t(StatsTimer::DECOMPRESS)], NS_TO_S);
+
+    AppendFamily(out, "uoproxy_codec_bytes_total", "counter",
+                 "Input and output bytes of the Huffman codec.");
+    AppendF(out, "uoproxy_codec_bytes_total{op=\"compress\",stage=\"in\"} %" PRIu64 "\n",
+            s.compress_in);
+    AppendF(out, "uoproxy_codec_bytes_total{op=\"compress\",stage=\"out\"} %" PRIu64 "\n",
+            s.compress_out);
+    AppendF(out, "uoproxy_codec_bytes_total{op=\"decompress\",stage=\"in\"} %" PRIu64 "\n",
+            s.decompress_in);
+    AppendF(out, "uoproxy_codec_bytes_total{op=\"decompress\",stage=\"out\"} %" PRIu64 "\n",
+            s.decompress_out);
+
+    AppendFamily(out, "uoproxy_compression_ratio", "gauge",
+                 "Compressed size divided by uncompressed size.");
+    if (s.compress_in > 0)
+        AppendF(out, "uoproxy_compression_ratio{op=\"compress\"} %.6g\n",
+                double(s.compress_out) / double(s.compress_in));
+    if (s.decompress_out > 0)
+        AppendF(out, "uoproxy_compression_ratio{op=\"decompress\"} %.6g\n",
+                double(s.decompress_in) / double(s.decompress_out));
+
+    AppendFamily(out, "uoproxy_event_loop_lag_seconds", "histogram",
+                 "How late the event loops ran a periodic timer.");
+    AppendHistogram(out, "uoproxy_event_loop_lag_seconds", "",
+                    s.event_loop_lag, NS_TO_S);
+
+    AppendFamily(out, "uoproxy_client_output_queue_bytes", "histogram",
+                 "Samples of client output queue sizes.");
+    AppendHistogram(out, "uoproxy_client_output_queue_bytes", "",
+                    s.output_queue, 1);
+
+    AppendFamily(out, "uoproxy_client_updates_coalesced_total", "counter",
+                 "Updates to congested clients superseded before being sent.");
+    AppendF(out, "uoproxy_client_updates_coalesced_total %" PRIu64 "\n",
+            s.updates_coalesced);
+}
+
+static void
+RenderWorkers(std::string &out, const std::vector<WorkerMetrics> &workers)
+{
+    AppendFamily(out, "uoproxy_worker_connections", "gauge",
+                 "Connections to the game server.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        AppendF(out, "uoproxy_worker_connections{worker=\"%zu\"} %zu\n",
+                i, workers[i].connections.size());
+
+    AppendFamily(out, "uoproxy_worker_clients", "gauge",
+                 "Game clients (i.e. linked servers) including zombies.");
+    for (size_t i = 0; i < workers.size(); ++i) {
+        size_t n = 0;
+        for (const auto &c : workers[i].connections)
+            n += c.clients + c.zombies;
+        AppendF(out, "uoproxy_worker_clients{worker=\"%zu\"} %zu\n", i, n);
+    }
+
+    AppendFamily(out, "uoproxy_worker_event_loop_lag_seconds", "gauge",
+                 "How late the event loop ran the last periodic timer.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        AppendF(out, "uoproxy_worker_event_loop_lag_seconds{worker=\"%zu\"} %.9g\n",
+                i, double(workers[i].event_loop_lag_ns) * NS_TO_S);
+
+    AppendFamily(out, "uoproxy_worker_reconnects_queued", "gauge",
+                 "Connections waiting for a reconnect slot.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        AppendF(out, "uoproxy_worker_reconnects_queued{worker=\"%zu\"} %zu\n",
+                i, workers[i].reconnects_queued);
+
+    AppendFamily(out, "uoproxy_worker_reconnects_in_flight", "gauge",
+                 "Reconnects (connect and login) in progress.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        AppendF(out, "uoproxy_worker_reconnects_in_flight{worker=\"%zu\"} %zu\n",
+                i, workers[i].reconnects_in_flight);
+
+    /* per connection; those which have not logged in yet are only
+       counted above */
+
+    const auto for_each_connection = [&out, &workers](const char *name,
+                                                      const char *type,
+                                                      const char *help,
+                                                      auto get){
+        AppendFamily(out, name, type, help);
+        for (size_t i = 0; i < workers.size(); ++i) {
+            for (const auto &c : workers[i].connections) {
+                if (c.account.empty())
+                    continue;
+
+                AppendF(out, "%s{worker=\"%zu\",account=\"%s\",character=\"%u\"} %zu\n",
+                        name, i, EscapeLabel(c.account).c_str(),
+                        c.character, size_t(get(c)));
+            }
+        }
+    };
+
+    using ConnectionInfo = WorkerMetrics::ConnectionInfo;
+
+    for_each_connection("uoproxy_connection_clients", "gauge",
+                        "Game clients attached to this connection.",
+                        [](const ConnectionInfo &c){ return c.clients; });
+    for_each_connection("uoproxy_connection_zombies", "gauge",
+                        "Zombie clients waiting to be reattached.",
+                        [](const ConnectionInfo &c){ return c.zombies; });
+    for_each_connection("uoproxy_connection_in_game", "gauge",
+                        "Is this connection logged in to the game server?",
+                        [](const ConnectionInfo &c){ return c.in_game; });
+    for_each_connection("uoproxy_connection_items", "gauge",
+                        "Items in the world model.",
+                        [](const ConnectionInfo &c){ return c.items; });
+    for_each_connection("uoproxy_connection_mobiles", "gauge",
+                        "Mobiles in the world model.",
+                        [](const ConnectionInfo &c){ return c.mobiles; });
+    for_each_connection("uoproxy_connection_memory_bytes", "gauge",
+                        "Memory allocated for buffers, the world model and attach snapshots.",
+                        [](const ConnectionInfo &c){ return c.memory; });
+    for_each_connection("uoproxy_connection_reconnecting", "gauge",
+                        "Is a reconnect queued or in progress?",
+                        [](const ConnectionInfo &c){ return c.reconnecting; });
+    for_each_connection("uoproxy_connection_reconnect_attempts", "gauge",
+                        "Failed reconnect attempts since the last login.",
+                        [](const ConnectionInfo &c){ return c.reconnect_attempts; });
+
+    const auto for_each_quantile = [&out, &workers](const char *name,
+                                                    const char *help,
+                                                    auto get){
+        AppendFamily(out, name, "gauge", help);
+        for (size_t i = 0; i < workers.size(); ++i) {
+            for (const auto &c : workers[i].connections) {
+                if (c.account.empty())
+                    continue;
+
+                const uint64_t *ns = get(c);
+                for (unsigned q = 0; q < 3; ++q)
+                    if (ns[q] > 0)
+                        AppendF(out, "%s{worker=\"%zu\",account=\"%s\",character=\"%u\",quantile=\"0.%u\"} %.9g\n",
+                                name, i, EscapeLabel(c.account).c_str(),
+                                c.character,
+                                WorkerMetrics::LATENCY_QUANTILES[q],
+                                double(ns[q]) * NS_TO_S);
+            }
+        }
+    };
+
+    for_each_quantile("uoproxy_connection_rtt_seconds",
+                      "Round trip time to the game server (pings and walk acks).",
+                      [](const ConnectionInfo &c){ return c.rtt_ns; });
+    for_each_quantile("uoproxy_connection_forward_latency_seconds",
+                      "Time from receiving a packet from the game server until it was sent to the clients.",
+                      [](const ConnectionInfo &c){ return c.forward_ns; });
+
+    AppendFamily(out, "uoproxy_client_queued_bytes", "gauge",
+                 "Bytes queued for sending to a game client.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        for (const auto &c : workers[i].clients)
+            AppendF(out, "uoproxy_client_queued_bytes{worker=\"%zu\",account=\"%s\",client=\"%u\"} %zu\n",
+                    i, EscapeLabel(c.account).c_str(), c.id, c.output_queue);
+
+    AppendFamily(out, "uoproxy_client_congested", "gauge",
+                 "Is the client's output queue above the high watermark?");
+    for (size_t i = 0; i < workers.size(); ++i)
+        for (const auto &c : workers[i].clients)
+            AppendF(out, "uoproxy_client_congested{worker=\"%zu\",account=\"%s\",client=\"%u\"} %u\n",
+                    i, EscapeLabel(c.account).c_str(), c.id,
+                    unsigned(c.congested));
+}
+
+std::string
+AdminServer::RenderMetrics() const
+{
+    std::vector<WorkerMetrics> workers;
+
+    const unsigned n = instance.pool != nullptr
+        ? instance.pool->GetSize()
+        : 1;
+    workers.reserve(n);
+
+    for (unsigned i = 0; i < n; ++i) {
+        Instance &worker = instance.pool != nullptr
+            ? instance.pool->Get(i)
+            : instance;
+
+        const std::lock_guard<std::mutex> lock(worker.metrics_mutex);
+        workers.push_back(worker.metrics);
+    }
+
+    /* too large for the stack */
+    auto stats = std::make_unique<StatsSnapshot>();
+    stats_snapshot(*stats);
+
+    std::string out;
+    RenderStats(out, *stats);
+    RenderWorkers(out, workers);
+    return out;
+}
+
+/*
+ * HTTP
+ *
+ */
+
+/**
+ * A connection to the admin listener: read one request, send the
+ * response, close.
+ */
+class AdminConnection final : public IntrusiveListHook {
+    AdminServer &server;
+
+    const int fd;
+    struct event event;
+
+    std::string input, output;
+    size_t output_position = 0;
+
+public:
+    AdminConnection(AdminServer &_server, int _fd) noexcept
+        :server(_server), fd(_fd)
+    {
+        server.connections.push_back(*this);
+        ++server.n_connections;
+
+        thread_event_set(&event, fd, EV_READ|EV_PERSIST,
+                         EventCallback, this);
+        event_add(&event, &ADMIN_TIMEOUT);
+    }
+
+    ~AdminConnection() noexcept {
+        --server.n_connections;
+        event_del(&event);
+        close(fd);
+    }
+
+    AdminConnection(const AdminConnection &) = delete;
+    AdminConnection &operator=(const AdminConnection &) = delete;
+
+    void Destroy() noexcept {
+        unlink();
+        delete this;
+    }
+
+private:
+    void OnReadable() noexcept;
+    void OnWritable() noexcept;
+
+    void HandleRequest() noexcept;
+    void SetResponse(const char *status, const std::string &body,
+                     bool head) noexcept;
+
+    static void EventCallback(int, short events, void *ctx) noexcept;
+};
+
+void
+AdminConnection::SetResponse(const char *status, const std::string &body,
+                             bool head) noexcept
+{
+    AppendF(output,
+            "HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n"
+            "\r\n",
+            status, body.size());
+
+    if (!head)
+        output += body;
+}
+
+void
+AdminConnection::HandleRequest() noexcept
+{
+    const size_t eol = input.find_first_of("\r\n");
+    const std::string line = input.substr(0, eol);
+
+    const size_t space1 = line.find(' ');
+    const size_t space2 = line.find(' ', space1 + 1);
+    if (space1 == std::string::npos || space2 == std::string::npos) {
+        SetResponse("400 Bad Request", "Bad request\n", false);
+        return;
+    }
+
+    const std::string method = line.substr(0, space1);
+    std::string path = line.substr(space1 + 1, space2 - space1 - 1);
+    path = path.substr(0, path.find('?'));
+
+    const bool head = method == "HEAD";
+    if (method != "GET" && !head)
+        SetResponse("405 Method Not Allowed", "Method not allowed\n", false);
+    else if (path == "/metrics" || path == "/")
+        SetResponse("200 OK", server.RenderMetrics(), head);
+    else
+        SetResponse("404 Not Found", "Not found\n", head);
+}
+
+void
+AdminConnection::OnReadable() noexcept
+{
+    char buffer[1024];
+    const ssize_t nbytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (nbytes < 0 && errno == EAGAIN)
+        return;
+
+    if (nbytes <= 0) {
+        Destroy();
+        return;
+    }
+
+    input.append(buffer, nbytes);
+
+    if (input.find("\r\n\r\n") == std::string::npos &&
+        input.find("\n\n") == std::string::npos) {
+        if (input.size() > MAX_REQUEST)
+            Destroy();
+        return;
+    }
+
+    HandleRequest();
+
+    event_del(&event);
+    thread_event_set(&event, fd, EV_WRITE|EV_PERSIST,
+                     EventCallback, this);
+    event_add(&event, &ADMIN_TIMEOUT);
+}
+
+void
+AdminConnection::OnWritable() noexcept
+{
+    const ssize_t nbytes = send(fd, output.data() + output_position,
+                                output.size() - output_position,
+                                MSG_DONTWAIT);
+    if (nbytes < 0 && errno == EAGAIN)
+        return;
+
+    if (nbytes <= 0) {
+        Destroy();
+        return;
+    }
+
+    output_position += nbytes;
+    if (output_position == output.size()) {
+        shutdown(fd, SHUT_WR);
+        Destroy();
+    }
+}
+
+void
+AdminConnection::EventCallback(int, short events, void *ctx) noexcept
+{
+    auto &c = *(AdminConnection *)ctx;
+
+    if (events & EV_TIMEOUT)
+        c.Destroy();
+    else if (events & EV_READ)
+        c.OnReadable();
+    else if (events & EV_WRITE)
+        c.OnWritable();
+}
+
+AdminServer::AdminServer(Instance &_instance,
+                         const struct addrinfo *address)
+    :instance(_instance), fd(setup_server_socket(address))
+{
+    thread_event_set(&listener_event, fd, EV_READ|EV_PERSIST,
+                     ListenerCallback, this);
+    event_add(&listener_event, nullptr);
+}
+
+AdminServer::~AdminServer() noexcept
+{
+    connections.clear_and_dispose([](AdminConnection *c){
+        delete c;
+    });
+
+    event_del(&listener_event);
+    close(fd);
+}
+
+void
+AdminServer::ListenerCallback(int fd, short, void *ctx) noexcept
+{
+    auto &server = *(AdminServer *)ctx;
+
+    const int remote_fd = accept(fd, nullptr, nullptr);
+    if (remote_fd < 0) {
+        if (errno != EAGAIN
+#ifndef _WIN32
+            && errno != EWOULDBLOCK
+#endif
+            )
+            log_errno("accept() failed");
+        return;
+    }
+
+    if (server.n_connections >= MAX_ADMIN_CONNECTIONS) {
+        close(remote_fd);
+        return;
+    }
+
+    new AdminConnection(server, remote_fd);
+}
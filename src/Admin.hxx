@@ -0,0 +1,134 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * The optional admin listener (see "admin_bind"): a minimal HTTP
+ * server which answers each request with the statistics of all
+ * workers in the Prometheus text format, and closes the connection.
+ */
+
+#ifndef UOPROXY_ADMIN_H
+#define UOPROXY_ADMIN_H
+
+#include "util/IntrusiveList.hxx"
+
+#include <event.h>
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct addrinfo;
+struct Instance;
+class AdminConnection;
+
+/**
+ * A copy of the state of one worker, published by the worker itself
+ * once a second, so the admin listener does not need to touch the
+ * objects owned by other threads.
+ */
+struct WorkerMetrics {
+    struct ConnectionInfo {
+        std::string account;
+        unsigned character;
+
+        unsigned clients, zombies;
+        bool in_game;
+
+        size_t items, mobiles;
+
+        /**
+         * See Connection::GetMemoryUsage().
+         */
+        size_t memory;
+
+        bool reconnecting;
+        unsigned reconnect_attempts;
+
+        /**
+         * Percentiles (see #LATENCY_QUANTILES) of the upstream round
+         * trip time and of the forwarding latency in nanoseconds;
+         * zero if nothing has been measured yet.
+         */
+        uint64_t rtt_ns[3], forward_ns[3];
+    };
+
+    static constexpr unsigned LATENCY_QUANTILES[3] = {50, 90, 99};
+
+    struct ClientInfo {
+        std::string account;
+        unsigned id;
+
+        size_t output_queue;
+        bool congested;
+    };
+
+    /**
+     * How late the last metrics timer ran, in nanoseconds.
+     */
+    uint64_t event_loop_lag_ns = 0;
+
+    size_t reconnects_queued = 0, reconnects_in_flight = 0;
+
+    std::vector<ConnectionInfo> connections;
+    std::vector<ClientInfo> clients;
+};
+
+/**
+ * The admin listener; it runs in the main thread, i.e. in the
+ * #Instance of worker 0.
+ */
+class AdminServer {
+    friend class AdminConnection;
+
+    Instance &instance;
+
+    int fd;
+    struct event listener_event;
+
+    IntrusiveList<AdminConnection> connections;
+    unsigned n_connections = 0;
+
+public:
+    AdminServer(Instance &_instance, const struct addrinfo *address);
+    ~AdminServer() noexcept;
+
+    AdminServer(const AdminServer &) = delete;
+    AdminServer &operator=(const AdminServer &) = delete;
+
+    /**
+     * Render the statistics of the whole process.
+     */
+    std::string RenderMetrics() const;
+
+private:
+    static void ListenerCallback(int fd, short, void *ctx) noexcept;
+};
+
+/**
+ * Start publishing this worker's #WorkerMetrics (if the admin
+ * listener is enabled).  Call this in the worker's own thread.
+ */
+void
+instance_setup_metrics(Instance *instance);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "AsyncConnect.hxx"
+#include "Resolver.hxx"
+#include "SocketConnect.hxx"
+#include "Log.hxx"
+#include "EventBase.hxx"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+int
+AsyncConnect::Start(const struct sockaddr *address, size_t address_length,
+                    const ResolvedHost *socks4_address,
+                    unsigned timeout_seconds) noexcept
+{
+    assert(!IsPending());
+
+    ResolvedAddress socks4;
+
+    use_socks = socks4_address != nullptr;
+    if (use_socks) {
+        if (address->sa_family != AF_INET ||
+            address_length > sizeof(socks_destination)) {
+            LogFormat(1, "Not an IPv4 address\n");
+            return EAFNOSUPPORT;
+        }
+
+        if (!socks4_address->Get(socks4)) {
+            LogFormat(1, "'%s' has not been resolved yet\n",
+                      socks4_address->GetHost());
+            return EAGAIN;
+        }
+
+        memcpy(&socks_destination, address, address_length);
+
+        address = socks4.GetAddress();
+        address_length = socks4.length;
+    }
+
+    int ret = socket_connect(address->sa_family, SOCK_STREAM, 0,
+                             address, address_length);
+    if (ret < 0)
+        return -ret;
+
+    fd = ret;
+    timeout = {time_t(timeout_seconds), 0};
+    state = State::CONNECT;
+    Wait(EV_WRITE);
+    return 0;
+}
+
+void
+AsyncConnect::Cancel() noexcept
+{
+    if (!IsPending())
+        return;
+
+    event_del(&event);
+    close(fd);
+    fd = -1;
+    state = State::IDLE;
+}
+
+void
+AsyncConnect::Wait(short events) noexcept
+{
+    thread_event_set(&event, fd, events, Callback, this);
+    event_add(&event, timeout.tv_sec > 0 ? &timeout : nullptr);
+}
+
+void
+AsyncConnect::Succeed() noexcept
+{
+    const int result = fd;
+    fd = -1;
+    state = State::IDLE;
+
+    handler.OnAsyncConnectSuccess(result);
+}
+
+void
+AsyncConnect::Fail(int error) noexcept
+{
+    close(fd);
+    fd = -1;
+    state = State::IDLE;
+
+    handler.OnAsyncConnectError(error);
+}
+
+inline void
+AsyncConnect::OnConnected() noexcept
+{
+    int error;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0)
+        error = errno;
+
+    if (error != 0) {
+        Fail(error);
+        return;
+    }
+
+    if (!use_socks) {
+        Succeed();
+        return;
+    }
+
+    uint8_t request[SOCKS_REQUEST_SIZE];
+    const size_t request_size =
+        socks_format_request(request, sizeof(request),
+                             (const struct sockaddr *)&socks_destination);
+    if (request_size == 0) {
+        Fail(EINVAL);
+        return;
+    }
+
+    /* the freshly connected socket has plenty of buffer space, so
+       this small request is sent in one piece */
+    ssize_t nbytes = send(fd, request, request_size,
+                          MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (nbytes < 0) {
+        const int e = errno;
+        log_errno("Failed to send SOCKS4 request");
+        Fail(e);
+        return;
+    }
+
+    if ((size_t)nbytes != request_size) {
+        LogFormat(1, "Failed to send SOCKS4 request\n");
+        Fail(EIO);
+        return;
+    }
+
+    response_fill = 0;
+    state = State::SOCKS_RESPONSE;
+    Wait(EV_READ);
+}
+
+inline void
+AsyncConnect::OnSocksResponse() noexcept
+{
+    ssize_t nbytes = recv(fd, response + response_fill,
+                          sizeof(response) - response_fill, MSG_DONTWAIT);
+    if (nbytes < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            Wait(EV_READ);
+            return;
+        }
+
+        const int e = errno;
+        log_errno("Failed to receive SOCKS4 response");
+        Fail(e);
+        return;
+    }
+
+    if (nbytes == 0) {
+        LogFormat(1, "Failed to receive SOCKS4 response\n");
+        Fail(ECONNRESET);
+        return;
+    }
+
+    response_fill += (size_t)nbytes;
+    if (response_fill < sizeof(response)) {
+        Wait(EV_READ);
+        return;
+    }
+
+    if (!socks_check_response(response)) {
+        Fail(ECONNREFUSED);
+        return;
+    }
+
+    Succeed();
+}
+
+void
+AsyncConnect::Callback(int, short events, void *ctx) noexcept
+{
+    auto &ac = *(AsyncConnect *)ctx;
+
+    assert(ac.IsPending());
+
+    if (events & EV_TIMEOUT) {
+        ac.Fail(ETIMEDOUT);
+        return;
+    }
+
+    switch (ac.state) {
+    case State::IDLE:
+        assert(false);
+        break;
+
+    case State::CONNECT:
+        ac.OnConnected();
+        break;
+
+    case State::SOCKS_RESPONSE:
+        ac.OnSocksResponse();
+        break;
+    }
+}
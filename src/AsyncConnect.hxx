@@ -0,0 +1,133 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_ASYNC_CONNECT_H
+#define UOPROXY_ASYNC_CONNECT_H
+
+#include "ProxySocks.hxx"
+
+#include <event.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct sockaddr;
+class ResolvedHost;
+
+class AsyncConnectHandler {
+public:
+    /**
+     * The connection has been established.  The callee takes over
+     * the (non-blocking) socket.
+     */
+    virtual void OnAsyncConnectSuccess(int fd) noexcept = 0;
+
+    /**
+     * Connecting has failed.
+     *
+     * @param error an errno value
+     */
+    virtual void OnAsyncConnectError(int error) noexcept = 0;
+};
+
+/**
+ * Connect a TCP socket without blocking the event loop, optionally
+ * through a SOCKS4 proxy.
+ */
+class AsyncConnect {
+    AsyncConnectHandler &handler;
+
+    enum class State : uint8_t {
+        IDLE,
+
+        /**
+         * Waiting for the TCP connect to complete.
+         */
+        CONNECT,
+
+        /**
+         * The SOCKS4 request has been sent and we're waiting for
+         * the response.
+         */
+        SOCKS_RESPONSE,
+    } state = State::IDLE;
+
+    int fd = -1;
+
+    struct event event;
+
+    struct timeval timeout;
+
+    /**
+     * The destination; only used with a SOCKS4 proxy.
+     */
+    struct sockaddr_in socks_destination;
+    bool use_socks;
+
+    size_t response_fill;
+    uint8_t response[SOCKS_RESPONSE_SIZE];
+
+public:
+    explicit AsyncConnect(AsyncConnectHandler &_handler) noexcept
+        :handler(_handler) {}
+
+    ~AsyncConnect() noexcept {
+        Cancel();
+    }
+
+    AsyncConnect(const AsyncConnect &) = delete;
+    AsyncConnect &operator=(const AsyncConnect &) = delete;
+
+    bool IsPending() const noexcept {
+        return state != State::IDLE;
+    }
+
+    /**
+     * Begin connecting.  Errors which occur right away are returned
+     * and do not invoke the handler.
+     *
+     * @param socks4_address the SOCKS4 proxy or nullptr for a direct
+     * connection
+     * @param timeout_seconds give up after this duration (per step;
+     * 0 means no timeout)
+     * @return 0 on success or an errno value
+     */
+    int Start(const struct sockaddr *address, size_t address_length,
+              const ResolvedHost *socks4_address,
+              unsigned timeout_seconds) noexcept;
+
+    /**
+     * Abort the connect (if any) without invoking the handler.
+     */
+    void Cancel() noexcept;
+
+private:
+    void Wait(short events) noexcept;
+    void Succeed() noexcept;
+    void Fail(int error) noexcept;
+
+    void OnConnected() noexcept;
+    void OnSocksResponse() noexcept;
+
+    static void Callback(int fd, short events, void *ctx) noexcept;
+};
+
+#endif
@@ -19,172 +19,62 @@
  */
 
 #include "Connection.hxx"
+#include "AttachSnapshot.hxx"
 #include "LinkedServer.hxx"
-#include "Instance.hxx"
 #include "Server.hxx"
-#include "Bridge.hxx"
-#include "Log.hxx"
-
-#include <assert.h>
-#include <string.h>
-
-static void
-attach_item(LinkedServer *ls,
-            Item *item)
-{
-    World *world = &ls->connection->client.world;
-
-    item->attach_sequence = world->item_attach_sequence;
-
-    switch (item->socket.cmd) {
-        uint32_t parent_serial;
-        Item *parent;
-
-    case PCK_WorldItem:
-        if (ls->client_version.protocol >= PROTOCOL_7) {
-            uo_server_send(ls->server, &item->socket.ground,
-                           sizeof(item->socket.ground));
-        } else {
-            struct uo_packet_world_item p;
-            world_item_from_7(&p, &item->socket.ground);
-            uo_server_send(ls->server, &p, p.length);
-        }
-
-        break;
-
-    case PCK_ContainerUpdate:
-        /* attach parent first */
-        parent_serial = item->socket.container.item.parent_serial;
-        parent = world->FindItem(parent_serial);
-        if (parent != nullptr &&
-            parent->attach_sequence != world->item_attach_sequence)
-            attach_item(ls, parent);
-
-        /* then this item as container content */
-
-        if (ls->client_version.protocol < PROTOCOL_6) {
-            /* convert to v5 packet */
-            struct uo_packet_container_update p5;
-
-            container_update_6_to_5(&p5, &item->socket.container);
-            uo_server_send(ls->server, &p5, sizeof(p5));
-        } else {
-            uo_server_send(ls->server, &item->socket.container,
-                           sizeof(item->socket.container));
-        }
-
-        break;
-
-    case PCK_Equip:
-        uo_server_send(ls->server, &item->socket.mobile,
-                       sizeof(item->socket.mobile));
-        break;
-    }
+#include "Instance.hxx"
+#include "Config.hxx"
+#include "Capture.hxx"
+#include "Trace.hxx"
 
-    if (item->packet_container_open.cmd == PCK_ContainerOpen) {
-        if (ls->client_version.protocol >= PROTOCOL_7) {
-            struct uo_packet_container_open_7 p7 = {
-                .base = item->packet_container_open,
-                .zero = 0x00,
-                .x7d = 0x7d,
-            };
+#include <utility>
 
-            uo_server_send(ls->server, &p7, sizeof(p7));
-        } else
-            uo_server_send(ls->server, &item->packet_container_open,
-                           sizeof(item->packet_container_open));
-    }
-}
+#include <assert.h>
 
 void
 attach_send_world(LinkedServer *ls)
 {
-    World *world = &ls->connection->client.world;
-    struct uo_packet_login_complete login_complete;
-
-    /* 0x1b LoginConfirm */
-    if (world->packet_start.cmd == PCK_Start)
-        uo_server_send(ls->server, &world->packet_start,
-                       sizeof(world->packet_start));
+    Connection &c = *ls->connection;
+    const enum protocol_version protocol = ls->client_version.protocol;
+    assert(protocol < PROTOCOL_COUNT);
 
-    /* 0xbf 0x08 MapChange */
-    if (world->packet_map_change.length > 0) {
-        assert(world->packet_map_change.cmd == PCK_Extended);
-        assert(world->packet_map_change.length == sizeof(world->packet_map_change));
-        assert(world->packet_map_change.extended_cmd == 0x0008);
-        uo_server_send(ls->server, &world->packet_map_change,
-                       world->packet_map_change.length);
-    }
+    UOPROXY_TRACE2(attach_send_world_entry, ls->id, (int)protocol);
 
-    /* 0xbf 0x18 MapPatches */
-    if (world->packet_map_patches.length > 0) {
-        assert(world->packet_map_patches.cmd == PCK_Extended);
-        assert(world->packet_map_patches.length == sizeof(world->packet_map_patches));
-        assert(world->packet_map_patches.extended_cmd == 0x0018);
-        uo_server_send(ls->server, &world->packet_map_patches,
-                       world->packet_map_patches.length);
-    }
+    /* the world has not been tracked while in background; send what
+       we have, and let the server fill in the rest */
+    const bool resync = std::exchange(c.lazy_world, false);
 
-    /* 0xbc SeasonChange */
-    if (world->packet_season.cmd == PCK_Season)
-        uo_server_send(ls->server, &world->packet_season,
-                       sizeof(world->packet_season));
+    auto &snapshot = c.attach_snapshots[protocol];
+    if (snapshot == nullptr) {
+        snapshot = attach_make_snapshot(c.client.world,
+                                        c.client.supported_features_flags,
+                                        protocol);
+        ls->LogF(7, "built attach snapshot: %u packets, %zu bytes, %zu compressed",
+                 snapshot->n_packets, snapshot->raw.size(),
+                 snapshot->compressed.size());
+    } else
+        ls->LogF(7, "reusing attach snapshot");
 
-    /* 0xb9 SupportedFeatures */
-    if (ls->client_version.protocol >= PROTOCOL_6_0_14) {
-        struct uo_packet_supported_features_6014 supported_features;
-        supported_features.cmd = PCK_SupportedFeatures;
-        supported_features.flags = ls->connection->client.supported_features_flags;
-        uo_server_send(ls->server, &supported_features,
-                       sizeof(supported_features));
-    } else {
-        struct uo_packet_supported_features supported_features;
-        supported_features.cmd = PCK_SupportedFeatures;
-        supported_features.flags = ls->connection->client.supported_features_flags;
-        uo_server_send(ls->server, &supported_features,
-                       sizeof(supported_features));
-    }
+    capture_packet(PacketDirection::TO_CLIENT,
+                   uo_server_capture_id(ls->server),
+                   snapshot->raw.data(), snapshot->raw.size());
 
-    /* 0x4f GlobalLightLevel */
-    if (world->packet_global_light_level.cmd == PCK_GlobalLightLevel)
-        uo_server_send(ls->server, &world->packet_global_light_level,
-                       sizeof(world->packet_global_light_level));
+    const auto &data = uo_server_compression(ls->server)
+        ? snapshot->compressed
+        : snapshot->raw;
 
-    /* 0x4e PersonalLightLevel */
-    if (world->packet_personal_light_level.cmd == PCK_PersonalLightLevel)
-        uo_server_send(ls->server, &world->packet_personal_light_level,
-                       sizeof(world->packet_personal_light_level));
+    if (c.instance.config.client_cork)
+        uo_server_cork(ls->server);
 
-    /* 0x20 MobileUpdate */
-    if (world->packet_mobile_update.cmd == PCK_MobileUpdate)
-        uo_server_send(ls->server, &world->packet_mobile_update,
-                       sizeof(world->packet_mobile_update));
+    uo_server_send_stream(ls->server, snapshot,
+                          {data.data(), data.size()});
 
-    /* WarMode */
-    if (world->packet_war_mode.cmd == PCK_WarMode)
-        uo_server_send(ls->server, &world->packet_war_mode,
-                       sizeof(world->packet_war_mode));
+    ls->state = LinkedServer::State::IN_GAME;
 
-    /* mobiles */
-    for (const auto &mobile : world->mobiles) {
-        if (mobile.packet_mobile_incoming != nullptr)
-            uo_server_send(ls->server, mobile.packet_mobile_incoming.get(),
-                           mobile.packet_mobile_incoming.size());
-        if (mobile.packet_mobile_status != nullptr)
-            uo_server_send(ls->server, mobile.packet_mobile_status.get(),
-                           mobile.packet_mobile_status.size());
+    if (resync) {
+        ls->LogF(2, "requesting the world from the server");
+        connection_resync(c);
     }
 
-    /* items */
-    ++world->item_attach_sequence;
-    for (auto &item : world->items)
-        if (item.attach_sequence != world->item_attach_sequence)
-            attach_item(ls, &item);
-
-    /* LoginComplete */
-    login_complete.cmd = PCK_ReDrawAll;
-    uo_server_send(ls->server, &login_complete,
-                   sizeof(login_complete));
-
-    ls->state = LinkedServer::State::IN_GAME;
+    UOPROXY_TRACE2(attach_send_world_return, ls->id, data.size());
 }
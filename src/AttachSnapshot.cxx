@@ -0,0 +1,240 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "AttachSnapshot.hxx"
+#include "World.hxx"
+#include "Bridge.hxx"
+#include "Compression.hxx"
+
+#include <assert.h>
+
+namespace {
+
+class AttachSnapshotBuilder {
+    const enum protocol_version protocol;
+
+    std::vector<uint8_t> raw;
+
+    /**
+     * The end offset of each packet in #raw.
+     */
+    std::vector<size_t> ends;
+
+public:
+    explicit AttachSnapshotBuilder(enum protocol_version _protocol) noexcept
+        :protocol(_protocol) {}
+
+    enum protocol_version GetProtocol() const noexcept {
+        return protocol;
+    }
+
+    void Add(const void *data, size_t length) noexcept {
+        assert(length > 0);
+
+        const auto *p = (const uint8_t *)data;
+        raw.insert(raw.end(), p, p + length);
+        ends.push_back(raw.size());
+    }
+
+    std::shared_ptr<const AttachSnapshot> Finish() noexcept;
+};
+
+}
+
+std::shared_ptr<const AttachSnapshot>
+AttachSnapshotBuilder::Finish() noexcept
+{
+    auto snapshot = std::make_shared<AttachSnapshot>();
+
+    /* compress all packets in one batch, into a buffer which is
+       large enough for the worst case */
+    std::vector<ConstBuffer<void>> packets;
+    packets.reserve(ends.size());
+
+    size_t max_compressed = 0, start = 0;
+    for (const size_t end : ends) {
+        packets.emplace_back(raw.data() + start, end - start);
+        max_compressed += uo_compress_bound(end - start);
+        start = end;
+    }
+
+    snapshot->compressed.resize(max_compressed);
+    ssize_t nbytes = uo_compress_batch(snapshot->compressed.data(),
+                                       snapshot->compressed.size(),
+                                       packets.data(), packets.size());
+    assert(nbytes >= 0);
+    snapshot->compressed.resize((size_t)nbytes);
+    snapshot->compressed.shrink_to_fit();
+
+    snapshot->n_packets = ends.size();
+    snapshot->raw = std::move(raw);
+
+    return snapshot;
+}
+
+static void
+attach_item(AttachSnapshotBuilder &b, World *world,
+            Item *item)
+{
+    item->attach_sequence = world->item_attach_sequence;
+
+    switch (item->socket.cmd) {
+        uint32_t parent_serial;
+        Item *parent;
+
+    case PCK_WorldItem7:
+        if (b.GetProtocol() >= PROTOCOL_7) {
+            b.Add(&item->socket.ground, sizeof(item->socket.ground));
+        } else {
+            struct uo_packet_world_item p;
+            world_item_from_7(&p, &item->socket.ground);
+            b.Add(&p, p.length);
+        }
+
+        break;
+
+    case PCK_ContainerUpdate:
+        /* attach parent first */
+        parent_serial = item->socket.container.item.parent_serial;
+        parent = world->FindItem(parent_serial);
+        if (parent != nullptr &&
+            parent->attach_sequence != world->item_attach_sequence)
+            attach_item(b, world, parent);
+
+        /* then this item as container content */
+
+        if (b.GetProtocol() < PROTOCOL_6) {
+            /* convert to v5 packet */
+            struct uo_packet_container_update p5;
+
+            container_update_6_to_5(&p5, &item->socket.container);
+            b.Add(&p5, sizeof(p5));
+        } else {
+            b.Add(&item->socket.container, sizeof(item->socket.container));
+        }
+
+        break;
+
+    case PCK_Equip:
+        b.Add(&item->socket.mobile, sizeof(item->socket.mobile));
+        break;
+    }
+
+    if (item->packet_container_open.cmd == PCK_ContainerOpen) {
+        if (b.GetProtocol() >= PROTOCOL_7) {
+            struct uo_packet_container_open_7 p7 = {
+                .base = item->packet_container_open,
+                .zero = 0x00,
+                .x7d = 0x7d,
+            };
+
+            b.Add(&p7, sizeof(p7));
+        } else
+            b.Add(&item->packet_container_open,
+                  sizeof(item->packet_container_open));
+    }
+}
+
+std::shared_ptr<const AttachSnapshot>
+attach_make_snapshot(World &_world, uint32_t supported_features_flags,
+                     enum protocol_version protocol) noexcept
+{
+    World *world = &_world;
+    AttachSnapshotBuilder b(protocol);
+
+    /* 0x1b LoginConfirm */
+    if (world->packet_start.cmd == PCK_Start)
+        b.Add(&world->packet_start, sizeof(world->packet_start));
+
+    /* 0xbf 0x08 MapChange */
+    if (world->packet_map_change.length > 0) {
+        assert(world->packet_map_change.cmd == PCK_Extended);
+        assert(world->packet_map_change.length == sizeof(world->packet_map_change));
+        assert(world->packet_map_change.extended_cmd == 0x0008);
+        b.Add(&world->packet_map_change, world->packet_map_change.length);
+    }
+
+    /* 0xbf 0x18 MapPatches */
+    if (world->packet_map_patches.length > 0) {
+        assert(world->packet_map_patches.cmd == PCK_Extended);
+        assert(world->packet_map_patches.length == sizeof(world->packet_map_patches));
+        assert(world->packet_map_patches.extended_cmd == 0x0018);
+        b.Add(&world->packet_map_patches, world->packet_map_patches.length);
+    }
+
+    /* 0xbc SeasonChange */
+    if (world->packet_season.cmd == PCK_Season)
+        b.Add(&world->packet_season, sizeof(world->packet_season));
+
+    /* 0xb9 SupportedFeatures */
+    if (protocol >= PROTOCOL_6_0_14) {
+        struct uo_packet_supported_features_6014 supported_features;
+        supported_features.cmd = PCK_SupportedFeatures;
+        supported_features.flags = supported_features_flags;
+        b.Add(&supported_features, sizeof(supported_features));
+    } else {
+        struct uo_packet_supported_features supported_features;
+        supported_features.cmd = PCK_SupportedFeatures;
+        supported_features.flags = supported_features_flags;
+        b.Add(&supported_features, sizeof(supported_features));
+    }
+
+    /* 0x4f GlobalLightLevel */
+    if (world->packet_global_light_level.cmd == PCK_GlobalLightLevel)
+        b.Add(&world->packet_global_light_level,
+              sizeof(world->packet_global_light_level));
+
+    /* 0x4e PersonalLightLevel */
+    if (world->packet_personal_light_level.cmd == PCK_PersonalLightLevel)
+        b.Add(&world->packet_personal_light_level,
+              sizeof(world->packet_personal_light_level));
+
+    /* 0x20 MobileUpdate */
+    if (world->packet_mobile_update.cmd == PCK_MobileUpdate)
+        b.Add(&world->packet_mobile_update,
+              sizeof(world->packet_mobile_update));
+
+    /* WarMode */
+    if (world->packet_war_mode.cmd == PCK_WarMode)
+        b.Add(&world->packet_war_mode, sizeof(world->packet_war_mode));
+
+    /* mobiles */
+    for (const auto &mobile : world->mobiles) {
+        if (mobile.packet_mobile_incoming != nullptr)
+            b.Add(mobile.packet_mobile_incoming.get(),
+                  mobile.packet_mobile_incoming.size());
+        if (mobile.packet_mobile_status != nullptr)
+            b.Add(mobile.packet_mobile_status.get(),
+                  mobile.packet_mobile_status.size());
+    }
+
+    /* items */
+    ++world->item_attach_sequence;
+    for (auto &item : world->items)
+        if (item.attach_sequence != world->item_attach_sequence)
+            attach_item(b, world, &item);
+
+    /* LoginComplete */
+    struct uo_packet_login_complete login_complete;
+    login_complete.cmd = PCK_ReDrawAll;
+    b.Add(&login_complete, sizeof(login_complete));
+
+    return b.Finish();
+}
@@ -0,0 +1,58 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_ATTACH_SNAPSHOT_H
+#define UOPROXY_ATTACH_SNAPSHOT_H
+
+#include "PVersion.hxx"
+
+#include <memory>
+#include <vector>
+
+#include <stdint.h>
+
+struct World;
+
+/**
+ * The packets which are sent to a newly attached client, as one
+ * buffer of concatenated raw packets and in compressed form.  It is
+ * shared by all clients with the same protocol version which attach
+ * before the world changes.
+ */
+struct AttachSnapshot {
+    std::vector<uint8_t> raw;
+
+    /**
+     * All packets of #raw, compressed with uo_compress_batch().
+     */
+    std::vector<uint8_t> compressed;
+
+    unsigned n_packets = 0;
+};
+
+/**
+ * Build the packets which attach a client with the specified
+ * protocol version to the world.
+ */
+std::shared_ptr<const AttachSnapshot>
+attach_make_snapshot(World &world, uint32_t supported_features_flags,
+                     enum protocol_version protocol) noexcept;
+
+#endif
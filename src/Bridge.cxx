@@ -84,11 +84,12 @@ container_update_6_to_5(struct uo_packet_container_update *dest,
 
 /* container_content */
 
-VarStructPtr<struct uo_packet_container_content_6>
-container_content_5_to_6(const struct uo_packet_container_content *src) noexcept
+size_t
+container_content_5_to_6(void *_dest, size_t dest_size,
+                         const struct uo_packet_container_content *src) noexcept
 {
     size_t dest_length;
-    struct uo_packet_container_content_6 *dest;
+    auto *dest = (struct uo_packet_container_content_6 *)_dest;
 
     assert(src->cmd == PCK_ContainerContent);
 
@@ -96,9 +97,9 @@ container_content_5_to_6(const struct uo_packet_container_content *src) noexcept
 
     dest_length = sizeof(*dest) - sizeof(dest->items) +
         num * sizeof(dest->items);
+    if (dest_length > dest_size || dest_length > 0xffff)
+        return 0;
 
-    VarStructPtr<struct uo_packet_container_content_6> ptr(dest_length);
-    dest = ptr.get();
     dest->cmd = PCK_ContainerContent;
     dest->length = dest_length;
     dest->num = src->num;
@@ -106,14 +107,15 @@ container_content_5_to_6(const struct uo_packet_container_content *src) noexcept
     for (unsigned i = 0; i < num; ++i)
         container_item_5_to_6(&dest->items[i], &src->items[i]);
 
-    return ptr;
+    return dest_length;
 }
 
-VarStructPtr<struct uo_packet_container_content>
-container_content_6_to_5(const struct uo_packet_container_content_6 *src) noexcept
+size_t
+container_content_6_to_5(void *_dest, size_t dest_size,
+                         const struct uo_packet_container_content_6 *src) noexcept
 {
     size_t dest_length;
-    struct uo_packet_container_content *dest;
+    auto *dest = (struct uo_packet_container_content *)_dest;
 
     assert(src->cmd == PCK_ContainerContent);
 
@@ -121,9 +123,9 @@ container_content_6_to_5(const struct uo_packet_container_content_6 *src) noexce
 
     dest_length = sizeof(*dest) - sizeof(dest->items) +
         num * sizeof(dest->items);
+    if (dest_length > dest_size || dest_length > 0xffff)
+        return 0;
 
-    VarStructPtr<struct uo_packet_container_content> ptr(dest_length);
-    dest = ptr.get();
     dest->cmd = PCK_ContainerContent;
     dest->length = dest_length;
     dest->num = src->num;
@@ -131,7 +133,7 @@ container_content_6_to_5(const struct uo_packet_container_content_6 *src) noexce
     for (unsigned i = 0; i < num; ++i)
         container_item_6_to_5(&dest->items[i], &src->items[i]);
 
-    return ptr;
+    return dest_length;
 }
 
 /* drop */
@@ -198,13 +200,13 @@ world_item_to_7(struct uo_packet_world_item_7 *dest,
     const uint8_t *p = (const uint8_t *)&src->amount;
 
     if (have_amount) {
-        dest->amount = dest->amount2 = *(const uint16_t *)p;
+        dest->amount = dest->amount2 = *(const PackedBE16 *)p;
         p += 2;
     }
 
-    uint16_t x = *(const uint16_t *)p;
+    uint16_t x = *(const PackedBE16 *)p;
     p += 2;
-    uint16_t y = *(const uint16_t *)p;
+    uint16_t y = *(const PackedBE16 *)p;
     p += 2;
 
     const bool have_direction = (x & 0x8000) != 0;
@@ -220,7 +222,7 @@ world_item_to_7(struct uo_packet_world_item_7 *dest,
     dest->z = *p++;
 
     if (have_hue) {
-        dest->hue = *(const uint16_t *)p;
+        dest->hue = *(const PackedBE16 *)p;
         p += 2;
     }
 
@@ -232,6 +234,8 @@ world_item_to_7(struct uo_packet_world_item_7 *dest,
     dest->type = 0x00;
     dest->serial = serial;
     dest->item_id = src->item_id;
+    dest->x = x;
+    dest->y = y;
 }
 
 void
@@ -245,7 +249,7 @@ world_item_from_7(struct uo_packet_world_item *dest,
     uint8_t *p = (uint8_t *)&dest->amount;
 
     if (src->amount != 0) {
-        *(uint16_t *)p = src->amount;
+        *(PackedBE16 *)p = src->amount;
         p += 2;
 
         dest->serial |= PackedBE32(0x80000000);
@@ -273,7 +277,7 @@ world_item_from_7(struct uo_packet_world_item *dest,
     *p++ = src->z;
 
     if (src->hue != 0) {
-        *(uint16_t *)p = src->hue;
+        *(PackedBE16 *)p = src->hue;
         p += 2;
     }
 
@@ -27,7 +27,6 @@
 #ifndef __UOPROXY_BRIDGE_H
 #define __UOPROXY_BRIDGE_H
 
-#include "util/VarStructPtr.hxx"
 
 #include <stddef.h>
 
@@ -45,11 +44,20 @@ container_update_6_to_5(struct uo_packet_container_update *dest,
 struct uo_packet_container_content;
 struct uo_packet_container_content_6;
 
-VarStructPtr<struct uo_packet_container_content_6>
-container_content_5_to_6(const struct uo_packet_container_content *src) noexcept;
+/**
+ * Convert the container content packet into the caller-provided
+ * buffer.
+ *
+ * @return the length of the converted packet, or 0 if it does not
+ * fit into @a dest_size bytes (or into the 16 bit length field)
+ */
+size_t
+container_content_5_to_6(void *dest, size_t dest_size,
+                         const struct uo_packet_container_content *src) noexcept;
 
-VarStructPtr<struct uo_packet_container_content>
-container_content_6_to_5(const struct uo_packet_container_content_6 *src) noexcept;
+size_t
+container_content_6_to_5(void *dest, size_t dest_size,
+                         const struct uo_packet_container_content_6 *src) noexcept;
 
 struct uo_packet_drop;
 struct uo_packet_drop_6;
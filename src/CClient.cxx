@@ -20,28 +20,39 @@
 
 #include "Connection.hxx"
 #include "LinkedServer.hxx"
-#include "SocketConnect.hxx"
-#include "ProxySocks.hxx"
 #include "Server.hxx"
 #include "Handler.hxx"
 #include "Log.hxx"
 #include "Instance.hxx"
 #include "Config.hxx"
+#include "SocketUtil.hxx"
 
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
 
 bool
-Connection::OnClientPacket(const void *data, size_t length)
+Connection::OnClientPacket(const void *data, size_t length,
+                           ConstBuffer<void> compressed)
 {
     assert(client.client != nullptr);
 
-    const auto action = handle_packet_from_server(server_packet_bindings,
+    const auto received = LatencyHistogram::Clock::now();
+
+    if (lazy_world && IsLazyWorldPacket(data, length))
+        return true;
+
+    /* any packet from the server may modify the world */
+    InvalidateAttachSnapshots();
+
+    const auto action = handle_packet_from_server(server_packet_handlers,
                                                   *this, data, length);
     switch (action) {
     case PacketAction::ACCEPT:
-        if (!client.reconnecting)
-            BroadcastToInGameClients(data, length);
+        if (!client.reconnecting && HasInGameClients()) {
+            BroadcastToInGameClients(data, length, compressed);
+            forward_probe.Start(received);
+        }
 
         break;
 
@@ -83,35 +94,166 @@ Connection::OnClientDisconnect() noexcept
     }
 }
 
+int
+Connection::StartConnect(const struct sockaddr *server_address,
+                         size_t server_address_length,
+                         uint32_t seed, ConnectFailure on_failure,
+                         LinkedServer *requester) noexcept
+{
+    assert(client.client == nullptr);
+
+    async_connect.Cancel();
+
+    pending_connect.seed = seed;
+    pending_connect.on_failure = on_failure;
+    pending_connect.requester = requester;
+    pending_connect.host = nullptr;
+
+    return async_connect.Start(server_address, server_address_length,
+                               instance.config.socks4_address,
+                               instance.config.connect_timeout);
+}
+
+int
+Connection::StartConnect(ResolvedHost &host,
+                         uint32_t seed, ConnectFailure on_failure,
+                         LinkedServer *requester) noexcept
+{
+    ResolvedAddress address;
+    if (!host.Get(address)) {
+        LogFormat(1, "'%s' has not been resolved yet\n", host.GetHost());
+        return EAGAIN;
+    }
+
+    int ret = StartConnect(address.GetAddress(), address.length,
+                           seed, on_failure, requester);
+    if (ret != 0) {
+        host.Failed(address);
+        return ret;
+    }
+
+    pending_connect.host = &host;
+    pending_connect.address = address;
+    return 0;
+}
+
 int
 Connection::Connect(const struct sockaddr *server_address,
                     size_t server_address_length,
-                    uint32_t seed)
+                    uint32_t seed,
+                    const struct uo_packet_account_login &login,
+                    ConnectFailure on_failure,
+                    LinkedServer *requester) noexcept
 {
-    assert(client.client == nullptr);
+    pending_connect.login.account_login = login;
+    return StartConnect(server_address, server_address_length,
+                        seed, on_failure, requester);
+}
+
+int
+Connection::Connect(const struct sockaddr *server_address,
+                    size_t server_address_length,
+                    uint32_t seed,
+                    const struct uo_packet_game_login &login,
+                    ConnectFailure on_failure,
+                    LinkedServer *requester) noexcept
+{
+    pending_connect.login.game_login = login;
+    return StartConnect(server_address, server_address_length,
+                        seed, on_failure, requester);
+}
 
-    int fd;
+int
+Connection::Connect(ResolvedHost &host, uint32_t seed,
+                    const struct uo_packet_account_login &login,
+                    ConnectFailure on_failure,
+                    LinkedServer *requester) noexcept
+{
+    pending_connect.login.account_login = login;
+    return StartConnect(host, seed, on_failure, requester);
+}
 
-    const struct addrinfo *socks4_address =
-        instance.config.socks4_address;
-    if (socks4_address != nullptr) {
-        fd = socket_connect(socks4_address->ai_family, SOCK_STREAM, 0,
-                            socks4_address->ai_addr, socks4_address->ai_addrlen);
-        if (fd < 0)
-            return errno;
+int
+Connection::Connect(ResolvedHost &host, uint32_t seed,
+                    const struct uo_packet_game_login &login,
+                    ConnectFailure on_failure,
+                    LinkedServer *requester) noexcept
+{
+    pending_connect.login.game_login = login;
+    return StartConnect(host, seed, on_failure, requester);
+}
 
-        if (!socks_connect(fd, server_address)) {
-            int e = errno;
-            close(fd);
-            return e;
-        }
+void
+Connection::OnAsyncConnectSuccess(int fd) noexcept
+{
+    if (instance.config.server_notsent_lowat > 0)
+        socket_set_notsent_lowat(fd, instance.config.server_notsent_lowat);
+
+    client.Connect(fd, pending_connect.seed, *this);
+    UpdateBackpressure();
+
+    if (pending_connect.login.cmd == PCK_GameLogin) {
+        LogFormat(2, "connected, doing GameLogin\n");
+        uo_client_send(client.client, &pending_connect.login.game_login,
+                       sizeof(pending_connect.login.game_login));
     } else {
-        fd = socket_connect(server_address->sa_family, SOCK_STREAM, 0,
-                            server_address, server_address_length);
-        if (fd < 0)
-            return errno;
+        assert(pending_connect.login.cmd == PCK_AccountLogin);
+
+        LogFormat(2, "connected, doing AccountLogin\n");
+        uo_client_send(client.client, &pending_connect.login.account_login,
+                       sizeof(pending_connect.login.account_login));
     }
+}
 
-    client.Connect(fd, seed, *this);
-    return 0;
+void
+Connection::OnAsyncConnectError(int error) noexcept
+{
+    LinkedServer *const ls = pending_connect.requester;
+
+    if (pending_connect.host != nullptr)
+        /* try the next address next time */
+        pending_connect.host->Failed(pending_connect.address);
+
+    switch (pending_connect.on_failure) {
+    case ConnectFailure::REJECT_ACCOUNT_LOGIN:
+        log_error("connection to login server failed", error);
+
+        if (ls != nullptr) {
+            struct uo_packet_account_login_reject response;
+            response.cmd = PCK_AccountLoginReject;
+            response.reason = 0x02; /* blocked */
+
+            uo_server_send(ls->server, &response, sizeof(response));
+        }
+
+        break;
+
+    case ConnectFailure::DISCONNECT_CLIENT:
+        log_error("connect to game server failed", error);
+
+        if (ls != nullptr) {
+            ls->LogF(2, "aborting connection to client");
+            RemoveCheckEmpty(*ls);
+            delete ls;
+        }
+
+        break;
+
+    case ConnectFailure::SERVER_DISCONNECT:
+        log_error("connect to game server failed", error);
+
+        if (autoreconnect && IsInGame()) {
+            LogFormat(2, "auto-reconnecting\n");
+            ScheduleReconnect();
+        } else {
+            Destroy();
+        }
+
+        break;
+
+    case ConnectFailure::RECONNECT:
+        log_error("reconnect failed", error);
+        ScheduleReconnect();
+        break;
+    }
 }
@@ -32,6 +32,8 @@
 #include "util/Compiler.h"
 #include "util/VarStructPtr.hxx"
 
+#include <atomic>
+
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -330,13 +332,17 @@ handle_account_login(LinkedServer &ls, const void *data, size_t length)
             p->username, p->password);
 #endif
 
-    if (c->client.client != nullptr) {
+    if (c->client.client != nullptr || c->IsConnecting()) {
         ls.LogF(2, "already logged in");
         return PacketAction::DISCONNECT;
     }
 
     c->credentials = p->credentials;
 
+    if (c->instance.ClaimCredentials(*c, ls, data, length))
+        /* another worker has connections with these credentials */
+        return PacketAction::DROP;
+
     Connection *other = c->instance.FindAttachConnection(c->credentials);
     assert(other != c);
     if (other != nullptr) {
@@ -371,7 +377,6 @@ handle_account_login(LinkedServer &ls, const void *data, size_t length)
            server */
         unsigned i, num_game_servers = config.num_game_servers;
         struct game_server_config *game_servers = config.game_servers;
-        struct sockaddr_in *sin;
 
         assert(config.game_servers != nullptr);
 
@@ -391,14 +396,12 @@ handle_account_login(LinkedServer &ls, const void *data, size_t length)
             snprintf(p2->game_servers[i].name, sizeof(p2->game_servers[i].name),
                      "%s", game_servers[i].name);
 
-            if (game_servers[i].address->ai_family != AF_INET)
-                continue;
-
-            sin = (struct sockaddr_in*)game_servers[i].address->ai_addr;
-            p2->game_servers[i].address = sin->sin_addr.s_addr;
+            /* 0 if not resolved yet or IPv6 only */
+            p2->game_servers[i].address = game_servers[i].address->GetIPv4();
         }
 
         uo_server_send(ls.server, p2_.get(), p2_.size());
+        ls.state = LinkedServer::State::SERVER_LIST;
         return PacketAction::DROP;
     } else if (config.login_address != nullptr) {
         /* connect to the real login server */
@@ -413,9 +416,12 @@ handle_account_login(LinkedServer &ls, const void *data, size_t length)
         else
             seed = uo_server_seed(ls.server);
 
-        int ret = c->Connect(config.login_address->ai_addr,
-                             config.login_address->ai_addrlen,
-                             seed);
+        /* the AccountLogin packet is forwarded as soon as the
+           connection has been established */
+        int ret = c->Connect(*config.login_address,
+                             seed, *p,
+                             Connection::ConnectFailure::REJECT_ACCOUNT_LOGIN,
+                             &ls);
         if (ret != 0) {
             struct uo_packet_account_login_reject response;
 
@@ -426,10 +432,9 @@ handle_account_login(LinkedServer &ls, const void *data, size_t length)
 
             uo_server_send(ls.server, &response,
                            sizeof(response));
-            return PacketAction::DROP;
         }
 
-        return PacketAction::ACCEPT;
+        return PacketAction::DROP;
     } else {
         /* should not happen */
 
@@ -491,6 +496,10 @@ handle_game_login(LinkedServer &ls,
            correct zombie so that we can re-use its connection to the UO
            server. */
         LinkedServer *zombie = instance.FindZombie(*p);
+        if (zombie == nullptr && instance.HandOffToZombie(ls, *p))
+            /* the zombie lives in another worker */
+            return PacketAction::DROP;
+
         if (zombie == nullptr) {
             /* houston, we have a problem -- reject the game login -- it
                either came in too slowly (and so we already reaped the
@@ -581,10 +590,11 @@ static void
 redirect_to_self(LinkedServer &ls)
 {
     struct uo_packet_relay relay;
-    static uint32_t authid = 0;
+    static std::atomic<uint32_t> authid{0};
     struct in_addr addr;
 
-    if (!authid) authid = time(0);
+    uint32_t expected = 0;
+    authid.compare_exchange_strong(expected, (uint32_t)time(0));
 
     relay.cmd = PCK_Relay;
     relay.port = PackedBE16::FromBE(uo_server_getsockport(ls.server));
@@ -593,6 +603,7 @@ redirect_to_self(LinkedServer &ls)
     ls.LogF(8, "redirecting to: %s:%u",
             inet_ntoa(addr), (unsigned)relay.port);;
     relay.auth_id = ls.auth_id = authid++;
+    ls.connection->instance.AddAuthId(ls.auth_id);
     uo_server_send(ls.server, &relay, sizeof(relay));
     ls.state = LinkedServer::State::RELAY_SERVER;
 }
@@ -660,6 +671,9 @@ handle_play_server(LinkedServer &ls,
 
         assert(c.client.client == nullptr);
 
+        if (c.IsConnecting())
+            return PacketAction::DISCONNECT;
+
         /* locate the selected game server */
         unsigned i = p->index;
         if (i >= num_game_servers)
@@ -674,19 +688,19 @@ handle_play_server(LinkedServer &ls,
         else
             seed = 0xc0a80102; /* 192.168.1.2 */
 
-        ret = c.Connect(server_config.address->ai_addr,
-                        server_config.address->ai_addrlen, seed);
-        if (ret != 0) {
-            log_error("connect to game server failed", ret);
-            return PacketAction::DISCONNECT;
-        }
-
-        /* send game login to new server */
+        /* the game login is sent to the new server as soon as the
+           connection has been established */
         login.cmd = PCK_GameLogin;
         login.auth_id = seed;
         login.credentials = c.credentials;
 
-        uo_client_send(c.client.client, &login, sizeof(login));
+        ret = c.Connect(*server_config.address, seed,
+                        login, Connection::ConnectFailure::DISCONNECT_CLIENT,
+                        &ls);
+        if (ret != 0) {
+            log_error("connect to game server failed", ret);
+            return PacketAction::DISCONNECT;
+        }
 
         retaction = PacketAction::DROP;
     } else
@@ -875,7 +889,7 @@ handle_seed(LinkedServer &ls, const void *data, [[maybe_unused]] size_t length)
     return PacketAction::DROP;
 }
 
-const struct server_packet_binding client_packet_bindings[] = {
+static constexpr struct server_packet_binding client_packet_bindings[] = {
     { PCK_CreateCharacter, handle_create_character },
     { PCK_Walk, handle_walk },
     { PCK_TalkAscii, handle_talk_ascii },
@@ -900,3 +914,8 @@ const struct server_packet_binding client_packet_bindings[] = {
     { PCK_Seed, handle_seed }, /* 0xef */
     {}
 };
+
+static_assert(HasUniquePacketBindings(client_packet_bindings));
+
+constexpr server_packet_dispatch client_packet_handlers =
+    MakePacketDispatchTable(client_packet_bindings);
@@ -38,20 +38,25 @@ connection_speak_console(Connection *c, const char *msg)
 }
 
 void
-Connection::BroadcastToInGameClients(const void *data, size_t length) noexcept
+Connection::BroadcastToInGameClients(const void *data, size_t length,
+                                     ConstBuffer<void> compressed) noexcept
 {
+    UO::CompressedPacket packet(data, length, compressed);
+
     for (auto &ls : servers)
         if (ls.IsInGame())
-            uo_server_send(ls.server, data, length);
+            uo_server_send(ls.server, packet);
 }
 
 void
 Connection::BroadcastToInGameClientsExcept(const void *data, size_t length,
                                            LinkedServer &except) noexcept
 {
+    UO::CompressedPacket packet(data, length);
+
     for (auto &ls : servers)
         if (&ls != &except && ls.IsInGame())
-            uo_server_send(ls.server, data, length);
+            uo_server_send(ls.server, packet);
 }
 
 void
@@ -60,17 +65,21 @@ Connection::BroadcastToInGameClientsDivert(enum protocol_version new_protocol,
                                            const void *new_data, size_t new_length) noexcept
 {
     assert(new_protocol > PROTOCOL_UNKNOWN);
-    assert(old_data != nullptr);
-    assert(old_length > 0);
+    assert(old_data == nullptr || old_length > 0);
     assert(new_data != nullptr);
     assert(new_length > 0);
 
+    UO::CompressedPacket old_packet(old_data, old_length);
+    UO::CompressedPacket new_packet(new_data, new_length);
+
     for (auto &ls : servers) {
         if (ls.IsInGame()) {
             if (ls.client_version.protocol >= new_protocol)
-                uo_server_send(ls.server, new_data, new_length);
-            else
-                uo_server_send(ls.server, old_data, old_length);
+                uo_server_send(ls.server, new_packet);
+            else {
+                assert(old_data != nullptr);
+                uo_server_send(ls.server, old_packet);
+            }
         }
     }
 }
@@ -23,6 +23,8 @@
 #include "PacketStructs.hxx"
 #include "Log.hxx"
 
+#include <algorithm>
+
 #include <assert.h>
 
 void
@@ -41,8 +43,30 @@ Connection::Remove(LinkedServer &ls) noexcept
 
     connection_walk_server_removed(walk, ls);
 
+    if (pending_connect.requester == &ls)
+        pending_connect.requester = nullptr;
+
     ls.connection = nullptr;
     ls.unlink();
+
+    if (ls.congested)
+        UpdateBackpressure();
+}
+
+void
+Connection::UpdateBackpressure() noexcept
+{
+    if (client.client == nullptr)
+        return;
+
+    const bool congested =
+        std::any_of(servers.begin(), servers.end(),
+                    [](const LinkedServer &ls){ return ls.congested; });
+
+    if (congested)
+        uo_client_suspend_input(client.client);
+    else
+        uo_client_resume_input(client.client);
 }
 
 void
@@ -54,6 +78,7 @@ Connection::RemoveCheckEmpty(LinkedServer &ls) noexcept
         ls.LogF(2, "client disconnected, server connection still in use");
     } else if (background && client.IsConnected() && client.IsInGame()) {
         ls.LogF(1, "client disconnected, backgrounding");
+        EnterLazyWorld();
     } else {
         ls.LogF(1, "last client disconnected, removing connection");
         Destroy();
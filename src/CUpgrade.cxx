@@ -0,0 +1,176 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Connection.hxx"
+#include "LinkedServer.hxx"
+#include "Instance.hxx"
+#include "Client.hxx"
+#include "Config.hxx"
+#include "Serialize.hxx"
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @param server the index of the client which is walking among the
+ * saved clients, or ~0 if none
+ */
+static void
+walk_save(Serializer &s, WalkState &walk, uint32_t server)
+{
+    s.WriteU32(server);
+    s.WriteU8(walk.seq_next);
+    s.WriteU8(walk.notoriety);
+    s.WriteU64(std::chrono::duration_cast<std::chrono::nanoseconds>(walk.interval).count());
+
+    s.WriteU32(walk.queue_size);
+    for (unsigned i = 0; i < walk.queue_size; ++i) {
+        const auto &item = walk[i];
+        s.WritePacket(item.packet);
+        s.WriteU8(item.seq);
+        s.WriteBool(item.forward_ack);
+        s.WriteBool(item.resync_owner);
+    }
+}
+
+static void
+walk_load(Deserializer &d, WalkState &walk,
+          const std::vector<LinkedServer *> &clients)
+{
+    const uint32_t server = d.ReadU32();
+    if (server < clients.size())
+        walk.server = clients[server];
+
+    walk.seq_next = d.ReadU8();
+    walk.notoriety = d.ReadU8();
+    walk.interval = std::chrono::duration_cast<WalkState::Clock::duration>(std::chrono::nanoseconds(d.ReadU64()));
+
+    const uint32_t n = d.ReadU32();
+    if (n > MAX_WALK_QUEUE)
+        throw std::runtime_error("walk queue too large");
+
+    /* the round trip times of the pending steps are lost */
+    const auto now = WalkState::Clock::now();
+    walk.last_request = now;
+
+    for (unsigned i = 0; i < n; ++i) {
+        auto &item = walk.Append();
+        d.ReadPacket(item.packet);
+        item.seq = d.ReadU8();
+        item.forward_ack = d.ReadBool();
+        item.resync_owner = d.ReadBool();
+        item.sent = now;
+    }
+}
+
+bool
+Connection::Save(Serializer &s) noexcept
+{
+    if (!IsInGame())
+        return false;
+
+    s.WriteBool(background);
+    s.WriteBool(autoreconnect);
+    s.WritePacket(credentials);
+    s.WriteU32(server_index);
+    s.WriteU32(character_index);
+    s.WriteBool(lazy_world);
+    client.Save(s);
+
+    /* while (re)connecting, the new process starts over with a
+       reconnect */
+    auto mark = s.GetMark();
+    s.WriteBool(true);
+    if (client.client == nullptr || client.reconnecting || IsConnecting() ||
+        !uo_client_save(client.client, s)) {
+        s.Rollback(mark);
+        s.WriteBool(false);
+    }
+
+    uint32_t n = 0, walk_server = ~uint32_t(0);
+    for (auto &ls : servers) {
+        if (s.GetFds().size() >= Serializer::MAX_FDS)
+            break;
+
+        mark = s.GetMark();
+        s.WriteBool(true);
+        if (!ls.Save(s)) {
+            s.Rollback(mark);
+            continue;
+        }
+
+        if (&ls == walk.server)
+            walk_server = n;
+        ++n;
+    }
+
+    s.WriteBool(false);
+
+    walk_save(s, walk, walk_server);
+    return true;
+}
+
+Connection *
+connection_restore(Instance *instance, Deserializer &d)
+{
+    const auto &config = instance->config;
+
+    const bool background = d.ReadBool();
+    const bool autoreconnect = d.ReadBool();
+
+    auto c = std::make_unique<Connection>(*instance,
+                                          background, autoreconnect);
+    c->client.world.view_range = config.view_range;
+
+    d.ReadPacket(c->credentials);
+    c->server_index = d.ReadU32();
+    c->character_index = d.ReadU32();
+    c->lazy_world = d.ReadBool();
+    c->client.Load(d);
+
+    if (!c->IsInGame())
+        throw std::runtime_error("connection is not in game");
+
+    if (config.login_address == nullptr &&
+        c->server_index >= config.num_game_servers)
+        throw std::runtime_error("no such game server");
+
+    if (d.ReadBool()) {
+        c->client.client = uo_client_restore(d, *c);
+        c->client.SchedulePing();
+    }
+
+    std::vector<LinkedServer *> clients;
+    while (d.ReadBool()) {
+        auto *ls = new LinkedServer(d);
+        c->Add(*ls);
+        clients.push_back(ls);
+    }
+
+    walk_load(d, c->walk, clients);
+
+    if (c->client.client == nullptr)
+        c->ScheduleReconnect();
+    else
+        c->StartStandby();
+
+    return c.release();
+}
@@ -21,6 +21,9 @@
 #include "CVersion.hxx"
 #include "PacketType.hxx"
 #include "VerifyPacket.hxx"
+#include "Serialize.hxx"
+
+#include <stdexcept>
 
 #include <string.h>
 
@@ -119,3 +122,37 @@ ClientVersion::Seed(const struct uo_packet_seed &_seed) noexcept
     else
         protocol = PROTOCOL_6_0_5;
 }
+
+void
+ClientVersion::Save(Serializer &s) const
+{
+    s.WriteVarStruct(packet);
+
+    s.WriteBool(seed != nullptr);
+    if (seed != nullptr)
+        s.WritePacket(*seed);
+
+    s.WriteU8(protocol);
+}
+
+void
+ClientVersion::Load(Deserializer &d)
+{
+    d.ReadVarStruct(packet, sizeof(*packet));
+    if (packet && !packet_verify_client_version(packet.get(), packet.size()))
+        throw std::runtime_error("malformed client version");
+
+    if (d.ReadBool()) {
+        struct uo_packet_seed p;
+        d.ReadPacket(p);
+
+        delete seed;
+        seed = new struct uo_packet_seed(p);
+    }
+
+    const uint8_t _protocol = d.ReadU8();
+    if (_protocol >= PROTOCOL_COUNT)
+        throw std::runtime_error("malformed protocol version");
+
+    protocol = (enum protocol_version)_protocol;
+}
@@ -24,8 +24,13 @@
 #include "PVersion.hxx"
 #include "util/VarStructPtr.hxx"
 
+#include <utility>
+
 #include <stddef.h>
 
+class Serializer;
+class Deserializer;
+
 struct ClientVersion {
     VarStructPtr<struct uo_packet_client_version> packet;
     struct uo_packet_seed *seed = nullptr;
@@ -37,6 +42,13 @@ struct ClientVersion {
     ClientVersion(const ClientVersion &) = delete;
     ClientVersion &operator=(const ClientVersion &) = delete;
 
+    ClientVersion &operator=(ClientVersion &&src) noexcept {
+        packet = std::move(src.packet);
+        std::swap(seed, src.seed);
+        protocol = src.protocol;
+        return *this;
+    }
+
     bool IsDefined() const noexcept {
         return packet;
     }
@@ -47,6 +59,9 @@ struct ClientVersion {
     void Set(const char *version) noexcept;
 
     void Seed(const struct uo_packet_seed &_seed) noexcept;
+
+    void Save(Serializer &s) const;
+    void Load(Deserializer &d);
 };
 
 #endif
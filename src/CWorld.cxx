@@ -21,33 +21,119 @@
 #include "Connection.hxx"
 #include "LinkedServer.hxx"
 #include "Server.hxx"
+#include "Instance.hxx"
+#include "Config.hxx"
+#include "Log.hxx"
+
+#include <assert.h>
+
+bool
+Connection::HasInGameClients() const noexcept
+{
+    for (const auto &ls : servers)
+        if (ls.IsInGame())
+            return true;
+
+    return false;
+}
+
+bool
+Connection::HasInGameClientsBelow(enum protocol_version protocol) const noexcept
+{
+    for (const auto &ls : servers)
+        if (ls.IsInGame() && ls.client_version.protocol < protocol)
+            return true;
+
+    return false;
+}
 
 void
 Connection::DeleteItems() noexcept
 {
-    client.world.items.clear_and_dispose([this](Item *i){
-        const struct uo_packet_delete p{
-            .cmd = PCK_Delete,
-            .serial = i->serial,
-        };
+    /* if no client would receive the delete packets, skip the
+       per-item loop and release everything at once */
+    if (HasInGameClients()) {
+        for (const auto &i : client.world.items) {
+            const struct uo_packet_delete p{
+                .cmd = PCK_Delete,
+                .serial = i.serial,
+            };
 
-        BroadcastToInGameClients(&p, sizeof(p));
+            BroadcastToInGameClients(&p, sizeof(p));
+        }
+    }
 
-        delete i;
-    });
+    client.world.ClearItems();
 }
 
 void
 Connection::DeleteMobiles() noexcept
 {
-    client.world.mobiles.clear_and_dispose([this](Mobile *m){
-        const struct uo_packet_delete p{
-            .cmd = PCK_Delete,
-            .serial = m->serial,
-        };
+    if (HasInGameClients()) {
+        for (const auto &m : client.world.mobiles) {
+            const struct uo_packet_delete p{
+                .cmd = PCK_Delete,
+                .serial = m.serial,
+            };
+
+            BroadcastToInGameClients(&p, sizeof(p));
+        }
+    }
+
+    client.world.ClearMobiles();
+}
+
+void
+Connection::EnterLazyWorld() noexcept
+{
+    assert(servers.empty());
+
+    if (lazy_world || !instance.config.lazy_background || !IsInGame())
+        return;
+
+    lazy_world = true;
+    InvalidateAttachSnapshots();
+
+    client.world.ClearAllButPlayer();
+
+    LogFormat(3, "releasing the world while in background\n");
+}
+
+/**
+ * Does this packet refer to a mobile other than the player?
+ */
+static bool
+IsOtherMobile(uint32_t player, const uint8_t *data, size_t length,
+              size_t offset) noexcept
+{
+    return length >= offset + sizeof(uint32_t) &&
+        *(const PackedBE32 *)(data + offset) != player;
+}
+
+bool
+Connection::IsLazyWorldPacket(const void *_data, size_t length) const noexcept
+{
+    const auto *data = (const uint8_t *)_data;
+    const uint32_t player = client.world.packet_start.serial;
+
+    switch (data[0]) {
+    case PCK_WorldItem:
+    case PCK_ContainerOpen:
+    case PCK_ContainerUpdate:
+    case PCK_Equip:
+    case PCK_ContainerContent:
+    case PCK_WorldItem7:
+        return true;
+
+    case PCK_Delete:
+    case PCK_MobileMoving:
+        return IsOtherMobile(player, data, length, 1);
 
-        BroadcastToInGameClients(&p, sizeof(p));
+    case PCK_MobileStatus:
+    case PCK_MobileIncoming:
+        return IsOtherMobile(player, data, length, 3);
 
-        delete m;
-    });
+    default:
+        return false;
+    }
 }
@@ -0,0 +1,256 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Capture.hxx"
+#include "Log.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+bool capture_enabled = false;
+
+namespace {
+
+/**
+ * A ring buffer with one producer (the thread which owns it) and one
+ * consumer (the writer thread).  #head and #tail grow monotonically;
+ * the buffer position is their value modulo #SIZE.
+ */
+class CaptureRing {
+    static constexpr size_t SIZE = 4 * 1024 * 1024;
+    static_assert((SIZE & (SIZE - 1)) == 0);
+
+    const std::unique_ptr<uint8_t[]> buffer{new uint8_t[SIZE]};
+
+    /**
+     * The end of the data written by the producer.
+     */
+    alignas(64) std::atomic<uint64_t> head{0};
+
+    /**
+     * The producer's copy of #tail, refreshed when the ring appears
+     * to be full.
+     */
+    uint64_t cached_tail = 0;
+
+    /**
+     * The number of records dropped by the producer.
+     */
+    std::atomic<uint64_t> dropped{0};
+
+    /**
+     * The end of the data consumed by the writer.
+     */
+    alignas(64) std::atomic<uint64_t> tail{0};
+
+public:
+    bool Push(const CaptureRecordHeader &header, const void *data) noexcept {
+        const size_t total = sizeof(header) + header.length;
+        const uint64_t position = head.load(std::memory_order_relaxed);
+
+        if (SIZE - (position - cached_tail) < total) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (SIZE - (position - cached_tail) < total) {
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1,
+                              std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        Copy(position, &header, sizeof(header));
+        Copy(position + sizeof(header), data, header.length);
+        head.store(position + total, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Write all pending data to the file.
+     *
+     * @return the number of bytes written
+     */
+    size_t Drain(FILE *file) noexcept {
+        const uint64_t position = tail.load(std::memory_order_relaxed);
+        const size_t n = head.load(std::memory_order_acquire) - position;
+        if (n == 0)
+            return 0;
+
+        const size_t offset = position & (SIZE - 1);
+        const size_t first = std::min(n, SIZE - offset);
+        fwrite(buffer.get() + offset, 1, first, file);
+        fwrite(buffer.get(), 1, n - first, file);
+
+        tail.store(position + n, std::memory_order_release);
+        return n;
+    }
+
+    uint64_t GetDropped() const noexcept {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    void Copy(uint64_t position, const void *src, size_t n) noexcept {
+        const size_t offset = position & (SIZE - 1);
+        const size_t first = std::min(n, SIZE - offset);
+        memcpy(buffer.get() + offset, src, first);
+        memcpy(buffer.get(), (const uint8_t *)src + first, n - first);
+    }
+};
+
+}
+
+static struct {
+    FILE *file = nullptr;
+    std::thread writer;
+    std::atomic<bool> stop{false};
+
+    /**
+     * The rings of all threads which have recorded something.  They
+     * are only freed by capture_close(), because the writer may
+     * still have to drain them after their thread has exited.
+     */
+    std::mutex mutex;
+    std::vector<std::unique_ptr<CaptureRing>> rings;
+} capture;
+
+static thread_local CaptureRing *thread_capture_ring;
+
+static std::atomic<uint32_t> capture_id_counter{0};
+
+uint32_t
+capture_next_id() noexcept
+{
+    return capture_id_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+static CaptureRing &
+capture_thread_ring() noexcept
+{
+    if (thread_capture_ring == nullptr) {
+        auto ring = std::make_unique<CaptureRing>();
+        thread_capture_ring = ring.get();
+
+        const std::lock_guard<std::mutex> lock(capture.mutex);
+        capture.rings.push_back(std::move(ring));
+    }
+
+    return *thread_capture_ring;
+}
+
+void
+capture_record(PacketDirection direction, uint32_t connection_id,
+               const void *data, size_t length) noexcept
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    CaptureRecordHeader header{};
+    header.time_ns = uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    header.connection_id = connection_id;
+    header.length = length;
+    header.direction = uint8_t(direction);
+
+    capture_thread_ring().Push(header, data);
+}
+
+/**
+ * Write all pending records to the file.
+ *
+ * @return the number of bytes written
+ */
+static size_t
+capture_drain() noexcept
+{
+    const std::lock_guard<std::mutex> lock(capture.mutex);
+
+    size_t n = 0;
+    for (auto &i : capture.rings)
+        n += i->Drain(capture.file);
+    return n;
+}
+
+static void
+capture_writer() noexcept
+{
+    while (true) {
+        if (capture_drain() > 0)
+            continue;
+
+        if (capture.stop.load(std::memory_order_acquire))
+            break;
+
+        fflush(capture.file);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void
+capture_open(const char *path)
+{
+    capture.file = fopen(path, "wb");
+    if (capture.file == nullptr) {
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    CaptureFileHeader header{};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    fwrite(&header, sizeof(header), 1, capture.file);
+
+    capture.writer = std::thread(capture_writer);
+    capture_enabled = true;
+}
+
+void
+capture_close() noexcept
+{
+    if (capture.file == nullptr)
+        return;
+
+    capture_enabled = false;
+
+    capture.stop.store(true, std::memory_order_release);
+    capture.writer.join();
+
+    uint64_t dropped = 0;
+    for (const auto &i : capture.rings)
+        dropped += i->GetDropped();
+    capture.rings.clear();
+
+    if (dropped > 0)
+        LogFormat(1, "capture: %" PRIu64 " records dropped\n", dropped);
+
+    const bool error = ferror(capture.file) != 0;
+    if (fclose(capture.file) != 0 || error)
+        LogFormat(1, "capture: failed to write the file\n");
+
+    capture.file = nullptr;
+}
@@ -0,0 +1,109 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Binary packet capture (see the "capture" option).  Each thread
+ * appends timestamped records to its own single-producer ring
+ * buffer, and a writer thread copies them to the capture file; the
+ * event loops never wait for the disk, and drop records when their
+ * ring is full.
+ *
+ * The file begins with a #CaptureFileHeader, followed by records: a
+ * #CaptureRecordHeader and #length bytes of raw (uncompressed,
+ * unencrypted) packet data.  All integers are in host byte order.
+ * Records of different threads may be out of order.
+ */
+
+#ifndef UOPROXY_CAPTURE_H
+#define UOPROXY_CAPTURE_H
+
+#include "Stats.hxx"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct CaptureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+static constexpr char CAPTURE_MAGIC[8] = "UOPXCAP";
+static constexpr uint32_t CAPTURE_VERSION = 1;
+
+struct CaptureRecordHeader {
+    /**
+     * Nanoseconds since the epoch.
+     */
+    uint64_t time_ns;
+
+    /**
+     * Identifies the TCP connection; the same number is never used
+     * twice by a process.
+     */
+    uint32_t connection_id;
+
+    uint32_t length;
+
+    /**
+     * A #PacketDirection.
+     */
+    uint8_t direction;
+
+    uint8_t reserved[7];
+};
+
+static_assert(sizeof(CaptureRecordHeader) == 24);
+
+extern bool capture_enabled;
+
+/**
+ * Open the capture file and start the writer thread.  Exits the
+ * process on error.
+ */
+void
+capture_open(const char *path);
+
+/**
+ * Write all pending records and close the capture file.  Call this
+ * after all other threads have exited.
+ */
+void
+capture_close() noexcept;
+
+/**
+ * Allocate a new connection id for #CaptureRecordHeader.
+ */
+uint32_t
+capture_next_id() noexcept;
+
+void
+capture_record(PacketDirection direction, uint32_t connection_id,
+               const void *data, size_t length) noexcept;
+
+static inline void
+capture_packet(PacketDirection direction, uint32_t connection_id,
+               const void *data, size_t length) noexcept
+{
+    if (capture_enabled)
+        capture_record(direction, connection_id, data, length);
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "ChunkPool.hxx"
+
+#include <assert.h>
+
+ChunkPool::~ChunkPool() noexcept
+{
+    while (free_list != nullptr) {
+        Chunk *chunk = free_list;
+        free_list = chunk->next;
+        delete chunk;
+    }
+}
+
+Chunk *
+ChunkPool::Get() noexcept
+{
+    Chunk *chunk = free_list;
+    if (chunk == nullptr)
+        return new Chunk;
+
+    assert(n_free > 0);
+
+    free_list = chunk->next;
+    --n_free;
+    return chunk;
+}
+
+void
+ChunkPool::Put(Chunk *chunk) noexcept
+{
+    assert(chunk != nullptr);
+
+    if (n_free >= MAX_FREE) {
+        delete chunk;
+        return;
+    }
+
+    chunk->next = free_list;
+    free_list = chunk;
+    ++n_free;
+}
+
+ChunkPool &
+thread_chunk_pool() noexcept
+{
+    static thread_local ChunkPool pool;
+    return pool;
+}
@@ -0,0 +1,78 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_CHUNK_POOL_H
+#define UOPROXY_CHUNK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A fixed-size buffer obtained from a #ChunkPool.
+ */
+struct Chunk {
+    static constexpr size_t SIZE = 8192 - sizeof(void *);
+
+    /**
+     * Managed by #ChunkPool.
+     */
+    Chunk *next;
+
+    uint8_t data[SIZE];
+};
+
+/**
+ * A cache of idle #Chunk objects.  Socket buffers grow on demand by
+ * taking chunks from here and give them back as soon as they have
+ * been sent, so an idle connection holds no output memory at all.
+ *
+ * There is one pool per thread (see thread_chunk_pool()), which
+ * needs no locking.  A chunk may be returned to a different thread's
+ * pool than the one it came from.
+ */
+class ChunkPool {
+    Chunk *free_list = nullptr;
+
+    size_t n_free = 0;
+
+    /**
+     * Keep at most this many idle chunks (2 MiB); more are given
+     * back to the allocator.
+     */
+    static constexpr size_t MAX_FREE = 256;
+
+public:
+    ChunkPool() = default;
+    ~ChunkPool() noexcept;
+
+    ChunkPool(const ChunkPool &) = delete;
+    ChunkPool &operator=(const ChunkPool &) = delete;
+
+    Chunk *Get() noexcept;
+    void Put(Chunk *chunk) noexcept;
+};
+
+/**
+ * Returns the #ChunkPool of the calling thread.
+ */
+ChunkPool &
+thread_chunk_pool() noexcept;
+
+#endif
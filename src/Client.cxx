@@ -25,13 +25,22 @@
 #include "PacketStructs.hxx"
 #include "PacketType.hxx"
 #include "Log.hxx"
+#include "Trace.hxx"
+#include "Stats.hxx"
+#include "Capture.hxx"
 #include "SocketUtil.hxx"
+#include "Serialize.hxx"
 #include "util/DynamicFifoBuffer.hxx"
+#include "EventBase.hxx"
 
+#include <memory>
+#include <stdexcept>
 #include <utility>
+#include <vector>
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -55,23 +64,57 @@ public:
     SocketBuffer *const sock;
     bool compression_enabled = false;
     struct uo_decompression decompression;
-    DynamicFifoBuffer<uint8_t> decompressed_buffer{65536};
+
+    /**
+     * Allocated on demand, and freed by uo_client_release_idle().
+     */
+    DynamicFifoBuffer<uint8_t> decompressed_buffer{nullptr};
+
+    static constexpr size_t DECOMPRESSED_BUFFER_SIZE = 65536;
+
+    /**
+     * Is #decompression at the beginning of a frame, i.e. did the
+     * previous input byte contain the flush code?
+     */
+    bool frame_start = true;
+
+    /**
+     * An incomplete frame shorter than this is left in the socket
+     * buffer until the rest arrives, so it can be relayed as a whole
+     * (see ClientHandler::OnClientPacket()).  Longer ones are
+     * decompressed right away.
+     */
+    static constexpr size_t MAX_FRAME_WAIT = 4096;
+
+    /**
+     * Stop decompressing and dispatching after this many (compressed)
+     * bytes per event loop iteration, and continue in the next one,
+     * so one busy server does not starve the other connections of
+     * this worker.  Only whole frames are consumed, so it may be
+     * exceeded by one frame.
+     */
+    static constexpr size_t INPUT_BUDGET = 4096;
 
     enum protocol_version protocol_version = PROTOCOL_UNKNOWN;
 
-    ClientHandler &handler;
+    /**
+     * Never nullptr; it may be replaced with uo_client_set_handler().
+     */
+    ClientHandler *handler;
+
+    const uint32_t capture_id = capture_next_id();
 
     bool aborted = false;
     struct event abort_event;
 
     explicit Client(int fd, ClientHandler &_handler) noexcept
         :sock(sock_buff_create(fd, 8192, 65536, *this)),
-         handler(_handler)
+         handler(&_handler)
     {
         uo_decompression_init(&decompression);
 
-        evtimer_set(&abort_event,
-                    uo_client_abort_event_callback, this);
+        thread_evtimer_set(&abort_event,
+                           uo_client_abort_event_callback, this);
     }
 
     ~Client() noexcept {
@@ -82,9 +125,26 @@ public:
 
     void Abort() noexcept;
 
+    void AllocateDecompressedBuffer() noexcept {
+        if (decompressed_buffer.IsNull())
+            decompressed_buffer.Allocate(DECOMPRESSED_BUFFER_SIZE);
+    }
+
 private:
-    ssize_t Decompress(const uint8_t *data, size_t length);
-    ssize_t ParsePackets(const uint8_t *data, size_t length);
+    /**
+     * Decompress and handle one frame.
+     *
+     * @return the number of bytes consumed from #data, 0 if the
+     * frame is incomplete, or -1 if this object has been closed
+     */
+    ssize_t DecompressFrame(const uint8_t *data, size_t length);
+
+    /**
+     * @param frame the compressed frame #data was decompressed from,
+     * if it is exactly that frame; nullptr otherwise
+     */
+    ssize_t ParsePackets(const uint8_t *data, size_t length,
+                         ConstBuffer<void> frame=nullptr);
 
     /* virtual methods from SocketBufferHandler */
     size_t OnSocketData(const void *data, size_t length) override;
@@ -100,7 +160,7 @@ uo_client_abort_event_callback(int, short, void *ctx) noexcept
 
     assert(client->aborted);
 
-    client->handler.OnClientDisconnect();
+    client->handler->OnClientDisconnect();
 }
 
 void
@@ -118,9 +178,70 @@ UO::Client::Abort() noexcept
     aborted = true;
 }
 
+ssize_t
+UO::Client::ParsePackets(const uint8_t *data, size_t length,
+                         ConstBuffer<void> frame)
+{
+    size_t consumed = 0;
+    PacketBatch batch;
+
+    while (length > 0) {
+        frame_packets(protocol_version, data, length, batch);
+        if (batch.n == 0) {
+            if (batch.invalid) {
+                LogFormat(1, "malformed packet from server\n");
+                log_hexdump(5, data, length);
+                Abort();
+                return 0;
+            }
+
+            /* incomplete */
+            break;
+        }
+
+        const auto protocol = protocol_version;
+
+        for (size_t i = 0; i < batch.n; ++i) {
+            const size_t packet_length = batch.lengths[i];
+
+            LogFormat(9, "from server: 0x%02x length=%u\n",
+                      data[0], (unsigned)packet_length);
+            log_hexdump(10, data, packet_length);
+
+            UOPROXY_TRACE3(packet_from_server, data[0], packet_length, data);
+            thread_stats().CountPacket(PacketDirection::FROM_SERVER,
+                                       data, packet_length);
+            capture_packet(PacketDirection::FROM_SERVER, capture_id,
+                           data, packet_length);
+
+            /* the frame can only be relayed if it contains exactly
+               this one packet */
+            const ConstBuffer<void> compressed = consumed == 0 && packet_length == length
+                ? frame
+                : nullptr;
+
+            if (!handler->OnClientPacket(data, packet_length, compressed))
+                return -1;
+
+            consumed += packet_length;
+            data += packet_length;
+            length -= packet_length;
+
+            if (protocol_version != protocol)
+                /* the packet lengths have changed; frame the rest
+                   again */
+                break;
+        }
+    }
+
+    return (ssize_t)consumed;
+}
+
 inline ssize_t
-UO::Client::Decompress(const uint8_t *data, size_t length)
+UO::Client::DecompressFrame(const uint8_t *data, size_t length)
 {
+    AllocateDecompressedBuffer();
+
     auto w = decompressed_buffer.Write();
     if (w.empty()) {
         LogFormat(1, "decompression buffer full\n");
@@ -128,51 +249,43 @@ UO::Client::Decompress(const uint8_t *data, size_t length)
         return -1;
     }
 
-    ssize_t nbytes = uo_decompress(&decompression,
-                                   w.data, w.size,
-                                   data, length);
+    /* a frame which begins on a packet boundary may be relayed */
+    const bool relayable = frame_start && decompressed_buffer.empty();
+
+    const auto saved = decompression;
+    size_t src_consumed = 0;
+    bool flushed;
+    UOPROXY_TRACE1(decompress_entry, length);
+    ssize_t nbytes = uo_decompress_frame(&decompression,
+                                         w.data, w.size,
+                                         data, length,
+                                         &src_consumed, &flushed);
+    UOPROXY_TRACE2(decompress_return, src_consumed, nbytes);
     if (nbytes < 0) {
         LogFormat(1, "decompression failed\n");
         Abort();
         return -1;
     }
 
-    decompressed_buffer.Append((size_t)nbytes);
-
-    return (size_t)length;
-}
-
-ssize_t
-UO::Client::ParsePackets(const uint8_t *data, size_t length)
-{
-    size_t consumed = 0, packet_length;
-
-    while (length > 0) {
-        packet_length = get_packet_length(protocol_version, data, length);
-        if (packet_length == PACKET_LENGTH_INVALID) {
-            LogFormat(1, "malformed packet from server\n");
-            log_hexdump(5, data, length);
-            Abort();
-            return 0;
-        }
-
-        LogFormat(9, "from server: 0x%02x length=%u\n",
-            data[0], (unsigned)packet_length);
-
-        if (packet_length == 0 || packet_length > length)
-            break;
-
-        log_hexdump(10, data, packet_length);
-
-        if (!handler.OnClientPacket(data, packet_length))
-            return -1;
-
-        consumed += packet_length;
-        data += packet_length;
-        length -= packet_length;
+    if (!flushed && relayable && length < MAX_FRAME_WAIT) {
+        /* wait for the rest of the frame */
+        decompression = saved;
+        return 0;
     }
 
-    return (ssize_t)consumed;
+    decompressed_buffer.Append((size_t)nbytes);
+    frame_start = flushed;
+
+    auto r = decompressed_buffer.Read();
+    nbytes = ParsePackets(r.data, r.size,
+                          flushed && relayable
+                          ? ConstBuffer<void>(data, src_consumed)
+                          : nullptr);
+    if (nbytes < 0)
+        return -1;
+
+    decompressed_buffer.Consume((size_t)nbytes);
+    return (ssize_t)src_consumed;
 }
 
 size_t
@@ -181,23 +294,24 @@ UO::Client::OnSocketData(const void *data0, size_t length)
     const uint8_t *data = (const uint8_t *)data0;
 
     if (compression_enabled) {
-        ssize_t nbytes;
-        size_t consumed;
+        size_t consumed = 0;
 
-        nbytes = Decompress(data, length);
-        if (nbytes <= 0)
-            return 0;
-        consumed = (size_t)nbytes;
+        while (consumed < length && !aborted) {
+            ssize_t nbytes = DecompressFrame(data + consumed,
+                                             length - consumed);
+            if (nbytes < 0)
+                return 0;
 
-        auto r = decompressed_buffer.Read();
-        if (r.empty())
-            return consumed;
+            if (nbytes == 0)
+                break;
 
-        nbytes = ParsePackets(r.data, r.size);
-        if (nbytes < 0)
-            return 0;
+            consumed += (size_t)nbytes;
 
-        decompressed_buffer.Consume((size_t)nbytes);
+            if (consumed >= INPUT_BUDGET && consumed < length && !aborted) {
+                sock_buff_continue_input(sock);
+                break;
+            }
+        }
 
         return consumed;
     } else {
@@ -217,7 +331,7 @@ UO::Client::OnSocketDisconnect(int error) noexcept
     else
         log_error("error during communication with server", error);
 
-    handler.OnClientDisconnect();
+    handler->OnClientDisconnect();
 }
 
 UO::Client *
@@ -235,8 +349,10 @@ uo_client_create(int fd, uint32_t seed,
         p.seed = seed;
         uo_client_send(client, &p, sizeof(p));
     } else {
+        /* not a packet; bypass uo_client_send() and its
+           statistics */
         PackedBE32 seed_be(seed);
-        uo_client_send(client, &seed_be, sizeof(seed_be));
+        sock_buff_send(client->sock, &seed_be, sizeof(seed_be));
     }
 
     return client;
@@ -246,6 +362,74 @@ void uo_client_dispose(UO::Client *client) {
     delete client;
 }
 
+bool
+uo_client_save(UO::Client *client, Serializer &s) noexcept
+{
+    if (client->aborted)
+        return false;
+
+    std::vector<uint8_t> input, output;
+    s.WriteFd(sock_buff_export(client->sock, input, output));
+
+    s.WriteU8(client->protocol_version);
+    s.WriteBool(client->compression_enabled);
+    s.WriteT(client->decompression.bit);
+    s.WriteT(client->decompression.treepos);
+    s.WriteT(client->decompression.mask);
+    s.WriteU8(client->decompression.value);
+    s.WriteBool(client->frame_start);
+
+    const auto r = client->decompressed_buffer.Read();
+    s.WriteBuffer(r.data, r.size);
+    s.WriteBuffer(input.data(), input.size());
+    s.WriteBuffer(output.data(), output.size());
+    return true;
+}
+
+UO::Client *
+uo_client_restore(Deserializer &d, UO::ClientHandler &handler)
+{
+    auto client = std::make_unique<UO::Client>(d.ReadFd(), handler);
+
+    const uint8_t protocol = d.ReadU8();
+    if (protocol >= PROTOCOL_COUNT)
+        throw std::runtime_error("malformed protocol version");
+
+    client->protocol_version = (enum protocol_version)protocol;
+    client->compression_enabled = d.ReadBool();
+    client->decompression.bit = d.ReadT<int>();
+    client->decompression.treepos = d.ReadT<int>();
+    client->decompression.mask = d.ReadT<int>();
+    client->decompression.value = d.ReadU8();
+    client->frame_start = d.ReadBool();
+
+    const auto decompressed = d.ReadBuffer();
+    if (!decompressed.empty()) {
+        client->AllocateDecompressedBuffer();
+        auto w = client->decompressed_buffer.Write();
+        if (decompressed.size > w.size)
+            throw std::runtime_error("decompressed data too large");
+        memcpy(w.data, decompressed.data, decompressed.size);
+        client->decompressed_buffer.Append(decompressed.size);
+    }
+
+    if (!sock_buff_import_input(client->sock, d.ReadBuffer()))
+        throw std::runtime_error("input buffer too small");
+
+    const auto output = d.ReadBuffer();
+    if (!output.empty() &&
+        !sock_buff_send(client->sock, output.data, output.size))
+        throw std::runtime_error("output too large");
+
+    return client.release();
+}
+
+void
+uo_client_set_handler(UO::Client *client, UO::ClientHandler &handler) noexcept
+{
+    client->handler = &handler;
+}
+
 void
 uo_client_set_protocol(UO::Client *client,
                        enum protocol_version protocol_version)
@@ -255,6 +439,34 @@ uo_client_set_protocol(UO::Client *client,
     client->protocol_version = protocol_version;
 }
 
+void
+uo_client_suspend_input(UO::Client *client) noexcept
+{
+    sock_buff_suspend_input(client->sock);
+}
+
+void
+uo_client_resume_input(UO::Client *client) noexcept
+{
+    sock_buff_resume_input(client->sock);
+}
+
+void
+uo_client_release_idle(UO::Client *client) noexcept
+{
+    if (sock_buff_release_idle(client->sock) &&
+        client->decompressed_buffer.IsDefined() &&
+        client->decompressed_buffer.empty())
+        client->decompressed_buffer.Free();
+}
+
+size_t
+uo_client_memory_usage(const UO::Client *client) noexcept
+{
+    return sizeof(*client) + client->decompressed_buffer.GetCapacity() +
+        sock_buff_memory_usage(client->sock);
+}
+
 void uo_client_send(UO::Client *client,
                     const void *src, size_t length) {
     assert(client->sock != nullptr || client->aborted);
@@ -266,6 +478,10 @@ void uo_client_send(UO::Client *client,
     LogFormat(9, "sending packet to server, length=%u\n", (unsigned)length);
     log_hexdump(10, src, length);
 
+    thread_stats().CountPacket(PacketDirection::TO_SERVER, src, length);
+    capture_packet(PacketDirection::TO_SERVER, client->capture_id,
+                   src, length);
+
     if (*(const uint8_t*)src == PCK_GameLogin)
         client->compression_enabled = true;
 
@@ -23,10 +23,14 @@
 
 #include "PVersion.hxx"
 
+#include "util/ConstBuffer.hxx"
+
 #include <stdint.h>
 #include <stddef.h>
 
 struct uo_packet_seed;
+class Serializer;
+class Deserializer;
 
 namespace UO {
 
@@ -37,10 +41,15 @@ public:
     /**
      * A packet has been received.
      *
+     * @param compressed the packet exactly as it was compressed by
+     * the server (one packet terminated by the flush code), if
+     * available; it may be forwarded to clients as-is instead of
+     * compressing #data again.  Only valid during this call.
      * @return false if this object has been closed within the
      * function
      */
-    virtual bool OnClientPacket(const void *data, size_t length) = 0;
+    virtual bool OnClientPacket(const void *data, size_t length,
+                                ConstBuffer<void> compressed) = 0;
 
     /**
      * The connection has been closed due to an error or because the
@@ -59,10 +68,60 @@ uo_client_create(int fd, uint32_t seed,
 
 void uo_client_dispose(UO::Client *client);
 
+/**
+ * Stop this client and save its state (including the data which has
+ * not been processed or sent yet) for a new process; see
+ * #UpgradeServer.  Afterwards, the object can only be disposed.
+ *
+ * @return false if the client is being aborted; nothing has been
+ * written then
+ */
+bool
+uo_client_save(UO::Client *client, Serializer &s) noexcept;
+
+/**
+ * Continue a client which has been saved with uo_client_save() by
+ * the previous process.
+ */
+UO::Client *
+uo_client_restore(Deserializer &d, UO::ClientHandler &handler);
+
+/**
+ * Deliver the following packets to another handler, e.g. when a
+ * standby connection is taken over.
+ */
+void
+uo_client_set_handler(UO::Client *client, UO::ClientHandler &handler) noexcept;
+
 void
 uo_client_set_protocol(UO::Client *client,
                        enum protocol_version protocol_version);
 
+/**
+ * Stop reading packets from the server, because the clients we
+ * forward them to can't keep up.  Packets which have been received
+ * already are still delivered.
+ */
+void
+uo_client_suspend_input(UO::Client *client) noexcept;
+
+void
+uo_client_resume_input(UO::Client *client) noexcept;
+
+/**
+ * Free the buffers if nothing has been received since the last call
+ * (see sock_buff_release_idle()).
+ */
+void
+uo_client_release_idle(UO::Client *client) noexcept;
+
+/**
+ * @return the number of bytes allocated for this object and its
+ * buffers
+ */
+size_t
+uo_client_memory_usage(const UO::Client *client) noexcept;
+
 void uo_client_send(UO::Client *client,
                     const void *src, size_t length);
 
@@ -22,8 +22,14 @@
  */
 
 #include "Compression.hxx"
+#include "Stats.hxx"
+#include "Trace.hxx"
+
+#include <array>
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 
 /**
  * Decompression Table
@@ -299,9 +305,9 @@ void uo_decompression_init(struct uo_decompression *de) {
     de->value = 0;
 }
 
-ssize_t uo_decompress(struct uo_decompression *de,
-                      unsigned char *dest, size_t dest_max_len,
-                      const unsigned char *src, size_t src_len) {
+ssize_t uo_decompress_bitwise(struct uo_decompression *de,
+                              unsigned char *dest, size_t dest_max_len,
+                              const unsigned char *src, size_t src_len) {
     size_t dest_index = 0;
 
     while (1) {
@@ -343,13 +349,207 @@ ssize_t uo_decompress(struct uo_decompression *de,
     }
 }
 
+/**
+ * The result of feeding one whole input byte into the Huffman tree,
+ * starting at a given inner node.  Since the shortest code is 2 bits
+ * long, one byte can never complete more than 4 symbols (a 1 bit
+ * remainder of the previous code plus three 2 bit codes).
+ */
+struct DecodeStep {
+    uint8_t symbols[4];
+    uint8_t n_symbols;
+
+    /**
+     * The tree node after this byte; 0 if the byte ended exactly on
+     * a leaf or with the flush code.
+     */
+    uint8_t next_node;
+
+    /**
+     * Did this byte end with the flush code?
+     */
+    bool flush;
+
+    uint8_t padding;
+};
+
+static_assert(sizeof(DecodeStep) == 8);
+
+static constexpr unsigned HUFFMAN_NODES = sizeof(huffman_tree) / sizeof(huffman_tree[0]) / 2;
+
+static_assert(HUFFMAN_NODES == 256);
+
+/**
+ * The byte-wise decoder table, indexed by the current tree node and
+ * the next input byte.  It is generated from #huffman_tree at startup
+ * (512 kB is too much for the constexpr evaluator of some
+ * compilers).
+ */
+static struct DecodeTable {
+    DecodeStep steps[HUFFMAN_NODES][256];
+
+    DecodeTable() noexcept {
+        for (unsigned node = 0; node < HUFFMAN_NODES; ++node) {
+            for (unsigned value = 0; value < 256; ++value) {
+                DecodeStep &step = steps[node][value];
+                step = {};
+
+                int pos = node;
+                for (unsigned mask = 0x80; mask != 0; mask >>= 1) {
+                    pos = value & mask
+                        ? huffman_tree[pos * 2]
+                        : huffman_tree[pos * 2 + 1];
+
+                    if (pos > 0)
+                        continue;
+
+                    if (pos == -256) {
+                        /* flush the rest of the byte */
+                        step.flush = true;
+                        pos = 0;
+                        break;
+                    }
+
+                    assert(step.n_symbols < sizeof(step.symbols));
+                    step.symbols[step.n_symbols++] = (uint8_t)-pos;
+                    pos = 0;
+                }
+
+                step.next_node = (uint8_t)pos;
+            }
+        }
+    }
+} decode_table;
+
+static ssize_t
+DecompressTable(struct uo_decompression *de,
+                unsigned char *dest, size_t dest_max_len,
+                const unsigned char *src, size_t src_len) noexcept
+{
+    if (de->bit < 8)
+        /* we're in the middle of a byte (which only happens if the
+           bit walker has bailed out); let it finish the job */
+        return uo_decompress_bitwise(de, dest, dest_max_len,
+                                     src, src_len);
+
+    const unsigned char *const src_end = src + src_len;
+    unsigned char *const dest_start = dest, *const dest_end = dest + dest_max_len;
+    unsigned node = de->treepos;
+
+    while (src != src_end) {
+        const DecodeStep &step = decode_table.steps[node][*src];
+        const size_t dest_left = dest_end - dest;
+
+        if (dest_left >= sizeof(step.symbols)) {
+            /* fast path: copy all 4 slots, even if not all of them
+               are used */
+            memcpy(dest, step.symbols, sizeof(step.symbols));
+        } else if (step.n_symbols <= dest_left) {
+            memcpy(dest, step.symbols, step.n_symbols);
+        } else {
+            /* Buffer full */
+            de->treepos = node;
+            return -1;
+        }
+
+        dest += step.n_symbols;
+        node = step.next_node;
+        de->value = *src++;
+    }
+
+    de->treepos = node;
+    return dest - dest_start;
+}
+
+/**
+ * Account a uo_decompress() call in #ThreadStats.
+ */
+static void
+RecordDecompress(StatsClock::time_point start,
+                 size_t src_len, ssize_t nbytes) noexcept
+{
+    auto &stats = thread_stats();
+    stats.RecordTimer(StatsTimer::DECOMPRESS, start);
+    stats.decompress_in.Add(src_len);
+    if (nbytes > 0)
+        stats.decompress_out.Add((size_t)nbytes);
+}
+
+ssize_t uo_decompress(struct uo_decompression *de,
+                      unsigned char *dest, size_t dest_max_len,
+                      const unsigned char *src, size_t src_len) {
+    const auto start = StatsClock::now();
+    ssize_t nbytes = DecompressTable(de, dest, dest_max_len,
+                                     src, src_len);
+    RecordDecompress(start, src_len, nbytes);
+    return nbytes;
+}
+
+static ssize_t
+DecompressFrame(struct uo_decompression *de,
+                unsigned char *dest, size_t dest_max_len,
+                const unsigned char *src, size_t src_len,
+                size_t *src_consumed_r, bool *flushed_r) noexcept
+{
+    *flushed_r = false;
+
+    if (de->bit < 8) {
+        /* the bit walker doesn't know about frames */
+        *src_consumed_r = src_len;
+        return uo_decompress_bitwise(de, dest, dest_max_len,
+                                     src, src_len);
+    }
+
+    const unsigned char *const src_start = src, *const src_end = src + src_len;
+    unsigned char *const dest_start = dest, *const dest_end = dest + dest_max_len;
+    unsigned node = de->treepos;
+
+    while (src != src_end) {
+        const DecodeStep &step = decode_table.steps[node][*src];
+        if (step.n_symbols > (size_t)(dest_end - dest)) {
+            /* Buffer full */
+            de->treepos = node;
+            *src_consumed_r = src - src_start;
+            return -1;
+        }
+
+        memcpy(dest, step.symbols, step.n_symbols);
+        dest += step.n_symbols;
+        node = step.next_node;
+        de->value = *src++;
+
+        if (step.flush) {
+            *flushed_r = true;
+            break;
+        }
+    }
+
+    de->treepos = node;
+    *src_consumed_r = src - src_start;
+    return dest - dest_start;
+}
+
+ssize_t
+uo_decompress_frame(struct uo_decompression *de,
+                    unsigned char *dest, size_t dest_max_len,
+                    const unsigned char *src, size_t src_len,
+                    size_t *src_consumed_r, bool *flushed_r)
+{
+    const auto start = StatsClock::now();
+    ssize_t nbytes = DecompressFrame(de, dest, dest_max_len,
+                                     src, src_len,
+                                     src_consumed_r, flushed_r);
+    RecordDecompress(start, *src_consumed_r, nbytes);
+    return nbytes;
+}
+
 /**
  * Compression Table
  *
  * This code was taken from Iris and is originally based on part of
  * UOX.
  */
-static unsigned bit_table[257][2] =
+static constexpr unsigned bit_table[257][2] =
 {
     { 0x02, 0x00 }, { 0x05, 0x1F }, { 0x06, 0x22 }, { 0x07, 0x34 },
     { 0x07, 0x75 }, { 0x06, 0x28 }, { 0x06, 0x3B }, { 0x07, 0x32 },
@@ -419,58 +619,136 @@ static unsigned bit_table[257][2] =
     { 0x04, 0x0D }
 };
 
-struct uo_compression {
-    int bit;
-    unsigned out_data;
+struct HuffmanCode {
+    uint16_t code;
+    uint8_t bits;
 };
 
-static int output_bits(struct uo_compression *co,
-                       unsigned char *dest,
-                       size_t dest_max_len,
-                       size_t *dest_indexp) {
-    while (co->bit >= 8) {
-        if (*dest_indexp >= dest_max_len)
-            return -1;
-        co->bit -= 8;
-        dest[(*dest_indexp)++] = (co->out_data >> co->bit) & 0xff;
+static constexpr auto
+MakeCodeTable() noexcept
+{
+    std::array<HuffmanCode, 257> table{};
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        table[i].code = (uint16_t)bit_table[i][1];
+        table[i].bits = (uint8_t)bit_table[i][0];
     }
 
-    return 0;
+    return table;
 }
 
-ssize_t uo_compress(unsigned char *dest, size_t dest_max_len,
-                    const unsigned char *src, size_t src_len) {
-    struct uo_compression co = { .bit = 0, .out_data = 0 };
-    size_t src_index, dest_index = 0;
-    int num_bits;
+static constexpr auto code_table = MakeCodeTable();
+
+static constexpr HuffmanCode flush_code = code_table[256];
 
-    for (src_index = 0; src_index < src_len; src_index++) {
-        const unsigned char src_char = src[src_index];
+/**
+ * Packs Huffman codes into a 64 bit accumulator and writes them to
+ * the destination buffer one 32 bit word at a time.
+ */
+class HuffmanWriter {
+    unsigned char *dest;
+    unsigned char *const dest_end;
 
-        num_bits = bit_table[src_char][0];
-        co.bit += num_bits;
-        assert(co.bit < 31);
-        co.out_data = (co.out_data << num_bits) | bit_table[src_char][1];
+    uint_least64_t acc = 0;
 
-        if (output_bits(&co, dest, dest_max_len, &dest_index) < 0)
-            return -1;
+    /**
+     * The number of valid bits in #acc; always less than 32 between
+     * calls.
+     */
+    unsigned n_bits = 0;
+
+public:
+    HuffmanWriter(unsigned char *_dest, size_t dest_max_len) noexcept
+        :dest(_dest), dest_end(_dest + dest_max_len) {}
+
+    unsigned char *GetPosition() const noexcept {
+        return dest;
+    }
+
+    bool Put(HuffmanCode c) noexcept {
+        acc = (acc << c.bits) | c.code;
+        n_bits += c.bits;
+
+        if (n_bits < 32)
+            return true;
+
+        if (dest_end - dest < 4)
+            return false;
+
+        n_bits -= 32;
+
+        const uint32_t word = (uint32_t)(acc >> n_bits);
+        dest[0] = (unsigned char)(word >> 24);
+        dest[1] = (unsigned char)(word >> 16);
+        dest[2] = (unsigned char)(word >> 8);
+        dest[3] = (unsigned char)word;
+        dest += 4;
+        return true;
+    }
+
+    bool Put(const unsigned char *src, size_t src_len) noexcept {
+        for (size_t i = 0; i < src_len; ++i)
+            if (!Put(code_table[src[i]]))
+                return false;
+
+        return true;
     }
 
-    num_bits = bit_table[256][0];
-    co.bit += num_bits;
-    assert(co.bit < 31);
-    co.out_data = (co.out_data << num_bits) | bit_table[256][1];
+    /**
+     * Write the remaining bits, padded to the next byte boundary.
+     */
+    bool PadToByte() noexcept {
+        const unsigned n_bytes = (n_bits + 7) / 8;
+        if ((size_t)(dest_end - dest) < n_bytes)
+            return false;
+
+        const uint32_t word = (uint32_t)(acc << (n_bytes * 8 - n_bits));
+        for (unsigned i = n_bytes; i > 0; --i)
+            *dest++ = (unsigned char)(word >> ((i - 1) * 8));
 
-    if (output_bits(&co, dest, dest_max_len, &dest_index) < 0)
-        return -1;
+        acc = 0;
+        n_bits = 0;
+        return true;
+    }
+};
+
+static ssize_t
+CompressBatch(unsigned char *dest, size_t dest_max_len,
+              const ConstBuffer<void> *packets,
+              size_t n_packets) noexcept
+{
+    HuffmanWriter w(dest, dest_max_len);
 
-    if (co.bit > 0) {
-        if (dest_index >= dest_max_len)
+    for (size_t i = 0; i < n_packets; ++i) {
+        const auto *src = (const unsigned char *)packets[i].data;
+        if (!w.Put(src, packets[i].size) || !w.Put(flush_code) ||
+            !w.PadToByte())
             return -1;
+    }
+
+    return w.GetPosition() - dest;
+}
+
+ssize_t uo_compress_batch(unsigned char *dest, size_t dest_max_len,
+                          const ConstBuffer<void> *packets,
+                          size_t n_packets) {
+    const auto start = StatsClock::now();
+    UOPROXY_TRACE1(compress_entry, n_packets);
+    ssize_t nbytes = CompressBatch(dest, dest_max_len, packets, n_packets);
+    UOPROXY_TRACE1(compress_return, nbytes);
 
-        co.out_data <<= (8 - co.bit);
-        dest[dest_index++] = co.out_data & 0xff;
+    auto &stats = thread_stats();
+    stats.RecordTimer(StatsTimer::COMPRESS, start);
+    if (nbytes > 0) {
+        for (size_t i = 0; i < n_packets; ++i)
+            stats.compress_in.Add(packets[i].size);
+        stats.compress_out.Add((size_t)nbytes);
     }
 
-    return (ssize_t)dest_index;
+    return nbytes;
+}
+
+ssize_t uo_compress(unsigned char *dest, size_t dest_max_len,
+                    const unsigned char *src, size_t src_len) {
+    const ConstBuffer<void> packet(src, src_len);
+    return uo_compress_batch(dest, dest_max_len, &packet, 1);
 }
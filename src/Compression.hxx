@@ -21,6 +21,8 @@
 #ifndef __UOPROXY_COMPRESSION_H
 #define __UOPROXY_COMPRESSION_H
 
+#include "util/ConstBuffer.hxx"
+
 #include <sys/types.h> /* for ssize_t */
 
 struct uo_decompression {
@@ -30,11 +32,68 @@ struct uo_decompression {
 
 void uo_decompression_init(struct uo_decompression *de);
 
+/**
+ * Decompress a chunk of the server-to-client stream.  This uses a
+ * precomputed table which consumes one input byte per step.
+ *
+ * @return the number of bytes written to #dest, or -1 if #dest is
+ * too small
+ */
 ssize_t uo_decompress(struct uo_decompression *de,
                       unsigned char *dest, size_t dest_max_len,
                       const unsigned char *src, size_t src_len);
 
+/**
+ * Like uo_decompress(), but stop after the flush code.  The server
+ * terminates each packet (or batch of packets) with it, so this
+ * decodes one "frame" at a time.
+ *
+ * @param src_consumed_r receives the number of bytes consumed from
+ * #src
+ * @param flushed_r receives whether the frame is complete, i.e. the
+ * last consumed byte contained the flush code
+ * @return the number of bytes written to #dest, or -1 if #dest is
+ * too small
+ */
+ssize_t uo_decompress_frame(struct uo_decompression *de,
+                            unsigned char *dest, size_t dest_max_len,
+                            const unsigned char *src, size_t src_len,
+                            size_t *src_consumed_r, bool *flushed_r);
+
+/**
+ * The reference implementation of uo_decompress(), which walks the
+ * Huffman tree one bit at a time.  Both functions share the same
+ * #uo_decompression state and can be used interchangeably.
+ */
+ssize_t uo_decompress_bitwise(struct uo_decompression *de,
+                              unsigned char *dest, size_t dest_max_len,
+                              const unsigned char *src, size_t src_len);
+
+/**
+ * The maximum compressed size of a packet with the given length:
+ * 11 bits per byte (the longest code) plus the 4 bit flush code,
+ * padded to a byte boundary.
+ */
+static constexpr size_t
+uo_compress_bound(size_t src_len) noexcept
+{
+    return (src_len * 11 + 4 + 7) / 8;
+}
+
 ssize_t uo_compress(unsigned char *dest, size_t dest_max_len,
                     const unsigned char *src, size_t src_len);
 
+/**
+ * Compress several packets in one call.  Each packet is terminated
+ * with the flush code and padded to a byte boundary, so the result
+ * is the same as calling uo_compress() for each packet and
+ * concatenating the output.
+ *
+ * @return the total number of bytes written to #dest, or -1 if
+ * #dest is too small
+ */
+ssize_t uo_compress_batch(unsigned char *dest, size_t dest_max_len,
+                          const ConstBuffer<void> *packets,
+                          size_t n_packets);
+
 #endif
@@ -20,6 +20,7 @@
 
 #include "Config.hxx"
 #include "NetUtil.hxx"
+#include "Resolver.hxx"
 #include "version.h"
 #include "Log.hxx"
 
@@ -90,7 +91,7 @@ static struct addrinfo *port_to_addrinfo(int port) {
 }
 
 static struct addrinfo *
-parse_address(const char *host_and_port)
+parse_address(const char *host_and_port, unsigned default_port=2593)
 {
     struct addrinfo hints, *ai;
     int ret;
@@ -99,7 +100,7 @@ parse_address(const char *host_and_port)
     hints.ai_family = PF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
-    ret = getaddrinfo_helper(host_and_port, 2593, &hints, &ai);
+    ret = getaddrinfo_helper(host_and_port, default_port, &hints, &ai);
     if (ret != 0) {
         fprintf(stderr, "getaddrinfo_helper failed: %s\n",
                 gai_strerror(ret));
@@ -125,7 +126,6 @@ void parse_cmdline(Config *config, int argc, char **argv) {
 #endif
     int bind_port = 0;
     const char *bind_address = nullptr, *login_address = nullptr;
-    struct addrinfo hints;
 
     while (1) {
 #ifdef __GLIBC__
@@ -200,23 +200,11 @@ void parse_cmdline(Config *config, int argc, char **argv) {
         exit(1);
     }
 
-    /* resolve login_address */
+    /* parse login_address; it is resolved later by the Resolver */
 
     if (login_address != nullptr) {
-        if (config->login_address != nullptr)
-            freeaddrinfo(config->login_address);
-
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = PF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-
-        ret = getaddrinfo_helper(login_address, 2593, &hints,
-                                 &config->login_address);
-        if (ret < 0) {
-            fprintf(stderr, "failed to resolve '%s': %s\n",
-                    login_address, gai_strerror(ret));
-            exit(1);
-        }
+        delete config->login_address;
+        config->login_address = new ResolvedHost(login_address, 2593);
     }
 
     /* resolve bind_address */
@@ -291,6 +279,20 @@ parse_bool(const char *path, unsigned no, const char *val) {
     }
 }
 
+static unsigned
+parse_notsent_lowat(const char *path, unsigned no, const char *val) {
+    char *endptr;
+    unsigned long nbytes = strtoul(val, &endptr, 10);
+
+    if (endptr == val || *endptr != 0 || nbytes > 16 * 1024 * 1024) {
+        fprintf(stderr, "%s line %u: invalid byte count\n",
+                path, no);
+        exit(2);
+    }
+
+    return (unsigned)nbytes;
+}
+
 static void assign_string(char **destp, const char *src) {
     if (*destp != nullptr)
         free(*destp);
@@ -303,8 +305,6 @@ parse_game_server(const char *path, unsigned no,
                   struct game_server_config *config, char *string)
 {
     char *eq = strchr(string, '=');
-    struct addrinfo hints;
-    int ret;
 
     if (eq == nullptr) {
         fprintf(stderr, "%s line %u: no address for server ('=' missing)\n",
@@ -320,16 +320,7 @@ parse_game_server(const char *path, unsigned no,
         exit(2);
     }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = PF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    ret = getaddrinfo_helper(eq + 1, 2593, &hints, &config->address);
-    if (ret < 0) {
-        fprintf(stderr, "failed to resolve '%s': %s\n",
-                eq + 1, gai_strerror(ret));
-        exit(1);
-    }
+    config->address = new ResolvedHost(eq + 1, 2593);
 }
 
 int config_read_file(Config *config, const char *path) {
@@ -337,7 +328,6 @@ int config_read_file(Config *config, const char *path) {
     char line[2048], *p;
     char *key, *value;
     unsigned no = 0;
-    int ret;
 
     file = fopen(path, "r");
     if (file == nullptr)
@@ -385,40 +375,17 @@ int config_read_file(Config *config, const char *path) {
                 freeaddrinfo(config->bind_address);
 
             config->bind_address = parse_address(value);
-        } else if (strcmp(key, "socks4") == 0) {
-            struct addrinfo hints;
-
-            if (config->socks4_address != nullptr)
-                freeaddrinfo(config->socks4_address);
-
-            memset(&hints, 0, sizeof(hints));
-            hints.ai_family = PF_INET;
-            hints.ai_socktype = SOCK_STREAM;
+        } else if (strcmp(key, "admin_bind") == 0) {
+            if (config->admin_address != nullptr)
+                freeaddrinfo(config->admin_address);
 
-            ret = getaddrinfo_helper(value, 9050, &hints,
-                                     &config->socks4_address);
-            if (ret < 0) {
-                fprintf(stderr, "failed to resolve '%s': %s\n",
-                        value, gai_strerror(ret));
-                exit(1);
-            }
+            config->admin_address = parse_address(value, 2594);
+        } else if (strcmp(key, "socks4") == 0) {
+            delete config->socks4_address;
+            config->socks4_address = new ResolvedHost(value, 9050);
         } else if (strcmp(key, "server") == 0) {
-            struct addrinfo hints;
-
-            if (config->login_address != nullptr)
-                freeaddrinfo(config->login_address);
-
-            memset(&hints, 0, sizeof(hints));
-            hints.ai_family = PF_INET;
-            hints.ai_socktype = SOCK_STREAM;
-
-            ret = getaddrinfo_helper(value, 2593, &hints,
-                                     &config->login_address);
-            if (ret < 0) {
-                fprintf(stderr, "failed to resolve '%s': %s\n",
-                        value, gai_strerror(ret));
-                exit(1);
-            }
+            delete config->login_address;
+            config->login_address = new ResolvedHost(value, 2593);
         } else if (strcmp(key, "server_list") == 0) {
             unsigned i;
 
@@ -426,8 +393,7 @@ int config_read_file(Config *config, const char *path) {
                 for (i = 0; i < config->num_game_servers; i++) {
                     if (config->game_servers[i].name != nullptr)
                         free(config->game_servers[i].name);
-                    if (config->game_servers[i].address != nullptr)
-                        freeaddrinfo(config->game_servers[i].address);
+                    delete config->game_servers[i].address;
                 }
 
                 config->game_servers = nullptr;
@@ -466,16 +432,120 @@ int config_read_file(Config *config, const char *path) {
             }
         } else if (strcmp(key, "background") == 0) {
             config->background = parse_bool(path, no, value);
+        } else if (strcmp(key, "lazy_background") == 0) {
+            config->lazy_background = parse_bool(path, no, value);
         } else if (strcmp(key, "autoreconnect") == 0) {
             config->autoreconnect = parse_bool(path, no, value);
         } else if (strcmp(key, "antispy") == 0) {
             config->antispy = parse_bool(path, no, value);
+        } else if (strcmp(key, "standby") == 0) {
+            config->standby = parse_bool(path, no, value);
         } else if (strcmp(key, "razor_workaround") == 0) {
             config->razor_workaround = parse_bool(path, no, value);
         } else if (strcmp(key, "light") == 0) {
             config->light = parse_bool(path, no, value);
         } else if (strcmp(key, "client_version") == 0) {
             assign_string(&config->client_version, value);
+        } else if (strcmp(key, "capture") == 0) {
+            assign_string(&config->capture_path, value);
+        } else if (strcmp(key, "connect_timeout") == 0) {
+            char *endptr;
+            unsigned long timeout = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || timeout > 3600) {
+                fprintf(stderr, "%s line %u: invalid connect timeout\n",
+                        path, no);
+                exit(2);
+            }
+
+            config->connect_timeout = (unsigned)timeout;
+        } else if (strcmp(key, "dns_refresh") == 0) {
+            char *endptr;
+            unsigned long refresh = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || refresh > 86400) {
+                fprintf(stderr, "%s line %u: invalid DNS refresh interval\n",
+                        path, no);
+                exit(2);
+            }
+
+            config->dns_refresh = (unsigned)refresh;
+        } else if (strcmp(key, "reconnect_concurrency") == 0) {
+            char *endptr;
+            unsigned long n = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || n == 0 || n > 1024) {
+                fprintf(stderr, "%s line %u: invalid reconnect concurrency\n",
+                        path, no);
+                exit(2);
+            }
+
+            config->reconnect_concurrency = (unsigned)n;
+        } else if (strcmp(key, "workers") == 0) {
+            char *endptr;
+            unsigned long n = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || n == 0 || n > 256) {
+                fprintf(stderr, "%s line %u: invalid number of workers\n",
+                        path, no);
+                exit(2);
+            }
+
+#ifdef _WIN32
+            if (n > 1) {
+                fprintf(stderr, "%s line %u: workers are not supported on this platform\n",
+                        path, no);
+                exit(2);
+            }
+#endif
+
+            config->workers = (unsigned)n;
+        } else if (strcmp(key, "walk_queue") == 0) {
+            char *endptr;
+            unsigned long n = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 ||
+                n < MIN_WALK_QUEUE || n > MAX_WALK_QUEUE) {
+                fprintf(stderr, "%s line %u: walk queue must be between %u and %u\n",
+                        path, no, MIN_WALK_QUEUE, MAX_WALK_QUEUE);
+                exit(2);
+            }
+
+            config->walk_queue = (unsigned)n;
+        } else if (strcmp(key, "view_range") == 0) {
+            char *endptr;
+            unsigned long n = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || n > 1024) {
+                fprintf(stderr, "%s line %u: invalid view range\n",
+                        path, no);
+                exit(2);
+            }
+
+            config->view_range = (unsigned)n;
+        } else if (strcmp(key, "walk_optimistic_ack") == 0) {
+            config->walk_optimistic_ack = parse_bool(path, no, value);
+        } else if (strcmp(key, "idle_release") == 0) {
+            char *endptr;
+            unsigned long seconds = strtoul(value, &endptr, 10);
+
+            if (endptr == value || *endptr != 0 || seconds > 86400) {
+                fprintf(stderr, "%s line %u: invalid idle release interval\n",
+                        path, no);
+                exit(2);
+            }
+
+            config->idle_release = (unsigned)seconds;
+        } else if (strcmp(key, "client_cork") == 0) {
+            config->client_cork = parse_bool(path, no, value);
+        } else if (strcmp(key, "client_notsent_lowat") == 0) {
+            config->client_notsent_lowat = parse_notsent_lowat(path, no, value);
+        } else if (strcmp(key, "server_notsent_lowat") == 0) {
+            config->server_notsent_lowat = parse_notsent_lowat(path, no, value);
+        } else if (strcmp(key, "io_uring") == 0) {
+            config->io_uring = parse_bool(path, no, value);
+        } else if (strcmp(key, "upgrade_socket") == 0) {
+            assign_string(&config->upgrade_socket, value);
         } else {
             fprintf(stderr, "%s line %u: invalid keyword '%s'\n",
                     path, no, key);
@@ -493,21 +563,22 @@ Config::~Config() noexcept
     if (bind_address != nullptr)
         freeaddrinfo(bind_address);
 
-    if (socks4_address != nullptr)
-        freeaddrinfo(socks4_address);
+    if (admin_address != nullptr)
+        freeaddrinfo(admin_address);
 
-    if (login_address != nullptr)
-        freeaddrinfo(login_address);
+    delete socks4_address;
+    delete login_address;
 
     if (game_servers != nullptr) {
         unsigned i;
         for (i = 0; i < num_game_servers; i++) {
             free(game_servers[i].name);
-            if (game_servers[i].address != nullptr)
-                freeaddrinfo(game_servers[i].address);
+            delete game_servers[i].address;
         }
         free(game_servers);
     }
 
     free(client_version);
+    free(capture_path);
+    free(upgrade_socket);
 }
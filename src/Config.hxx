@@ -23,9 +23,17 @@
 
 #include <sys/types.h> /* for uid_t/gid_t */
 
+/**
+ * The bounds of the "walk_queue" setting.
+ */
+#define MIN_WALK_QUEUE 4
+#define MAX_WALK_QUEUE 64
+
+class ResolvedHost;
+
 struct game_server_config {
     char *name;
-    struct addrinfo *address;
+    ResolvedHost *address;
 };
 
 struct Config {
@@ -34,14 +42,27 @@ struct Config {
     /**
      * The address of the SOCKS4 proxy server.
      */
-    struct addrinfo *socks4_address = nullptr;
+    ResolvedHost *socks4_address = nullptr;
 
-    struct addrinfo *login_address = nullptr;
+    ResolvedHost *login_address = nullptr;
+
+    /**
+     * The address of the admin listener which serves metrics;
+     * nullptr disables it.
+     */
+    struct addrinfo *admin_address = nullptr;
 
     unsigned num_game_servers = 0;
     struct game_server_config *game_servers = nullptr;
     bool background = false, autoreconnect = true, antispy = false, razor_workaround = false;
 
+    /**
+     * Stop tracking the world of a backgrounded connection without
+     * clients, and request it from the server again on the next
+     * attach?
+     */
+    bool lazy_background = false;
+
     /**
      * Always full light level?
      */
@@ -49,6 +70,90 @@ struct Config {
 
     char *client_version = nullptr;
 
+    /**
+     * Record all packets in this binary capture file (nullptr
+     * disables it).
+     */
+    char *capture_path = nullptr;
+
+    /**
+     * Give up connecting to a server after this number of seconds
+     * (0 means no timeout).
+     */
+    unsigned connect_timeout = 30;
+
+    /**
+     * Look up the host names of servers again after this number of
+     * seconds (0 means only once at startup).
+     */
+    unsigned dns_refresh = 300;
+
+    /**
+     * The maximum number of reconnects (connect and login) in
+     * flight at the same time.
+     */
+    unsigned reconnect_concurrency = 4;
+
+    /**
+     * The number of event loop threads, each with its own listener
+     * socket.
+     */
+    unsigned workers = 1;
+
+    /**
+     * The maximum number of walk requests in flight to the game
+     * server; the effective depth is sized from the measured round
+     * trip time.
+     */
+    unsigned walk_queue = 16;
+
+    /**
+     * Forget ground items and mobiles farther away from the player
+     * than this number of tiles; 0 disables this.
+     */
+    unsigned view_range = 32;
+
+    /**
+     * Acknowledge walk requests to the client right away, instead of
+     * waiting for the game server's WalkAck?
+     */
+    bool walk_optimistic_ack = false;
+
+    /**
+     * Keep a second session of each account logged in and parked at
+     * the character list, to be taken over by the next reconnect?
+     */
+    bool standby = false;
+
+    /**
+     * Free the buffers of sockets which have not received anything
+     * for this number of seconds (0 disables this).
+     */
+    unsigned idle_release = 60;
+
+    /**
+     * Cork the sockets to clients while a world is sent to them?
+     */
+    bool client_cork = true;
+
+    /**
+     * TCP_NOTSENT_LOWAT for the sockets to clients and to servers (0
+     * keeps the kernel's default).
+     */
+    unsigned client_notsent_lowat = 0, server_notsent_lowat = 0;
+
+    /**
+     * Use io_uring for socket I/O (if compiled in and supported by
+     * the kernel)?
+     */
+    bool io_uring = false;
+
+    /**
+     * The Unix socket on which a new uoproxy process asks this one
+     * to hand over all connections (nullptr disables hot upgrades).
+     */
+    char *upgrade_socket = nullptr;
+
     ~Config() noexcept;
 };
 
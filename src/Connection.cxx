@@ -23,6 +23,8 @@
 #include "Instance.hxx"
 #include "Config.hxx"
 #include "Log.hxx"
+#include "AttachSnapshot.hxx"
+#include "Server.hxx"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -36,6 +38,7 @@ int connection_new(Instance *instance,
     auto *c = new Connection(*instance,
                              instance->config.background,
                              instance->config.autoreconnect);
+    c->client.world.view_range = instance->config.view_range;
 
     if (instance->config.client_version != nullptr) {
         c->client.version.Set(instance->config.client_version);
@@ -57,5 +60,48 @@ Connection::~Connection() noexcept
 
     Disconnect();
 
-    evtimer_del(&reconnect_event);
+    instance.reconnect_scheduler.Cancel(*this);
+
+    if (credentials_claimed)
+        instance.ReleaseCredentials(*this);
+}
+
+void
+Connection::ReleaseIdleBuffers() noexcept
+{
+    if (client.client != nullptr)
+        uo_client_release_idle(client.client);
+
+    if (standby)
+        standby->ReleaseIdleBuffers();
+
+    for (auto &ls : servers)
+        if (ls.server != nullptr)
+            uo_server_release_idle(ls.server);
+}
+
+size_t
+Connection::GetMemoryUsage() const noexcept
+{
+    size_t result = sizeof(*this) + client.world.GetMemoryUsage() +
+        client.version.packet.GetCapacity() +
+        client.server_list.GetCapacity() + client.char_list.GetCapacity();
+
+    if (client.client != nullptr)
+        result += uo_client_memory_usage(client.client);
+
+    if (standby)
+        result += standby->GetMemoryUsage();
+
+    for (const auto &ls : servers) {
+        result += sizeof(ls);
+        if (ls.server != nullptr)
+            result += uo_server_memory_usage(ls.server);
+    }
+
+    for (const auto &i : attach_snapshots)
+        if (i != nullptr)
+            result += sizeof(*i) + i->raw.capacity() + i->compressed.capacity();
+
+    return result;
 }
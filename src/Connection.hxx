@@ -26,14 +26,25 @@
 #include "World.hxx"
 #include "Client.hxx"
 #include "StatefulClient.hxx"
+#include "AsyncConnect.hxx"
+#include "Resolver.hxx"
+#include "ReconnectScheduler.hxx"
+#include "Config.hxx"
+#include "Latency.hxx"
+#include "Standby.hxx"
 
 #include <event.h>
 
-#define MAX_WALK_QUEUE 4
+#include <array>
+#include <chrono>
+#include <memory>
 
 struct Instance;
 struct Connection;
 struct LinkedServer;
+struct AttachSnapshot;
+class Serializer;
+class Deserializer;
 
 namespace UO {
 class Client;
@@ -41,6 +52,8 @@ class Server;
 }
 
 struct WalkState {
+    using Clock = std::chrono::steady_clock;
+
     struct Item {
         /**
          * The walk packet sent by the client.
@@ -51,15 +64,63 @@ struct WalkState {
          * The walk sequence number which was sent to the server.
          */
         uint8_t seq;
+
+        /**
+         * Forward the server's WalkAck to the client?  False if the
+         * client has already been acknowledged optimistically, or if
+         * its sequence was reset by a WalkCancel meanwhile.
+         */
+        bool forward_ack;
+
+        /**
+         * Send the new position to the requesting client, too, when
+         * this step is acknowledged, because the client's idea of its
+         * position may be out of sync.
+         */
+        bool resync_owner;
+
+        Clock::time_point sent;
     };
 
     LinkedServer *server = nullptr;
+
+    /**
+     * A ring buffer of walk requests which were forwarded to the
+     * server, but not yet acknowledged.
+     */
     Item queue[MAX_WALK_QUEUE];
-    unsigned queue_size = 0;
+    unsigned queue_head = 0, queue_size = 0;
+
     uint8_t seq_next = 0;
+
+    /**
+     * The notoriety from the most recent WalkAck, used for
+     * optimistic acknowledgements.
+     */
+    uint8_t notoriety = 0x01;
+
+    /**
+     * Smoothed interval between two walk requests while walking; zero
+     * if not yet measured.
+     */
+    Clock::duration interval = Clock::duration::zero();
+
+    Clock::time_point last_request;
+
+    Item &operator[](unsigned i) noexcept {
+        return queue[(queue_head + i) % MAX_WALK_QUEUE];
+    }
+
+    Item &Front() noexcept {
+        return (*this)[0];
+    }
+
+    Item &Append() noexcept {
+        return (*this)[queue_size++];
+    }
 };
 
-struct Connection final : IntrusiveListHook, UO::ClientHandler {
+struct Connection final : IntrusiveListHook, UO::ClientHandler, AsyncConnectHandler {
     Instance &instance;
 
     /* flags */
@@ -73,19 +134,119 @@ struct Connection final : IntrusiveListHook, UO::ClientHandler {
     StatefulClient client;
 
     /**
-     * A timer which is used to schedule a reconnect.
+     * Our state in Instance::reconnect_scheduler.
+     */
+    ReconnectTicket reconnect_ticket;
+
+    /**
+     * What to do when the asynchronous connect to the server fails;
+     * see Connect().
+     */
+    enum class ConnectFailure : uint8_t {
+        /**
+         * Send AccountLoginReject to the requesting client.
+         */
+        REJECT_ACCOUNT_LOGIN,
+
+        /**
+         * Disconnect the requesting client.
+         */
+        DISCONNECT_CLIENT,
+
+        /**
+         * Handle like a server disconnect: auto-reconnect or destroy
+         * this object.
+         */
+        SERVER_DISCONNECT,
+
+        /**
+         * Schedule another reconnect attempt.
+         */
+        RECONNECT,
+    };
+
+    AsyncConnect async_connect{*this};
+
+    /**
+     * Parameters of the pending #async_connect.
      */
-    struct event reconnect_event;
+    struct {
+        uint32_t seed;
+
+        ConnectFailure on_failure;
+
+        /**
+         * The client which has requested the connection; cleared by
+         * Remove().
+         */
+        LinkedServer *requester;
+
+        /**
+         * The configured host which is being connected to (or
+         * nullptr), to be notified about failures, and the address
+         * which was picked from it.
+         */
+        ResolvedHost *host;
+        ResolvedAddress address;
+
+        /**
+         * The login packet which is sent after the connection has
+         * been established.
+         */
+        union {
+            uint8_t cmd;
+            struct uo_packet_account_login account_login;
+            struct uo_packet_game_login game_login;
+        } login;
+    } pending_connect;
 
     /* state */
     UO::CredentialsFragment credentials{};
 
+    /**
+     * Have the #credentials been registered with
+     * Instance::ClaimCredentials()?
+     */
+    bool credentials_claimed = false;
+
     unsigned server_index = 0;
 
     unsigned character_index = 0;
 
     WalkState walk;
 
+    /**
+     * Is the world being ignored, because this connection is in
+     * background and no client is attached?  See EnterLazyWorld().
+     */
+    bool lazy_world = false;
+
+    /**
+     * Round trip times to the game server, measured from pings and
+     * walk acknowledgements.
+     */
+    LatencyHistogram upstream_rtt;
+
+    /**
+     * How long packets from the game server took until they were
+     * sent to the attached clients.
+     */
+    LatencyHistogram forward_latency;
+    ForwardProbe forward_probe{forward_latency};
+
+    /**
+     * Cached world snapshots for attaching clients, one per protocol
+     * version; see attach_send_world().  They are discarded whenever
+     * the world may have changed.
+     */
+    std::array<std::shared_ptr<const AttachSnapshot>, PROTOCOL_COUNT> attach_snapshots;
+
+    /**
+     * The standby session (see "standby"); nullptr if not
+     * configured or not in game yet.
+     */
+    std::unique_ptr<Standby> standby;
+
     /* sub-objects */
 
     IntrusiveList<LinkedServer> servers;
@@ -95,7 +256,6 @@ struct Connection final : IntrusiveListHook, UO::ClientHandler {
         :instance(_instance), background(_background),
          autoreconnect(_autoreconnect)
     {
-        evtimer_set(&reconnect_event, ReconnectTimerCallback, this);
     }
 
     ~Connection() noexcept;
@@ -112,23 +272,87 @@ struct Connection final : IntrusiveListHook, UO::ClientHandler {
         return client.IsInGame();
     }
 
+    /**
+     * Is at least one client attached and in game?
+     */
+    bool HasInGameClients() const noexcept;
+
+    /**
+     * Is at least one client in game which speaks a protocol older
+     * than the specified one?  Used to skip the conversion for
+     * BroadcastToInGameClientsDivert() if nobody needs it.
+     */
+    bool HasInGameClientsBelow(enum protocol_version protocol) const noexcept;
+
     bool CanAttach() const noexcept {
         return IsInGame() && client.char_list;
     }
 
+    bool IsConnecting() const noexcept {
+        return async_connect.IsPending();
+    }
+
     /**
-     * @return 0 on success or an errno value
+     * Begin connecting to the server.  When the connection has been
+     * established, the login packet (AccountLogin or GameLogin) is
+     * sent to it; if that fails later, #on_failure decides what
+     * happens next.
+     *
+     * @return 0 on success (i.e. connecting has begun) or an errno
+     * value if it failed right away
      */
     int Connect(const struct sockaddr *server_address,
                 size_t server_address_length,
-                uint32_t seed);
+                uint32_t seed,
+                const struct uo_packet_account_login &login,
+                ConnectFailure on_failure,
+                LinkedServer *requester=nullptr) noexcept;
+
+    int Connect(const struct sockaddr *server_address,
+                size_t server_address_length,
+                uint32_t seed,
+                const struct uo_packet_game_login &login,
+                ConnectFailure on_failure,
+                LinkedServer *requester=nullptr) noexcept;
+
+    /**
+     * Connect to the current address of a configured host; if that
+     * fails, the next attempt uses the next address.
+     */
+    int Connect(ResolvedHost &host, uint32_t seed,
+                const struct uo_packet_account_login &login,
+                ConnectFailure on_failure,
+                LinkedServer *requester=nullptr) noexcept;
+
+    int Connect(ResolvedHost &host, uint32_t seed,
+                const struct uo_packet_game_login &login,
+                ConnectFailure on_failure,
+                LinkedServer *requester=nullptr) noexcept;
     void Disconnect() noexcept;
     void Reconnect();
+
+    /**
+     * Send PlayCharacter for #character_index to the server.
+     */
+    void SendPlayCharacter() noexcept;
+
+    /**
+     * Schedule logging in the standby session after entering the
+     * game, if configured.
+     */
+    void StartStandby() noexcept;
     void ScheduleReconnect() noexcept;
 
     void Add(LinkedServer &ls) noexcept;
     void Remove(LinkedServer &ls) noexcept;
 
+    /**
+     * Suspend reading from the server while at least one client is
+     * congested (see LinkedServer::congested), and resume when all
+     * have drained.
+     */
+    void UpdateBackpressure() noexcept;
+
     /**
      * Remove the specified #LinkedServer and check if this is the
      * last connection from a client; if so, it may destroy the whole
@@ -136,16 +360,37 @@ struct Connection final : IntrusiveListHook, UO::ClientHandler {
      */
     void RemoveCheckEmpty(LinkedServer &ls) noexcept;
 
-    void BroadcastToInGameClients(const void *data, size_t length) noexcept;
+    /**
+     * @param compressed the packet compressed by the game server, to
+     * be forwarded without compressing it again; see
+     * UO::ClientHandler::OnClientPacket()
+     */
+    void BroadcastToInGameClients(const void *data, size_t length,
+                                  ConstBuffer<void> compressed=nullptr) noexcept;
     void BroadcastToInGameClientsExcept(const void *data, size_t length,
                                         LinkedServer &except) noexcept;
+
+    /**
+     * Send @a new_data to all in-game clients which speak at least
+     * @a new_protocol, and @a old_data to all others.  Each variant
+     * is compressed only once and shared by all its clients.
+     *
+     * @param old_data may be nullptr if HasInGameClientsBelow()
+     * returned false
+     */
     void BroadcastToInGameClientsDivert(enum protocol_version new_protocol,
                                         const void *old_data, size_t old_length,
                                         const void *new_data, size_t new_length) noexcept;
 
     LinkedServer *FindZombie(const struct uo_packet_game_login &game_login) noexcept;
 
+    void InvalidateAttachSnapshots() noexcept {
+        for (auto &i : attach_snapshots)
+            i.reset();
+    }
+
     void ClearWorld() noexcept {
+        InvalidateAttachSnapshots();
         DeleteItems();
         DeleteMobiles();
     }
@@ -153,19 +398,83 @@ struct Connection final : IntrusiveListHook, UO::ClientHandler {
     void DeleteItems() noexcept;
     void DeleteMobiles() noexcept;
 
+    /**
+     * The last client has gone and this connection stays in
+     * background: if configured, release all items and mobiles
+     * except the player, and ignore packets which would add them
+     * again until the next attach, which requests a resync from the
+     * server (see attach_send_world()).
+     */
+    void EnterLazyWorld() noexcept;
+
+    /**
+     * Shall this packet from the server be ignored in #lazy_world
+     * mode, because it only describes the world around the player?
+     */
+    bool IsLazyWorldPacket(const void *data, size_t length) const noexcept;
+
+    /**
+     * Save this connection and its in-game clients for a new process
+     * (see #UpgradeServer).  Only connections which are in game can
+     * be saved.  The sockets of a saved connection are dead; it can
+     * only be destroyed afterwards.
+     *
+     * @return false if nothing has been written
+     */
+    bool Save(Serializer &s) noexcept;
+
+    /**
+     * Free the buffers of the sockets which have not received
+     * anything since the last call (see "idle_release").
+     */
+    void ReleaseIdleBuffers() noexcept;
+
+    /**
+     * The number of bytes allocated for this connection, its
+     * sockets, the world model and the attach snapshots.
+     */
+    size_t GetMemoryUsage() const noexcept;
+
 private:
+    int StartConnect(const struct sockaddr *server_address,
+                     size_t server_address_length,
+                     uint32_t seed, ConnectFailure on_failure,
+                     LinkedServer *requester) noexcept;
+
+    int StartConnect(ResolvedHost &host,
+                     uint32_t seed, ConnectFailure on_failure,
+                     LinkedServer *requester) noexcept;
+
+    friend class ReconnectScheduler;
     void DoReconnect() noexcept;
-    static void ReconnectTimerCallback(int, short, void *ctx) noexcept;
+
+    /**
+     * Take over the #standby session instead of logging in again.
+     */
+    void UseStandby() noexcept;
 
     /* virtual methods from UO::ClientHandler */
-    bool OnClientPacket(const void *data, size_t length) override;
+    bool OnClientPacket(const void *data, size_t length,
+                        ConstBuffer<void> compressed) override;
     void OnClientDisconnect() noexcept override;
+
+    /* virtual methods from AsyncConnectHandler */
+    void OnAsyncConnectSuccess(int fd) noexcept override;
+    void OnAsyncConnectError(int error) noexcept override;
 };
 
 int connection_new(Instance *instance,
                    int server_socket,
                    Connection **connectionp);
 
+/**
+ * Restore a connection which has been saved with Connection::Save()
+ * by the previous process.  If it had no connection to the server,
+ * it reconnects.
+ */
+Connection *
+connection_restore(Instance *instance, Deserializer &d);
+
 void connection_speak_console(Connection *c, const char *msg);
 
 /* walk */
@@ -186,6 +495,13 @@ void
 connection_walk_ack(Connection &c,
                     const struct uo_packet_walk_ack &p);
 
+/**
+ * Ask the server to send the player's position and surroundings
+ * again.
+ */
+void
+connection_resync(Connection &c);
+
 /* attach */
 
 void
@@ -76,15 +76,12 @@ min_size_t(size_t a, size_t b)
 }
 
 void
-log_hexdump(unsigned level, const void *data, size_t length) noexcept
+do_log_hexdump(unsigned level, const void *data, size_t length) noexcept
 {
     const unsigned char *p = (const unsigned char *)data;
     size_t row;
     char line[80];
 
-    if (level > verbose)
-        return;
-
     for (row = 0; row < length; row += 0x10) {
         hexdump_line(line, row, p + row,
                      min_size_t(0x10, length - row));
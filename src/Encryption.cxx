@@ -22,10 +22,17 @@
 #include "PacketStructs.hxx"
 #include "PacketType.hxx"
 #include "Log.hxx"
+#include "Serialize.hxx"
+#include "util/ByteOrder.hxx"
+
+#include <iterator>
+#include <stdexcept>
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 enum encryption_state {
     STATE_NEW,
@@ -117,6 +124,8 @@ static constexpr struct login_key login_keys[] = {
     { nullptr, 0, 0 }
 };
 
+static_assert(std::size(login_keys) <= 0x100);
+
 
 struct encryption *
 encryption_new()
@@ -145,51 +154,148 @@ account_login_valid(const struct uo_packet_account_login *p)
         p->credentials.password[29] == 0x00;
 }
 
+/**
+ * Advance the key stream by one byte.
+ */
+static inline void
+login_step(uint32_t &table1, uint32_t &table2,
+           uint32_t key1, uint32_t key2) noexcept
+{
+    const uint32_t msb1 = table1 << 31;
+    uint32_t eax = ((((table2 >> 1) | msb1) ^ (key1 - 1)) >> 1) | msb1;
+    const uint32_t ecx = (table1 >> 1) | (table2 << 31);
+    table1 = ecx ^ key2;
+    table2 = eax ^ key1;
+}
+
 static void
 login_decrypt(struct login_encryption *e, const void *src0,
               void *dest0, size_t length)
 {
-    const uint8_t *src = (const uint8_t *)src0, *src_end = src + length;
+    const uint8_t *src = (const uint8_t *)src0, *const src_end = src + length;
     uint8_t *dest = (uint8_t *)dest0;
 
+    /* work on local copies, so the compiler does not need to reload
+       the state after each (possibly aliasing) byte store */
+    uint32_t table1 = e->table1, table2 = e->table2;
+    const uint32_t key1 = e->key1, key2 = e->key2;
+
+    /* the key stream is inherently serial, but generating eight
+       bytes at a time allows XORing whole words */
+    while (src_end - src >= 8) {
+        uint64_t key_stream = 0;
+        for (unsigned i = 0; i < 8; ++i) {
+            key_stream |= uint64_t(table1 & 0xff) << (i * 8);
+            login_step(table1, table2, key1, key2);
+        }
+
+        uint64_t word;
+        memcpy(&word, src, sizeof(word));
+        word ^= IsLittleEndian() ? key_stream : ByteSwap64(key_stream);
+        memcpy(dest, &word, sizeof(word));
+
+        src += 8;
+        dest += 8;
+    }
+
     while (src != src_end) {
-        *dest++ = (*src++ ^ e->table1);
-        uint32_t edx = e->table2;
-        uint32_t esi = e->table1 << 31;
-        uint32_t eax = e->table2 >> 1;
-        eax |= esi;
-        eax ^= e->key1 - 1;
-        edx <<= 31;
-        eax >>= 1;
-        uint32_t ecx = e->table1 >> 1;
-        eax |= esi;
-        ecx |= edx;
-        eax ^= e->key1;
-        ecx ^= e->key2;
-        e->table1 = ecx;
-        e->table2 = eax;
+        *dest++ = *src++ ^ table1;
+        login_step(table1, table2, key1, key2);
+    }
+
+    e->table1 = table1;
+    e->table2 = table2;
+}
+
+/**
+ * Does this key decrypt an AccountLogin packet?  Only the bytes
+ * checked by account_login_valid() are decrypted; the key stream is
+ * advanced without output in between, and most wrong keys are
+ * rejected after the username.
+ */
+static bool
+login_key_matches(const struct login_encryption &e,
+                  const uint8_t *src) noexcept
+{
+    static constexpr size_t username_end =
+        offsetof(struct uo_packet_account_login, credentials.username) + 29;
+    static constexpr size_t password_end =
+        offsetof(struct uo_packet_account_login, credentials.password) + 29;
+
+    uint32_t table1 = e.table1, table2 = e.table2;
+
+    size_t position = 0;
+    for (const size_t offset : {username_end, password_end}) {
+        for (; position < offset; ++position)
+            login_step(table1, table2, e.key1, e.key2);
+
+        if (uint8_t(src[offset] ^ table1) != 0)
+            return false;
     }
+
+    return true;
+}
+
+/**
+ * The most recently detected #login_keys indexes of this thread,
+ * most recent first.  Clients reconnecting after a shard restart
+ * usually share a few versions, so their key is found in the first
+ * try.
+ */
+static thread_local uint8_t recent_login_keys[4];
+static thread_local unsigned n_recent_login_keys;
+
+static void
+remember_login_key(uint8_t index) noexcept
+{
+    unsigned i = 0;
+    while (i < n_recent_login_keys && recent_login_keys[i] != index)
+        ++i;
+
+    if (i == n_recent_login_keys &&
+        n_recent_login_keys < std::size(recent_login_keys))
+        ++n_recent_login_keys;
+    else if (i == std::size(recent_login_keys))
+        --i;
+
+    for (; i > 0; --i)
+        recent_login_keys[i] = recent_login_keys[i - 1];
+    recent_login_keys[0] = index;
 }
 
 static bool
 encryption_login_init(struct login_encryption *e, uint32_t seed,
                       const void *data)
 {
+    const uint8_t *const src = (const uint8_t *)data;
+
     e->table1 = (((~seed) ^ 0x00001357) << 16) | ((seed ^ 0x0000aaaa) & 0x0000ffff);
     e->table2 = ((seed ^ 0x43210000) >> 16) | (((~seed) ^ 0xabcd0000) & 0xffff0000);
 
-    for (const struct login_key *i = login_keys; i->version != nullptr; ++i) {
-        e->key1 = i->key1;
-        e->key2 = i->key2;
+    /* the first byte does not depend on the key: if it does not
+       decrypt to AccountLogin, no key will match */
+    if (uint8_t(src[0] ^ e->table1) != PCK_AccountLogin)
+        return false;
+
+    const auto try_key = [e, src](uint8_t index){
+        e->key1 = login_keys[index].key1;
+        e->key2 = login_keys[index].key2;
+        if (!login_key_matches(*e, src))
+            return false;
+
+        LogFormat(2, "login encryption for client version %s\n",
+                  login_keys[index].version);
+        remember_login_key(index);
+        return true;
+    };
+
+    for (unsigned i = 0; i < n_recent_login_keys; ++i)
+        if (try_key(recent_login_keys[i]))
+            return true;
 
-        struct login_encryption tmp = *e;
-        struct uo_packet_account_login decrypted;
-        login_decrypt(&tmp, data, &decrypted, sizeof(decrypted));
-        if (account_login_valid(&decrypted)) {
-            LogFormat(2, "login encryption for client version %s\n", i->version);
+    for (uint8_t i = 0; login_keys[i].version != nullptr; ++i)
+        if (try_key(i))
             return true;
-        }
-    }
 
     return false;
 }
@@ -295,3 +401,29 @@ encryption_from_client(struct encryption *e,
     /* XXX decrypt */
     return e->buffer;
 }
+
+void
+encryption_save(const struct encryption *e, Serializer &s)
+{
+    s.WriteU8(e->state);
+    s.WriteU32(e->seed);
+    s.WriteU32(e->login.key1);
+    s.WriteU32(e->login.key2);
+    s.WriteU32(e->login.table1);
+    s.WriteU32(e->login.table2);
+}
+
+void
+encryption_restore(struct encryption *e, Deserializer &d)
+{
+    const uint8_t state = d.ReadU8();
+    if (state > STATE_GAME)
+        throw std::runtime_error("malformed encryption state");
+
+    e->state = (enum encryption_state)state;
+    e->seed = d.ReadU32();
+    e->login.key1 = d.ReadU32();
+    e->login.key2 = d.ReadU32();
+    e->login.table1 = d.ReadU32();
+    e->login.table2 = d.ReadU32();
+}
@@ -24,6 +24,8 @@
 #include <stddef.h>
 
 struct encryption;
+class Serializer;
+class Deserializer;
 
 struct encryption *
 encryption_new();
@@ -39,4 +41,13 @@ const void *
 encryption_from_client(struct encryption *e,
                        const void *data, size_t length);
 
+/**
+ * Save the state for a new process (see #UpgradeServer).
+ */
+void
+encryption_save(const struct encryption *e, Serializer &s);
+
+void
+encryption_restore(struct encryption *e, Deserializer &d);
+
 #endif
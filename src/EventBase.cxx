@@ -0,0 +1,50 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "EventBase.hxx"
+#include "Flush.hxx"
+#include "Log.hxx"
+
+static thread_local struct event_base *the_thread_event_base;
+
+struct event_base *
+thread_event_base() noexcept
+{
+    return the_thread_event_base;
+}
+
+void
+set_thread_event_base(struct event_base *base) noexcept
+{
+    the_thread_event_base = base;
+}
+
+void
+run_event_loop(struct event_base *base, FlushContext &flush) noexcept
+{
+    while (event_base_loop(base, EVLOOP_ONCE) == 0)
+        flush.Flush();
+
+    flush.Flush();
+
+    LogFormat(2, "%llu packets were sent with %llu flushes\n",
+              (unsigned long long)flush.GetScheduled(),
+              (unsigned long long)flush.GetFlushed());
+}
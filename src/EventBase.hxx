@@ -0,0 +1,73 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_EVENT_BASE_H
+#define UOPROXY_EVENT_BASE_H
+
+#include <event.h>
+
+class FlushContext;
+
+/**
+ * Returns the event_base of the event loop running in the calling
+ * thread.
+ */
+struct event_base *
+thread_event_base() noexcept;
+
+void
+set_thread_event_base(struct event_base *base) noexcept;
+
+/**
+ * Run the event loop until there are no more events.  After each
+ * iteration, the #FlushContext is flushed.
+ */
+void
+run_event_loop(struct event_base *base, FlushContext &flush) noexcept;
+
+/**
+ * Like event_set(), but binds the event to the calling thread's
+ * event loop instead of libevent's global "current" base.
+ */
+static inline void
+thread_event_set(struct event *ev, evutil_socket_t fd, short events,
+                 event_callback_fn callback, void *arg) noexcept
+{
+    event_assign(ev, thread_event_base(), fd, events, callback, arg);
+}
+
+static inline void
+thread_evtimer_set(struct event *ev, event_callback_fn callback,
+                   void *arg) noexcept
+{
+    thread_event_set(ev, -1, 0, callback, arg);
+}
+
+/**
+ * Move an event which is not pending to the calling thread's event
+ * loop.
+ */
+static inline void
+thread_event_rebind(struct event *ev) noexcept
+{
+    event_base_set(thread_event_base(), ev);
+}
+
+#endif
@@ -19,8 +19,8 @@
  */
 
 /*
- * Collect all objects which have to be flushed, wait until
- * flush_end() is called an then flush them all at once.
+ * Collect all objects which have to be flushed, and flush them all
+ * at once after the current event loop iteration.
  *
  * This is useful for buffering data being sent.
  */
@@ -29,36 +29,63 @@
 
 #include <assert.h>
 
-static IntrusiveList<PendingFlush> flush_pending;
-static bool flush_postponed = false;
+static thread_local FlushContext *the_thread_flush_context;
 
-void
-flush_begin()
+FlushContext &
+thread_flush_context() noexcept
 {
-    assert(flush_pending.empty());
-    assert(!flush_postponed);
-    flush_postponed = true;
+    assert(the_thread_flush_context != nullptr);
+
+    return *the_thread_flush_context;
 }
 
 void
-flush_end()
+set_thread_flush_context(FlushContext *context) noexcept
+{
+    the_thread_flush_context = context;
+}
+
+FlushContext::~FlushContext() noexcept
 {
-    assert(flush_postponed);
-    flush_postponed = false;
+    assert(pending.empty());
+}
+
+inline void
+FlushContext::Schedule(PendingFlush &flush) noexcept
+{
+    ++n_scheduled;
+
+    if (!flush.is_linked) {
+        flush.is_linked = true;
+        pending.push_back(flush);
+    }
+}
 
-    flush_pending.clear_and_dispose([](PendingFlush *flush){
+void
+FlushContext::Flush() noexcept
+{
+    pending.clear_and_dispose([this](PendingFlush *flush){
+        flush->is_linked = false;
+        ++n_flushed;
         flush->DoFlush();
     });
 }
 
+PendingFlush::PendingFlush() noexcept
+    :context(&thread_flush_context())
+{
+}
+
 void
 PendingFlush::ScheduleFlush() noexcept
 {
-    if (!flush_postponed)
-        DoFlush();
-    else if (!is_linked) {
-        is_linked = true;
+    context->Schedule(*this);
+}
 
-        flush_pending.push_back(*this);
-    }
+void
+PendingFlush::RebindFlush() noexcept
+{
+    assert(!is_linked);
+
+    context = &thread_flush_context();
 }
@@ -19,8 +19,8 @@
  */
 
 /*
- * Collect all objects which have to be flushed, wait until
- * flush_end() is called an then flush them all at once.
+ * Collect all objects which have to be flushed, and flush them all
+ * at once after the current event loop iteration.
  *
  * This is useful for buffering data being sent.
  */
@@ -30,14 +30,28 @@
 
 #include "util/IntrusiveList.hxx"
 
+#include <cstdint>
+
+class FlushContext;
+
 /**
  * An operation that has to be flushed.
  */
 class PendingFlush : public IntrusiveListHook {
+    friend class FlushContext;
+
+    /**
+     * The context of the event loop this object belongs to.
+     */
+    FlushContext *context;
+
     bool is_linked = false;
 
 public:
-    PendingFlush() = default;
+    /**
+     * Binds the object to the calling thread's #FlushContext.
+     */
+    PendingFlush() noexcept;
 
     ~PendingFlush() noexcept {
         CancelFlush();
@@ -57,26 +71,67 @@ protected:
             unlink();
         }
     }
+
+    /**
+     * Move this object to the calling thread's #FlushContext, e.g.
+     * after it has been handed over to another worker.  It must not
+     * be scheduled.
+     */
+    void RebindFlush() noexcept;
 };
 
-void
-flush_begin();
+/**
+ * The list of #PendingFlush objects of one event loop.  The loop
+ * calls Flush() after each iteration, i.e. after all callbacks have
+ * run, so packets sent to a socket from several callbacks within one
+ * iteration are coalesced into one send().
+ */
+class FlushContext {
+    IntrusiveList<PendingFlush> pending;
 
-void
-flush_end();
+    /**
+     * The number of ScheduleFlush() calls; each one is (roughly) a
+     * packet.
+     */
+    uint64_t n_scheduled = 0;
+
+    /**
+     * The number of DoFlush() calls; each one is (at most) a send()
+     * system call.
+     */
+    uint64_t n_flushed = 0;
 
-class ScopeLockFlush {
 public:
-    ScopeLockFlush() noexcept {
-        flush_begin();
-    }
+    FlushContext() = default;
+    ~FlushContext() noexcept;
+
+    FlushContext(const FlushContext &) = delete;
+    FlushContext &operator=(const FlushContext &) = delete;
+
+    void Schedule(PendingFlush &flush) noexcept;
 
-    ~ScopeLockFlush() noexcept {
-        flush_end();
+    /**
+     * Flush all pending objects.
+     */
+    void Flush() noexcept;
+
+    uint64_t GetScheduled() const noexcept {
+        return n_scheduled;
     }
 
-    ScopeLockFlush(const ScopeLockFlush &) = delete;
-    ScopeLockFlush &operator=(const ScopeLockFlush &) = delete;
+    uint64_t GetFlushed() const noexcept {
+        return n_flushed;
+    }
 };
 
+/**
+ * Returns the #FlushContext of the event loop running in the calling
+ * thread.
+ */
+FlushContext &
+thread_flush_context() noexcept;
+
+void
+set_thread_flush_context(FlushContext *context) noexcept;
+
 #endif
@@ -19,35 +19,47 @@
  */
 
 #include "Handler.hxx"
+#include "Stats.hxx"
+#include "Trace.hxx"
 
 PacketAction
-handle_packet_from_server(const struct client_packet_binding *bindings,
+handle_packet_from_server(const client_packet_dispatch &handlers,
                           Connection &c,
                           const void *data, size_t length)
 {
     const unsigned char cmd
         = *(const unsigned char*)data;
 
-    for (; bindings->handler != nullptr; bindings++) {
-        if (bindings->cmd == cmd)
-            return bindings->handler(c, data, length);
-    }
+    const auto handler = handlers[cmd];
+    if (handler == nullptr)
+        return PacketAction::ACCEPT;
 
-    return PacketAction::ACCEPT;
+    const auto start = StatsClock::now();
+    UOPROXY_TRACE2(handle_from_server_entry, cmd, length);
+    const auto action = handler(c, data, length);
+    UOPROXY_TRACE2(handle_from_server_return, cmd, (int)action);
+    thread_stats().RecordHandler(PacketDirection::FROM_SERVER,
+                                 StatsTimer::SERVER_HANDLER, cmd, start);
+    return action;
 }
 
 PacketAction
-handle_packet_from_client(const struct server_packet_binding *bindings,
+handle_packet_from_client(const server_packet_dispatch &handlers,
                           LinkedServer &ls,
                           const void *data, size_t length)
 {
     const unsigned char cmd
         = *(const unsigned char*)data;
 
-    for (; bindings->handler != nullptr; bindings++) {
-        if (bindings->cmd == cmd)
-            return bindings->handler(ls, data, length);
-    }
+    const auto handler = handlers[cmd];
+    if (handler == nullptr)
+        return PacketAction::ACCEPT;
 
-    return PacketAction::ACCEPT;
+    const auto start = StatsClock::now();
+    UOPROXY_TRACE2(handle_from_client_entry, cmd, length);
+    const auto action = handler(ls, data, length);
+    UOPROXY_TRACE2(handle_from_client_return, cmd, (int)action);
+    thread_stats().RecordHandler(PacketDirection::FROM_CLIENT,
+                                 StatsTimer::CLIENT_HANDLER, cmd, start);
+    return action;
 }
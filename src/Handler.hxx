@@ -21,6 +21,8 @@
 #ifndef __HANDLER_H
 #define __HANDLER_H
 
+#include <array>
+
 #include <stddef.h>
 
 struct Connection;
@@ -53,16 +55,69 @@ struct server_packet_binding {
                             const void *data, size_t length);
 };
 
-extern const struct client_packet_binding server_packet_bindings[];
-extern const struct server_packet_binding client_packet_bindings[];
+/**
+ * A handler function for each packet command; nullptr means the
+ * packet is accepted without looking at it.
+ */
+template<typename B>
+using PacketDispatchTable = std::array<decltype(B::handler), 0x100>;
+
+using client_packet_dispatch = PacketDispatchTable<client_packet_binding>;
+using server_packet_dispatch = PacketDispatchTable<server_packet_binding>;
+
+/**
+ * Build a #PacketDispatchTable from a binding list terminated by an
+ * empty entry.  This runs at compile time.
+ */
+template<typename B, size_t N>
+constexpr auto
+MakePacketDispatchTable(const B (&bindings)[N]) noexcept
+{
+    PacketDispatchTable<B> table{};
+
+    for (const auto &b : bindings) {
+        if (b.handler == nullptr)
+            break;
+
+        table[b.cmd] = b.handler;
+    }
+
+    return table;
+}
+
+/**
+ * Check that no packet command is bound twice; to be used with
+ * static_assert() next to MakePacketDispatchTable().
+ */
+template<typename B, size_t N>
+constexpr bool
+HasUniquePacketBindings(const B (&bindings)[N]) noexcept
+{
+    std::array<bool, 0x100> seen{};
+
+    for (const auto &b : bindings) {
+        if (b.handler == nullptr)
+            break;
+
+        if (seen[b.cmd])
+            return false;
+
+        seen[b.cmd] = true;
+    }
+
+    return true;
+}
+
+extern const client_packet_dispatch server_packet_handlers;
+extern const server_packet_dispatch client_packet_handlers;
 
 PacketAction
-handle_packet_from_server(const struct client_packet_binding *bindings,
+handle_packet_from_server(const client_packet_dispatch &handlers,
                           Connection &c,
                           const void *data, size_t length);
 
 PacketAction
-handle_packet_from_client(const struct server_packet_binding *bindings,
+handle_packet_from_client(const server_packet_dispatch &handlers,
                           LinkedServer &ls,
                           const void *data, size_t length);
 
@@ -20,11 +20,18 @@
 
 #include "Instance.hxx"
 #include "Connection.hxx"
+#include "LinkedServer.hxx"
+#include "WorkerPool.hxx"
+#include "EventBase.hxx"
 #include "Log.hxx"
 #include "NetUtil.hxx"
 #include "Config.hxx"
+#include "SocketUtil.hxx"
 
+#include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #ifdef _WIN32
@@ -55,6 +62,10 @@ listener_event_callback(int fd, short, void *ctx)
         return;
     }
 
+    if (instance->config.client_notsent_lowat > 0)
+        socket_set_notsent_lowat(remote_fd,
+                                 instance->config.client_notsent_lowat);
+
     ret = connection_new(instance, remote_fd, &c);
     if (ret != 0) {
         log_error("connection_new() failed", ret);
@@ -65,14 +76,83 @@ listener_event_callback(int fd, short, void *ctx)
     instance->connections.push_front(*c);
 }
 
+/**
+ * A client on its way from one worker to another.
+ */
+struct ClientHandoff {
+    /**
+     * The client; its #UO::Server has been paused.  Owned by this
+     * object until it has been received.
+     */
+    LinkedServer *ls;
+
+    /**
+     * Moved from the old #Connection.
+     */
+    ClientVersion version;
+
+    /**
+     * The packet which will be handled again by the new worker.
+     */
+    std::vector<uint8_t> packet;
+
+    ClientHandoff(LinkedServer &_ls, ClientVersion &&_version,
+                  const void *_packet, size_t length) noexcept
+        :ls(&_ls),
+         packet((const uint8_t *)_packet, (const uint8_t *)_packet + length)
+    {
+        version = std::move(_version);
+    }
+
+    ~ClientHandoff() noexcept {
+        delete ls;
+    }
+
+    ClientHandoff(const ClientHandoff &) = delete;
+    ClientHandoff &operator=(const ClientHandoff &) = delete;
+};
+
+Instance::Instance(Config &_config,
+                   WorkerPool *_pool, unsigned _worker_id) noexcept
+    :config(_config), pool(_pool), worker_id(_worker_id),
+     reconnect_scheduler(_config)
+{
+    /* the pipe is created here (i.e. before the worker thread
+       starts), because other threads may post to it right away */
+    if (pool != nullptr && pipe2(wake_pipe, O_CLOEXEC|O_NONBLOCK) < 0) {
+        log_errno("pipe() failed");
+        exit(1);
+    }
+}
+
+Instance::~Instance() noexcept
+{
+    assert(connections.empty());
+
+    if (wake_pipe[0] >= 0) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+    }
+}
+
 void
 instance_setup_server_socket(Instance *instance)
 {
-    instance->server_socket = setup_server_socket(instance->config.bind_address);
+    instance_setup_server_socket(instance,
+                                 setup_server_socket(instance->config.bind_address,
+                                                     instance->pool != nullptr));
+}
 
-    event_set(&instance->server_socket_event, instance->server_socket,
-              EV_READ|EV_PERSIST,
-              listener_event_callback, instance);
+void
+instance_setup_server_socket(Instance *instance, int fd)
+{
+    assert(instance->server_socket < 0);
+
+    instance->server_socket = fd;
+
+    thread_event_set(&instance->server_socket_event, instance->server_socket,
+                     EV_READ|EV_PERSIST,
+                     listener_event_callback, instance);
     event_add(&instance->server_socket_event, nullptr);
 }
 
@@ -109,3 +189,265 @@ Instance::FindZombie(const struct uo_packet_game_login &game_login) noexcept
 
     return nullptr;
 }
+
+bool
+Instance::ClaimCredentials(Connection &c, LinkedServer &ls,
+                           const void *packet, size_t length) noexcept
+{
+    assert(ls.connection == &c);
+    assert(!c.credentials_claimed);
+
+    if (pool == nullptr)
+        return false;
+
+    const unsigned owner = pool->index.AcquireCredentials(c.credentials,
+                                                          worker_id);
+    if (owner == worker_id) {
+        c.credentials_claimed = true;
+        return false;
+    }
+
+    /* if handing over is not possible, continue here; the account
+       may then have connections in two workers, which only means
+       that they can't attach to each other */
+    return HandOff(ls, owner, packet, length);
+}
+
+void
+Instance::ReleaseCredentials(Connection &c) noexcept
+{
+    assert(pool != nullptr);
+    assert(c.credentials_claimed);
+
+    pool->index.ReleaseCredentials(c.credentials);
+    c.credentials_claimed = false;
+}
+
+void
+Instance::AddAuthId(uint32_t auth_id) noexcept
+{
+    if (pool != nullptr)
+        pool->index.AddAuthId(auth_id, worker_id);
+}
+
+bool
+Instance::HandOffToZombie(LinkedServer &ls,
+                          const struct uo_packet_game_login &game_login) noexcept
+{
+    if (pool == nullptr)
+        return false;
+
+    const int worker = pool->index.FindAuthId(game_login.auth_id);
+    if (worker < 0 || (unsigned)worker == worker_id)
+        return false;
+
+    return HandOff(ls, (unsigned)worker, &game_login, sizeof(game_login));
+}
+
+bool
+Instance::HandOff(LinkedServer &ls, unsigned worker,
+                  const void *packet, size_t length) noexcept
+{
+    assert(pool != nullptr);
+    assert(worker != worker_id);
+
+    Connection &c = *ls.connection;
+
+    /* only a fresh connection which has nothing but this client can
+       be handed over */
+    if (c.client.client != nullptr || c.IsConnecting() ||
+        c.servers.iterator_to(ls) != c.servers.begin() ||
+        std::next(c.servers.begin()) != c.servers.end())
+        return false;
+
+    if (!uo_server_pause(ls.server))
+        return false;
+
+    ls.LogF(2, "handing over to worker %u", worker);
+
+    auto handoff = std::make_unique<ClientHandoff>(ls,
+                                                   std::move(c.client.version),
+                                                   packet, length);
+
+    /* the new worker starts from scratch */
+    ls.state = LinkedServer::State::INIT;
+
+    c.Remove(ls);
+    c.Destroy();
+
+    /* post it after the current callback has returned, because that
+       may still touch the socket buffer */
+    outgoing.emplace_back(worker, std::move(handoff));
+
+    static constexpr struct timeval tv{0, 0};
+    event_add(&outgoing_event, &tv);
+
+    return true;
+}
+
+void
+Instance::OutgoingCallback(int, short, void *ctx) noexcept
+{
+    auto &instance = *(Instance *)ctx;
+
+    auto outgoing = std::exchange(instance.outgoing, {});
+
+    for (auto &i : outgoing)
+        instance.pool->Get(i.first).PostHandoff(std::move(i.second));
+}
+
+static void
+wake_mailbox(int fd) noexcept
+{
+    static constexpr char ch = 0;
+    if (write(fd, &ch, sizeof(ch)) < 0 && errno != EAGAIN)
+        log_errno("failed to wake up worker");
+}
+
+void
+Instance::PostHandoff(std::unique_ptr<ClientHandoff> handoff) noexcept
+{
+    const std::lock_guard<std::mutex> lock(mailbox_mutex);
+
+    if (mailbox_closed)
+        /* shutting down; the client is destroyed */
+        return;
+
+    mailbox.emplace_back(std::move(handoff));
+    wake_mailbox(wake_pipe[1]);
+}
+
+void
+Instance::PostQuit() noexcept
+{
+    const std::lock_guard<std::mutex> lock(mailbox_mutex);
+
+    if (mailbox_closed)
+        return;
+
+    mailbox_quit = true;
+    wake_mailbox(wake_pipe[1]);
+}
+
+void
+Instance::ReceiveHandoff(ClientHandoff &handoff)
+{
+    LinkedServer &ls = *std::exchange(handoff.ls, nullptr);
+
+    auto *c = new Connection(*this, config.background, config.autoreconnect);
+    c->client.world.view_range = config.view_range;
+    c->client.version = std::move(handoff.version);
+    c->Add(ls);
+    connections.push_front(*c);
+
+    ls.LogF(2, "taken over by worker %u", worker_id);
+
+    ls.Resume(handoff.packet.data(), handoff.packet.size());
+}
+
+void
+Instance::WakeCallback(int fd, short, void *ctx) noexcept
+{
+    auto &instance = *(Instance *)ctx;
+
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {}
+
+    std::vector<std::unique_ptr<ClientHandoff>> handoffs;
+    bool quit;
+
+    {
+        const std::lock_guard<std::mutex> lock(instance.mailbox_mutex);
+        handoffs.swap(instance.mailbox);
+        quit = instance.mailbox_quit;
+    }
+
+    if (quit) {
+        instance_shutdown(&instance);
+        return;
+    }
+
+    for (auto &i : handoffs)
+        instance.ReceiveHandoff(*i);
+}
+
+void
+instance_setup_mailbox(Instance *instance)
+{
+    assert(instance->pool != nullptr);
+    assert(instance->wake_pipe[0] >= 0);
+
+    thread_event_set(&instance->wake_event, instance->wake_pipe[0],
+                     EV_READ|EV_PERSIST,
+                     Instance::WakeCallback, instance);
+    event_add(&instance->wake_event, nullptr);
+
+    thread_evtimer_set(&instance->outgoing_event,
+                       Instance::OutgoingCallback, instance);
+}
+
+static void
+idle_release_callback(int, short, void *ctx) noexcept
+{
+    auto &instance = *(Instance *)ctx;
+
+    for (auto &c : instance.connections)
+        c.ReleaseIdleBuffers();
+}
+
+void
+instance_setup_idle_release(Instance *instance)
+{
+    if (instance->config.idle_release == 0)
+        return;
+
+    thread_event_set(&instance->idle_release_event, -1, EV_PERSIST,
+                     idle_release_callback, instance);
+    instance->idle_release_enabled = true;
+
+    const struct timeval tv{time_t(instance->config.idle_release), 0};
+    event_add(&instance->idle_release_event, &tv);
+}
+
+void
+instance_shutdown(Instance *instance) noexcept
+{
+    if (instance->pool != nullptr) {
+        {
+            const std::lock_guard<std::mutex> lock(instance->mailbox_mutex);
+            instance->mailbox_closed = true;
+            instance->mailbox.clear();
+        }
+
+        event_del(&instance->wake_event);
+        event_del(&instance->outgoing_event);
+        instance->outgoing.clear();
+    }
+
+    if (instance->metrics_enabled) {
+        instance->metrics_enabled = false;
+        event_del(&instance->metrics_event);
+    }
+
+    if (instance->idle_release_enabled) {
+        instance->idle_release_enabled = false;
+        event_del(&instance->idle_release_event);
+    }
+
+    instance->admin.reset();
+    instance->resolver.reset();
+
+    if (instance->server_socket >= 0) {
+        event_del(&instance->server_socket_event);
+        close(instance->server_socket);
+        instance->server_socket = -1;
+    }
+
+    instance->connections.clear_and_dispose([](Connection *c) {
+        delete c;
+    });
+
+    /* last, because this lets a new process continue, which has
+       taken over from us */
+    instance->upgrade.reset();
+}
@@ -22,38 +22,236 @@
 #define __INSTANCE_H
 
 #include "util/IntrusiveList.hxx"
+#include "ReconnectScheduler.hxx"
+#include "Flush.hxx"
+#include "TimerWheel.hxx"
+#include "Admin.hxx"
+#include "Upgrade.hxx"
+#include "Resolver.hxx"
+#include "Stats.hxx"
 
 #include <event.h>
 
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
 struct Config;
 struct Connection;
 struct LinkedServer;
+struct ClientHandoff;
+class WorkerPool;
 namespace UO { struct CredentialsFragment; }
 
+/**
+ * The state of one event loop.  Normally, there is only one; with
+ * the "workers" option, each worker thread has its own.
+ */
 struct Instance {
     /* configuration */
     const Config &config;
 
+    /**
+     * The pool this worker belongs to, or nullptr if there is only
+     * one event loop.
+     */
+    WorkerPool *const pool;
+
+    /**
+     * The index of this worker within the #pool; 0 is the main
+     * thread.
+     */
+    const unsigned worker_id;
+
     /* state */
 
+    /**
+     * The flush list of this event loop.
+     */
+    FlushContext flush;
+
+    /**
+     * The coarse timers (pings, zombies) of this event loop.
+     */
+    TimerWheel timer_wheel;
+
     struct event sigterm_event, sigint_event, sigquit_event;
     bool should_exit = false;
 
-    int server_socket;
+    int server_socket = -1;
     struct event server_socket_event;
 
     IntrusiveList<Connection> connections;
 
-    explicit Instance(Config &_config) noexcept
-        :config(_config) {}
+    ReconnectScheduler reconnect_scheduler;
+
+    /* handing over clients between workers */
+
+    /**
+     * Clients which are about to be handed over to another worker;
+     * they are posted from #outgoing_event, i.e. after the current
+     * callback has returned.
+     */
+    std::vector<std::pair<unsigned, std::unique_ptr<ClientHandoff>>> outgoing;
+    struct event outgoing_event;
+
+    /**
+     * Clients handed over to this worker by other threads; protected
+     * by #mailbox_mutex.  Writing to #wake_pipe wakes up this
+     * worker.
+     */
+    std::mutex mailbox_mutex;
+    std::vector<std::unique_ptr<ClientHandoff>> mailbox;
+    bool mailbox_quit = false, mailbox_closed = false;
+    int wake_pipe[2] = {-1, -1};
+    struct event wake_event;
+
+    /**
+     * Fires every "idle_release" seconds to free the buffers of idle
+     * connections (see Connection::ReleaseIdleBuffers()).
+     */
+    struct event idle_release_event;
+    bool idle_release_enabled = false;
+
+    /* metrics for the admin listener ("admin_bind") */
+
+    /**
+     * Fires once a second to update #metrics and to measure the
+     * event loop lag.
+     */
+    struct event metrics_event;
+    bool metrics_enabled = false;
+    StatsClock::time_point metrics_due;
+
+    /**
+     * Published by this worker, read by the #AdminServer; protected
+     * by #metrics_mutex.
+     */
+    std::mutex metrics_mutex;
+    WorkerMetrics metrics;
+
+    /**
+     * The admin listener; only in the main thread.
+     */
+    std::unique_ptr<AdminServer> admin;
+
+    /**
+     * Resolves the configured host names; only in the main thread.
+     */
+    std::unique_ptr<Resolver> resolver;
+
+    /**
+     * Waits for a new process to hand over to ("upgrade_socket");
+     * only in the main thread without workers.
+     */
+    std::unique_ptr<UpgradeServer> upgrade;
+
+    explicit Instance(Config &_config,
+                      WorkerPool *_pool=nullptr,
+                      unsigned _worker_id=0) noexcept;
+
+    ~Instance() noexcept;
+
+    Instance(const Instance &) = delete;
+    Instance &operator=(const Instance &) = delete;
 
     Connection *FindAttachConnection(const UO::CredentialsFragment &credentials) noexcept;
     Connection *FindAttachConnection(Connection &c) noexcept;
 
     LinkedServer *FindZombie(const struct uo_packet_game_login &game_login) noexcept;
+
+    /**
+     * Register Connection::credentials of this (fresh) connection
+     * with the #pool's index.  If another worker owns them already,
+     * the client is handed over to that worker instead, where the
+     * packet will be handled again.
+     *
+     * @return true if the client has been handed over
+     */
+    bool ClaimCredentials(Connection &c, LinkedServer &ls,
+                          const void *packet, size_t length) noexcept;
+
+    /**
+     * Undo ClaimCredentials(); called by the #Connection
+     * destructor.
+     */
+    void ReleaseCredentials(Connection &c) noexcept;
+
+    /**
+     * Announce a Razor redirect with the specified auth_id.
+     */
+    void AddAuthId(uint32_t auth_id) noexcept;
+
+    /**
+     * The zombie for this GameLogin was not found here; if another
+     * worker has it, hand the client over.
+     *
+     * @return true if the client has been handed over
+     */
+    bool HandOffToZombie(LinkedServer &ls,
+                         const struct uo_packet_game_login &game_login) noexcept;
+
+    /**
+     * Post a #ClientHandoff to this (other) worker.  May be called
+     * from any thread.
+     */
+    void PostHandoff(std::unique_ptr<ClientHandoff> handoff) noexcept;
+
+    /**
+     * Ask this (other) worker to shut down.  May be called from any
+     * thread.
+     */
+    void PostQuit() noexcept;
+
+private:
+    /**
+     * Hand the (fresh) connection of this client over to another
+     * worker, which will handle the packet again.
+     */
+    bool HandOff(LinkedServer &ls, unsigned worker,
+                 const void *packet, size_t length) noexcept;
+
+    void ReceiveHandoff(ClientHandoff &handoff);
+
+    friend void instance_setup_mailbox(Instance *instance);
+
+    static void OutgoingCallback(int, short, void *ctx) noexcept;
+    static void WakeCallback(int fd, short, void *ctx) noexcept;
 };
 
 void
 instance_setup_server_socket(Instance *instance);
 
+/**
+ * Listen on a socket which has been set up already, e.g. by the
+ * previous process (see upgrade_takeover()).
+ */
+void
+instance_setup_server_socket(Instance *instance, int fd);
+
+/**
+ * Set up the event which receives clients handed over by other
+ * workers.  Only used with a #WorkerPool.
+ */
+void
+instance_setup_mailbox(Instance *instance);
+
+/**
+ * Start freeing the buffers of idle connections periodically (if
+ * enabled by "idle_release").
+ */
+void
+instance_setup_idle_release(Instance *instance);
+
+/**
+ * Close the listener socket and destroy all connections, so the
+ * event loop will finish.
+ */
+void
+instance_shutdown(Instance *instance) noexcept;
+
 #endif
@@ -0,0 +1,82 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Latency.hxx"
+
+unsigned
+LatencyHistogram::GetBucket(uint64_t us) noexcept
+{
+    if (us < (1u << SUB_BITS))
+        return (unsigned)us;
+
+    /* the position of the most significant bit selects the power of
+       two, the next SUB_BITS bits the bucket within it */
+    const unsigned msb = 63 - __builtin_clzll(us);
+    const unsigned sub = unsigned(us >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+    const unsigned bucket = ((msb - SUB_BITS + 1) << SUB_BITS) | sub;
+    return bucket < N_BUCKETS ? bucket : N_BUCKETS - 1;
+}
+
+uint64_t
+LatencyHistogram::GetUpperBound(unsigned bucket) noexcept
+{
+    if (bucket < (1u << SUB_BITS))
+        return bucket + 1;
+
+    const unsigned shift = (bucket >> SUB_BITS) - 1;
+    const uint64_t sub = bucket & ((1u << SUB_BITS) - 1);
+    return (((1u << SUB_BITS) | sub) + 1) << shift;
+}
+
+void
+LatencyHistogram::Record(Clock::duration value) noexcept
+{
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(value).count();
+    ++buckets[GetBucket(us > 0 ? (uint64_t)us : 0)];
+
+    if (++count < DECAY_THRESHOLD)
+        return;
+
+    count = 0;
+    for (auto &i : buckets) {
+        i /= 2;
+        count += i;
+    }
+}
+
+LatencyHistogram::Clock::duration
+LatencyHistogram::Percentile(unsigned p) const noexcept
+{
+    if (count == 0)
+        return Clock::duration::zero();
+
+    /* the rank of the requested sample, rounded up, at least 1 */
+    const uint64_t rank = ((uint64_t)count * p + 99) / 100;
+
+    uint64_t seen = 0;
+    unsigned i = 0;
+    for (; i < N_BUCKETS - 1; ++i) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0)
+            break;
+    }
+
+    return std::chrono::microseconds(GetUpperBound(i));
+}
@@ -0,0 +1,111 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Latency percentiles of one connection.
+ */
+
+#ifndef UOPROXY_LATENCY_H
+#define UOPROXY_LATENCY_H
+
+#include "Flush.hxx"
+
+#include <chrono>
+
+#include <stdint.h>
+
+/**
+ * A histogram of latency samples for estimating percentiles.  Each
+ * power of two (in microseconds) is split into four buckets, so an
+ * estimate is off by less than 25%.  Old samples fade out: whenever
+ * #DECAY_THRESHOLD samples have been collected, all counts are
+ * halved.  It is not thread-safe; it is owned by the thread of its
+ * #Connection.
+ */
+class LatencyHistogram {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    static constexpr unsigned SUB_BITS = 2;
+    static constexpr unsigned N_BUCKETS = 32 << SUB_BITS;
+    static constexpr unsigned DECAY_THRESHOLD = 1024;
+
+    uint32_t buckets[N_BUCKETS]{};
+    uint32_t count = 0;
+
+public:
+    bool IsEmpty() const noexcept {
+        return count == 0;
+    }
+
+    void Record(Clock::duration value) noexcept;
+
+    /**
+     * Returns an upper bound of the specified percentile (0..100),
+     * or zero if there are no samples.
+     */
+    Clock::duration Percentile(unsigned p) const noexcept;
+
+private:
+    static unsigned GetBucket(uint64_t us) noexcept;
+    static uint64_t GetUpperBound(unsigned bucket) noexcept;
+};
+
+/**
+ * Measures the time from receiving a packet from the game server
+ * until it has been sent to the clients.  Start() schedules this
+ * object after the clients' socket buffers, so it is flushed right
+ * after them.
+ */
+class ForwardProbe final : PendingFlush {
+    LatencyHistogram &histogram;
+
+    LatencyHistogram::Clock::time_point received;
+
+    bool pending = false;
+
+public:
+    explicit ForwardProbe(LatencyHistogram &_histogram) noexcept
+        :histogram(_histogram) {}
+
+    /**
+     * A packet received at the specified time has been forwarded.
+     * If older ones are still waiting for the flush, the oldest one
+     * is measured.
+     */
+    void Start(LatencyHistogram::Clock::time_point _received) noexcept {
+        if (pending)
+            return;
+
+        pending = true;
+        received = _received;
+        ScheduleFlush();
+    }
+
+private:
+    /* virtual methods from PendingFlush */
+    void DoFlush() noexcept override {
+        pending = false;
+        histogram.Record(LatencyHistogram::Clock::now() - received);
+    }
+};
+
+#endif
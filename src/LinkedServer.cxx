@@ -22,24 +22,51 @@
 #include "Connection.hxx"
 #include "Handler.hxx"
 #include "Log.hxx"
+#include "Serialize.hxx"
 
 #include <cassert>
 #include <cstdarg>
 
-unsigned LinkedServer::id_counter;
+std::atomic_uint LinkedServer::id_counter;
 
-LinkedServer::~LinkedServer() noexcept
+LinkedServer::LinkedServer(Deserializer &d)
+    :server(uo_server_restore(d, *this)),
+     zombie_timer(ZombieTimeoutCallback, this),
+     id(++id_counter),
+     state(State::IN_GAME)
 {
-    evtimer_del(&zombie_timeout);
+    try {
+        client_version.Load(d);
+        auth_id = d.ReadU32();
+        welcome = d.ReadBool();
+    } catch (...) {
+        uo_server_dispose(server);
+        throw;
+    }
+}
 
+LinkedServer::~LinkedServer() noexcept
+{
     if (server != nullptr)
         uo_server_dispose(server);
 }
 
+bool
+LinkedServer::Save(Serializer &s) noexcept
+{
+    if (!IsInGame() || server == nullptr || !uo_server_save(server, s))
+        return false;
+
+    client_version.Save(s);
+    s.WriteU32(auth_id);
+    s.WriteBool(welcome);
+    return true;
+}
+
 void
 LinkedServer::LogF(unsigned level, const char *fmt, ...) noexcept
 {
-    if (level > verbose)
+    if (level > MAX_LOG_LEVEL || level > verbose)
         return;
 
     char msg[1024];
@@ -53,7 +80,20 @@ LinkedServer::LogF(unsigned level, const char *fmt, ...) noexcept
 }
 
 void
-LinkedServer::ZombieTimeoutCallback(int, short, void *ctx) noexcept
+LinkedServer::Resume(const void *packet, size_t length)
+{
+    assert(connection != nullptr);
+    assert(server != nullptr);
+    assert(state == State::INIT);
+
+    zombie_timer.Rebind();
+    uo_server_resume(server);
+
+    OnServerPacket(packet, length);
+}
+
+void
+LinkedServer::ZombieTimeoutCallback(void *ctx) noexcept
 {
     auto &ls = *(LinkedServer *)ctx;
     assert(ls.state == LinkedServer::State::RELAY_SERVER);
@@ -70,7 +110,7 @@ LinkedServer::OnServerPacket(const void *data, size_t length)
     assert(c != nullptr);
     assert(server != nullptr);
 
-    const auto action = handle_packet_from_client(client_packet_bindings,
+    const auto action = handle_packet_from_client(client_packet_handlers,
                                                   *this, data, length);
     switch (action) {
     case PacketAction::ACCEPT:
@@ -91,9 +131,10 @@ LinkedServer::OnServerPacket(const void *data, size_t length)
         c->Remove(*this);
 
         if (c->servers.empty()) {
-            if (c->background)
+            if (c->background) {
                 LogF(1, "backgrounding");
-            else
+                c->EnterLazyWorld();
+            } else
                 c->Destroy();
         }
 
@@ -113,11 +154,13 @@ LinkedServer::OnServerDisconnect() noexcept
     assert(server != nullptr);
     uo_server_dispose(std::exchange(server, nullptr));
 
+    if (std::exchange(congested, false) && connection != nullptr)
+        connection->UpdateBackpressure();
+
     if (state == State::RELAY_SERVER) {
         LogF(2, "client disconnected, zombifying server connection for 5 seconds");
 
-        static constexpr struct timeval tv{5, 0};
-        evtimer_add(&zombie_timeout, &tv);
+        zombie_timer.Schedule(std::chrono::seconds(5));
         return;
     }
 
@@ -127,3 +170,17 @@ LinkedServer::OnServerDisconnect() noexcept
 
     delete this;
 }
+
+void
+LinkedServer::OnServerCongestion(bool _congested) noexcept
+{
+    if (_congested)
+        LogF(3, "client is congested, pausing the server");
+    else
+        LogF(3, "client has drained");
+
+    congested = _congested;
+
+    if (connection != nullptr)
+        connection->UpdateBackpressure();
+}
@@ -24,12 +24,14 @@
 #include "CVersion.hxx"
 #include "util/Compiler.h"
 #include "util/IntrusiveList.hxx"
+#include "TimerWheel.hxx"
 
-#include <event.h>
-
+#include <atomic>
 #include <cstdint>
 
 struct Connection;
+class Serializer;
+class Deserializer;
 
 namespace UO {
 class Server;
@@ -48,15 +50,15 @@ struct LinkedServer final : IntrusiveListHook, UO::ServerHandler {
 
     ClientVersion client_version;
 
-    struct event zombie_timeout; /**< zombies time out and auto-reap themselves
-                                    after 5 seconds using this timer */
+    WheelTimer zombie_timer; /**< zombies time out and auto-reap themselves
+                                after 5 seconds using this timer */
 
     /**
      * Identifier for this object in log messages.
      */
     const unsigned id;
 
-    static unsigned id_counter;
+    static std::atomic_uint id_counter;
 
     uint32_t auth_id; /**< unique identifier for this linked_server used in
                            redirect handling to locate the zombied
@@ -127,13 +129,26 @@ struct LinkedServer final : IntrusiveListHook, UO::ServerHandler {
         IN_GAME,
     } state = State::INIT;
 
+    /**
+     * Is the output queue to this client above its backpressure
+     * watermark?
+     * See Connection::UpdateBackpressure().
+     */
+    bool congested = false;
+
     explicit LinkedServer(int fd)
         :server(uo_server_create(fd, *this)),
+         zombie_timer(ZombieTimeoutCallback, this),
          id(++id_counter)
     {
-        evtimer_set(&zombie_timeout, ZombieTimeoutCallback, this);
     }
 
+    /**
+     * Restore an in-game client which has been saved by the
+     * previous process; see Save().
+     */
+    explicit LinkedServer(Deserializer &d);
+
     ~LinkedServer() noexcept;
 
     LinkedServer(const LinkedServer &) = delete;
@@ -151,13 +166,30 @@ struct LinkedServer final : IntrusiveListHook, UO::ServerHandler {
         return state == State::IN_GAME;
     }
 
+    /**
+     * Continue in the calling thread after this client has been
+     * handed over from another worker (see Instance::HandOff()), and
+     * handle the packet which triggered the handover again.
+     */
+    void Resume(const void *packet, size_t length);
+
+    /**
+     * Save this client for a new process (see #UpgradeServer).  Only
+     * clients which are in game can be saved.  The #server can only
+     * be disposed afterwards.
+     *
+     * @return false if nothing has been written
+     */
+    bool Save(Serializer &s) noexcept;
+
     gcc_printf(3, 4)
     void LogF(unsigned level, const char *fmt, ...) noexcept;
 
 private:
-    static void ZombieTimeoutCallback(int, short, void *ctx) noexcept;
+    static void ZombieTimeoutCallback(void *ctx) noexcept;
 
     /* virtual methods from UO::ServerHandler */
     bool OnServerPacket(const void *data, size_t length) override;
     void OnServerDisconnect() noexcept override;
+    void OnServerCongestion(bool congested) noexcept override;
 };
@@ -22,6 +22,7 @@
 #define __UOPROXY_LOG_H
 
 #include "util/Compiler.h"
+#include "config.h"
 
 #include <string.h>
 #include <errno.h>
@@ -35,13 +36,21 @@
 #define log_hexdump(level, data, length)
 #else
 
+/**
+ * Log calls above this level are removed at compile time (see the
+ * "max_log_level" build option), no matter what #verbose says.
+ */
+#ifndef MAX_LOG_LEVEL
+#define MAX_LOG_LEVEL 10
+#endif
+
 extern unsigned verbose;
 
 void
 do_log(const char *fmt, ...) noexcept
     gcc_printf(1, 2);
 
-#define LogFormat(level, ...) do { if (verbose >= (level)) do_log(__VA_ARGS__); } while (0)
+#define LogFormat(level, ...) do { if ((level) <= MAX_LOG_LEVEL && verbose >= (level)) do_log(__VA_ARGS__); } while (0)
 
 static inline void
 log_oom()
@@ -65,7 +74,14 @@ log_errno(const char *msg)
 }
 
 void
-log_hexdump(unsigned level, const void *data, size_t length) noexcept;
+do_log_hexdump(unsigned level, const void *data, size_t length) noexcept;
+
+static inline void
+log_hexdump(unsigned level, const void *data, size_t length) noexcept
+{
+    if (level <= MAX_LOG_LEVEL && verbose >= level)
+        do_log_hexdump(level, data, length);
+}
 
 #endif
 
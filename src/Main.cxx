@@ -21,15 +21,27 @@
 #include "Instance.hxx"
 #include "Connection.hxx"
 #include "Config.hxx"
+#include "WorkerPool.hxx"
+#include "EventBase.hxx"
+#include "Capture.hxx"
 #include "version.h"
 #include "Log.hxx"
 #include "config.h"
 
+#ifdef HAVE_IO_URING
+#include "Uring.hxx"
+#endif
+
+#ifndef _WIN32
+#include "Upgrade.hxx"
+#endif
+
 #ifdef HAVE_LIBSYSTEMD
 #include <systemd/sd-daemon.h>
 #endif
 
 #include <exception>
+#include <memory>
 
 #ifndef _WIN32
 #include <sys/signal.h>
@@ -68,17 +80,27 @@ exit_event_callback(int, short, void *ctx)
 
     deinit_signals(instance);
 
-    if (instance->server_socket >= 0) {
-        event_del(&instance->server_socket_event);
-        close(instance->server_socket);
-        instance->server_socket = -1;
-    }
+    if (instance->pool != nullptr)
+        instance->pool->Stop();
 
-    instance->connections.clear_and_dispose([](Connection *c) {
-        delete c;
-    });
+    instance_shutdown(instance);
 }
 
+/**
+ * Exits after everything has been handed over to a new process.
+ */
+class MainUpgradeHandler final : public UpgradeHandler {
+    Instance &instance;
+
+public:
+    explicit MainUpgradeHandler(Instance &_instance) noexcept
+        :instance(_instance) {}
+
+    void OnUpgradeComplete() noexcept override {
+        exit_event_callback(-1, 0, &instance);
+    }
+};
+
 #endif
 
 static void config_get(Config *config, int argc, char **argv) {
@@ -108,16 +130,16 @@ setup_signal_handlers(Instance *instance)
 #else
     signal(SIGPIPE, SIG_IGN);
 
-    event_set(&instance->sigterm_event, SIGTERM, EV_SIGNAL|EV_PERSIST,
-              exit_event_callback, instance);
+    thread_event_set(&instance->sigterm_event, SIGTERM, EV_SIGNAL|EV_PERSIST,
+                     exit_event_callback, instance);
     event_add(&instance->sigterm_event, nullptr);
 
-    event_set(&instance->sigint_event, SIGINT, EV_SIGNAL|EV_PERSIST,
-              exit_event_callback, instance);
+    thread_event_set(&instance->sigint_event, SIGINT, EV_SIGNAL|EV_PERSIST,
+                     exit_event_callback, instance);
     event_add(&instance->sigint_event, nullptr);
 
-    event_set(&instance->sigquit_event, SIGQUIT, EV_SIGNAL|EV_PERSIST,
-              exit_event_callback, instance);
+    thread_event_set(&instance->sigquit_event, SIGQUIT, EV_SIGNAL|EV_PERSIST,
+                     exit_event_callback, instance);
     event_add(&instance->sigquit_event, nullptr);
 #endif
 }
@@ -125,7 +147,6 @@ setup_signal_handlers(Instance *instance)
 int main(int argc, char **argv)
 try {
     Config config;
-    Instance instance(config);
 
     /* WinSock */
 
@@ -149,11 +170,70 @@ try {
 
     /* set up */
 
+    if (config.upgrade_socket != nullptr && config.workers > 1) {
+        fprintf(stderr, "upgrade_socket is not supported with workers\n");
+        return EXIT_FAILURE;
+    }
+
+    if (config.capture_path != nullptr)
+        capture_open(config.capture_path);
+
+    std::unique_ptr<WorkerPool> pool;
+    std::unique_ptr<Instance> single_instance;
+    if (config.workers > 1)
+        pool = std::make_unique<WorkerPool>(config, config.workers);
+    else
+        single_instance = std::make_unique<Instance>(config);
+
+    Instance &instance = pool ? pool->Get(0) : *single_instance;
+
     struct event_base *event_base = event_init();
+    set_thread_event_base(event_base);
+    set_thread_flush_context(&instance.flush);
+    set_thread_timer_wheel(&instance.timer_wheel);
+
+#ifdef HAVE_IO_URING
+    std::unique_ptr<Uring> uring;
+    if (config.io_uring) {
+        uring = Uring::Create();
+        set_thread_uring(uring.get());
+    }
+#endif
 
     setup_signal_handlers(&instance);
 
-    instance_setup_server_socket(&instance);
+    instance.timer_wheel.Init();
+    instance.reconnect_scheduler.Init();
+
+    if (pool)
+        instance_setup_mailbox(&instance);
+
+    instance.resolver = std::make_unique<Resolver>(config);
+
+#ifndef _WIN32
+    MainUpgradeHandler upgrade_handler(instance);
+
+    if (config.upgrade_socket == nullptr ||
+        !upgrade_takeover(instance, config.upgrade_socket))
+#endif
+        instance_setup_server_socket(&instance);
+
+    instance_setup_metrics(&instance);
+    instance_setup_idle_release(&instance);
+
+    if (config.admin_address != nullptr)
+        instance.admin = std::make_unique<AdminServer>(instance,
+                                                       config.admin_address);
+
+#ifndef _WIN32
+    if (config.upgrade_socket != nullptr)
+        instance.upgrade = std::make_unique<UpgradeServer>(instance,
+                                                           config.upgrade_socket,
+                                                           upgrade_handler);
+#endif
+
+    if (pool)
+        pool->Start();
 
     /* main loop */
 
@@ -162,10 +242,23 @@ try {
     sd_notify(0, "READY=1");
 #endif
 
-    event_dispatch();
+    run_event_loop(event_base, instance.flush);
 
     /* cleanup */
 
+    if (pool)
+        pool->Join();
+
+    capture_close();
+
+#ifdef HAVE_IO_URING
+    set_thread_uring(nullptr);
+    uring.reset();
+#endif
+
+    set_thread_timer_wheel(nullptr);
+    set_thread_flush_context(nullptr);
+    set_thread_event_base(nullptr);
     event_base_free(event_base);
 
     return EXIT_SUCCESS;
@@ -71,7 +71,8 @@ int getaddrinfo_helper(const char *host_and_port, int default_port,
     return getaddrinfo(host, port, hints, aip);
 }
 
-int setup_server_socket(const struct addrinfo *bind_address) {
+int setup_server_socket(const struct addrinfo *bind_address,
+                        bool reuse_port) {
     int sockfd, ret;
 
     assert(bind_address != nullptr);
@@ -91,6 +92,18 @@ int setup_server_socket(const struct addrinfo *bind_address) {
                 strerror(errno));
         exit(1);
     }
+
+    if (reuse_port) {
+        ret = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                         &param, sizeof(param));
+        if (ret < 0) {
+            fprintf(stderr, "setsockopt(SO_REUSEPORT) failed: %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+    }
+#else
+    (void)reuse_port;
 #endif
 
     ret = bind(sockfd, bind_address->ai_addr,
@@ -101,7 +114,7 @@ int setup_server_socket(const struct addrinfo *bind_address) {
         exit(1);
     }
 
-    ret = listen(sockfd, 4);
+    ret = listen(sockfd, SOMAXCONN);
     if (ret < 0) {
         fprintf(stderr, "listen failed: %s\n",
                 strerror(errno));
@@ -27,6 +27,11 @@ int getaddrinfo_helper(const char *host_and_port, int default_port,
                        const struct addrinfo *hints,
                        struct addrinfo **aip);
 
-int setup_server_socket(const struct addrinfo *bind_address);
+/**
+ * @param reuse_port set SO_REUSEPORT, so several sockets (one per
+ * worker thread) can be bound to the same address
+ */
+int setup_server_socket(const struct addrinfo *bind_address,
+                        bool reuse_port=false);
 
 #endif
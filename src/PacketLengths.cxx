@@ -144,3 +144,44 @@ get_packet_length(enum protocol_version protocol,
 
     return length;
 }
+
+void
+frame_packets(enum protocol_version protocol,
+              const void *data, std::size_t length,
+              PacketBatch &batch) noexcept
+{
+    const auto &lengths = GetPacketLengths(protocol);
+    const uint8_t *const p = (const uint8_t *)data;
+
+    std::size_t n = 0, position = 0;
+    bool invalid = false;
+
+    while (n < batch.CAPACITY && position < length) {
+        const std::size_t remaining = length - position;
+        std::size_t packet_length = lengths[p[position]];
+
+        if (packet_length == 0) {
+            if (remaining < 3)
+                break;
+
+            packet_length = *(const PackedBE16 *)(p + position + 1);
+            if (packet_length < 3 || packet_length >= 0x8000) {
+                invalid = true;
+                break;
+            }
+        } else if (packet_length == 0xffff) {
+            invalid = true;
+            break;
+        }
+
+        if (packet_length > remaining)
+            break;
+
+        batch.lengths[n++] = (uint16_t)packet_length;
+        position += packet_length;
+    }
+
+    batch.n = n;
+    batch.size = position;
+    batch.invalid = invalid;
+}
@@ -23,7 +23,9 @@
 
 #include "PVersion.hxx"
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
 
 inline constexpr std::size_t PACKET_LENGTH_INVALID(-1);
 
@@ -37,4 +39,40 @@ std::size_t
 get_packet_length(enum protocol_version protocol,
                   const void *q, std::size_t max_length);
 
+/**
+ * The complete packets at the beginning of a buffer, as determined by
+ * frame_packets().  They are contiguous, so only their lengths are
+ * stored.
+ */
+struct PacketBatch {
+    static constexpr std::size_t CAPACITY = 64;
+
+    std::size_t n;
+
+    /**
+     * The total length of all packets, i.e. the offset of the first
+     * one which is not in this batch.
+     */
+    std::size_t size;
+
+    /**
+     * Is the packet following this batch malformed?  This is false if
+     * it is merely incomplete, or if the batch is full.
+     */
+    bool invalid;
+
+    std::array<uint16_t, CAPACITY> lengths;
+};
+
+/**
+ * Splits a buffer into packets in one pass, up to
+ * PacketBatch::CAPACITY of them.  The result is the same as calling
+ * get_packet_length() repeatedly, but the length table is looked up
+ * only once.
+ */
+void
+frame_packets(enum protocol_version protocol,
+              const void *data, std::size_t length,
+              PacketBatch &batch) noexcept;
+
 #endif
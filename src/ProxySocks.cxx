@@ -22,6 +22,7 @@
 #include "Log.hxx"
 
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
 #ifdef _WIN32
@@ -38,50 +39,43 @@ struct socks4_header {
     uint32_t ip;
 };
 
-bool
-socks_connect(int fd, const struct sockaddr *address)
+static_assert(sizeof(struct socks4_header) == SOCKS_RESPONSE_SIZE);
+static_assert(sizeof(struct socks4_header) + 1 == SOCKS_REQUEST_SIZE);
+
+size_t
+socks_format_request(void *buffer, size_t buffer_size,
+                     const struct sockaddr *address)
 {
     if (address->sa_family != AF_INET) {
         LogFormat(1, "Not an IPv4 address\n");
-        return false;
+        return 0;
     }
 
     const struct sockaddr_in *in = (const struct sockaddr_in *)address;
-    struct socks4_header header = {
+    const struct socks4_header header = {
         .version = 0x04,
         .command = 0x01,
         .port = in->sin_port,
         .ip = in->sin_addr.s_addr,
     };
 
-    ssize_t nbytes = send(fd, (const char *)&header, sizeof(header), 0);
-    if (nbytes < 0) {
-        log_errno("Failed to send SOCKS4 request");
-        return false;
-    }
-
-    if (nbytes != sizeof(header)) {
-        LogFormat(1, "Failed to send SOCKS4 request\n");
-        return false;
-    }
-
+    /* the header is followed by an empty (null-terminated) user
+       name */
     static const char user[] = "";
-    nbytes = send(fd, user, sizeof(user), 0);
-    if (nbytes < 0) {
-        log_errno("Failed to send SOCKS4 user");
-        return false;
-    }
 
-    nbytes = recv(fd, (char *)&header, sizeof(header), 0);
-    if (nbytes < 0) {
-        log_errno("Failed to receive SOCKS4 response");
-        return false;
-    }
+    if (buffer_size < SOCKS_REQUEST_SIZE)
+        return 0;
 
-    if (nbytes != sizeof(header)) {
-        LogFormat(1, "Failed to receive SOCKS4 response\n");
-        return false;
-    }
+    memcpy(buffer, &header, sizeof(header));
+    memcpy((char *)buffer + sizeof(header), user, sizeof(user));
+    return sizeof(header) + sizeof(user);
+}
+
+bool
+socks_check_response(const void *response)
+{
+    struct socks4_header header;
+    memcpy(&header, response, sizeof(header));
 
     if (header.command != 0x5a) {
         LogFormat(2, "SOCKS4 request rejected: 0x%02x\n", header.command);
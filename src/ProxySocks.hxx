@@ -21,9 +21,35 @@
 #ifndef UOPROXY_SOCKS_H
 #define UOPROXY_SOCKS_H
 
+#include <stddef.h>
+
 struct sockaddr;
 
+/**
+ * The size of a SOCKS4 CONNECT request with an empty user name.
+ */
+static constexpr size_t SOCKS_REQUEST_SIZE = 9;
+
+/**
+ * The size of a SOCKS4 response.
+ */
+static constexpr size_t SOCKS_RESPONSE_SIZE = 8;
+
+/**
+ * Build a SOCKS4 CONNECT request for the given (IPv4) destination.
+ *
+ * @return the size of the request, or 0 on error
+ */
+size_t
+socks_format_request(void *buffer, size_t buffer_size,
+                     const struct sockaddr *address);
+
+/**
+ * Check a SOCKS4 response of #SOCKS_RESPONSE_SIZE bytes.
+ *
+ * @return true if the proxy has established the connection
+ */
 bool
-socks_connect(int fd, const struct sockaddr *address);
+socks_check_response(const void *response);
 
 #endif
@@ -24,24 +24,20 @@
 #include "Config.hxx"
 #include "Log.hxx"
 
+#include <utility>
+
 #include <assert.h>
 #include <time.h>
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#else
-#include <netdb.h>
-#endif
-
 void
 Connection::Disconnect() noexcept
 {
+    async_connect.Cancel();
+
     if (client.client == nullptr)
         return;
 
     client.reconnecting = false;
-    event_del(&reconnect_event);
 
     client.Disconnect();
     ClearWorld();
@@ -58,6 +54,11 @@ Connection::DoReconnect() noexcept
     assert(client.reconnecting);
     assert(client.client == nullptr);
 
+    if (standby && standby->IsReady()) {
+        UseStandby();
+        return;
+    }
+
     if (client.version.seed != nullptr)
         seed = client.version.seed->seed;
     else
@@ -65,44 +66,35 @@ Connection::DoReconnect() noexcept
 
     if (config.login_address == nullptr) {
         /* connect to game server */
-        struct addrinfo *server_address
-            = config.game_servers[server_index].address;
-
         assert(config.game_servers != nullptr);
         assert(server_index < config.num_game_servers);
 
-        ret = Connect(server_address->ai_addr,
-                      server_address->ai_addrlen, seed);
-        if (ret == 0) {
-            const struct uo_packet_game_login p = {
-                .cmd = PCK_GameLogin,
-                .auth_id = seed,
-                .credentials = credentials,
-            };
+        ResolvedHost &server_address
+            = *config.game_servers[server_index].address;
 
-            LogFormat(2, "connected, doing GameLogin\n");
+        const struct uo_packet_game_login p = {
+            .cmd = PCK_GameLogin,
+            .auth_id = seed,
+            .credentials = credentials,
+        };
 
-            uo_client_send(client.client, &p, sizeof(p));
-        } else {
+        ret = Connect(server_address, seed,
+                      p, ConnectFailure::RECONNECT);
+        if (ret != 0) {
             log_error("reconnect failed", ret);
             ScheduleReconnect();
         }
     } else {
         /* connect to login server */
-        ret = Connect(config.login_address->ai_addr,
-                      config.login_address->ai_addrlen,
-                      seed);
-        if (ret == 0) {
-            const struct uo_packet_account_login p = {
-                .cmd = PCK_AccountLogin,
-                .credentials = credentials,
-                .unknown1 = {},
-            };
-
-            LogFormat(2, "connected, doing AccountLogin\n");
-
-            uo_client_send(client.client, &p, sizeof(p));
-        } else {
+        const struct uo_packet_account_login p = {
+            .cmd = PCK_AccountLogin,
+            .credentials = credentials,
+            .unknown1 = {},
+        };
+
+        ret = Connect(*config.login_address, seed,
+                      p, ConnectFailure::RECONNECT);
+        if (ret != 0) {
             log_error("reconnect failed", ret);
             ScheduleReconnect();
         }
@@ -110,16 +102,60 @@ Connection::DoReconnect() noexcept
 }
 
 void
-Connection::ReconnectTimerCallback(int, short, void *ctx) noexcept
+Connection::UseStandby() noexcept
+{
+    assert(standby && standby->IsReady());
+
+    LogFormat(2, "taking over the standby connection\n");
+
+    client.char_list = std::move(standby->GetCharList());
+    client.Adopt(standby->Release(), *this);
+    UpdateBackpressure();
+
+    SendPlayCharacter();
+}
+
+void
+Connection::SendPlayCharacter() noexcept
 {
-    auto c = (Connection *)ctx;
+    const struct uo_packet_play_character p = {
+        .cmd = PCK_PlayCharacter,
+        .unknown0 = {},
+        .name = {},
+        .unknown1 = {},
+        .flags = {},
+        .unknown2 = {},
+        .slot = character_index,
+        .client_ip = 0xc0a80102, /* 192.168.1.2 */
+    };
+
+    LogFormat(2, "sending PlayCharacter\n");
+
+    uo_client_send(client.client, &p, sizeof(p));
+}
 
-    c->DoReconnect();
+void
+Connection::StartStandby() noexcept
+{
+    using std::chrono_literals::operator""s;
+
+    if (!instance.config.standby)
+        return;
+
+    if (!standby)
+        standby = std::make_unique<Standby>(*this);
+
+    /* give the server some time to settle the main session before
+       logging in again */
+    standby->Schedule(10s);
 }
 
 void
 Connection::Reconnect()
 {
+    /* explicitly requested by the user: bypass the scheduler */
+    instance.reconnect_scheduler.Cancel(*this);
+
     Disconnect();
 
     assert(IsInGame());
@@ -140,6 +176,5 @@ Connection::ScheduleReconnect() noexcept
 
     client.reconnecting = true;
 
-    static constexpr struct timeval tv{5, 0};
-    evtimer_add(&reconnect_event, &tv);
+    instance.reconnect_scheduler.Schedule(*this);
 }
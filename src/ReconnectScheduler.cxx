@@ -0,0 +1,275 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "ReconnectScheduler.hxx"
+#include "Connection.hxx"
+#include "Config.hxx"
+#include "Log.hxx"
+#include "EventBase.hxx"
+
+#include <algorithm>
+
+#include <assert.h>
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+/**
+ * The backoff delay of the first attempt; it is doubled with each
+ * failed attempt.
+ */
+static constexpr milliseconds RECONNECT_BASE_DELAY = seconds(5);
+
+static constexpr milliseconds RECONNECT_MAX_DELAY = seconds(300);
+
+/**
+ * Release the slot of a connection which didn't receive PCK_Start
+ * after this duration (in addition to the connect timeout), and
+ * start over.
+ */
+static constexpr seconds RECONNECT_LOGIN_TIMEOUT{60};
+
+ReconnectScheduler::ReconnectScheduler(const Config &_config) noexcept
+    :config(_config),
+     rand(std::random_device()())
+{
+}
+
+void
+ReconnectScheduler::Init() noexcept
+{
+    thread_evtimer_set(&timer_event, TimerCallback, this);
+}
+
+inline unsigned
+ReconnectScheduler::GetConcurrency() const noexcept
+{
+    return config.reconnect_concurrency;
+}
+
+ReconnectScheduler::Clock::duration
+ReconnectScheduler::CalcDelay(unsigned attempts) noexcept
+{
+    assert(attempts > 0);
+
+    const unsigned shift = std::min(attempts - 1, 16U);
+    const milliseconds delay = std::min(RECONNECT_BASE_DELAY * (1U << shift),
+                                        RECONNECT_MAX_DELAY);
+
+    /* "equal jitter": half of the delay is fixed, the other half is
+       random; this keeps a minimum distance between attempts while
+       spreading out connections which failed at the same time */
+    const auto half = delay.count() / 2;
+    std::uniform_int_distribution<milliseconds::rep> dist(0, delay.count() - half);
+    return milliseconds(half + dist(rand));
+}
+
+void
+ReconnectScheduler::Unlink(Connection &c) noexcept
+{
+    auto &ticket = c.reconnect_ticket;
+
+    switch (ticket.state) {
+    case ReconnectTicket::State::NONE:
+        break;
+
+    case ReconnectTicket::State::QUEUED: {
+        auto q = queues.find(ticket.server_key);
+        assert(q != queues.end());
+
+        q->second.erase(QueueKey(ticket.due, ticket.seq));
+        if (q->second.empty())
+            queues.erase(q);
+        break;
+    }
+
+    case ReconnectTicket::State::IN_FLIGHT: {
+        auto i = std::find(in_flight.begin(), in_flight.end(), &c);
+        assert(i != in_flight.end());
+        in_flight.erase(i);
+        break;
+    }
+    }
+
+    ticket.state = ReconnectTicket::State::NONE;
+}
+
+void
+ReconnectScheduler::Schedule(Connection &c) noexcept
+{
+    auto &ticket = c.reconnect_ticket;
+
+    Unlink(c);
+
+    ++ticket.attempts;
+    ticket.server_key = config.login_address != nullptr
+        ? 0
+        : c.server_index + 1;
+
+    const auto delay = CalcDelay(ticket.attempts);
+    ticket.due = Clock::now() + delay;
+    ticket.seq = next_seq++;
+    ticket.state = ReconnectTicket::State::QUEUED;
+
+    queues[ticket.server_key].emplace(QueueKey(ticket.due, ticket.seq), &c);
+
+    LogFormat(2, "reconnect attempt %u in %u ms\n", ticket.attempts,
+              (unsigned)std::chrono::duration_cast<milliseconds>(delay).count());
+
+    Rearm();
+}
+
+void
+ReconnectScheduler::Completed(Connection &c) noexcept
+{
+    auto &ticket = c.reconnect_ticket;
+
+    ticket.attempts = 0;
+
+    if (ticket.state == ReconnectTicket::State::NONE)
+        return;
+
+    Unlink(c);
+    Rearm();
+}
+
+void
+ReconnectScheduler::Cancel(Connection &c) noexcept
+{
+    if (c.reconnect_ticket.state == ReconnectTicket::State::NONE)
+        return;
+
+    Unlink(c);
+    Rearm();
+}
+
+ReconnectScheduler::Queue *
+ReconnectScheduler::FindDueQueue(Clock::time_point now) noexcept
+{
+    const auto is_due = [now](const std::pair<const unsigned, Queue> &i){
+        assert(!i.second.empty());
+        return i.second.begin()->first.first <= now;
+    };
+
+    auto i = std::find_if(queues.upper_bound(last_server_key),
+                          queues.end(), is_due);
+    if (i == queues.end()) {
+        i = std::find_if(queues.begin(), queues.end(), is_due);
+        if (i == queues.end())
+            return nullptr;
+    }
+
+    return &i->second;
+}
+
+void
+ReconnectScheduler::ExpireInFlight(Clock::time_point now) noexcept
+{
+    const auto timeout = RECONNECT_LOGIN_TIMEOUT + seconds(config.connect_timeout);
+
+    std::vector<Connection *> expired;
+    for (Connection *c : in_flight)
+        if (now >= c->reconnect_ticket.in_flight_since + timeout)
+            expired.push_back(c);
+
+    for (Connection *c : expired) {
+        LogFormat(2, "reconnect timed out\n");
+        c->ScheduleReconnect();
+    }
+}
+
+void
+ReconnectScheduler::Dispatch() noexcept
+{
+    const auto now = Clock::now();
+
+    ExpireInFlight(now);
+
+    while (in_flight.size() < GetConcurrency()) {
+        Queue *q = FindDueQueue(now);
+        if (q == nullptr)
+            break;
+
+        auto i = q->begin();
+        Connection &c = *i->second;
+        auto &ticket = c.reconnect_ticket;
+
+        last_server_key = ticket.server_key;
+
+        q->erase(i);
+        if (q->empty())
+            queues.erase(ticket.server_key);
+
+        ticket.state = ReconnectTicket::State::IN_FLIGHT;
+        ticket.in_flight_since = now;
+        in_flight.push_back(&c);
+
+        /* this may call Schedule() again if connecting fails right
+           away */
+        c.DoReconnect();
+    }
+
+    Rearm();
+}
+
+void
+ReconnectScheduler::Rearm() noexcept
+{
+    evtimer_del(&timer_event);
+
+    bool found = false;
+    Clock::time_point next;
+
+    const auto update = [&found, &next](Clock::time_point t){
+        if (!found || t < next) {
+            next = t;
+            found = true;
+        }
+    };
+
+    /* if all slots are taken, queued connections have to wait for
+       Completed() or Schedule() */
+    if (in_flight.size() < GetConcurrency())
+        for (const auto &i : queues)
+            update(i.second.begin()->first.first);
+
+    const auto timeout = RECONNECT_LOGIN_TIMEOUT + seconds(config.connect_timeout);
+    for (const Connection *c : in_flight)
+        update(c->reconnect_ticket.in_flight_since + timeout);
+
+    if (!found)
+        return;
+
+    const auto delay = std::max(std::chrono::duration_cast<std::chrono::microseconds>(next - Clock::now()),
+                                std::chrono::microseconds::zero());
+
+    struct timeval tv;
+    tv.tv_sec = delay.count() / 1000000;
+    tv.tv_usec = delay.count() % 1000000;
+    evtimer_add(&timer_event, &tv);
+}
+
+void
+ReconnectScheduler::TimerCallback(int, short, void *ctx) noexcept
+{
+    auto &scheduler = *(ReconnectScheduler *)ctx;
+
+    scheduler.Dispatch();
+}
@@ -0,0 +1,176 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_RECONNECT_SCHEDULER_H
+#define UOPROXY_RECONNECT_SCHEDULER_H
+
+#include <event.h>
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Config;
+struct Connection;
+
+/**
+ * Per-connection state managed by #ReconnectScheduler.
+ */
+struct ReconnectTicket {
+    using Clock = std::chrono::steady_clock;
+
+    enum class State : uint8_t {
+        NONE,
+
+        /**
+         * Waiting in the queue of #server_key.
+         */
+        QUEUED,
+
+        /**
+         * DoReconnect() has been called, and we're waiting for
+         * the server to send PCK_Start.
+         */
+        IN_FLIGHT,
+    } state = State::NONE;
+
+    /**
+     * The number of failed attempts since the last successful login;
+     * this determines the backoff delay.
+     */
+    unsigned attempts = 0;
+
+    /**
+     * Identifies the server queue: 0 is the login server, all other
+     * values are the game server index plus one.
+     */
+    unsigned server_key;
+
+    /**
+     * Sort key within the server queue.
+     */
+    Clock::time_point due;
+    uint64_t seq;
+
+    Clock::time_point in_flight_since;
+};
+
+/**
+ * Spreads out reconnect attempts of all connections.  Each attempt is
+ * delayed by an exponential backoff with jitter, queued per server,
+ * and at most "reconnect_concurrency" connects (including the login
+ * which follows) are in flight at any time.
+ */
+class ReconnectScheduler {
+    using Clock = ReconnectTicket::Clock;
+
+    const Config &config;
+
+    struct event timer_event;
+
+    std::minstd_rand rand;
+
+    using QueueKey = std::pair<Clock::time_point, uint64_t>;
+    using Queue = std::map<QueueKey, Connection *>;
+
+    /**
+     * One queue per server, see ReconnectTicket::server_key.
+     */
+    std::map<unsigned, Queue> queues;
+
+    /**
+     * The server which was served last; used to rotate between the
+     * queues.
+     */
+    unsigned last_server_key = 0;
+
+    uint64_t next_seq = 0;
+
+    std::vector<Connection *> in_flight;
+
+public:
+    explicit ReconnectScheduler(const Config &_config) noexcept;
+
+    ReconnectScheduler(const ReconnectScheduler &) = delete;
+    ReconnectScheduler &operator=(const ReconnectScheduler &) = delete;
+
+    /**
+     * Set up the timer; call this after event_init().
+     */
+    void Init() noexcept;
+
+    /**
+     * Queue a reconnect attempt for the specified connection (which
+     * must already be disconnected).  If an attempt is in flight, it
+     * is considered failed.
+     */
+    void Schedule(Connection &c) noexcept;
+
+    /**
+     * The connection has logged in successfully: release its slot
+     * and reset the backoff.
+     */
+    void Completed(Connection &c) noexcept;
+
+    /**
+     * Remove the connection from the scheduler, e.g. because it is
+     * being destroyed.
+     */
+    void Cancel(Connection &c) noexcept;
+
+    /**
+     * The number of connections waiting in the queues.
+     */
+    size_t GetQueuedCount() const noexcept {
+        size_t n = 0;
+        for (const auto &i : queues)
+            n += i.second.size();
+        return n;
+    }
+
+    size_t GetInFlightCount() const noexcept {
+        return in_flight.size();
+    }
+
+private:
+    Clock::duration CalcDelay(unsigned attempts) noexcept;
+
+    void Unlink(Connection &c) noexcept;
+
+    unsigned GetConcurrency() const noexcept;
+
+    /**
+     * Find the next queue (rotating after #last_server_key) whose
+     * first connection is due.
+     */
+    Queue *FindDueQueue(Clock::time_point now) noexcept;
+
+    void ExpireInFlight(Clock::time_point now) noexcept;
+    void Dispatch() noexcept;
+    void Rearm() noexcept;
+
+    static void TimerCallback(int, short, void *ctx) noexcept;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Resolver.hxx"
+#include "Config.hxx"
+#include "EventBase.hxx"
+#include "Log.hxx"
+
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#include <stdexcept>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#endif
+
+/**
+ * Retry a failed lookup after this number of seconds.
+ */
+static constexpr unsigned RESOLVER_RETRY = 30;
+
+bool
+ResolvedAddress::operator==(const ResolvedAddress &other) const noexcept
+{
+    return length == other.length &&
+        memcmp(&address, &other.address, length) == 0;
+}
+
+/**
+ * Append the addresses of the specified family to the vector,
+ * skipping duplicates.
+ */
+static void
+collect_addresses(std::vector<ResolvedAddress> &dest,
+                  const struct addrinfo *ai, int family) noexcept
+{
+    for (; ai != nullptr; ai = ai->ai_next) {
+        if (ai->ai_family != family ||
+            ai->ai_addrlen > sizeof(ResolvedAddress::address))
+            continue;
+
+        ResolvedAddress a;
+        memcpy(&a.address, ai->ai_addr, ai->ai_addrlen);
+        a.length = (socklen_t)ai->ai_addrlen;
+
+        bool found = false;
+        for (const auto &i : dest)
+            if (i == a)
+                found = true;
+
+        if (!found)
+            dest.push_back(a);
+    }
+}
+
+static std::vector<ResolvedAddress>
+sort_addresses(const struct addrinfo *ai) noexcept
+{
+    std::vector<ResolvedAddress> result;
+    collect_addresses(result, ai, AF_INET);
+    collect_addresses(result, ai, AF_INET6);
+    return result;
+}
+
+ResolvedHost::ResolvedHost(const char *host_and_port,
+                           unsigned default_port) noexcept
+{
+    const char *colon = strchr(host_and_port, ':');
+    if (colon == nullptr) {
+        host = host_and_port;
+        port = std::to_string(default_port);
+    } else {
+        host.assign(host_and_port, colon);
+        port = colon + 1;
+    }
+
+    /* numeric addresses don't need the resolver */
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &ai) == 0) {
+        addresses = sort_addresses(ai);
+        freeaddrinfo(ai);
+        numeric = true;
+    }
+}
+
+bool
+ResolvedHost::Get(ResolvedAddress &dest) const noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    if (addresses.empty())
+        return false;
+
+    dest = addresses[current];
+    return true;
+}
+
+uint32_t
+ResolvedHost::GetIPv4() const noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    if (addresses.empty())
+        return 0;
+
+    if (addresses[current].address.ss_family == AF_INET)
+        return ((const struct sockaddr_in *)&addresses[current].address)->sin_addr.s_addr;
+
+    for (const auto &i : addresses)
+        if (i.address.ss_family == AF_INET)
+            return ((const struct sockaddr_in *)&i.address)->sin_addr.s_addr;
+
+    return 0;
+}
+
+void
+ResolvedHost::Failed(const ResolvedAddress &address) noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    /* somebody else may have moved on already */
+    if (addresses.size() < 2 || !(addresses[current] == address))
+        return;
+
+    current = (current + 1) % addresses.size();
+
+    LogFormat(2, "switching to address %zu of %zu of '%s'\n",
+              current + 1, addresses.size(), host.c_str());
+}
+
+bool
+ResolvedHost::Update(std::vector<ResolvedAddress> &&new_addresses) noexcept
+{
+    assert(!new_addresses.empty());
+
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    if (new_addresses == addresses)
+        return false;
+
+    /* stick with the current address if it is still valid */
+    size_t new_current = 0;
+    if (!addresses.empty())
+        for (size_t i = 0; i < new_addresses.size(); ++i)
+            if (new_addresses[i] == addresses[current])
+                new_current = i;
+
+    addresses = std::move(new_addresses);
+    current = new_current;
+    return true;
+}
+
+/**
+ * The periodic lookup of one #ResolvedHost.
+ */
+class Resolver::Lookup {
+    struct evdns_base &dns;
+    ResolvedHost &host;
+
+    /**
+     * The refresh interval in seconds; 0 means resolve only once.
+     */
+    const unsigned refresh;
+
+    struct evdns_getaddrinfo_request *request = nullptr;
+
+    struct event timer;
+
+public:
+    Lookup(struct evdns_base &_dns, ResolvedHost &_host,
+           unsigned _refresh) noexcept
+        :dns(_dns), host(_host), refresh(_refresh) {
+        thread_evtimer_set(&timer, TimerCallback, this);
+    }
+
+    ~Lookup() noexcept {
+        event_del(&timer);
+
+        if (request != nullptr)
+            /* this invokes the callback with EVUTIL_EAI_CANCEL */
+            evdns_getaddrinfo_cancel(request);
+    }
+
+    Lookup(const Lookup &) = delete;
+    Lookup &operator=(const Lookup &) = delete;
+
+    void Start() noexcept;
+
+private:
+    void Schedule(unsigned seconds) noexcept {
+        const struct timeval tv{time_t(seconds), 0};
+        event_add(&timer, &tv);
+    }
+
+    void OnResult(int result, struct evutil_addrinfo *ai) noexcept;
+
+    static void Callback(int result, struct evutil_addrinfo *ai,
+                         void *ctx) noexcept;
+    static void TimerCallback(int, short, void *ctx) noexcept;
+};
+
+void
+Resolver::Lookup::Start() noexcept
+{
+    assert(request == nullptr);
+
+    struct evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+
+    /* the callback may be invoked right away (e.g. for names from
+       /etc/hosts); then nullptr is returned */
+    request = evdns_getaddrinfo(&dns, host.GetHost(), host.GetPort(),
+                                &hints, Callback, this);
+}
+
+inline void
+Resolver::Lookup::OnResult(int result, struct evutil_addrinfo *ai) noexcept
+{
+    if (result != 0) {
+        LogFormat(1, "failed to resolve '%s': %s\n",
+                  host.GetHost(), evutil_gai_strerror(result));
+        Schedule(RESOLVER_RETRY);
+        return;
+    }
+
+    auto addresses = sort_addresses(ai);
+    evutil_freeaddrinfo(ai);
+
+    if (addresses.empty()) {
+        LogFormat(1, "no usable address for '%s'\n", host.GetHost());
+        Schedule(RESOLVER_RETRY);
+        return;
+    }
+
+    const size_t n = addresses.size();
+    if (host.Update(std::move(addresses)))
+        LogFormat(2, "resolved '%s' to %zu address(es)\n",
+                  host.GetHost(), n);
+
+    if (refresh > 0)
+        Schedule(refresh);
+}
+
+void
+Resolver::Lookup::Callback(int result, struct evutil_addrinfo *ai,
+                           void *ctx) noexcept
+{
+    if (result == EVUTIL_EAI_CANCEL)
+        /* the Lookup is being destroyed */
+        return;
+
+    auto &lookup = *(Lookup *)ctx;
+    lookup.request = nullptr;
+    lookup.OnResult(result, ai);
+}
+
+void
+Resolver::Lookup::TimerCallback(int, short, void *ctx) noexcept
+{
+    auto &lookup = *(Lookup *)ctx;
+    lookup.Start();
+}
+
+Resolver::Resolver(Config &config)
+{
+    Add(config.login_address, config.dns_refresh);
+    Add(config.socks4_address, config.dns_refresh);
+
+    for (unsigned i = 0; i < config.num_game_servers; ++i)
+        Add(config.game_servers[i].address, config.dns_refresh);
+
+    for (auto &i : lookups)
+        i->Start();
+}
+
+Resolver::~Resolver() noexcept
+{
+    lookups.clear();
+
+    if (dns != nullptr)
+        evdns_base_free(dns, 0);
+}
+
+void
+Resolver::Add(ResolvedHost *host, unsigned refresh)
+{
+    if (host == nullptr || host->IsNumeric())
+        return;
+
+    if (dns == nullptr) {
+        dns = evdns_base_new(thread_event_base(),
+                             EVDNS_BASE_INITIALIZE_NAMESERVERS);
+        if (dns == nullptr)
+            throw std::runtime_error("Failed to initialize the DNS resolver");
+    }
+
+    lookups.emplace_back(std::make_unique<Lookup>(*dns, *host, refresh));
+}
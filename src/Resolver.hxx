@@ -0,0 +1,166 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Host names from the configuration (login server, game servers,
+ * SOCKS4 proxy) are resolved asynchronously in the event loop and
+ * refreshed periodically, so a shard which moves to another IP does
+ * not require a restart.
+ */
+
+#ifndef UOPROXY_RESOLVER_H
+#define UOPROXY_RESOLVER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+struct Config;
+struct evdns_base;
+
+/**
+ * A copy of one socket address.
+ */
+struct ResolvedAddress {
+    struct sockaddr_storage address;
+    socklen_t length = 0;
+
+    const struct sockaddr *GetAddress() const noexcept {
+        return (const struct sockaddr *)&address;
+    }
+
+    bool operator==(const ResolvedAddress &other) const noexcept;
+};
+
+/**
+ * A "host:port" from the configuration and the addresses it
+ * currently resolves to.  They are updated by the #Resolver in the
+ * main thread and may be read by all workers.
+ */
+class ResolvedHost {
+    std::string host, port;
+
+    /**
+     * Was the host a numeric address?  Then it has been "resolved"
+     * right away and is never looked up again.
+     */
+    bool numeric = false;
+
+    /**
+     * Protects #addresses and #current.
+     */
+    mutable std::mutex mutex;
+
+    /**
+     * IPv4 addresses first; empty until the first lookup has
+     * succeeded.
+     */
+    std::vector<ResolvedAddress> addresses;
+
+    /**
+     * The index of the address which is used for connecting; it
+     * moves on to the next one after a failure.
+     */
+    size_t current = 0;
+
+public:
+    ResolvedHost(const char *host_and_port, unsigned default_port) noexcept;
+
+    ResolvedHost(const ResolvedHost &) = delete;
+    ResolvedHost &operator=(const ResolvedHost &) = delete;
+
+    const char *GetHost() const noexcept {
+        return host.c_str();
+    }
+
+    const char *GetPort() const noexcept {
+        return port.c_str();
+    }
+
+    bool IsNumeric() const noexcept {
+        return numeric;
+    }
+
+    /**
+     * Copy the address which should be connected to.
+     *
+     * @return false if the host has not been resolved yet
+     */
+    bool Get(ResolvedAddress &dest) const noexcept;
+
+    /**
+     * @return the current address if it is IPv4, or else the
+     * first IPv4 address (in network byte order), or 0
+     */
+    uint32_t GetIPv4() const noexcept;
+
+    /**
+     * Connecting to this address (obtained from Get()) has failed;
+     * use the next one from now on.
+     */
+    void Failed(const ResolvedAddress &address) noexcept;
+
+    /**
+     * Replace the addresses with a new lookup result.
+     *
+     * @return true if they have changed
+     */
+    bool Update(std::vector<ResolvedAddress> &&new_addresses) noexcept;
+};
+
+/**
+ * Looks up all host names of the #Config with libevent's evdns and
+ * repeats that every Config::dns_refresh seconds.  Only in the main
+ * thread.
+ */
+class Resolver {
+    class Lookup;
+
+    struct evdns_base *dns = nullptr;
+
+    std::vector<std::unique_ptr<Lookup>> lookups;
+
+public:
+    /**
+     * Throws std::runtime_error if the resolver could not be
+     * initialized.
+     */
+    explicit Resolver(Config &config);
+
+    ~Resolver() noexcept;
+
+    Resolver(const Resolver &) = delete;
+    Resolver &operator=(const Resolver &) = delete;
+
+private:
+    void Add(ResolvedHost *host, unsigned refresh);
+};
+
+#endif
@@ -125,6 +125,8 @@ handle_start(Connection &c, const void *data, [[maybe_unused]] size_t length)
     /* if we're auto-reconnecting, this is the point where it
        succeeded */
     c.client.reconnecting = false;
+    c.instance.reconnect_scheduler.Completed(c);
+    c.StartStandby();
 
     c.walk.seq_next = 0;
 
@@ -250,12 +252,14 @@ handle_container_update(Connection &c, const void *data, size_t length)
 
         assert(length == sizeof(*p));
 
-        container_update_6_to_5(&p5, p);
+        const bool need_p5 = c.HasInGameClientsBelow(PROTOCOL_6);
+        if (need_p5)
+            container_update_6_to_5(&p5, p);
 
         c.client.world.Apply(*p);
 
         c.BroadcastToInGameClientsDivert(PROTOCOL_6,
-                                          &p5, sizeof(p5),
+                                          need_p5 ? &p5 : nullptr, sizeof(p5),
                                           data, length);
     }
 
@@ -274,6 +278,12 @@ handle_equip(Connection &c, const void *data, [[maybe_unused]] size_t length)
     return PacketAction::ACCEPT;
 }
 
+/**
+ * Scratch buffer for container_content_5_to_6() and
+ * container_content_6_to_5(); large enough for the biggest packet.
+ */
+static thread_local uint8_t convert_buffer[0x10000];
+
 static PacketAction
 handle_container_content(Connection &c, const void *data, size_t length)
 {
@@ -281,22 +291,29 @@ handle_container_content(Connection &c, const void *data, size_t length)
         /* protocol v5 */
         auto p = (const struct uo_packet_container_content *)data;
 
-        const auto p6 = container_content_5_to_6(p);
+        const size_t p6_length =
+            container_content_5_to_6(convert_buffer, sizeof(convert_buffer), p);
+        if (p6_length == 0)
+            return PacketAction::DISCONNECT;
 
-        c.client.world.Apply(*p6);
+        c.client.world.Apply(*(const struct uo_packet_container_content_6 *)convert_buffer);
 
         c.BroadcastToInGameClientsDivert(PROTOCOL_6,
                                           data, length,
-                                          p6.get(), p6.size());
+                                          convert_buffer, p6_length);
     } else if (packet_verify_container_content_6((const uo_packet_container_content_6 *)data, length)) {
         /* protocol v6 */
         auto p = (const struct uo_packet_container_content_6 *)data;
 
         c.client.world.Apply(*p);
 
-        const auto p5 = container_content_6_to_5(p);
+        /* the v5 packet is smaller, it always fits */
+        const size_t p5_length = c.HasInGameClientsBelow(PROTOCOL_6)
+            ? container_content_6_to_5(convert_buffer, sizeof(convert_buffer), p)
+            : 0;
         c.BroadcastToInGameClientsDivert(PROTOCOL_6,
-                                          p5.get(), p5.size(),
+                                          p5_length > 0 ? convert_buffer : nullptr,
+                                          p5_length,
                                           data, length);
     } else
         return PacketAction::DISCONNECT;
@@ -399,6 +416,10 @@ handle_ping(Connection &c, const void *data, [[maybe_unused]] size_t length)
 
     assert(length == sizeof(*p));
 
+    if (p->id == c.client.ping_request && p->id != c.client.ping_ack)
+        c.upstream_rtt.Record(std::chrono::steady_clock::now() -
+                              c.client.ping_sent);
+
     c.client.ping_ack = p->id;
 
     return PacketAction::DROP;
@@ -450,21 +471,7 @@ handle_char_list(Connection &c, const void *data, size_t length)
 
     /* respond directly during reconnect */
     if (c.client.reconnecting) {
-        struct uo_packet_play_character p2 = {
-            .cmd = PCK_PlayCharacter,
-            .unknown0 = {},
-            .name = {},
-            .unknown1 = {},
-            .flags = {},
-            .unknown2 = {},
-            .slot = c.character_index,
-            .client_ip = 0xc0a80102, /* 192.168.1.2 */
-        };
-
-        LogFormat(2, "sending PlayCharacter\n");
-
-        uo_client_send(c.client.client, &p2, sizeof(p2));
-
+        c.SendPlayCharacter();
         return PacketAction::DROP;
     } else {
         for (auto &ls : c.servers) {
@@ -543,22 +550,20 @@ handle_relay(Connection &c, const void *data, [[maybe_unused]] size_t length)
     if (c.client.version.seed != nullptr)
         c.client.version.seed->seed = relay.auth_id;
 
+    /* the game login is sent to the new server as soon as the
+       connection has been established */
+    login.cmd = PCK_GameLogin;
+    login.auth_id = relay.auth_id;
+    login.credentials = c.credentials;
+
     ret = c.Connect((const struct sockaddr *)&sin,
-                     sizeof(sin), relay.auth_id);
+                    sizeof(sin), relay.auth_id,
+                    login, Connection::ConnectFailure::SERVER_DISCONNECT);
     if (ret != 0) {
         log_error("connect to game server failed", ret);
         return PacketAction::DISCONNECT;
     }
 
-    /* send game login to new server */
-    LogFormat(2, "connected, doing GameLogin\n");
-
-    login.cmd = PCK_GameLogin;
-    login.auth_id = relay.auth_id;
-    login.credentials = c.credentials;
-
-    uo_client_send(c.client.client, &login, sizeof(login));
-
     return PacketAction::DELETED;
 }
 
@@ -725,12 +730,15 @@ handle_world_item_7(Connection &c, const void *data, size_t length)
     assert(length == sizeof(*p));
 
     struct uo_packet_world_item old;
-    world_item_from_7(&old, p);
+    const bool need_old = c.HasInGameClientsBelow(PROTOCOL_7);
+    if (need_old)
+        world_item_from_7(&old, p);
 
     c.client.world.Apply(*p);
 
     c.BroadcastToInGameClientsDivert(PROTOCOL_7,
-                                      &old, old.length,
+                                      need_old ? &old : nullptr,
+                                      need_old ? size_t(old.length) : 0,
                                       data, length);
     return PacketAction::DROP;
 }
@@ -759,7 +767,7 @@ handle_protocol_extension(Connection &c, const void *data, size_t length)
     return PacketAction::ACCEPT;
 }
 
-const struct client_packet_binding server_packet_bindings[] = {
+static constexpr struct client_packet_binding server_packet_bindings[] = {
     { PCK_MobileStatus, handle_mobile_status }, /* 0x11 */
     { PCK_WorldItem, handle_world_item }, /* 0x1a */
     { PCK_Start, handle_start }, /* 0x1b */
@@ -797,3 +805,8 @@ const struct client_packet_binding server_packet_bindings[] = {
     { PCK_ProtocolExtension, handle_protocol_extension }, /* 0xf0 */
     {}
 };
+
+static_assert(HasUniquePacketBindings(server_packet_bindings));
+
+constexpr client_packet_dispatch server_packet_handlers =
+    MakePacketDispatchTable(server_packet_bindings);
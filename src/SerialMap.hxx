@@ -0,0 +1,157 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __UOPROXY_SERIAL_MAP_H
+#define __UOPROXY_SERIAL_MAP_H
+
+#include <algorithm>
+#include <memory>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An intrusive hash table which maps serials to entities.  The
+ * entity type must have the attributes "const uint32_t serial" and
+ * "T *serial_next"; the latter is managed by this class.
+ *
+ * It does not own the entities; the caller is responsible for
+ * removing them before disposing them.
+ */
+template<typename T>
+class SerialMap {
+    std::unique_ptr<T *[]> buckets;
+
+    /**
+     * The logarithm of the bucket count; 0 means no buckets have
+     * been allocated yet.
+     */
+    unsigned log2_n_buckets = 0;
+
+    size_t n_entities = 0;
+
+    static constexpr unsigned INITIAL_LOG2 = 6;
+
+public:
+    SerialMap() = default;
+    SerialMap(const SerialMap &) = delete;
+    SerialMap &operator=(const SerialMap &) = delete;
+
+    size_t size() const noexcept {
+        return n_entities;
+    }
+
+    /**
+     * The number of bytes allocated for the bucket array.
+     */
+    size_t GetMemoryUsage() const noexcept {
+        return log2_n_buckets > 0
+            ? (size_t(1) << log2_n_buckets) * sizeof(T *)
+            : 0;
+    }
+
+    T *Find(uint32_t serial) const noexcept {
+        if (n_entities == 0)
+            return nullptr;
+
+        for (T *i = buckets[Hash(serial)]; i != nullptr; i = i->serial_next)
+            if (i->serial == serial)
+                return i;
+
+        return nullptr;
+    }
+
+    /**
+     * Add an entity; the caller must ensure that there is no entity
+     * with the same serial yet.
+     */
+    void Insert(T &t) noexcept {
+        assert(Find(t.serial) == nullptr);
+
+        if (n_entities >= GetBucketCount())
+            Grow();
+
+        T *&bucket = buckets[Hash(t.serial)];
+        t.serial_next = bucket;
+        bucket = &t;
+        ++n_entities;
+    }
+
+    void Remove(T &t) noexcept {
+        assert(n_entities > 0);
+
+        for (T **p = &buckets[Hash(t.serial)]; *p != nullptr;
+             p = &(*p)->serial_next) {
+            if (*p == &t) {
+                *p = t.serial_next;
+                --n_entities;
+                return;
+            }
+        }
+
+        assert(false);
+    }
+
+    /**
+     * Forget all entities (without touching them).  The bucket array
+     * is kept for reuse.
+     */
+    void Clear() noexcept {
+        if (n_entities == 0)
+            return;
+
+        std::fill_n(buckets.get(), GetBucketCount(), nullptr);
+        n_entities = 0;
+    }
+
+private:
+    size_t GetBucketCount() const noexcept {
+        return log2_n_buckets > 0 ? size_t(1) << log2_n_buckets : 0;
+    }
+
+    size_t Hash(uint32_t serial) const noexcept {
+        /* Fibonacci hashing; serials are often sequential, and this
+           spreads them evenly */
+        return uint32_t(serial * 0x9e3779b1u) >> (32 - log2_n_buckets);
+    }
+
+    void Grow() noexcept {
+        const size_t old_size = GetBucketCount();
+        auto old_buckets = std::move(buckets);
+
+        log2_n_buckets = log2_n_buckets > 0
+            ? log2_n_buckets + 1
+            : INITIAL_LOG2;
+        buckets.reset(new T *[GetBucketCount()]());
+
+        for (size_t b = 0; b < old_size; ++b) {
+            for (T *i = old_buckets[b]; i != nullptr;) {
+                T *next = i->serial_next;
+                T *&bucket = buckets[Hash(i->serial)];
+                i->serial_next = bucket;
+                bucket = i;
+                i = next;
+            }
+        }
+    }
+};
+
+#endif
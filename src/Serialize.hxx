@@ -0,0 +1,241 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A simple binary encoding of the state which is handed over to a
+ * new process during a hot upgrade (see #UpgradeServer).  Both
+ * processes run on the same host, so integers are stored in host
+ * byte order; structs which are stored as a whole are packets in
+ * wire format.  File descriptors are collected separately, to be
+ * passed with SCM_RIGHTS.
+ */
+
+#ifndef UOPROXY_SERIALIZE_H
+#define UOPROXY_SERIALIZE_H
+
+#include "util/ConstBuffer.hxx"
+#include "util/VarStructPtr.hxx"
+
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class Serializer {
+    std::vector<uint8_t> buffer;
+    std::vector<int> fds;
+
+public:
+    /**
+     * The maximum number of file descriptors in one record.
+     */
+    static constexpr size_t MAX_FDS = 64;
+
+    /**
+     * A position which may be restored with Rollback().
+     */
+    struct Mark {
+        size_t size, n_fds;
+    };
+
+    ConstBuffer<uint8_t> GetData() const noexcept {
+        return {buffer.data(), buffer.size()};
+    }
+
+    const std::vector<int> &GetFds() const noexcept {
+        return fds;
+    }
+
+    Mark GetMark() const noexcept {
+        return {buffer.size(), fds.size()};
+    }
+
+    /**
+     * Discard everything which has been written since GetMark().
+     */
+    void Rollback(Mark mark) noexcept {
+        buffer.resize(mark.size);
+        fds.resize(mark.n_fds);
+    }
+
+    void Write(const void *data, size_t length) {
+        const auto *p = (const uint8_t *)data;
+        buffer.insert(buffer.end(), p, p + length);
+    }
+
+    template<typename T>
+    void WriteT(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Write(&value, sizeof(value));
+    }
+
+    void WriteBool(bool value) {
+        WriteT<uint8_t>(value);
+    }
+
+    void WriteU8(uint8_t value) {
+        WriteT(value);
+    }
+
+    void WriteU32(uint32_t value) {
+        WriteT(value);
+    }
+
+    void WriteU64(uint64_t value) {
+        WriteT(value);
+    }
+
+    /**
+     * Write a buffer with its length.
+     */
+    void WriteBuffer(const void *data, size_t length) {
+        WriteU32(length);
+        Write(data, length);
+    }
+
+    /**
+     * Write a fixed-size packet with its length, which is checked
+     * by Deserializer::ReadPacket().
+     */
+    template<typename T>
+    void WritePacket(const T &packet) {
+        static_assert(alignof(T) == 1);
+        WriteBuffer(&packet, sizeof(packet));
+    }
+
+    /**
+     * Write a variable-length packet; an empty one is read back as
+     * nullptr.
+     */
+    template<typename T>
+    void WriteVarStruct(const VarStructPtr<T> &p) {
+        WriteBuffer(p.get(), p.size());
+    }
+
+    /**
+     * Pass a file descriptor along.  It remains owned by the
+     * caller.
+     */
+    void WriteFd(int fd) {
+        WriteU32(fds.size());
+        fds.push_back(fd);
+    }
+};
+
+/**
+ * Parses what #Serializer has written.  Throws std::runtime_error
+ * if the data is malformed.
+ */
+class Deserializer {
+    const uint8_t *p;
+    const uint8_t *const end;
+
+    std::vector<int> &fds;
+
+public:
+    /**
+     * @param _fds the received file descriptors; ReadFd() takes
+     * them out of the vector, and the caller must close the others
+     */
+    Deserializer(ConstBuffer<uint8_t> data, std::vector<int> &_fds) noexcept
+        :p(data.begin()), end(data.end()), fds(_fds) {}
+
+    ConstBuffer<void> Read(size_t length) {
+        if (length > size_t(end - p))
+            throw std::runtime_error("truncated upgrade record");
+
+        ConstBuffer<void> result(p, length);
+        p += length;
+        return result;
+    }
+
+    template<typename T>
+    T ReadT() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        memcpy(&value, Read(sizeof(value)).data, sizeof(value));
+        return value;
+    }
+
+    bool ReadBool() {
+        return ReadT<uint8_t>() != 0;
+    }
+
+    uint8_t ReadU8() {
+        return ReadT<uint8_t>();
+    }
+
+    uint32_t ReadU32() {
+        return ReadT<uint32_t>();
+    }
+
+    uint64_t ReadU64() {
+        return ReadT<uint64_t>();
+    }
+
+    ConstBuffer<void> ReadBuffer() {
+        return Read(ReadU32());
+    }
+
+    template<typename T>
+    void ReadPacket(T &packet) {
+        const auto b = ReadBuffer();
+        if (b.size != sizeof(packet))
+            throw std::runtime_error("packet size mismatch in upgrade record");
+
+        memcpy(&packet, b.data, sizeof(packet));
+    }
+
+    /**
+     * @param min_size the minimum size of a non-empty struct
+     */
+    template<typename T>
+    void ReadVarStruct(VarStructPtr<T> &dest, size_t min_size) {
+        const auto b = ReadBuffer();
+        if (b.empty()) {
+            dest.reset();
+            return;
+        }
+
+        if (b.size < min_size)
+            throw std::runtime_error("malformed packet in upgrade record");
+
+        dest = VarStructPtr<T>((const T *)b.data, b.size);
+    }
+
+    /**
+     * Take a file descriptor which was written with
+     * Serializer::WriteFd(); the caller owns it afterwards.
+     */
+    int ReadFd() {
+        const uint32_t i = ReadU32();
+        if (i >= fds.size() || fds[i] < 0)
+            throw std::runtime_error("missing file descriptor in upgrade record");
+
+        const int fd = fds[i];
+        fds[i] = -1;
+        return fd;
+    }
+};
+
+#endif
@@ -23,12 +23,22 @@
 #include "Compression.hxx"
 #include "PacketLengths.hxx"
 #include "PacketStructs.hxx"
+#include "PacketType.hxx"
 #include "Log.hxx"
+#include "Trace.hxx"
+#include "Stats.hxx"
+#include "Capture.hxx"
 #include "SocketUtil.hxx"
 #include "Encryption.hxx"
+#include "UpdateQueue.hxx"
+#include "Serialize.hxx"
 #include "util/WritableBuffer.hxx"
+#include "EventBase.hxx"
 
+#include <algorithm>
+#include <stdexcept>
 #include <utility>
+#include <vector>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -52,15 +62,65 @@ public:
 
     ServerHandler &handler;
 
+    const uint32_t capture_id = capture_next_id();
+
     bool aborted = false;
     struct event abort_event;
 
+    /**
+     * Has uo_server_pause() been called?
+     */
+    bool paused = false;
+
+    /**
+     * Is the output queue above #OUTPUT_HIGH_WATERMARK (and has not
+     * drained to #OUTPUT_LOW_WATERMARK yet)?  Updates are coalesced
+     * in #updates meanwhile.
+     */
+    bool congested = false;
+
+    /**
+     * Has the #handler been asked to stop producing data, because
+     * the queue has exceeded #OUTPUT_BACKPRESSURE_WATERMARK?
+     */
+    bool backpressure = false;
+
+    /**
+     * State updates which are held back while the client is
+     * #congested; they are sent when it has drained.
+     */
+    UpdateQueue updates;
+
+    /**
+     * Start coalescing updates when this many bytes are queued for
+     * the client.
+     */
+    static constexpr size_t OUTPUT_HIGH_WATERMARK = 256 * 1024;
+
+    /**
+     * Report backpressure to the #handler when the queue grows to
+     * this size despite the coalescing.
+     */
+    static constexpr size_t OUTPUT_BACKPRESSURE_WATERMARK = 1024 * 1024;
+
+    /**
+     * Send the coalesced updates and report relief when the queue
+     * has shrunk to this size.
+     */
+    static constexpr size_t OUTPUT_LOW_WATERMARK = 64 * 1024;
+
+    /**
+     * Abort the client if it doesn't read and the queue grows
+     * beyond this size despite the backpressure.
+     */
+    static constexpr size_t MAX_OUTPUT = 4 * 1024 * 1024;
+
     explicit Server(int fd, ServerHandler &_handler) noexcept
-        :sock(sock_buff_create(fd, 8192, 65536, *this)),
+        :sock(sock_buff_create(fd, 8192, MAX_OUTPUT, *this)),
          handler(_handler)
     {
-        evtimer_set(&abort_event,
-                    uo_server_abort_event_callback, this);
+        thread_evtimer_set(&abort_event,
+                           uo_server_abort_event_callback, this);
     }
 
     ~Server() noexcept {
@@ -73,12 +133,60 @@ public:
 
     void Abort() noexcept;
 
+    /**
+     * Send an encoded packet.
+     */
+    void SendEncoded(const void *data, size_t length) noexcept;
+
+    /**
+     * Send an encoded buffer which is shared with other clients by
+     * passing a reference to the socket buffer.
+     */
+    void SendShared(std::shared_ptr<const void> owner,
+                    ConstBuffer<void> data) noexcept;
+
+    /**
+     * Compress the packet into the output queue.
+     */
+    void SendCompress(const void *src, size_t length) noexcept;
+
+    /**
+     * Send a raw packet, compressing it if enabled.
+     */
+    void SendPacket(const void *src, size_t length) noexcept;
+
+    /**
+     * Hold back the packet if it is a coalescible update and the
+     * client is congested.  Otherwise, make sure the packet does not
+     * overtake the updates it depends on.
+     *
+     * @return true if the packet has been queued in #updates
+     */
+    bool DeferUpdate(ConstBuffer<void> packet) noexcept;
+
+    /**
+     * Send all updates held back in #updates.
+     */
+    void FlushUpdates() noexcept;
+
 private:
+    /**
+     * Abort the client because its output queue is full.
+     */
+    void OutputFull() noexcept;
+
+    /**
+     * Check the output queue against #OUTPUT_HIGH_WATERMARK after
+     * something has been queued.
+     */
+    void CheckCongestion() noexcept;
+
     ssize_t ParsePackets(const uint8_t *data, size_t length);
 
     /* virtual methods from SocketBufferHandler */
     size_t OnSocketData(const void *data, size_t length) override;
     void OnSocketDisconnect(int error) noexcept override;
+    void OnSocketDrained() noexcept override;
 };
 
 } // namespace UO
@@ -108,35 +216,199 @@ UO::Server::Abort() noexcept
     aborted = true;
 }
 
+void
+UO::Server::OutputFull() noexcept
+{
+    LogFormat(1, "output buffer full in uo_server_send()\n");
+    Abort();
+}
+
+void
+UO::Server::CheckCongestion() noexcept
+{
+    const size_t queued = sock_buff_output_size(sock);
+    thread_stats().output_queue.Record(queued);
+
+    if (!congested) {
+        if (queued < OUTPUT_HIGH_WATERMARK)
+            return;
+
+        congested = true;
+        sock_buff_request_drain(sock, OUTPUT_LOW_WATERMARK);
+    }
+
+    if (!backpressure && queued >= OUTPUT_BACKPRESSURE_WATERMARK) {
+        backpressure = true;
+        handler.OnServerCongestion(true);
+    }
+}
+
+void
+UO::Server::SendEncoded(const void *data, size_t length) noexcept
+{
+    if (!sock_buff_send(sock, data, length)) {
+        OutputFull();
+        return;
+    }
+
+    CheckCongestion();
+}
+
+void
+UO::Server::SendShared(std::shared_ptr<const void> owner,
+                       ConstBuffer<void> data) noexcept
+{
+    if (!sock_buff_send_shared(sock, std::move(owner), data)) {
+        OutputFull();
+        return;
+    }
+
+    CheckCongestion();
+}
+
+void
+UO::Server::SendCompress(const void *src, size_t length) noexcept
+{
+    const size_t max_length = uo_compress_bound(length);
+
+    auto w = WritableBuffer<uint8_t>::FromVoid(sock_buff_write(sock, max_length));
+    if (!w.empty()) {
+        /* compress right into the output queue */
+        ssize_t nbytes = uo_compress(w.data, w.size,
+                                     (const unsigned char *)src, length);
+        if (nbytes < 0) {
+            LogFormat(1, "uo_compress() failed\n");
+            Abort();
+            return;
+        }
+
+        sock_buff_append(sock, (size_t)nbytes);
+        CheckCongestion();
+        return;
+    }
+
+    /* larger than a chunk (or the queue is full): compress into a
+       temporary buffer and let sock_buff_send() split it */
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[max_length]);
+    ssize_t nbytes = uo_compress(buffer.get(), max_length,
+                                 (const unsigned char *)src, length);
+    if (nbytes < 0) {
+        LogFormat(1, "uo_compress() failed\n");
+        Abort();
+        return;
+    }
+
+    SendEncoded(buffer.get(), (size_t)nbytes);
+}
+
+void
+UO::Server::SendPacket(const void *src, size_t length) noexcept
+{
+    LogFormat(9, "sending packet to client, length=%u\n", (unsigned)length);
+    log_hexdump(10, src, length);
+
+    thread_stats().CountPacket(PacketDirection::TO_CLIENT, src, length);
+    capture_packet(PacketDirection::TO_CLIENT, capture_id,
+                   src, length);
+
+    if (compression_enabled) {
+        SendCompress(src, length);
+    } else {
+        SendEncoded(src, length);
+    }
+}
+
+bool
+UO::Server::DeferUpdate(ConstBuffer<void> packet) noexcept
+{
+    if (congested) {
+        const uint64_t key = UpdateQueue::GetKey(packet);
+        if (key != 0) {
+            if (updates.Push(key, packet))
+                thread_stats().updates_coalesced.Add(1);
+
+            if (updates.size() > UpdateQueue::MAX_ENTRIES)
+                FlushUpdates();
+            return true;
+        }
+    }
+
+    if (updates.empty() || UpdateQueue::CanOvertake(packet))
+        return false;
+
+    if (*(const uint8_t *)packet.data == PCK_Delete) {
+        /* the object is gone; its pending updates would only
+           resurrect it */
+        const auto *p = (const struct uo_packet_delete *)packet.data;
+        thread_stats().updates_coalesced.Add(updates.Discard(p->serial));
+        return false;
+    }
+
+    /* this packet may refer to the state described by the queued
+       updates: preserve the order */
+    FlushUpdates();
+    return false;
+}
+
+void
+UO::Server::FlushUpdates() noexcept
+{
+    updates.Flush([this](ConstBuffer<void> packet){
+        if (!aborted)
+            SendPacket(packet.data, packet.size);
+    });
+}
+
 inline ssize_t
 UO::Server::ParsePackets(const uint8_t *data, size_t length)
 {
     size_t consumed = 0;
+    PacketBatch batch;
 
     while (length > 0) {
-        size_t packet_length = get_packet_length(protocol_version,
-                                                 data, length);
-        if (packet_length == PACKET_LENGTH_INVALID) {
-            LogFormat(1, "malformed packet from client\n");
-            log_hexdump(5, data, length);
-            Abort();
-            return 0;
+        frame_packets(protocol_version, data, length, batch);
+        if (batch.n == 0) {
+            if (batch.invalid) {
+                LogFormat(1, "malformed packet from client\n");
+                log_hexdump(5, data, length);
+                Abort();
+                return 0;
+            }
+
+            /* incomplete */
+            break;
         }
 
-        LogFormat(9, "from client: 0x%02x length=%u\n",
-            data[0], (unsigned)packet_length);
+        const auto protocol = protocol_version;
 
-        if (packet_length == 0 || packet_length > length)
-            break;
+        for (size_t i = 0; i < batch.n; ++i) {
+            const size_t packet_length = batch.lengths[i];
+
+            LogFormat(9, "from client: 0x%02x length=%u\n",
+                      data[0], (unsigned)packet_length);
+            log_hexdump(10, data, packet_length);
+
+            UOPROXY_TRACE3(packet_from_client, data[0], packet_length, data);
+            thread_stats().CountPacket(PacketDirection::FROM_CLIENT,
+                                       data, packet_length);
+            capture_packet(PacketDirection::FROM_CLIENT, capture_id,
+                           data, packet_length);
 
-        log_hexdump(10, data, packet_length);
+            if (!handler.OnServerPacket(data, packet_length))
+                return -1;
 
-        if (!handler.OnServerPacket(data, packet_length))
-            return -1;
+            consumed += packet_length;
+            data += packet_length;
+            length -= packet_length;
 
-        consumed += packet_length;
-        data += packet_length;
-        length -= packet_length;
+            if (paused)
+                return (ssize_t)consumed;
+
+            if (protocol_version != protocol)
+                /* the packet lengths have changed; frame the rest
+                   again */
+                break;
+        }
     }
 
     return (ssize_t)consumed;
@@ -192,6 +464,26 @@ UO::Server::OnSocketData(const void *data0, size_t length)
     return consumed + (size_t)nbytes;
 }
 
+void
+UO::Server::OnSocketDrained() noexcept
+{
+    assert(congested);
+
+    congested = false;
+
+    if (aborted)
+        return;
+
+    /* this may congest the client again; then the backpressure
+       remains until the next drain */
+    FlushUpdates();
+
+    if (backpressure && !congested && !aborted) {
+        backpressure = false;
+        handler.OnServerCongestion(false);
+    }
+}
+
 void
 UO::Server::OnSocketDisconnect(int error) noexcept
 {
@@ -216,6 +508,56 @@ void uo_server_dispose(UO::Server *server) {
     delete server;
 }
 
+bool
+uo_server_save(UO::Server *server, Serializer &s) noexcept
+{
+    if (!server->aborted)
+        server->FlushUpdates();
+
+    if (server->aborted)
+        return false;
+
+    std::vector<uint8_t> input, output;
+    s.WriteFd(sock_buff_export(server->sock, input, output));
+
+    s.WriteU32(server->seed);
+    s.WriteBool(server->compression_enabled);
+    s.WriteU8(server->protocol_version);
+    encryption_save(server->encryption, s);
+
+    s.WriteBuffer(input.data(), input.size());
+    s.WriteBuffer(output.data(), output.size());
+    return true;
+}
+
+UO::Server *
+uo_server_restore(Deserializer &d, UO::ServerHandler &handler)
+{
+    auto server = std::make_unique<UO::Server>(d.ReadFd(), handler);
+
+    server->seed = d.ReadU32();
+    server->compression_enabled = d.ReadBool();
+
+    const uint8_t protocol = d.ReadU8();
+    if (protocol >= PROTOCOL_COUNT)
+        throw std::runtime_error("malformed protocol version");
+    server->protocol_version = (enum protocol_version)protocol;
+
+    encryption_restore(server->encryption, d);
+
+    if (!sock_buff_import_input(server->sock, d.ReadBuffer()))
+        throw std::runtime_error("input buffer too small");
+
+    /* bypass CheckCongestion(), because the handler is not ready
+       yet; the next packet will check it */
+    const auto output = d.ReadBuffer();
+    if (!output.empty() &&
+        !sock_buff_send(server->sock, output.data, output.size))
+        throw std::runtime_error("output too large");
+
+    return server.release();
+}
+
 uint32_t uo_server_seed(const UO::Server *server) {
     return server->seed;
 }
@@ -224,6 +566,40 @@ void uo_server_set_compression(UO::Server *server, bool comp) {
     server->compression_enabled = comp;
 }
 
+bool uo_server_compression(const UO::Server *server) {
+    return server->compression_enabled;
+}
+
+uint32_t
+uo_server_capture_id(const UO::Server *server) noexcept
+{
+    return server->capture_id;
+}
+
+size_t
+uo_server_output_size(const UO::Server *server) noexcept
+{
+    return sock_buff_output_size(server->sock);
+}
+
+void
+uo_server_cork(UO::Server *server) noexcept
+{
+    sock_buff_cork(server->sock);
+}
+
+void
+uo_server_release_idle(UO::Server *server) noexcept
+{
+    sock_buff_release_idle(server->sock);
+}
+
+size_t
+uo_server_memory_usage(const UO::Server *server) noexcept
+{
+    return sizeof(*server) + sock_buff_memory_usage(server->sock);
+}
+
 void
 uo_server_set_protocol(UO::Server *server,
                        enum protocol_version protocol_version)
@@ -233,6 +609,28 @@ uo_server_set_protocol(UO::Server *server,
     server->protocol_version = protocol_version;
 }
 
+bool
+uo_server_pause(UO::Server *server) noexcept
+{
+    if (server->aborted)
+        return false;
+
+    server->paused = true;
+    sock_buff_pause(server->sock);
+    return true;
+}
+
+void
+uo_server_resume(UO::Server *server) noexcept
+{
+    assert(server->paused);
+    assert(!server->aborted);
+
+    server->paused = false;
+    thread_event_rebind(&server->abort_event);
+    sock_buff_resume(server->sock);
+}
+
 uint32_t uo_server_getsockname(const UO::Server *server)
 {
     return sock_buff_sockname(server->sock);
@@ -243,39 +641,106 @@ uint16_t uo_server_getsockport(const UO::Server *server)
     return sock_buff_port(server->sock);
 }
 
-void uo_server_send(UO::Server *server,
-                    const void *src, size_t length) {
+ConstBuffer<void>
+UO::CompressedPacket::GetCompressed() noexcept
+{
+    if (compressed != nullptr)
+        return {compressed, compressed_length};
+
+    const size_t max_length = uo_compress_bound(length);
+    uint8_t *dest = inline_buffer;
+    if (max_length > sizeof(inline_buffer)) {
+        dest = new uint8_t[max_length];
+        heap_buffer.reset(dest, std::default_delete<uint8_t[]>());
+    }
+
+    ssize_t nbytes = uo_compress(dest, max_length,
+                                 (const unsigned char *)data, length);
+    if (nbytes < 0)
+        return nullptr;
+
+    compressed = dest;
+    compressed_length = (size_t)nbytes;
+    return {compressed, compressed_length};
+}
+
+std::shared_ptr<const void>
+UO::CompressedPacket::GetCompressedOwner() noexcept
+{
+    if (heap_buffer == nullptr && compressed != nullptr &&
+        compressed_length > sizeof(inline_buffer)) {
+        /* passed to the constructor; it lives in the caller's
+           buffer, which we can't reference */
+        auto *p = new uint8_t[compressed_length];
+        std::copy_n(compressed, compressed_length, p);
+        heap_buffer.reset(p, std::default_delete<uint8_t[]>());
+        compressed = p;
+    }
+
+    return heap_buffer;
+}
+
+void uo_server_send(UO::Server *server, UO::CompressedPacket &packet) {
+    const auto raw = packet.GetRaw();
+
     assert(server->sock != nullptr || server->aborted);
-    assert(length > 0);
-    assert(get_packet_length(server->protocol_version, src, length) == length);
+    assert(raw.size > 0);
+    assert(get_packet_length(server->protocol_version, raw.data, raw.size) == raw.size);
 
-    if (server->aborted)
+    if (server->aborted || server->DeferUpdate(raw))
         return;
 
-    LogFormat(9, "sending packet to client, length=%u\n", (unsigned)length);
-    log_hexdump(10, src, length);
+    LogFormat(9, "sending packet to client, length=%u\n", (unsigned)raw.size);
+    log_hexdump(10, raw.data, raw.size);
 
-    if (server->compression_enabled) {
-        auto w = WritableBuffer<uint8_t>::FromVoid(sock_buff_write(server->sock));
-        if (w.empty()) {
-            LogFormat(1, "output buffer full in uo_server_send()\n");
-            server->Abort();
-            return;
-        }
+    thread_stats().CountPacket(PacketDirection::TO_CLIENT,
+                               raw.data, raw.size);
+    capture_packet(PacketDirection::TO_CLIENT, server->capture_id,
+                   raw.data, raw.size);
 
-        ssize_t nbytes = uo_compress(w.data, w.size,
-                                     (const unsigned char *)src, length);
-        if (nbytes < 0) {
+    ConstBuffer<void> src = raw;
+    if (server->compression_enabled) {
+        src = packet.GetCompressed();
+        if (src.IsNull()) {
             LogFormat(1, "uo_compress() failed\n");
             server->Abort();
             return;
         }
 
-        sock_buff_append(server->sock, (size_t)nbytes);
-    } else {
-        if (!sock_buff_send(server->sock, src, length)) {
-            LogFormat(1, "output buffer full in uo_server_send()\n");
-            server->Abort();
+        if (auto owner = packet.GetCompressedOwner()) {
+            /* a large packet: all clients reference the same
+               buffer */
+            server->SendShared(std::move(owner), packet.GetCompressed());
+            return;
         }
     }
+
+    server->SendEncoded(src.data, src.size);
+}
+
+void uo_server_send_stream(UO::Server *server,
+                           std::shared_ptr<const void> owner,
+                           ConstBuffer<void> data) {
+    assert(owner != nullptr);
+
+    if (server->aborted || data.empty())
+        return;
+
+    server->FlushUpdates();
+
+    LogFormat(9, "sending stream to client, length=%zu\n", data.size);
+
+    server->SendShared(std::move(owner), data);
+}
+
+void uo_server_send(UO::Server *server,
+                    const void *src, size_t length) {
+    assert(server->sock != nullptr || server->aborted);
+    assert(length > 0);
+    assert(get_packet_length(server->protocol_version, src, length) == length);
+
+    if (server->aborted || server->DeferUpdate({src, length}))
+        return;
+
+    server->SendPacket(src, length);
 }
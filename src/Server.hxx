@@ -23,13 +23,89 @@
 
 #include "PVersion.hxx"
 
+#include "util/ConstBuffer.hxx"
+
+#include <memory>
+
 #include <stdint.h>
 #include <stddef.h>
 
+class Serializer;
+class Deserializer;
+
 namespace UO {
 
 class Server;
 
+/**
+ * A packet which is sent to several clients.  It gets compressed on
+ * demand, at most once, and the result is shared by all clients
+ * which have compression enabled.  The Huffman stream does not carry
+ * state from one packet to the next, which makes this possible.
+ *
+ * The object does not copy the uncompressed payload (or an already
+ * compressed one); the caller must keep it alive.
+ */
+class CompressedPacket {
+    const void *const data;
+    const size_t length;
+
+    /**
+     * The compressed packet; points to #inline_buffer or #heap_buffer
+     * once compressed, nullptr before that.
+     */
+    const uint8_t *compressed = nullptr;
+    size_t compressed_length = 0;
+
+    /**
+     * Large packets are compressed into this buffer, which is
+     * referenced by the socket buffers of all clients until they
+     * have sent it, instead of being copied.
+     */
+    std::shared_ptr<const uint8_t> heap_buffer;
+
+    uint8_t inline_buffer[512];
+
+public:
+    CompressedPacket(const void *_data, size_t _length) noexcept
+        :data(_data), length(_length) {}
+
+    /**
+     * @param _compressed the packet in compressed form (as received
+     * from the game server), or nullptr to compress it on demand
+     */
+    CompressedPacket(const void *_data, size_t _length,
+                     ConstBuffer<void> _compressed) noexcept
+        :data(_data), length(_length),
+         compressed((const uint8_t *)_compressed.data),
+         compressed_length(_compressed.size) {}
+
+    CompressedPacket(const CompressedPacket &) = delete;
+    CompressedPacket &operator=(const CompressedPacket &) = delete;
+
+    ConstBuffer<void> GetRaw() const noexcept {
+        return {data, length};
+    }
+
+    /**
+     * Returns the compressed packet, compressing it if this has not
+     * been done yet.
+     *
+     * @return the compressed packet or nullptr on error
+     */
+    ConstBuffer<void> GetCompressed() noexcept;
+
+    /**
+     * Returns the owner of the buffer returned by GetCompressed() if
+     * it is shareable, i.e. if the packet was too large for the
+     * inline buffer; nullptr otherwise.  A large packet which was
+     * passed in compressed form is copied once into a shareable
+     * buffer by this method, so call GetCompressed() again
+     * afterwards.
+     */
+    std::shared_ptr<const void> GetCompressedOwner() noexcept;
+};
+
 class ServerHandler {
 public:
     /**
@@ -46,6 +122,16 @@ public:
      * this callback, and the method has to invoke this function.
      */
     virtual void OnServerDisconnect() noexcept = 0;
+
+    /**
+     * The client doesn't read fast enough: its output queue has
+     * exceeded the backpressure watermark despite coalescing updates
+     * (true), or it has drained to the low watermark again (false).
+     * The handler should stop (or resume) producing data for it.
+     */
+    virtual void OnServerCongestion(bool congested) noexcept {
+        (void)congested;
+    }
 };
 
 } // namespace UO
@@ -55,6 +141,25 @@ uo_server_create(int sockfd,
                  UO::ServerHandler &handler);
 void uo_server_dispose(UO::Server *server);
 
+/**
+ * Stop this client and save its state (including the data which has
+ * not been processed or sent yet) for a new process; see
+ * #UpgradeServer.  Coalesced updates are flushed first.  Afterwards,
+ * the object can only be disposed.
+ *
+ * @return false if the client is being aborted; nothing has been
+ * written then
+ */
+bool
+uo_server_save(UO::Server *server, Serializer &s) noexcept;
+
+/**
+ * Continue a client which has been saved with uo_server_save() by
+ * the previous process.
+ */
+UO::Server *
+uo_server_restore(Deserializer &d, UO::ServerHandler &handler);
+
 uint32_t uo_server_seed(const UO::Server *server);
 
 void
@@ -63,9 +168,78 @@ uo_server_set_protocol(UO::Server *server,
 
 void uo_server_set_compression(UO::Server *server, bool compression);
 
+bool uo_server_compression(const UO::Server *server);
+
+/**
+ * @return the connection id in capture records
+ */
+uint32_t
+uo_server_capture_id(const UO::Server *server) noexcept;
+
+/**
+ * @return the number of bytes queued for sending to the client
+ */
+size_t
+uo_server_output_size(const UO::Server *server) noexcept;
+
+/**
+ * Cork the socket until everything queued has been sent (see
+ * sock_buff_cork()).
+ */
+void
+uo_server_cork(UO::Server *server) noexcept;
+
+/**
+ * Free the input buffer if nothing has been received since the last
+ * call (see sock_buff_release_idle()).
+ */
+void
+uo_server_release_idle(UO::Server *server) noexcept;
+
+/**
+ * @return the number of bytes allocated for this object and its
+ * buffers
+ */
+size_t
+uo_server_memory_usage(const UO::Server *server) noexcept;
+
+/**
+ * Stop receiving and parsing packets, so the object can be handed
+ * over to another thread.  May be called from within
+ * ServerHandler::OnServerPacket(); the current packet is consumed,
+ * and the following ones are left in the input buffer.
+ *
+ * @return false if the server is being aborted and cannot be paused
+ */
+bool uo_server_pause(UO::Server *server) noexcept;
+
+/**
+ * Resume after uo_server_pause() in the calling thread's event
+ * loop.
+ */
+void uo_server_resume(UO::Server *server) noexcept;
+
 void uo_server_send(UO::Server *server,
                     const void *src, size_t length);
 
+/**
+ * Like uo_server_send(), but let the #CompressedPacket do the
+ * compression, to share the result with other clients.
+ */
+void uo_server_send(UO::Server *server, UO::CompressedPacket &packet);
+
+/**
+ * Send a sequence of packets which has been encoded already, i.e.
+ * compressed with uo_compress_batch() if uo_server_compression() is
+ * enabled.  The socket buffer references the data instead of copying
+ * it, and packets sent later are queued behind it.
+ *
+ * @param owner keeps #data alive until it has been sent
+ */
+void uo_server_send_stream(UO::Server *server,
+                           std::shared_ptr<const void> owner,
+                           ConstBuffer<void> data);
+
 
 /** @return ip address, in network byte order, of our uo server socket
             (= connection to client) */
@@ -0,0 +1,139 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __UOPROXY_SLAB_ALLOCATOR_H
+#define __UOPROXY_SLAB_ALLOCATOR_H
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <stddef.h>
+
+/**
+ * A simple allocator for objects of one type.  Memory is obtained
+ * in slabs of #SLAB_OBJECTS objects, and freed objects are kept in a
+ * free list for reuse; slabs are only returned to the system by
+ * Clear() and by the destructor.  This avoids heap fragmentation
+ * from many small objects with a high turnover.
+ */
+template<typename T>
+class SlabAllocator {
+    static constexpr size_t SLAB_OBJECTS = 256;
+
+    union Slot {
+        Slot *next_free;
+        alignas(T) unsigned char value[sizeof(T)];
+    };
+
+    struct Slab {
+        Slab *next;
+        Slot slots[SLAB_OBJECTS];
+    };
+
+    /**
+     * A linked list of all slabs; only the first one may have
+     * unused slots at its end.
+     */
+    Slab *slabs = nullptr;
+
+    /**
+     * The number of slots of the first slab which have been handed
+     * out at least once.
+     */
+    size_t n_used = SLAB_OBJECTS;
+
+    size_t n_slabs = 0;
+
+    Slot *free_list = nullptr;
+
+public:
+    SlabAllocator() = default;
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    ~SlabAllocator() noexcept {
+        FreeSlabs();
+    }
+
+    template<typename... Args>
+    T *New(Args&&... args) noexcept {
+        return new(Allocate()) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * The number of bytes allocated for slabs.
+     */
+    size_t GetMemoryUsage() const noexcept {
+        return n_slabs * sizeof(Slab);
+    }
+
+    void Delete(T *t) noexcept {
+        t->~T();
+
+        Slot *slot = reinterpret_cast<Slot *>(t);
+        slot->next_free = free_list;
+        free_list = slot;
+    }
+
+    /**
+     * Release all objects at once, without invoking their
+     * destructors.  This is only allowed for trivially destructible
+     * types.
+     */
+    void Clear() noexcept {
+        static_assert(std::is_trivially_destructible<T>::value);
+
+        FreeSlabs();
+    }
+
+private:
+    void *Allocate() noexcept {
+        if (free_list != nullptr) {
+            Slot *slot = free_list;
+            free_list = slot->next_free;
+            return slot;
+        }
+
+        if (n_used == SLAB_OBJECTS) {
+            Slab *slab = static_cast<Slab *>(::operator new(sizeof(Slab)));
+            slab->next = slabs;
+            slabs = slab;
+            ++n_slabs;
+            n_used = 0;
+        }
+
+        return &slabs->slots[n_used++];
+    }
+
+    void FreeSlabs() noexcept {
+        while (slabs != nullptr) {
+            Slab *slab = slabs;
+            slabs = slab->next;
+            ::operator delete(slab);
+        }
+
+        n_used = SLAB_OBJECTS;
+        n_slabs = 0;
+        free_list = nullptr;
+    }
+};
+
+#endif
@@ -20,33 +20,235 @@
 
 #include "SocketBuffer.hxx"
 #include "BufferedIO.hxx"
+#include "ChunkPool.hxx"
 #include "Flush.hxx"
 #include "Log.hxx"
+#include "Trace.hxx"
+#include "SocketUtil.hxx"
 #include "util/DynamicFifoBuffer.hxx"
+#include "util/WritableBuffer.hxx"
+#include "EventBase.hxx"
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+#include "Uring.hxx"
+#endif
 
 #include <event.h>
 
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <vector>
+
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <netdb.h>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/**
+ * One piece of the output queue: either a #Chunk from the pool which
+ * was filled by sock_buff_write() and sock_buff_send(), or a
+ * reference to a shared buffer queued by sock_buff_send_shared().
+ */
+struct OutputSegment {
+    /**
+     * The pooled chunk owned by this segment, or nullptr if this is
+     * a shared buffer.
+     */
+    Chunk *chunk;
+
+    std::shared_ptr<const void> owner;
+
+    /**
+     * The data which has not been sent yet.
+     */
+    ConstBuffer<uint8_t> data;
+
+    /**
+     * How many bytes may still be appended to this chunk?
+     */
+    size_t GetTailRoom() const noexcept {
+        assert(chunk != nullptr);
+
+        return std::end(chunk->data) - data.end();
+    }
+};
+
 struct SocketBuffer final : PendingFlush {
     const int fd;
 
     struct event recv_event, send_event;
 
-    DynamicFifoBuffer<uint8_t> input, output;
+    /**
+     * A zero timer scheduled by sock_buff_continue_input(); it hands
+     * the remaining input to the handler in the next event loop
+     * iteration.
+     */
+    struct event continue_event;
+
+    /**
+     * The input buffer.  It is freed by sock_buff_release_idle() and
+     * allocated again (with #input_max bytes) when data arrives.
+     */
+    DynamicFifoBuffer<uint8_t> input;
+
+    const size_t input_max;
+
+    /**
+     * The output queue.  It grows on demand, one #Chunk at a time,
+     * and shrinks as data gets sent.
+     */
+    std::deque<OutputSegment> output;
+
+    /**
+     * The total size of #output.
+     */
+    size_t output_size = 0;
+
+    /**
+     * Refuse to queue more than this number of bytes.
+     */
+    const size_t output_max;
+
+    /**
+     * The maximum number of buffers passed to one sendmsg() call.
+     */
+    static constexpr size_t MAX_IOV = 64;
 
     SocketBufferHandler &handler;
 
-    SocketBuffer(int _fd, size_t input_max,
+    /**
+     * Call SocketBufferHandler::OnSocketDrained() as soon as the
+     * output size is at or below this value; only valid if
+     * #want_drain is set.
+     */
+    size_t drain_threshold;
+
+    /**
+     * Has sock_buff_request_drain() been called?
+     */
+    bool want_drain = false;
+
+    /**
+     * Has sock_buff_resume() left unconsumed input for the recv
+     * callback?
+     */
+    bool resubmit = false;
+
+    /**
+     * Has sock_buff_suspend_input() been called?
+     */
+    bool input_suspended = false;
+
+    /**
+     * Between sock_buff_pause() and sock_buff_resume().
+     */
+    bool paused = false;
+
+    /**
+     * Has data been received since the last sock_buff_release_idle()
+     * call?
+     */
+    bool input_received = false;
+
+    /**
+     * Has sock_buff_cork() set TCP_CORK?  It is removed as soon as
+     * the output queue is empty.
+     */
+    bool corked = false;
+
+#ifdef HAVE_IO_URING
+    /**
+     * The calling thread's ring, or nullptr if this socket uses
+     * libevent.
+     */
+    Uring *uring = nullptr;
+
+    struct RecvOperation final : UringOperation {
+        SocketBuffer &sb;
+
+        explicit RecvOperation(SocketBuffer &_sb) noexcept:sb(_sb) {}
+
+        void OnUringCompletion(int res, unsigned flags) noexcept override;
+    };
+
+    struct SendOperation final : UringOperation {
+        SocketBuffer &sb;
+
+        explicit SendOperation(SocketBuffer &_sb) noexcept:sb(_sb) {}
+
+        void OnUringCompletion(int res, unsigned flags) noexcept override;
+    };
+
+    /**
+     * The multishot receive into the ring's provided buffers.
+     */
+    RecvOperation recv_operation{*this};
+
+    SendOperation send_operation{*this};
+
+    /**
+     * Received data which did not fit into #input.  The multishot
+     * receive is cancelled as soon as #input is full, so this holds
+     * only what was in flight at that time.
+     */
+    std::vector<uint8_t> input_overflow;
+
+    /**
+     * The vector of the send in flight; the kernel may read it until
+     * the operation completes.
+     */
+    struct iovec send_iov[MAX_IOV];
+    struct msghdr send_msg;
+
+    bool recv_armed = false, recv_cancelled = false;
+    bool send_in_flight = false;
+
+    /**
+     * Cleared if the kernel does not support multishot receives;
+     * then libevent is used for reading.
+     */
+    bool uring_recv = true;
+
+    /**
+     * Is sock_buff_pause() waiting for the outstanding operations?
+     * Their completions must not invoke the handler.
+     */
+    bool pausing = false;
+
+    /**
+     * Has sock_buff_dispose() been called while operations were
+     * still in flight?  The object deletes itself after the last
+     * one has completed.
+     */
+    bool disposed = false;
+#endif
+
+    SocketBuffer(int _fd, size_t _input_max,
                  size_t output_max,
                  SocketBufferHandler &_handler);
     ~SocketBuffer() noexcept;
 
     using PendingFlush::ScheduleFlush;
+    using PendingFlush::CancelFlush;
+    using PendingFlush::RebindFlush;
 
     /**
      * @return false on error or if nothing was consumed
@@ -61,6 +263,132 @@ struct SocketBuffer final : PendingFlush {
      */
     bool FlushOutput();
 
+    void AllocateInput() noexcept {
+        if (input.IsNull())
+            input.Allocate(input_max);
+    }
+
+    bool IsOutputEmpty() const noexcept {
+        return output_size == 0;
+    }
+
+    void Uncork() noexcept {
+        if (corked) {
+            corked = false;
+            socket_set_cork(fd, 0);
+        }
+    }
+
+    void ClearOutput() noexcept {
+        while (!output.empty())
+            PopOutput();
+        output_size = 0;
+    }
+
+    bool UsesUring() const noexcept {
+#ifdef HAVE_IO_URING
+        return uring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Shall we read more from the socket, i.e. is there room in the
+     * input buffer and did nobody suspend input?
+     */
+    bool WantRead() const noexcept {
+#ifdef HAVE_IO_URING
+        if (!input_overflow.empty())
+            return false;
+#endif
+        return !paused && !input_suspended &&
+            (input.IsNull() || !input.IsFull());
+    }
+
+    /**
+     * The heap memory owned by this object.
+     */
+    size_t GetMemoryUsage() const noexcept;
+
+    /**
+     * Start or stop reading, depending on WantRead().
+     */
+    void UpdateRead() noexcept;
+
+#ifdef HAVE_IO_URING
+    void UringBind() noexcept;
+    void UringPause() noexcept;
+
+    /**
+     * sock_buff_dispose() while operations are in flight: cancel
+     * them, and delete this object when they have completed.
+     */
+    void UringOrphan() noexcept;
+
+    /**
+     * Move data from #input_overflow to #input.
+     */
+    void MoveOverflow() noexcept;
+
+    void CheckUringDrain() noexcept;
+#endif
+
+    WritableBuffer<uint8_t> Write(size_t min_length) noexcept;
+    void Append(size_t length) noexcept;
+    bool Send(const uint8_t *data, size_t length) noexcept;
+    bool SendShared(std::shared_ptr<const void> owner,
+                    ConstBuffer<uint8_t> data) noexcept;
+
+private:
+    void OutputQueued() noexcept {
+        if (!UsesUring())
+            event_add(&send_event, nullptr);
+        ScheduleFlush();
+    }
+
+#ifndef _WIN32
+    /**
+     * Fill the I/O vector with the output queue.
+     *
+     * @param flags receives MSG_MORE if not all of the queue fits
+     * into the vector, so the kernel may hold back the last partial
+     * frame until the next send
+     * @return the number of buffers
+     */
+    size_t FillIovec(struct iovec *v, int &flags) const noexcept;
+#endif
+
+#ifdef HAVE_IO_URING
+    /**
+     * Append received data to #input, and what does not fit to
+     * #input_overflow.
+     */
+    void ReceiveUring(ConstBuffer<uint8_t> src) noexcept;
+
+    void ArmUringRecv() noexcept;
+    void SendUring() noexcept;
+
+    /**
+     * Delete the object if it was orphaned and this was its last
+     * operation.
+     *
+     * @return true if the object was orphaned (and may be gone)
+     */
+    bool CheckOrphan() noexcept;
+
+    void OnUringRecv(int res, unsigned flags) noexcept;
+    void OnUringSend(int res, unsigned flags) noexcept;
+#endif
+
+    void PopOutput() noexcept;
+
+    /**
+     * Remove the specified number of bytes from the front of
+     * #output.
+     */
+    void ConsumeOutput(size_t nbytes) noexcept;
+
 protected:
     /* virtual methods from PendingFlush */
     void DoFlush() noexcept override;
@@ -73,8 +401,6 @@ SocketBuffer::SubmitData()
     if (r.empty())
         return true;
 
-    const ScopeLockFlush lock_flush;
-
     ssize_t nbytes = handler.OnSocketData(r.data, r.size);
     if (nbytes == 0)
         return false;
@@ -83,29 +409,479 @@ SocketBuffer::SubmitData()
     return true;
 }
 
+inline void
+SocketBuffer::PopOutput() noexcept
+{
+    auto &segment = output.front();
+    if (segment.chunk != nullptr)
+        thread_chunk_pool().Put(segment.chunk);
+
+    output.pop_front();
+}
+
+inline void
+SocketBuffer::ConsumeOutput(size_t nbytes) noexcept
+{
+    assert(nbytes <= output_size);
+
+    output_size -= nbytes;
+
+    while (!output.empty()) {
+        auto &segment = output.front();
+        if (nbytes < segment.data.size) {
+            segment.data.skip_front(nbytes);
+            break;
+        }
+
+        nbytes -= segment.data.size;
+        PopOutput();
+    }
+
+    if (output_size == 0)
+        /* the burst is complete: push out the last partial frame */
+        Uncork();
+}
+
+#ifndef _WIN32
+
+size_t
+SocketBuffer::FillIovec(struct iovec *v, int &flags) const noexcept
+{
+    size_t n = 0;
+
+    flags = 0;
+
+    for (const auto &i : output) {
+        if (i.data.empty())
+            continue;
+
+        if (n == MAX_IOV) {
+            flags = MSG_MORE;
+            break;
+        }
+
+        v[n].iov_base = const_cast<uint8_t *>(i.data.data);
+        v[n].iov_len = i.data.size;
+        ++n;
+    }
+
+    return n;
+}
+
+#endif
+
 bool
 SocketBuffer::FlushOutput()
 {
-    ssize_t nbytes = write_from_buffer(fd, output);
-    if (nbytes == -2)
+    if (IsOutputEmpty()) {
+        /* release chunks which were allocated by sock_buff_write()
+           but never filled */
+        ClearOutput();
         return true;
+    }
+
+#ifdef _WIN32
+    /* no scatter/gather; send the segments one by one */
+    const auto &segment = output.front();
+    ssize_t nbytes = send(fd, (const char *)segment.data.data,
+                          segment.data.size, 0);
+#else
+    struct iovec v[MAX_IOV];
 
+    struct msghdr msg{};
+    int flags;
+    msg.msg_iov = v;
+    msg.msg_iovlen = FillIovec(v, flags);
+
+    ssize_t nbytes = sendmsg(fd, &msg, MSG_DONTWAIT|flags);
+#endif
     if (nbytes < 0)
-        return false;
+        return errno == EAGAIN;
 
+    UOPROXY_TRACE2(socket_flush, fd, nbytes);
+    ConsumeOutput((size_t)nbytes);
     return true;
 }
 
 void
 SocketBuffer::DoFlush() noexcept
 {
+#ifdef HAVE_IO_URING
+    if (uring != nullptr) {
+        /* the completion of a send in flight submits the rest */
+        if (!send_in_flight && !disposed)
+            SendUring();
+        return;
+    }
+#endif
+
     if (!FlushOutput())
         return;
 
-    if (output.empty())
+    if (IsOutputEmpty() && !want_drain)
         event_del(&send_event);
 }
 
+void
+SocketBuffer::UpdateRead() noexcept
+{
+#ifdef HAVE_IO_URING
+    if (!input_overflow.empty() && !paused && !input_suspended &&
+        (input.IsNull() || !input.IsFull()))
+        /* move the overflow to the input buffer in the next
+           iteration */
+        sock_buff_continue_input(this);
+
+    if (uring != nullptr && uring_recv) {
+        if (WantRead()) {
+            if (!recv_armed)
+                ArmUringRecv();
+        } else if (recv_armed && !recv_cancelled) {
+            /* don't let the kernel fill the shared buffers with
+               data we can't take */
+            recv_cancelled = true;
+            uring->CancelOperation(recv_operation);
+        }
+
+        return;
+    }
+#endif
+
+    if (WantRead())
+        event_add(&recv_event, nullptr);
+    else
+        event_del(&recv_event);
+}
+
+WritableBuffer<uint8_t>
+SocketBuffer::Write(size_t min_length) noexcept
+{
+    if (min_length > Chunk::SIZE || min_length > output_max - output_size)
+        return nullptr;
+
+    if (output.empty() || output.back().chunk == nullptr ||
+        output.back().GetTailRoom() < std::max<size_t>(min_length, 1)) {
+        Chunk *chunk = thread_chunk_pool().Get();
+        output.push_back({chunk, nullptr, {chunk->data, size_t(0)}});
+    }
+
+    const auto &tail = output.back();
+    uint8_t *p = tail.chunk->data + (tail.data.end() - tail.chunk->data);
+    return {p, std::min(tail.GetTailRoom(), output_max - output_size)};
+}
+
+void
+SocketBuffer::Append(size_t length) noexcept
+{
+    assert(!output.empty());
+
+    auto &tail = output.back();
+    assert(tail.chunk != nullptr);
+    assert(length <= tail.GetTailRoom());
+
+    tail.data.size += length;
+    output_size += length;
+
+    OutputQueued();
+}
+
+bool
+SocketBuffer::Send(const uint8_t *data, size_t length) noexcept
+{
+    if (length > output_max - output_size)
+        return false;
+
+    while (length > 0) {
+        auto w = Write(1);
+        assert(!w.empty());
+
+        const size_t n = std::min(w.size, length);
+        std::copy_n(data, n, w.data);
+        Append(n);
+
+        data += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+bool
+SocketBuffer::SendShared(std::shared_ptr<const void> owner,
+                         ConstBuffer<uint8_t> data) noexcept
+{
+    if (data.size > output_max - output_size)
+        return false;
+
+    output.push_back({nullptr, std::move(owner), data});
+    output_size += data.size;
+
+    OutputQueued();
+    return true;
+}
+
+
+#ifdef HAVE_IO_URING
+
+/*
+ * io_uring
+ *
+ */
+
+void
+SocketBuffer::UringBind() noexcept
+{
+    assert(uring == nullptr);
+
+    uring = thread_uring();
+    if (uring != nullptr)
+        uring->AddUser();
+}
+
+void
+SocketBuffer::ArmUringRecv() noexcept
+{
+    assert(!recv_armed);
+
+    auto &sqe = uring->Prepare(&recv_operation);
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = Uring::BUFFER_GROUP;
+
+    recv_armed = true;
+    recv_cancelled = false;
+}
+
+void
+SocketBuffer::SendUring() noexcept
+{
+    assert(!send_in_flight);
+
+    if (IsOutputEmpty()) {
+        ClearOutput();
+        return;
+    }
+
+    send_msg = {};
+    int flags;
+    send_msg.msg_iov = send_iov;
+    send_msg.msg_iovlen = FillIovec(send_iov, flags);
+
+    auto &sqe = uring->Prepare(&send_operation);
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = fd;
+    sqe.addr = (uintptr_t)&send_msg;
+    sqe.len = 1;
+    sqe.msg_flags = flags;
+
+    send_in_flight = true;
+}
+
+void
+SocketBuffer::ReceiveUring(ConstBuffer<uint8_t> src) noexcept
+{
+    AllocateInput();
+
+    /* keep the order: nothing goes to the input buffer while there
+       is an overflow */
+    while (!src.empty() && input_overflow.empty()) {
+        auto w = input.Write();
+        if (w.empty())
+            break;
+
+        const size_t n = std::min(w.size, src.size);
+        std::copy_n(src.data, n, w.data);
+        input.Append(n);
+        src.skip_front(n);
+    }
+
+    input_overflow.insert(input_overflow.end(), src.begin(), src.end());
+}
+
+void
+SocketBuffer::MoveOverflow() noexcept
+{
+    if (input_overflow.empty())
+        return;
+
+    AllocateInput();
+
+    size_t n = 0;
+    while (n < input_overflow.size()) {
+        auto w = input.Write();
+        if (w.empty())
+            break;
+
+        const size_t m = std::min(w.size, input_overflow.size() - n);
+        std::copy_n(input_overflow.data() + n, m, w.data);
+        input.Append(m);
+        n += m;
+    }
+
+    input_overflow.erase(input_overflow.begin(), input_overflow.begin() + n);
+}
+
+void
+SocketBuffer::CheckUringDrain() noexcept
+{
+    if (want_drain && !send_in_flight && output_size <= drain_threshold)
+        /* sock_buff_send_callback() calls the handler */
+        event_active(&send_event, EV_WRITE, 0);
+}
+
+inline bool
+SocketBuffer::CheckOrphan() noexcept
+{
+    if (!disposed)
+        return false;
+
+    if (!recv_armed && !send_in_flight)
+        delete this;
+
+    return true;
+}
+
+void
+SocketBuffer::OnUringRecv(int res, unsigned flags) noexcept
+{
+    if ((flags & IORING_CQE_F_MORE) == 0)
+        recv_armed = false;
+
+    if (res > 0) {
+        assert(flags & IORING_CQE_F_BUFFER);
+
+        UOPROXY_TRACE2(socket_read, fd, res);
+        input_received = true;
+
+        const unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        ReceiveUring(uring->GetBuffer(bid, res));
+        uring->RecycleBuffer(bid);
+    }
+
+    if (CheckOrphan() || pausing)
+        return;
+
+    if (res > 0) {
+        if (!input_suspended) {
+            /* the input left over by the handler is submitted
+               along with the new data */
+            evtimer_del(&continue_event);
+
+            if (!SubmitData())
+                return;
+        }
+    } else if (res == 0) {
+        handler.OnSocketDisconnect(0);
+        return;
+    } else if (res == -EINVAL && (flags & IORING_CQE_F_MORE) == 0 &&
+               !recv_cancelled) {
+        /* multishot receive requires Linux 6.0 */
+        LogFormat(2, "io_uring multishot receive not supported; using libevent\n");
+        uring_recv = false;
+    } else if (res != -ECANCELED && res != -ENOBUFS) {
+        /* ENOBUFS: all provided buffers are in use; arm again
+           below, after the others have been recycled */
+        handler.OnSocketDisconnect(-res);
+        return;
+    }
+
+    UpdateRead();
+}
+
+void
+SocketBuffer::OnUringSend(int res, unsigned) noexcept
+{
+    assert(send_in_flight);
+    send_in_flight = false;
+
+    if (res > 0) {
+        UOPROXY_TRACE2(socket_flush, fd, res);
+        ConsumeOutput((size_t)res);
+    }
+
+    if (CheckOrphan() || pausing)
+        return;
+
+    if (res < 0) {
+        handler.OnSocketDisconnect(-res);
+        return;
+    }
+
+    if (!IsOutputEmpty())
+        /* submit the rest after this event loop iteration */
+        ScheduleFlush();
+
+    if (want_drain && output_size <= drain_threshold) {
+        want_drain = false;
+        handler.OnSocketDrained();
+    }
+}
+
+void
+SocketBuffer::RecvOperation::OnUringCompletion(int res, unsigned flags) noexcept
+{
+    sb.OnUringRecv(res, flags);
+}
+
+void
+SocketBuffer::SendOperation::OnUringCompletion(int res, unsigned flags) noexcept
+{
+    sb.OnUringSend(res, flags);
+}
+
+void
+SocketBuffer::UringPause() noexcept
+{
+    assert(uring != nullptr);
+
+    pausing = true;
+
+    if (recv_armed && !recv_cancelled) {
+        recv_cancelled = true;
+        uring->CancelOperation(recv_operation);
+    }
+
+    if (send_in_flight)
+        uring->CancelOperation(send_operation);
+
+    while (recv_armed || send_in_flight)
+        uring->WaitOne(recv_operation, send_operation);
+
+    pausing = false;
+
+    MoveOverflow();
+
+    uring->RemoveUser();
+    uring = nullptr;
+}
+
+void
+SocketBuffer::UringOrphan() noexcept
+{
+    assert(uring != nullptr);
+    assert(recv_armed || send_in_flight);
+
+    disposed = true;
+
+    event_del(&recv_event);
+    event_del(&send_event);
+    evtimer_del(&continue_event);
+    CancelFlush();
+
+    if (recv_armed && !recv_cancelled) {
+        recv_cancelled = true;
+        uring->CancelOperation(recv_operation);
+    }
+
+    /* what's left after the cancelled send is written by the
+       destructor */
+    if (send_in_flight)
+        uring->CancelOperation(send_operation);
+}
+
+#endif
 
 /*
  * libevent callback function
@@ -121,8 +897,25 @@ sock_buff_recv_callback(int fd, short event, void *ctx)
 
     assert(fd == sb->fd);
 
+    /* the input left over by the handler is submitted below along
+       with the new data */
+    evtimer_del(&sb->continue_event);
+
+    if (sb->resubmit) {
+        /* activated by sock_buff_resume(): handle the input which
+           was left over before reading more */
+        sb->resubmit = false;
+        if (sb->SubmitData())
+            sb->UpdateRead();
+        return;
+    }
+
+    sb->AllocateInput();
+
     ssize_t nbytes = read_to_buffer(fd, sb->input, 65536);
     if (nbytes > 0) {
+        UOPROXY_TRACE2(socket_read, fd, nbytes);
+        sb->input_received = true;
         if (!sb->SubmitData())
             return;
     } else if (nbytes == 0) {
@@ -137,6 +930,23 @@ sock_buff_recv_callback(int fd, short event, void *ctx)
         event_del(&sb->recv_event);
 }
 
+static void
+sock_buff_continue_callback(int, short, void *ctx)
+{
+    auto sb = (SocketBuffer *)ctx;
+
+#ifdef HAVE_IO_URING
+    sb->MoveOverflow();
+#endif
+
+    if (!sb->SubmitData())
+        return;
+
+    /* the recv callback may have stopped reading because the input
+       buffer was full */
+    sb->UpdateRead();
+}
+
 static void
 sock_buff_send_callback(int fd, short event, void *ctx)
 {
@@ -147,12 +957,18 @@ sock_buff_send_callback(int fd, short event, void *ctx)
 
     assert(fd == sb->fd);
 
-    if (!sb->FlushOutput()) {
+    /* with io_uring, this is only activated by CheckUringDrain() */
+    if (!sb->UsesUring() && !sb->FlushOutput()) {
         sb->handler.OnSocketDisconnect(errno);
         return;
     }
 
-    if (sb->output.empty())
+    if (sb->want_drain && sb->output_size <= sb->drain_threshold) {
+        sb->want_drain = false;
+        sb->handler.OnSocketDrained();
+    }
+
+    if (sb->IsOutputEmpty() && !sb->want_drain)
         event_del(&sb->send_event);
 }
 
@@ -163,32 +979,239 @@ sock_buff_send_callback(int fd, short event, void *ctx)
  */
 
 WritableBuffer<void>
-sock_buff_write(SocketBuffer *sb) noexcept
+sock_buff_write(SocketBuffer *sb, size_t min_length) noexcept
 {
-    return sb->output.Write().ToVoid();
+    return sb->Write(min_length).ToVoid();
 }
 
 void
 sock_buff_append(SocketBuffer *sb, size_t length)
 {
-    sb->output.Append(length);
+    sb->Append(length);
+}
+
+bool
+sock_buff_send(SocketBuffer *sb, const void *data, size_t length)
+{
+    return sb->Send((const uint8_t *)data, length);
+}
+
+bool
+sock_buff_send_shared(SocketBuffer *sb, std::shared_ptr<const void> owner,
+                      ConstBuffer<void> data) noexcept
+{
+    assert(owner != nullptr);
+    assert(!data.empty());
+
+    return sb->SendShared(std::move(owner),
+                          ConstBuffer<uint8_t>::FromVoid(data));
+}
+
+size_t
+sock_buff_output_size(const SocketBuffer *sb) noexcept
+{
+    return sb->output_size;
+}
+
+void
+sock_buff_request_drain(SocketBuffer *sb, size_t threshold) noexcept
+{
+    sb->want_drain = true;
+    sb->drain_threshold = threshold;
+
+#ifdef HAVE_IO_URING
+    if (sb->uring != nullptr) {
+        sb->CheckUringDrain();
+        return;
+    }
+#endif
 
     event_add(&sb->send_event, nullptr);
-    sb->ScheduleFlush();
+}
+
+void
+sock_buff_cork(SocketBuffer *sb) noexcept
+{
+    if (!sb->corked && socket_set_cork(sb->fd, 1) == 0)
+        sb->corked = true;
+}
+
+void
+sock_buff_continue_input(SocketBuffer *sb) noexcept
+{
+    if (sb->input_suspended)
+        /* sock_buff_resume_input() will do it */
+        return;
+
+    static constexpr struct timeval tv{0, 0};
+    evtimer_add(&sb->continue_event, &tv);
+}
+
+void
+sock_buff_suspend_input(SocketBuffer *sb) noexcept
+{
+    if (sb->input_suspended)
+        return;
+
+    sb->input_suspended = true;
+    sb->UpdateRead();
+    evtimer_del(&sb->continue_event);
+}
+
+void
+sock_buff_resume_input(SocketBuffer *sb) noexcept
+{
+    if (!sb->input_suspended)
+        return;
+
+    sb->input_suspended = false;
+    sb->UpdateRead();
+
+    if (!sb->input.empty())
+        /* there may be complete packets which were left over */
+        sock_buff_continue_input(sb);
+}
+
+void
+sock_buff_pause(SocketBuffer *sb) noexcept
+{
+    sb->paused = true;
+
+    event_del(&sb->recv_event);
+    event_del(&sb->send_event);
+    evtimer_del(&sb->continue_event);
+
+#ifdef HAVE_IO_URING
+    /* the other thread has another ring */
+    if (sb->uring != nullptr)
+        sb->UringPause();
+#endif
+
+    /* don't leave this object in the calling thread's flush list */
+    if (!sb->IsOutputEmpty()) {
+        sb->CancelFlush();
+        sb->FlushOutput();
+    }
+}
+
+void
+sock_buff_resume(SocketBuffer *sb) noexcept
+{
+    thread_event_rebind(&sb->recv_event);
+    thread_event_rebind(&sb->send_event);
+    thread_event_rebind(&sb->continue_event);
+    sb->RebindFlush();
+    sb->paused = false;
+
+#ifdef HAVE_IO_URING
+    sb->UringBind();
+#endif
+
+    sb->UpdateRead();
+
+    if (sb->UsesUring()) {
+        if (!sb->IsOutputEmpty())
+            sb->ScheduleFlush();
+#ifdef HAVE_IO_URING
+        sb->CheckUringDrain();
+#endif
+    } else if (!sb->IsOutputEmpty() || sb->want_drain)
+        event_add(&sb->send_event, nullptr);
+
+    if (!sb->input.empty()) {
+        sb->resubmit = true;
+        event_active(&sb->recv_event, EV_READ, 0);
+    }
+}
+
+int
+sock_buff_export(SocketBuffer *sb, std::vector<uint8_t> &input,
+                 std::vector<uint8_t> &output) noexcept
+{
+    sock_buff_pause(sb);
+
+    const auto r = sb->input.Read();
+    input.assign(r.begin(), r.end());
+    sb->input.Clear();
+
+#ifdef HAVE_IO_URING
+    input.insert(input.end(),
+                 sb->input_overflow.begin(), sb->input_overflow.end());
+    sb->input_overflow.clear();
+#endif
+
+    output.clear();
+    output.reserve(sb->output_size);
+    for (const auto &i : sb->output)
+        output.insert(output.end(), i.data.begin(), i.data.end());
+    sb->ClearOutput();
+    sb->Uncork();
+
+    sb->want_drain = false;
+
+    return sb->fd;
 }
 
 bool
-sock_buff_send(SocketBuffer *sb, const void *data, size_t length)
+sock_buff_import_input(SocketBuffer *sb, ConstBuffer<void> data) noexcept
 {
-    auto w = sock_buff_write(sb);
-    if (length > w.size)
+    if (data.empty())
+        return true;
+
+    sb->AllocateInput();
+
+    auto w = sb->input.Write();
+    if (w.size < data.size)
         return false;
 
-    memcpy(w.data, data, length);
-    sock_buff_append(sb, length);
+    memcpy(w.data, data.data, data.size);
+    sb->input.Append(data.size);
+
+    sock_buff_continue_input(sb);
     return true;
 }
 
+bool
+sock_buff_release_idle(SocketBuffer *sb) noexcept
+{
+    if (std::exchange(sb->input_received, false))
+        return false;
+
+#ifdef HAVE_IO_URING
+    if (!sb->input_overflow.empty())
+        return false;
+
+    sb->input_overflow.shrink_to_fit();
+#endif
+
+    if (sb->input.IsDefined() && sb->input.empty())
+        sb->input.Free();
+
+    return true;
+}
+
+inline size_t
+SocketBuffer::GetMemoryUsage() const noexcept
+{
+    size_t result = input.GetCapacity();
+
+    for (const auto &i : output)
+        if (i.chunk != nullptr)
+            result += sizeof(*i.chunk);
+
+#ifdef HAVE_IO_URING
+    result += input_overflow.capacity();
+#endif
+
+    return result;
+}
+
+size_t
+sock_buff_memory_usage(const SocketBuffer *sb) noexcept
+{
+    return sizeof(*sb) + sb->GetMemoryUsage();
+}
+
 uint32_t sock_buff_sockname(const SocketBuffer *sb)
 {
     struct sockaddr_in addr;
@@ -219,20 +1242,26 @@ uint16_t sock_buff_port(const SocketBuffer *sb)
  */
 
 inline
-SocketBuffer::SocketBuffer(int _fd, size_t input_max,
-                           size_t output_max,
+SocketBuffer::SocketBuffer(int _fd, size_t _input_max,
+                           size_t _output_max,
                            SocketBufferHandler &_handler)
     :fd(_fd),
-     input(input_max),
-     output(output_max),
+     input(_input_max),
+     input_max(_input_max),
+     output_max(_output_max),
      handler(_handler)
 {
-    event_set(&recv_event, fd, EV_READ|EV_PERSIST,
-              sock_buff_recv_callback, this);
-    event_set(&send_event, fd, EV_WRITE|EV_PERSIST,
-              sock_buff_send_callback, this);
+    thread_event_set(&recv_event, fd, EV_READ|EV_PERSIST,
+                     sock_buff_recv_callback, this);
+    thread_event_set(&send_event, fd, EV_WRITE|EV_PERSIST,
+                     sock_buff_send_callback, this);
+    thread_evtimer_set(&continue_event, sock_buff_continue_callback, this);
+
+#ifdef HAVE_IO_URING
+    UringBind();
+#endif
 
-    event_add(&recv_event, nullptr);
+    UpdateRead();
 }
 
 SocketBuffer *
@@ -247,12 +1276,35 @@ SocketBuffer::~SocketBuffer() noexcept
 {
     assert(fd >= 0);
 
+#ifdef HAVE_IO_URING
+    assert(!recv_armed);
+    assert(!send_in_flight);
+
+    if (uring != nullptr)
+        uring->RemoveUser();
+#endif
+
     event_del(&recv_event);
     event_del(&send_event);
+    evtimer_del(&continue_event);
+
+    /* the flush may have been postponed until the end of this event
+       loop iteration; try to deliver what we have before closing */
+    if (!IsOutputEmpty())
+        FlushOutput();
+
+    ClearOutput();
 
     close(fd);
 }
 
 void sock_buff_dispose(SocketBuffer *sb) {
+#ifdef HAVE_IO_URING
+    if (sb->recv_armed || sb->send_in_flight) {
+        sb->UringOrphan();
+        return;
+    }
+#endif
+
     delete sb;
 }
@@ -21,6 +21,11 @@
 #ifndef UOPROXY_SOCKET_BUFFER_H
 #define UOPROXY_SOCKET_BUFFER_H
 
+#include "util/ConstBuffer.hxx"
+
+#include <memory>
+#include <vector>
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -40,11 +45,22 @@ public:
      * callback, and the callee has to invoke this function.
      */
     virtual void OnSocketDisconnect(int error) noexcept = 0;
+
+    /**
+     * The output queue has shrunk to the threshold passed to
+     * sock_buff_request_drain().
+     */
+    virtual void OnSocketDrained() noexcept {}
 };
 
 struct SocketBuffer;
 template<typename T> struct WritableBuffer;
 
+/**
+ * @param input_max the size of the input buffer
+ * @param output_max the maximum number of bytes in the output queue;
+ * memory for it is allocated from the #ChunkPool on demand
+ */
 SocketBuffer *
 sock_buff_create(int fd, size_t input_max,
                  size_t output_max,
@@ -52,19 +68,141 @@ sock_buff_create(int fd, size_t input_max,
 
 void sock_buff_dispose(SocketBuffer *sb);
 
+/**
+ * Obtain contiguous room at the end of the output queue, to be
+ * committed with sock_buff_append().
+ *
+ * @param min_length the returned buffer has at least this size (it
+ * may be larger)
+ * @return the buffer, or nullptr if #min_length is larger than a
+ * #Chunk or would exceed the output limit
+ */
 WritableBuffer<void>
-sock_buff_write(SocketBuffer *sb) noexcept;
+sock_buff_write(SocketBuffer *sb, size_t min_length) noexcept;
 
 void
 sock_buff_append(SocketBuffer *sb, size_t length);
 
 /**
  * @return true on success, false if there is no more room in the
- * output buffer
+ * output queue
  */
 bool
 sock_buff_send(SocketBuffer *sb, const void *data, size_t length);
 
+/**
+ * Queue a reference to a buffer which is shared with other sockets
+ * (or other parts of the program) instead of copying it into the
+ * output queue.  The reference is released as soon as the last byte
+ * has been sent.
+ *
+ * @return true on success, false if there is no more room in the
+ * output queue
+ */
+bool
+sock_buff_send_shared(SocketBuffer *sb, std::shared_ptr<const void> owner,
+                      ConstBuffer<void> data) noexcept;
+
+/**
+ * @return the number of bytes in the output queue
+ */
+size_t
+sock_buff_output_size(const SocketBuffer *sb) noexcept;
+
+/**
+ * Ask for a SocketBufferHandler::OnSocketDrained() call as soon as
+ * the output queue has shrunk to the specified size.  The call
+ * happens from the event loop, never from within this function.
+ */
+void
+sock_buff_request_drain(SocketBuffer *sb, size_t threshold) noexcept;
+
+/**
+ * Send only full frames until the output queue is empty again (see
+ * TCP_CORK).  Call this before queueing a burst of packets, so a
+ * burst which takes more than one send does not leave small segments
+ * on the wire.
+ */
+void
+sock_buff_cork(SocketBuffer *sb) noexcept;
+
+/**
+ * The handler has stopped consuming input voluntarily (e.g. because
+ * it has used up its processing budget for this event loop
+ * iteration): hand the rest of the input buffer to it again in the
+ * next iteration, after the other ready sockets have been served.
+ */
+void
+sock_buff_continue_input(SocketBuffer *sb) noexcept;
+
+/**
+ * Stop reading from the socket (e.g. because the peers we are
+ * forwarding to can't keep up) until sock_buff_resume_input() is
+ * called.  Calling it again has no effect.
+ */
+void
+sock_buff_suspend_input(SocketBuffer *sb) noexcept;
+
+void
+sock_buff_resume_input(SocketBuffer *sb) noexcept;
+
+/**
+ * Stop all I/O on this socket buffer, so it can be handed over to
+ * another thread.  Pending output is flushed (as far as the socket
+ * allows it) right away.
+ */
+void
+sock_buff_pause(SocketBuffer *sb) noexcept;
+
+/**
+ * Resume I/O after sock_buff_pause() in the calling thread's event
+ * loop.  Input which has been received but not consumed is
+ * submitted to the handler from the event loop.
+ */
+void
+sock_buff_resume(SocketBuffer *sb) noexcept;
+
+/**
+ * Stop all I/O and move the input which has not been consumed yet
+ * and the output which has not been sent yet out of this object, so
+ * the socket can be handed over to another process.  The object can
+ * only be disposed afterwards, which closes this process's copy of
+ * the socket.
+ *
+ * @return the socket
+ */
+int
+sock_buff_export(SocketBuffer *sb, std::vector<uint8_t> &input,
+                 std::vector<uint8_t> &output) noexcept;
+
+/**
+ * Insert input which has been received by the previous owner of the
+ * socket (see sock_buff_export()).  It is submitted to the handler
+ * from the event loop, before anything which is received later.
+ *
+ * @return false if the input buffer is too small
+ */
+bool
+sock_buff_import_input(SocketBuffer *sb, ConstBuffer<void> data) noexcept;
+
+/**
+ * Free the input buffer if nothing has been received since the last
+ * call; it is allocated again as soon as data arrives.  Call this
+ * periodically.
+ *
+ * @return true if the socket has been idle since the last call
+ */
+bool
+sock_buff_release_idle(SocketBuffer *sb) noexcept;
+
+/**
+ * @return the number of bytes allocated for this object, its input
+ * buffer and the chunks of its output queue (not counting shared
+ * buffers queued with sock_buff_send_shared())
+ */
+size_t
+sock_buff_memory_usage(const SocketBuffer *sb) noexcept;
+
 /**
  * @return the 32-bit internet address of the socket buffer's fd, in
  * network byte order
@@ -17,6 +17,7 @@
 #include "SocketConnect.hxx"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -35,8 +36,17 @@ socket_connect(int domain, int type, int protocol,
     if (fd < 0)
         return -errno;
 
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        int save_errno = errno;
+        close(fd);
+        return -save_errno;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
     int ret = connect(fd, address, address_length);
-    if (ret < 0) {
+    if (ret < 0 && errno != EINPROGRESS) {
         int save_errno = errno;
         close(fd);
         return -save_errno;
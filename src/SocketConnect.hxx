@@ -21,6 +21,13 @@
 
 struct sockaddr;
 
+/**
+ * Create a non-blocking socket and begin connecting it.  The connect
+ * is usually still in progress when this function returns; wait for
+ * the socket to become writable and check SO_ERROR.
+ *
+ * @return the socket or a negative errno value
+ */
 int
 socket_connect(int domain, int type, int protocol,
                const struct sockaddr *address, size_t address_length);
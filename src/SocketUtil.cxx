@@ -32,4 +32,24 @@ socket_set_nodelay(int fd, int value)
                       &value, sizeof(value));
 }
 
+int
+socket_set_cork(int fd, int value)
+{
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK,
+                      &value, sizeof(value));
+}
+
+int
+socket_set_notsent_lowat(int fd, unsigned value)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                      &value, sizeof(value));
+#else
+    (void)fd;
+    (void)value;
+    return 0;
+#endif
+}
+
 #endif
@@ -26,6 +26,20 @@
 int
 socket_set_nodelay(int fd, int value);
 
+/**
+ * Hold back partial frames until the cork is removed (TCP_CORK).
+ */
+int
+socket_set_cork(int fd, int value);
+
+/**
+ * Limit the amount of unsent data in the kernel's send queue
+ * (TCP_NOTSENT_LOWAT); the socket is not writable while there is
+ * more.
+ */
+int
+socket_set_notsent_lowat(int fd, unsigned value);
+
 #else
 
 static inline int
@@ -34,6 +48,18 @@ socket_set_nodelay(int, int) noexcept
     return 0;
 }
 
+static inline int
+socket_set_cork(int, int) noexcept
+{
+    return 0;
+}
+
+static inline int
+socket_set_notsent_lowat(int, unsigned) noexcept
+{
+    return 0;
+}
+
 #endif
 
 #endif
@@ -0,0 +1,384 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Standby.hxx"
+#include "Connection.hxx"
+#include "Instance.hxx"
+#include "Config.hxx"
+#include "Log.hxx"
+#include "SocketUtil.hxx"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+using std::chrono_literals::operator""s;
+
+/**
+ * How long to wait before trying again after the standby session has
+ * failed or has been closed by the server.
+ */
+static constexpr auto STANDBY_RETRY_DELAY = 60s;
+
+/**
+ * Give up if the login has not reached the character list after this
+ * duration.
+ */
+static constexpr auto STANDBY_LOGIN_TIMEOUT = 60s;
+
+/**
+ * Keep the parked session alive.
+ */
+static constexpr auto STANDBY_PING_INTERVAL = 30s;
+
+Standby::Standby(Connection &_connection) noexcept
+    :connection(_connection),
+     timer(OnTimer, this)
+{
+}
+
+Standby::~Standby() noexcept
+{
+    Close();
+}
+
+void
+Standby::Schedule(Duration delay) noexcept
+{
+    if (state != State::IDLE)
+        return;
+
+    timer.Schedule(delay);
+}
+
+UO::Client *
+Standby::Release() noexcept
+{
+    assert(state == State::READY);
+    assert(client != nullptr);
+
+    timer.Cancel();
+
+    auto *result = client;
+    client = nullptr;
+    char_list = nullptr;
+    state = State::IDLE;
+    return result;
+}
+
+void
+Standby::ReleaseIdleBuffers() noexcept
+{
+    if (client != nullptr)
+        uo_client_release_idle(client);
+}
+
+size_t
+Standby::GetMemoryUsage() const noexcept
+{
+    size_t result = sizeof(*this) + char_list.GetCapacity();
+    if (client != nullptr)
+        result += uo_client_memory_usage(client);
+    return result;
+}
+
+void
+Standby::Close() noexcept
+{
+    timer.Cancel();
+    async_connect.Cancel();
+
+    if (client != nullptr) {
+        uo_client_dispose(client);
+        client = nullptr;
+    }
+
+    char_list = nullptr;
+    state = State::IDLE;
+}
+
+void
+Standby::Fail() noexcept
+{
+    Close();
+    timer.Schedule(STANDBY_RETRY_DELAY);
+}
+
+int
+Standby::StartConnect(const struct sockaddr *address, size_t address_length,
+                      uint32_t seed) noexcept
+{
+    const auto &config = connection.instance.config;
+
+    assert(client == nullptr);
+
+    pending_connect.seed = seed;
+    pending_connect.host = nullptr;
+
+    return async_connect.Start(address, address_length,
+                               config.socks4_address,
+                               config.connect_timeout);
+}
+
+int
+Standby::StartConnect(ResolvedHost &host, uint32_t seed) noexcept
+{
+    ResolvedAddress address;
+    if (!host.Get(address))
+        return EAGAIN;
+
+    int ret = StartConnect(address.GetAddress(), address.length, seed);
+    if (ret != 0) {
+        host.Failed(address);
+        return ret;
+    }
+
+    pending_connect.host = &host;
+    pending_connect.address = address;
+    return 0;
+}
+
+void
+Standby::Start() noexcept
+{
+    const auto &config = connection.instance.config;
+    const auto &version = connection.client.version;
+    uint32_t seed;
+    int ret;
+
+    assert(state == State::IDLE);
+    assert(client == nullptr);
+
+    if (version.seed != nullptr)
+        seed = version.seed->seed;
+    else
+        seed = 0xc0a80102; /* 192.168.1.2 */
+
+    if (config.login_address == nullptr) {
+        assert(config.game_servers != nullptr);
+        assert(connection.server_index < config.num_game_servers);
+
+        pending_connect.login.game_login = {
+            .cmd = PCK_GameLogin,
+            .auth_id = seed,
+            .credentials = connection.credentials,
+        };
+
+        ret = StartConnect(*config.game_servers[connection.server_index].address,
+                           seed);
+        state = State::GAME_LOGIN;
+    } else {
+        pending_connect.login.account_login = {
+            .cmd = PCK_AccountLogin,
+            .credentials = connection.credentials,
+            .unknown1 = {},
+        };
+
+        ret = StartConnect(*config.login_address, seed);
+        state = State::ACCOUNT_LOGIN;
+    }
+
+    if (ret != 0) {
+        log_error("standby connect failed", ret);
+        Fail();
+        return;
+    }
+
+    timer.Schedule(STANDBY_LOGIN_TIMEOUT);
+}
+
+bool
+Standby::OnRelay(const struct uo_packet_relay &_relay) noexcept
+{
+    /* save the relay packet - its buffer will be freed by
+       uo_client_dispose() */
+    const struct uo_packet_relay relay = _relay;
+
+    uo_client_dispose(client);
+    client = nullptr;
+
+    struct sockaddr_in sin;
+    sin.sin_family = AF_INET;
+    sin.sin_port = relay.port.raw();
+    sin.sin_addr.s_addr = relay.ip.raw();
+
+    pending_connect.login.game_login = {
+        .cmd = PCK_GameLogin,
+        .auth_id = relay.auth_id,
+        .credentials = connection.credentials,
+    };
+
+    int ret = StartConnect((const struct sockaddr *)&sin, sizeof(sin),
+                           relay.auth_id);
+    if (ret != 0) {
+        log_error("standby connect to game server failed", ret);
+        Fail();
+        return false;
+    }
+
+    state = State::GAME_LOGIN;
+    return false;
+}
+
+void
+Standby::OnCharList(const void *data, size_t length) noexcept
+{
+    auto p = (const struct uo_packet_simple_character_list *)data;
+
+    if (p->character_count == 0 ||
+        length < sizeof(*p) + (p->character_count - 1) * sizeof(p->character_info[0])) {
+        LogFormat(1, "standby: malformed character list\n");
+        Fail();
+        return;
+    }
+
+    char_list = {p, length};
+    state = State::READY;
+    timer.Schedule(STANDBY_PING_INTERVAL);
+
+    LogFormat(2, "standby connection parked at the character list\n");
+}
+
+void
+Standby::OnTimer(void *ctx) noexcept
+{
+    auto &standby = *(Standby *)ctx;
+
+    switch (standby.state) {
+    case State::IDLE:
+        standby.Start();
+        break;
+
+    case State::ACCOUNT_LOGIN:
+    case State::GAME_LOGIN:
+        LogFormat(1, "standby login timed out\n");
+        standby.Fail();
+        break;
+
+    case State::READY:
+        {
+            const struct uo_packet_ping ping = {
+                .cmd = PCK_Ping,
+                .id = ++standby.ping_request,
+            };
+
+            uo_client_send(standby.client, &ping, sizeof(ping));
+        }
+
+        standby.timer.Schedule(STANDBY_PING_INTERVAL);
+        break;
+    }
+}
+
+bool
+Standby::OnClientPacket(const void *data, size_t length,
+                        ConstBuffer<void>)
+{
+    const auto cmd = *(const uint8_t *)data;
+
+    assert(client != nullptr);
+
+    switch (cmd) {
+    case PCK_ServerList:
+        if (state == State::ACCOUNT_LOGIN) {
+            const struct uo_packet_play_server p = {
+                .cmd = PCK_PlayServer,
+                .index = 0, /* XXX */
+            };
+
+            uo_client_send(client, &p, sizeof(p));
+        }
+
+        break;
+
+    case PCK_Relay:
+        if (state == State::ACCOUNT_LOGIN &&
+            length == sizeof(struct uo_packet_relay))
+            return OnRelay(*(const struct uo_packet_relay *)data);
+
+        break;
+
+    case PCK_CharList:
+    case PCK_CharList2:
+    case PCK_CharList3:
+        if (state == State::GAME_LOGIN) {
+            OnCharList(data, length);
+            return client != nullptr;
+        }
+
+        break;
+
+    case PCK_ClientVersion:
+        if (connection.client.version.IsDefined())
+            uo_client_send(client, connection.client.version.packet.get(),
+                           connection.client.version.packet.size());
+        break;
+
+    case PCK_AccountLoginReject:
+        LogFormat(1, "standby login rejected: reason=0x%x\n",
+                  ((const struct uo_packet_account_login_reject *)data)->reason);
+        Fail();
+        return false;
+    }
+
+    /* everything else is irrelevant for a session which is not in
+       game yet */
+    return true;
+}
+
+void
+Standby::OnClientDisconnect() noexcept
+{
+    LogFormat(2, "standby connection closed by the server\n");
+    Fail();
+}
+
+void
+Standby::OnAsyncConnectSuccess(int fd) noexcept
+{
+    const auto &config = connection.instance.config;
+
+    if (config.server_notsent_lowat > 0)
+        socket_set_notsent_lowat(fd, config.server_notsent_lowat);
+
+    client = connection.client.CreateClient(fd, pending_connect.seed, *this);
+
+    if (pending_connect.login.cmd == PCK_GameLogin) {
+        LogFormat(3, "standby connected, doing GameLogin\n");
+        uo_client_send(client, &pending_connect.login.game_login,
+                       sizeof(pending_connect.login.game_login));
+    } else {
+        assert(pending_connect.login.cmd == PCK_AccountLogin);
+
+        LogFormat(3, "standby connected, doing AccountLogin\n");
+        uo_client_send(client, &pending_connect.login.account_login,
+                       sizeof(pending_connect.login.account_login));
+    }
+}
+
+void
+Standby::OnAsyncConnectError(int error) noexcept
+{
+    if (pending_connect.host != nullptr)
+        pending_connect.host->Failed(pending_connect.address);
+
+    log_error("standby connect failed", error);
+    Fail();
+}
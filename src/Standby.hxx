@@ -0,0 +1,166 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * The optional standby upstream connection ("standby"): a second
+ * session of the same account, logged in to the game server and
+ * parked at the character list.  A reconnect (e.g. "%char") takes
+ * it over instead of going through the whole login again.
+ */
+
+#ifndef UOPROXY_STANDBY_H
+#define UOPROXY_STANDBY_H
+
+#include "Client.hxx"
+#include "AsyncConnect.hxx"
+#include "Resolver.hxx"
+#include "TimerWheel.hxx"
+#include "PacketStructs.hxx"
+#include "util/VarStructPtr.hxx"
+
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sockaddr;
+struct Connection;
+
+class Standby final : UO::ClientHandler, AsyncConnectHandler {
+    using Duration = std::chrono::steady_clock::duration;
+
+    Connection &connection;
+
+    enum class State : uint8_t {
+        /**
+         * Nothing is going on; #timer may be pending to start
+         * again.
+         */
+        IDLE,
+
+        /**
+         * Connecting to the login server, or waiting for the
+         * ServerList or the Relay; #timer is the login timeout.
+         */
+        ACCOUNT_LOGIN,
+
+        /**
+         * Connecting to the game server, or waiting for the
+         * character list.
+         */
+        GAME_LOGIN,
+
+        /**
+         * Parked at the character list; #timer sends pings.
+         */
+        READY,
+    } state = State::IDLE;
+
+    AsyncConnect async_connect{*this};
+
+    UO::Client *client = nullptr;
+
+    WheelTimer timer;
+
+    struct {
+        uint32_t seed;
+
+        ResolvedHost *host;
+        ResolvedAddress address;
+
+        union {
+            uint8_t cmd;
+            struct uo_packet_account_login account_login;
+            struct uo_packet_game_login game_login;
+        } login;
+    } pending_connect;
+
+    uint8_t ping_request = 0;
+
+    /**
+     * The character list received by this session.
+     */
+    VarStructPtr<struct uo_packet_simple_character_list> char_list;
+
+public:
+    explicit Standby(Connection &_connection) noexcept;
+    ~Standby() noexcept;
+
+    Standby(const Standby &) = delete;
+    Standby &operator=(const Standby &) = delete;
+
+    bool IsReady() const noexcept {
+        return state == State::READY;
+    }
+
+    /**
+     * The character list received by the parked session; may be
+     * moved away before Release().
+     */
+    auto &GetCharList() noexcept {
+        return char_list;
+    }
+
+    /**
+     * Log in after the specified delay, unless a login is already in
+     * progress (or finished).
+     */
+    void Schedule(Duration delay) noexcept;
+
+    /**
+     * Hand over the parked session (see IsReady()).  This object
+     * becomes idle; Schedule() starts another one.
+     */
+    UO::Client *Release() noexcept;
+
+    void ReleaseIdleBuffers() noexcept;
+
+    size_t GetMemoryUsage() const noexcept;
+
+private:
+    void Start() noexcept;
+
+    /**
+     * Close the session and try again later.
+     */
+    void Fail() noexcept;
+
+    void Close() noexcept;
+
+    int StartConnect(const struct sockaddr *address, size_t address_length,
+                     uint32_t seed) noexcept;
+    int StartConnect(ResolvedHost &host, uint32_t seed) noexcept;
+
+    bool OnRelay(const struct uo_packet_relay &relay) noexcept;
+    void OnCharList(const void *data, size_t length) noexcept;
+
+    static void OnTimer(void *ctx) noexcept;
+
+    /* virtual methods from UO::ClientHandler */
+    bool OnClientPacket(const void *data, size_t length,
+                        ConstBuffer<void> compressed) override;
+    void OnClientDisconnect() noexcept override;
+
+    /* virtual methods from AsyncConnectHandler */
+    void OnAsyncConnectSuccess(int fd) noexcept override;
+    void OnAsyncConnectError(int error) noexcept override;
+};
+
+#endif
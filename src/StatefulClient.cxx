@@ -22,11 +22,14 @@
 #include "Client.hxx"
 #include "CVersion.hxx"
 #include "Log.hxx"
+#include "Serialize.hxx"
+
+#include <stdexcept>
 
 #include <assert.h>
 
 static void
-ping_event_callback(int, short, void *ctx) noexcept
+ping_timer_callback(void *ctx) noexcept
 {
     auto client = (StatefulClient *)ctx;
     struct uo_packet_ping ping;
@@ -35,6 +38,7 @@ ping_event_callback(int, short, void *ctx) noexcept
 
     ping.cmd = PCK_Ping;
     ping.id = ++client->ping_request;
+    client->ping_sent = std::chrono::steady_clock::now();
 
     LogFormat(2, "sending ping\n");
     uo_client_send(client->client, &ping, sizeof(ping));
@@ -44,17 +48,14 @@ ping_event_callback(int, short, void *ctx) noexcept
 }
 
 StatefulClient::StatefulClient() noexcept
+    :ping_timer(ping_timer_callback, this)
 {
-    evtimer_set(&ping_event, ping_event_callback, this);
 }
 
-void
-StatefulClient::Connect(int fd,
-                        uint32_t seed,
-                        UO::ClientHandler &handler)
+UO::Client *
+StatefulClient::CreateClient(int fd, uint32_t seed,
+                             UO::ClientHandler &handler) const
 {
-    assert(client == nullptr);
-
     const struct uo_packet_seed *seed_packet = version.seed;
     struct uo_packet_seed seed_buffer;
 
@@ -79,14 +80,32 @@ StatefulClient::Connect(int fd,
         seed_packet = &seed_buffer;
     }
 
-    client = uo_client_create(fd, seed,
-                              seed_packet,
-                              handler);
+    auto *c = uo_client_create(fd, seed, seed_packet, handler);
+    uo_client_set_protocol(c, version.protocol);
+    return c;
+}
 
-    uo_client_set_protocol(client, version.protocol);
+void
+StatefulClient::Connect(int fd,
+                        uint32_t seed,
+                        UO::ClientHandler &handler)
+{
+    assert(client == nullptr);
 
+    client = CreateClient(fd, seed, handler);
     SchedulePing();
+}
 
+void
+StatefulClient::Adopt(UO::Client *new_client,
+                      UO::ClientHandler &handler) noexcept
+{
+    assert(client == nullptr);
+    assert(new_client != nullptr);
+
+    uo_client_set_handler(new_client, handler);
+    client = new_client;
+    SchedulePing();
 }
 
 void
@@ -96,8 +115,46 @@ StatefulClient::Disconnect() noexcept
 
     version_requested = false;
 
-    event_del(&ping_event);
+    ping_timer.Cancel();
 
     uo_client_dispose(client);
     client = nullptr;
 }
+
+void
+StatefulClient::Save(Serializer &s) const
+{
+    s.WriteBool(version_requested);
+    version.Save(s);
+    s.WriteVarStruct(server_list);
+    s.WriteVarStruct(char_list);
+    s.WriteU32(supported_features_flags);
+    s.WriteU8(ping_request);
+    s.WriteU8(ping_ack);
+    world.Save(s);
+}
+
+void
+StatefulClient::Load(Deserializer &d)
+{
+    version_requested = d.ReadBool();
+    version.Load(d);
+    d.ReadVarStruct(server_list, sizeof(*server_list));
+    if (server_list &&
+        (server_list->num_game_servers == 0 ||
+         server_list.size() != sizeof(*server_list) +
+         (server_list->num_game_servers - 1) * sizeof(server_list->game_servers[0])))
+        throw std::runtime_error("malformed server list");
+
+    d.ReadVarStruct(char_list, sizeof(*char_list));
+    if (char_list &&
+        (char_list->character_count == 0 ||
+         char_list.size() < sizeof(*char_list) +
+         (char_list->character_count - 1) * sizeof(char_list->character_info[0])))
+        throw std::runtime_error("malformed character list");
+
+    supported_features_flags = d.ReadU32();
+    ping_request = d.ReadU8();
+    ping_ack = d.ReadU8();
+    world.Load(d);
+}
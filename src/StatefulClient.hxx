@@ -22,8 +22,12 @@
 
 #include "CVersion.hxx"
 #include "World.hxx"
+#include "TimerWheel.hxx"
 
-#include <event.h>
+#include <chrono>
+
+class Serializer;
+class Deserializer;
 
 namespace UO {
 class Client;
@@ -34,7 +38,7 @@ struct StatefulClient {
     bool reconnecting = false, version_requested = false;
 
     UO::Client *client = nullptr;
-    struct event ping_event;
+    WheelTimer ping_timer;
 
     ClientVersion version;
 
@@ -56,6 +60,11 @@ struct StatefulClient {
 
     unsigned char ping_request = 0, ping_ack = 0;
 
+    /**
+     * When the ping #ping_request was sent.
+     */
+    std::chrono::steady_clock::time_point ping_sent;
+
     World world;
 
     StatefulClient() noexcept;
@@ -71,14 +80,35 @@ struct StatefulClient {
         return client != nullptr;
     }
 
+    /**
+     * Create a #UO::Client with this client's version (seed packet
+     * and protocol), without connecting this object to it.
+     */
+    UO::Client *CreateClient(int fd, uint32_t seed,
+                             UO::ClientHandler &handler) const;
+
     void Connect(int fd,
                  uint32_t seed,
                  UO::ClientHandler &handler);
 
+    /**
+     * Take over a #UO::Client which has been logged in elsewhere
+     * (see #Standby).
+     */
+    void Adopt(UO::Client *new_client,
+               UO::ClientHandler &handler) noexcept;
+
     void Disconnect() noexcept;
 
+    /**
+     * Save the state for a new process (see #UpgradeServer); the
+     * #client is saved separately by the caller.
+     */
+    void Save(Serializer &s) const;
+
+    void Load(Deserializer &d);
+
     void SchedulePing() noexcept {
-        static constexpr struct timeval tv{30, 0};
-        event_add(&ping_event, &tv);
+        ping_timer.Schedule(std::chrono::seconds(30));
     }
 };
@@ -0,0 +1,141 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Stats.hxx"
+
+#include <mutex>
+
+/**
+ * All live #ThreadStats objects, and the sum of those which have
+ * been destroyed.
+ */
+static struct {
+    std::mutex mutex;
+    IntrusiveList<ThreadStats> threads;
+    StatsSnapshot retired;
+} stats_registry;
+
+void
+StatsHistogramSnapshot::Add(const StatsHistogram &src) noexcept
+{
+    for (unsigned i = 0; i < StatsHistogram::N_BUCKETS; ++i) {
+        const uint64_t n = src.buckets[i].Get();
+        buckets[i] += n;
+        count += n;
+    }
+
+    sum += src.sum.Get();
+}
+
+void
+StatsHistogramSnapshot::Add(const StatsHistogramSnapshot &src) noexcept
+{
+    for (unsigned i = 0; i < StatsHistogram::N_BUCKETS; ++i)
+        buckets[i] += src.buckets[i];
+
+    count += src.count;
+    sum += src.sum;
+}
+
+void
+StatsSnapshot::Add(const ThreadStats &src) noexcept
+{
+    for (size_t d = 0; d < size_t(PacketDirection::COUNT); ++d) {
+        for (size_t cmd = 0; cmd < 0x100; ++cmd) {
+            auto &p = packets[d][cmd];
+            const auto &s = src.packets[d][cmd];
+            p.packets += s.packets.Get();
+            p.bytes += s.bytes.Get();
+            p.handler_ns += s.handler_ns.Get();
+        }
+    }
+
+    for (size_t i = 0; i < size_t(StatsTimer::COUNT); ++i)
+        timers[i].Add(src.timers[i]);
+
+    output_queue.Add(src.output_queue);
+    event_loop_lag.Add(src.event_loop_lag);
+
+    compress_in += src.compress_in.Get();
+    compress_out += src.compress_out.Get();
+    decompress_in += src.decompress_in.Get();
+    decompress_out += src.decompress_out.Get();
+
+    updates_coalesced += src.updates_coalesced.Get();
+}
+
+void
+StatsSnapshot::Add(const StatsSnapshot &src) noexcept
+{
+    for (size_t d = 0; d < size_t(PacketDirection::COUNT); ++d) {
+        for (size_t cmd = 0; cmd < 0x100; ++cmd) {
+            auto &p = packets[d][cmd];
+            const auto &s = src.packets[d][cmd];
+            p.packets += s.packets;
+            p.bytes += s.bytes;
+            p.handler_ns += s.handler_ns;
+        }
+    }
+
+    for (size_t i = 0; i < size_t(StatsTimer::COUNT); ++i)
+        timers[i].Add(src.timers[i]);
+
+    output_queue.Add(src.output_queue);
+    event_loop_lag.Add(src.event_loop_lag);
+
+    compress_in += src.compress_in;
+    compress_out += src.compress_out;
+    decompress_in += src.decompress_in;
+    decompress_out += src.decompress_out;
+
+    updates_coalesced += src.updates_coalesced;
+}
+
+ThreadStats::ThreadStats() noexcept
+{
+    const std::lock_guard<std::mutex> lock(stats_registry.mutex);
+    stats_registry.threads.push_back(*this);
+}
+
+ThreadStats::~ThreadStats() noexcept
+{
+    const std::lock_guard<std::mutex> lock(stats_registry.mutex);
+    stats_registry.retired.Add(*this);
+    unlink();
+}
+
+ThreadStats &
+thread_stats() noexcept
+{
+    static thread_local ThreadStats stats;
+    return stats;
+}
+
+void
+stats_snapshot(StatsSnapshot &dest) noexcept
+{
+    dest = {};
+
+    const std::lock_guard<std::mutex> lock(stats_registry.mutex);
+    dest.Add(stats_registry.retired);
+
+    for (const auto &i : stats_registry.threads)
+        dest.Add(i);
+}
@@ -0,0 +1,240 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Always-on instrumentation: packet and byte counters per opcode and
+ * direction, and histograms of the time spent in handlers and in the
+ * Huffman codec.  Each thread writes only its own counters (with
+ * relaxed atomics, which compile to plain loads and stores), and
+ * stats_snapshot() can sum them up from any thread at any time.
+ */
+
+#ifndef UOPROXY_STATS_H
+#define UOPROXY_STATS_H
+
+#include "util/IntrusiveList.hxx"
+
+#include <atomic>
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+
+using StatsClock = std::chrono::steady_clock;
+
+enum class PacketDirection : uint8_t {
+    /**
+     * Received from the game server.
+     */
+    FROM_SERVER,
+
+    /**
+     * Sent to the game server.
+     */
+    TO_SERVER,
+
+    /**
+     * Received from a game client.
+     */
+    FROM_CLIENT,
+
+    /**
+     * Sent to a game client.
+     */
+    TO_CLIENT,
+
+    COUNT
+};
+
+enum class StatsTimer : uint8_t {
+    /**
+     * Handlers of packets from the game server.
+     */
+    SERVER_HANDLER,
+
+    /**
+     * Handlers of packets from game clients.
+     */
+    CLIENT_HANDLER,
+
+    COMPRESS,
+    DECOMPRESS,
+
+    COUNT
+};
+
+/**
+ * A counter which is modified only by the thread owning it, but may
+ * be read by any thread.
+ */
+class StatsCounter {
+    std::atomic<uint64_t> value{0};
+
+public:
+    void Add(uint64_t n) noexcept {
+        value.store(value.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const noexcept {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * A histogram with power-of-two buckets: bucket i counts the values
+ * in the range [2^i, 2^(i+1)), bucket 0 also counts zeroes, and the
+ * last bucket everything above.
+ */
+class StatsHistogram {
+public:
+    static constexpr unsigned N_BUCKETS = 32;
+
+    StatsCounter buckets[N_BUCKETS];
+    StatsCounter sum;
+
+    static constexpr unsigned GetBucket(uint64_t value) noexcept {
+        unsigned i = value > 0 ? 63 - __builtin_clzll(value) : 0;
+        return i < N_BUCKETS ? i : N_BUCKETS - 1;
+    }
+
+    void Record(uint64_t value) noexcept {
+        buckets[GetBucket(value)].Add(1);
+        sum.Add(value);
+    }
+};
+
+struct StatsHistogramSnapshot {
+    uint64_t buckets[StatsHistogram::N_BUCKETS]{};
+    uint64_t count = 0, sum = 0;
+
+    void Add(const StatsHistogram &src) noexcept;
+    void Add(const StatsHistogramSnapshot &src) noexcept;
+};
+
+/**
+ * The counters of one thread; obtain it with thread_stats().
+ */
+struct ThreadStats final : IntrusiveListHook {
+    struct PacketCounters {
+        StatsCounter packets, bytes;
+
+        /**
+         * Time spent in the handler (only for received packets).
+         */
+        StatsCounter handler_ns;
+    };
+
+    PacketCounters packets[size_t(PacketDirection::COUNT)][0x100];
+
+    StatsHistogram timers[size_t(StatsTimer::COUNT)];
+
+    /**
+     * Samples of a client's output queue size (in bytes), taken
+     * whenever something is queued.
+     */
+    StatsHistogram output_queue;
+
+    /**
+     * How late (in nanoseconds) the event loop ran a periodic timer;
+     * sampled once a second.
+     */
+    StatsHistogram event_loop_lag;
+
+    /**
+     * Input and output bytes of the Huffman codec.
+     */
+    StatsCounter compress_in, compress_out;
+    StatsCounter decompress_in, decompress_out;
+
+    /**
+     * Updates for congested clients which were superseded by a newer
+     * one (or by a deletion) before they were sent.
+     */
+    StatsCounter updates_coalesced;
+
+    ThreadStats() noexcept;
+    ~ThreadStats() noexcept;
+
+    ThreadStats(const ThreadStats &) = delete;
+    ThreadStats &operator=(const ThreadStats &) = delete;
+
+    void CountPacket(PacketDirection direction,
+                     const void *data, size_t length) noexcept {
+        auto &p = packets[size_t(direction)][*(const uint8_t *)data];
+        p.packets.Add(1);
+        p.bytes.Add(length);
+    }
+
+    void RecordTimer(StatsTimer timer, StatsClock::time_point start) noexcept {
+        timers[size_t(timer)].Record(ElapsedNS(start));
+    }
+
+    void RecordHandler(PacketDirection direction, StatsTimer timer,
+                       unsigned cmd, StatsClock::time_point start) noexcept {
+        const uint64_t ns = ElapsedNS(start);
+        timers[size_t(timer)].Record(ns);
+        packets[size_t(direction)][cmd].handler_ns.Add(ns);
+    }
+
+private:
+    static uint64_t ElapsedNS(StatsClock::time_point start) noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(StatsClock::now() - start).count();
+    }
+};
+
+/**
+ * The sum of all #ThreadStats, including those of threads which have
+ * exited already.
+ */
+struct StatsSnapshot {
+    struct PacketCounters {
+        uint64_t packets = 0, bytes = 0, handler_ns = 0;
+    };
+
+    PacketCounters packets[size_t(PacketDirection::COUNT)][0x100];
+
+    StatsHistogramSnapshot timers[size_t(StatsTimer::COUNT)];
+    StatsHistogramSnapshot output_queue;
+    StatsHistogramSnapshot event_loop_lag;
+
+    uint64_t compress_in = 0, compress_out = 0;
+    uint64_t decompress_in = 0, decompress_out = 0;
+
+    uint64_t updates_coalesced = 0;
+
+    void Add(const ThreadStats &src) noexcept;
+    void Add(const StatsSnapshot &src) noexcept;
+};
+
+/**
+ * Returns the counters of the calling thread.
+ */
+ThreadStats &
+thread_stats() noexcept;
+
+/**
+ * Sum up the counters of all threads.  This does not disturb the
+ * threads; the result may be slightly inconsistent while they run.
+ */
+void
+stats_snapshot(StatsSnapshot &dest) noexcept;
+
+#endif
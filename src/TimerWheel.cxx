@@ -0,0 +1,216 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "TimerWheel.hxx"
+#include "EventBase.hxx"
+
+#include <algorithm>
+
+#include <assert.h>
+
+static thread_local TimerWheel *the_thread_timer_wheel;
+
+TimerWheel &
+thread_timer_wheel() noexcept
+{
+    assert(the_thread_timer_wheel != nullptr);
+
+    return *the_thread_timer_wheel;
+}
+
+void
+set_thread_timer_wheel(TimerWheel *wheel) noexcept
+{
+    the_thread_timer_wheel = wheel;
+}
+
+WheelTimer::WheelTimer(Callback _callback, void *_ctx) noexcept
+    :wheel(&thread_timer_wheel()),
+     callback(_callback), ctx(_ctx)
+{
+}
+
+void
+WheelTimer::Schedule(std::chrono::steady_clock::duration delay) noexcept
+{
+    if (is_linked)
+        wheel->Remove(*this);
+
+    wheel->Add(*this, delay);
+}
+
+void
+WheelTimer::Cancel() noexcept
+{
+    if (is_linked)
+        wheel->Remove(*this);
+}
+
+void
+WheelTimer::Rebind() noexcept
+{
+    assert(!is_linked);
+
+    wheel = &thread_timer_wheel();
+}
+
+TimerWheel::~TimerWheel() noexcept
+{
+    assert(n_timers == 0);
+}
+
+void
+TimerWheel::Init() noexcept
+{
+    epoch = Clock::now();
+    thread_evtimer_set(&tick_event, TickCallback, this);
+}
+
+inline uint64_t
+TimerWheel::GetNowTick() const noexcept
+{
+    return (Clock::now() - epoch) / TICK;
+}
+
+void
+TimerWheel::Add(WheelTimer &t, Clock::duration delay) noexcept
+{
+    assert(!t.is_linked);
+
+    if (n_timers == 0)
+        /* the wheel has been idle; catch up without visiting the
+           empty slots */
+        current_tick = GetNowTick();
+
+    const uint64_t ticks = delay > Clock::duration::zero()
+        ? uint64_t((delay + TICK - Clock::duration(1)) / TICK)
+        : 0;
+    t.due = current_tick + (ticks > 0 ? ticks : 1);
+
+    Insert(t);
+    t.is_linked = true;
+
+    if (n_timers++ == 0)
+        Arm();
+}
+
+void
+TimerWheel::Remove(WheelTimer &t) noexcept
+{
+    assert(t.is_linked);
+    assert(n_timers > 0);
+
+    t.unlink();
+    t.is_linked = false;
+
+    if (--n_timers == 0)
+        evtimer_del(&tick_event);
+}
+
+void
+TimerWheel::Insert(WheelTimer &t) noexcept
+{
+    const uint64_t delta = t.due > current_tick ? t.due - current_tick : 0;
+
+    unsigned level = 0;
+    while (level < N_LEVELS - 1 &&
+           delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))
+        ++level;
+
+    /* too far in the future: park it in the farthest slot of the
+       last level */
+    uint64_t due = t.due;
+    const uint64_t max_delta = (uint64_t(1) << (N_LEVELS * SLOT_BITS)) - 1;
+    if (delta > max_delta)
+        due = current_tick + max_delta;
+
+    const unsigned slot = unsigned(due >> (level * SLOT_BITS)) & (N_SLOTS - 1);
+    slots[level][slot].push_back(t);
+}
+
+void
+TimerWheel::Cascade(unsigned level) noexcept
+{
+    const unsigned slot = unsigned(current_tick >> (level * SLOT_BITS)) & (N_SLOTS - 1);
+
+    Slot list(std::move(slots[level][slot]));
+    while (!list.empty()) {
+        auto &t = list.front();
+        list.pop_front();
+        Insert(t);
+    }
+}
+
+void
+TimerWheel::Tick() noexcept
+{
+    ++current_tick;
+
+    /* whenever a level wraps around, move the next slot of the level
+       above down */
+    for (unsigned level = 1; level < N_LEVELS; ++level) {
+        if ((current_tick & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) != 0)
+            break;
+
+        Cascade(level);
+    }
+
+    /* the callbacks may schedule and cancel timers, including those
+       in this list */
+    Slot expired(std::move(slots[0][current_tick & (N_SLOTS - 1)]));
+    while (!expired.empty()) {
+        auto &t = expired.front();
+        expired.pop_front();
+        t.is_linked = false;
+        --n_timers;
+
+        t.callback(t.ctx);
+    }
+}
+
+void
+TimerWheel::Arm() noexcept
+{
+    const auto next = epoch + TICK * int64_t(current_tick + 1);
+    const auto delay = std::max(std::chrono::duration_cast<std::chrono::microseconds>(next - Clock::now()),
+                                std::chrono::microseconds::zero());
+
+    struct timeval tv;
+    tv.tv_sec = delay.count() / 1000000;
+    tv.tv_usec = delay.count() % 1000000;
+    evtimer_add(&tick_event, &tv);
+}
+
+void
+TimerWheel::TickCallback(int, short, void *ctx) noexcept
+{
+    auto &wheel = *(TimerWheel *)ctx;
+
+    /* if the loop was late, process all of the missed ticks; timers
+       which were due in the same tick run together */
+    const uint64_t now_tick = wheel.GetNowTick();
+    while (wheel.n_timers > 0 && wheel.current_tick < now_tick)
+        wheel.Tick();
+
+    if (wheel.n_timers > 0)
+        wheel.Arm();
+    else
+        evtimer_del(&wheel.tick_event);
+}
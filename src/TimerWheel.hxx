@@ -0,0 +1,176 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A hierarchical timer wheel for coarse timeouts (pings, zombies).
+ * All timers of one event loop share a single libevent timer which
+ * ticks once a second while at least one timer is pending.
+ */
+
+#ifndef UOPROXY_TIMER_WHEEL_H
+#define UOPROXY_TIMER_WHEEL_H
+
+#include "util/IntrusiveList.hxx"
+
+#include <event.h>
+
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+
+class TimerWheel;
+
+/**
+ * A timer managed by the calling thread's #TimerWheel.  Scheduling
+ * and cancelling are O(1); the callback is invoked on the first tick
+ * at or after the deadline.
+ */
+class WheelTimer final : public IntrusiveListHook {
+    friend class TimerWheel;
+
+public:
+    using Callback = void (*)(void *ctx) noexcept;
+
+private:
+    /**
+     * The wheel of the event loop this object belongs to.
+     */
+    TimerWheel *wheel;
+
+    const Callback callback;
+    void *const ctx;
+
+    /**
+     * The tick at which this timer expires.
+     */
+    uint64_t due;
+
+    bool is_linked = false;
+
+public:
+    /**
+     * Binds the object to the calling thread's #TimerWheel.
+     */
+    WheelTimer(Callback _callback, void *_ctx) noexcept;
+
+    ~WheelTimer() noexcept {
+        Cancel();
+    }
+
+    WheelTimer(const WheelTimer &) = delete;
+    WheelTimer &operator=(const WheelTimer &) = delete;
+
+    bool IsPending() const noexcept {
+        return is_linked;
+    }
+
+    /**
+     * (Re)schedule the timer.  The delay is rounded up to whole
+     * ticks.
+     */
+    void Schedule(std::chrono::steady_clock::duration delay) noexcept;
+
+    void Cancel() noexcept;
+
+    /**
+     * Move this object to the calling thread's #TimerWheel, e.g.
+     * after it has been handed over to another worker.  It must not
+     * be pending.
+     */
+    void Rebind() noexcept;
+};
+
+class TimerWheel {
+    friend class WheelTimer;
+
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static constexpr Clock::duration TICK = std::chrono::seconds(1);
+
+private:
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr unsigned N_SLOTS = 1u << SLOT_BITS;
+    static constexpr unsigned N_LEVELS = 3;
+
+    using Slot = IntrusiveList<WheelTimer>;
+
+    /**
+     * Level 0 has one slot per tick; each slot of a higher level
+     * spans a whole revolution of the level below.  Timers beyond
+     * the last level wait in its farthest slot and are re-inserted
+     * when they come around.
+     */
+    Slot slots[N_LEVELS][N_SLOTS];
+
+    struct event tick_event;
+
+    Clock::time_point epoch;
+
+    /**
+     * The last tick which has been processed.
+     */
+    uint64_t current_tick = 0;
+
+    /**
+     * The number of pending timers; the #tick_event is only armed
+     * while this is non-zero.
+     */
+    size_t n_timers = 0;
+
+public:
+    TimerWheel() = default;
+    ~TimerWheel() noexcept;
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * Set up the timer; call this in the thread which runs the event
+     * loop.
+     */
+    void Init() noexcept;
+
+private:
+    uint64_t GetNowTick() const noexcept;
+
+    void Add(WheelTimer &t, Clock::duration delay) noexcept;
+    void Remove(WheelTimer &t) noexcept;
+
+    void Insert(WheelTimer &t) noexcept;
+    void Cascade(unsigned level) noexcept;
+    void Tick() noexcept;
+    void Arm() noexcept;
+
+    static void TickCallback(int, short, void *ctx) noexcept;
+};
+
+/**
+ * Returns the #TimerWheel of the event loop running in the calling
+ * thread.
+ */
+TimerWheel &
+thread_timer_wheel() noexcept;
+
+void
+set_thread_timer_wheel(TimerWheel *wheel) noexcept;
+
+#endif
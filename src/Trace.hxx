@@ -0,0 +1,49 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * USDT (static user-space) tracepoints, for perf, bpftrace and
+ * SystemTap.  Without sys/sdt.h, they compile to nothing; with it,
+ * each probe is a single nop until a tracer attaches.  The provider
+ * name is "uoproxy".  Arguments must be integers or pointers.
+ */
+
+#ifndef UOPROXY_TRACE_H
+#define UOPROXY_TRACE_H
+
+#include "config.h"
+
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define UOPROXY_TRACE1(name, a) DTRACE_PROBE1(uoproxy, name, a)
+#define UOPROXY_TRACE2(name, a, b) DTRACE_PROBE2(uoproxy, name, a, b)
+#define UOPROXY_TRACE3(name, a, b, c) DTRACE_PROBE3(uoproxy, name, a, b, c)
+
+#else
+
+#define UOPROXY_TRACE1(name, a) ((void)(a))
+#define UOPROXY_TRACE2(name, a, b) ((void)(a), (void)(b))
+#define UOPROXY_TRACE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "UpdateQueue.hxx"
+#include "PacketType.hxx"
+#include "PacketStructs.hxx"
+
+static constexpr uint64_t
+MakeKey(uint8_t cmd, uint32_t serial) noexcept
+{
+    return uint64_t(cmd) << 32 | serial;
+}
+
+/**
+ * Read the serial at the specified offset; the highest bit is a flag
+ * in some packets and is masked out.
+ */
+static uint32_t
+ReadSerial(const uint8_t *p) noexcept
+{
+    return *(const PackedBE32 *)p & 0x7fffffff;
+}
+
+uint64_t
+UpdateQueue::GetKey(ConstBuffer<void> packet) noexcept
+{
+    const auto *data = (const uint8_t *)packet.data;
+    const uint8_t cmd = data[0];
+
+    size_t offset;
+    switch (cmd) {
+    case PCK_MobileUpdate:
+    case PCK_MobileMoving:
+    case PCK_PersonalLightLevel:
+        offset = 1;
+        break;
+
+    case PCK_MobileStatus:
+    case PCK_WorldItem:
+        offset = 3;
+        break;
+
+    case PCK_WorldItem7:
+        offset = 4;
+        break;
+
+    case PCK_GlobalLightLevel:
+        return MakeKey(cmd, 0);
+
+    default:
+        return 0;
+    }
+
+    if (packet.size < offset + sizeof(uint32_t))
+        return 0;
+
+    return MakeKey(cmd, ReadSerial(data + offset));
+}
+
+bool
+UpdateQueue::CanOvertake(ConstBuffer<void> packet) noexcept
+{
+    switch (*(const uint8_t *)packet.data) {
+    case PCK_SpeakAscii:
+    case PCK_WalkAck:
+    case PCK_Sound:
+    case PCK_Time:
+    case PCK_Weather:
+    case PCK_PlayMusic:
+    case PCK_CharAction:
+    case PCK_Effect:
+    case PCK_Ping:
+    case PCK_SpeakUnicode:
+    case PCK_UnkHuedEffect:
+    case PCK_SpeakTable:
+    case PCK_ParticleEffect:
+    case PCK_UnkTextIDandStr:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool
+UpdateQueue::Push(uint64_t key, ConstBuffer<void> packet) noexcept
+{
+    const auto *data = (const uint8_t *)packet.data;
+
+    auto i = by_key.find(key);
+    if (i != by_key.end()) {
+        /* latest wins, and it is sent in the position of the
+           latest */
+        auto e = i->second;
+        e->packet.assign(data, data + packet.size);
+        entries.splice(entries.end(), entries, e);
+        return true;
+    }
+
+    entries.push_back({key, {data, data + packet.size}});
+    by_key.emplace(key, std::prev(entries.end()));
+    return false;
+}
+
+unsigned
+UpdateQueue::Discard(uint32_t serial) noexcept
+{
+    static constexpr uint8_t cmds[] = {
+        PCK_MobileStatus, PCK_WorldItem, PCK_MobileUpdate,
+        PCK_PersonalLightLevel, PCK_MobileMoving, PCK_WorldItem7,
+    };
+
+    serial &= 0x7fffffff;
+
+    unsigned n = 0;
+    for (const auto cmd : cmds) {
+        auto i = by_key.find(MakeKey(cmd, serial));
+        if (i != by_key.end()) {
+            entries.erase(i->second);
+            by_key.erase(i);
+            ++n;
+        }
+    }
+
+    return n;
+}
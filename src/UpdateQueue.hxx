@@ -0,0 +1,120 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A latest-wins queue for state update packets which are held back
+ * while a client is congested.
+ */
+
+#ifndef UOPROXY_UPDATE_QUEUE_H
+#define UOPROXY_UPDATE_QUEUE_H
+
+#include "util/ConstBuffer.hxx"
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Collects packets which only describe the current state of one
+ * object (e.g. the position of a mobile), replacing an older packet
+ * of the same type for the same serial.  A client which has fallen
+ * behind thus receives only the latest state when it catches up,
+ * instead of replaying every intermediate step.
+ */
+class UpdateQueue {
+    struct Entry {
+        uint64_t key;
+        std::vector<uint8_t> packet;
+    };
+
+    /**
+     * The entries in the order they shall be sent; a replaced entry
+     * moves to the end.
+     */
+    std::list<Entry> entries;
+
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> by_key;
+
+public:
+    /**
+     * Flush the queue when it grows beyond this number of entries.
+     */
+    static constexpr size_t MAX_ENTRIES = 4096;
+
+    UpdateQueue() = default;
+    UpdateQueue(const UpdateQueue &) = delete;
+    UpdateQueue &operator=(const UpdateQueue &) = delete;
+
+    bool empty() const noexcept {
+        return entries.empty();
+    }
+
+    size_t size() const noexcept {
+        return entries.size();
+    }
+
+    /**
+     * Returns the key under which the packet would be coalesced, or
+     * 0 if it is not a coalescible update.
+     */
+    static uint64_t GetKey(ConstBuffer<void> packet) noexcept;
+
+    /**
+     * Can the packet overtake queued updates, because it does not
+     * depend on or modify the state they describe?
+     */
+    static bool CanOvertake(ConstBuffer<void> packet) noexcept;
+
+    /**
+     * Add an update, replacing the one with the same key.
+     *
+     * @param key the return value of GetKey() (not 0)
+     * @return true if an older update has been replaced
+     */
+    bool Push(uint64_t key, ConstBuffer<void> packet) noexcept;
+
+    /**
+     * Drop all updates for the specified serial, e.g. because it has
+     * been deleted.
+     *
+     * @return the number of updates which have been dropped
+     */
+    unsigned Discard(uint32_t serial) noexcept;
+
+    /**
+     * Remove all updates from the queue and invoke the function for
+     * each of them in order.  The function may push new updates.
+     */
+    template<typename F>
+    void Flush(F &&f) {
+        auto list = std::move(entries);
+        entries.clear();
+        by_key.clear();
+
+        for (const auto &i : list)
+            f(ConstBuffer<void>(i.packet.data(), i.packet.size()));
+    }
+};
+
+#endif
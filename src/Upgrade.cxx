@@ -0,0 +1,469 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Upgrade.hxx"
+#include "Instance.hxx"
+#include "Connection.hxx"
+#include "Serialize.hxx"
+#include "EventBase.hxx"
+#include "Log.hxx"
+
+#include <exception>
+#include <vector>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Identifies the record format; change it whenever the
+ * serialization changes.
+ */
+static constexpr uint32_t UPGRADE_MAGIC = 0x75707231;
+
+enum class UpgradeRecordType : uint32_t {
+    /**
+     * A #Connection; see Connection::Save().
+     */
+    CONNECTION,
+
+    /**
+     * The listener socket.
+     */
+    LISTENER,
+
+    /**
+     * The last record.
+     */
+    END,
+};
+
+/**
+ * Each record begins with this header, which carries the file
+ * descriptors; the payload follows.
+ */
+struct UpgradeRecordHeader {
+    uint32_t magic;
+    UpgradeRecordType type;
+    uint32_t n_fds;
+    uint32_t length;
+};
+
+/**
+ * Don't let a stuck peer block the event loop forever.
+ */
+static void
+set_upgrade_timeout(int fd) noexcept
+{
+    static constexpr struct timeval tv{30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool
+send_full(int fd, const uint8_t *p, size_t length) noexcept
+{
+    while (length > 0) {
+        ssize_t nbytes = send(fd, p, length, MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        p += nbytes;
+        length -= nbytes;
+    }
+
+    return true;
+}
+
+static bool
+recv_full(int fd, uint8_t *p, size_t length) noexcept
+{
+    while (length > 0) {
+        ssize_t nbytes = recv(fd, p, length, MSG_WAITALL);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        if (nbytes == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+
+        p += nbytes;
+        length -= nbytes;
+    }
+
+    return true;
+}
+
+static bool
+send_record(int fd, UpgradeRecordType type, const Serializer &s) noexcept
+{
+    const auto data = s.GetData();
+    const auto &fds = s.GetFds();
+    assert(fds.size() <= Serializer::MAX_FDS);
+
+    const UpgradeRecordHeader header{
+        UPGRADE_MAGIC, type, uint32_t(fds.size()), uint32_t(data.size),
+    };
+
+    struct iovec iov = {
+        .iov_base = const_cast<UpgradeRecordHeader *>(&header),
+        .iov_len = sizeof(header),
+    };
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(Serializer::MAX_FDS * sizeof(int))];
+
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (!fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+
+    ssize_t nbytes;
+    do {
+        nbytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (nbytes < 0 && errno == EINTR);
+
+    if (nbytes < 0)
+        return false;
+
+    /* the header is tiny, and a partial send on a stream socket
+       only happens on errors */
+    if (size_t(nbytes) != sizeof(header)) {
+        errno = EIO;
+        return false;
+    }
+
+    return send_full(fd, data.data, data.size);
+}
+
+static void
+close_fds(std::vector<int> &fds) noexcept
+{
+    for (int fd : fds)
+        if (fd >= 0)
+            close(fd);
+
+    fds.clear();
+}
+
+/**
+ * @return false on error (errno is set; ECONNRESET on premature end
+ * of stream)
+ */
+static bool
+receive_record(int fd, UpgradeRecordHeader &header,
+               std::vector<int> &fds, std::vector<uint8_t> &payload) noexcept
+{
+    struct iovec iov = {
+        .iov_base = &header,
+        .iov_len = sizeof(header),
+    };
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(Serializer::MAX_FDS * sizeof(int))];
+
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t nbytes;
+    do {
+        nbytes = recvmsg(fd, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC);
+    } while (nbytes < 0 && errno == EINTR);
+
+    if (nbytes < 0)
+        return false;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int *p = (const int *)(const void *)CMSG_DATA(cmsg);
+        fds.insert(fds.end(), p, p + n);
+    }
+
+    if (size_t(nbytes) != sizeof(header)) {
+        errno = ECONNRESET;
+        return false;
+    }
+
+    if (header.magic != UPGRADE_MAGIC ||
+        (msg.msg_flags & MSG_CTRUNC) != 0 ||
+        header.n_fds != fds.size()) {
+        errno = EPROTO;
+        return false;
+    }
+
+    payload.resize(header.length);
+    return recv_full(fd, payload.data(), payload.size());
+}
+
+static int
+setup_upgrade_socket(const char *path)
+{
+    struct sockaddr_un sun{};
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "upgrade socket path is too long\n");
+        exit(1);
+    }
+
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create socket: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+
+    /* a stale socket of a crashed process, or one which has handed
+       over to us */
+    unlink(path);
+
+    if (bind(fd, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        fprintf(stderr, "failed to bind to %s: %s\n",
+                path, strerror(errno));
+        exit(1);
+    }
+
+    if (listen(fd, 1) < 0) {
+        fprintf(stderr, "listen failed: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+
+    return fd;
+}
+
+UpgradeServer::UpgradeServer(Instance &_instance, const char *_path,
+                             UpgradeHandler &_handler)
+    :instance(_instance), handler(_handler), path(_path),
+     fd(setup_upgrade_socket(_path))
+{
+    assert(instance.pool == nullptr);
+
+    thread_event_set(&listener_event, fd, EV_READ|EV_PERSIST,
+                     ListenerCallback, this);
+    event_add(&listener_event, nullptr);
+}
+
+UpgradeServer::~UpgradeServer() noexcept
+{
+    event_del(&listener_event);
+    close(fd);
+
+    if (peer_fd < 0)
+        unlink(path.c_str());
+    else
+        /* the new process continues now */
+        close(peer_fd);
+}
+
+bool
+UpgradeServer::HandOver(int peer) noexcept
+{
+    unsigned n = 0;
+
+    for (auto i = instance.connections.begin();
+         i != instance.connections.end();) {
+        Connection &c = *i;
+        ++i;
+
+        Serializer s;
+        if (!c.Save(s))
+            continue;
+
+        const bool success = send_record(peer, UpgradeRecordType::CONNECTION, s);
+
+        /* its sockets are dead now, even if sending has failed */
+        c.Destroy();
+
+        if (!success) {
+            log_errno("failed to hand over a connection");
+            return false;
+        }
+
+        ++n;
+    }
+
+    Serializer s;
+    s.WriteFd(instance.server_socket);
+    if (!send_record(peer, UpgradeRecordType::LISTENER, s) ||
+        !send_record(peer, UpgradeRecordType::END, Serializer())) {
+        log_errno("failed to hand over the listener");
+        return false;
+    }
+
+    LogFormat(2, "handed over %u connections to the new process\n", n);
+    return true;
+}
+
+void
+UpgradeServer::ListenerCallback(int fd, short, void *ctx) noexcept
+{
+    auto &server = *(UpgradeServer *)ctx;
+
+    const int peer = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_errno("accept() failed");
+        return;
+    }
+
+    LogFormat(2, "new process connected, handing over\n");
+
+    set_upgrade_timeout(peer);
+
+    if (!server.HandOver(peer)) {
+        /* continue with the connections which are left */
+        close(peer);
+        return;
+    }
+
+    server.peer_fd = peer;
+    server.handler.OnUpgradeComplete();
+}
+
+static void
+receive_connection(Instance &instance, Deserializer &d, unsigned &n)
+{
+    try {
+        auto *c = connection_restore(&instance, d);
+        instance.connections.push_front(*c);
+        ++n;
+    } catch (const std::exception &e) {
+        LogFormat(1, "failed to take over a connection: %s\n", e.what());
+    }
+}
+
+static bool
+receive_listener(Instance &instance, Deserializer &d)
+{
+    try {
+        instance_setup_server_socket(&instance, d.ReadFd());
+        return true;
+    } catch (const std::exception &e) {
+        LogFormat(1, "failed to take over the listener: %s\n", e.what());
+        return false;
+    }
+}
+
+bool
+upgrade_takeover(Instance &instance, const char *path)
+{
+    struct sockaddr_un sun{};
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+        return false;
+
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_errno("failed to create socket");
+        return false;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        /* no previous process: start from scratch */
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            log_errno("failed to connect to the upgrade socket");
+        close(fd);
+        return false;
+    }
+
+    LogFormat(2, "taking over from the previous process\n");
+
+    set_upgrade_timeout(fd);
+
+    unsigned n = 0;
+    bool listener = false;
+
+    while (true) {
+        UpgradeRecordHeader header;
+        std::vector<int> fds;
+        std::vector<uint8_t> payload;
+
+        if (!receive_record(fd, header, fds, payload)) {
+            log_errno("upgrade failed");
+            close_fds(fds);
+            break;
+        }
+
+        Deserializer d({payload.data(), payload.size()}, fds);
+
+        switch (header.type) {
+        case UpgradeRecordType::CONNECTION:
+            receive_connection(instance, d, n);
+            break;
+
+        case UpgradeRecordType::LISTENER:
+            listener = receive_listener(instance, d);
+            break;
+
+        case UpgradeRecordType::END:
+            /* wait until the previous process has exited (or at
+               least released all listeners) */
+            {
+                uint8_t dummy;
+                while (recv(fd, &dummy, sizeof(dummy), 0) > 0) {}
+            }
+
+            break;
+        }
+
+        close_fds(fds);
+
+        if (header.type == UpgradeRecordType::END)
+            break;
+    }
+
+    close(fd);
+
+    LogFormat(2, "took over %u connections\n", n);
+    return listener;
+}
@@ -0,0 +1,100 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Hot upgrade: a new uoproxy process connects to the Unix socket of
+ * the running one ("upgrade_socket"), which passes its listener
+ * socket and all connections which are in game (with their sockets,
+ * via SCM_RIGHTS) to the new process and exits.  The new process
+ * continues relaying without reconnecting to the game server.
+ */
+
+#ifndef UOPROXY_UPGRADE_H
+#define UOPROXY_UPGRADE_H
+
+#include <event.h>
+
+#include <string>
+
+struct Instance;
+
+class UpgradeHandler {
+public:
+    /**
+     * Everything has been handed over to the new process; this one
+     * shall exit now.  The new process continues after the
+     * #UpgradeServer has been destroyed, which may happen within
+     * this method.
+     */
+    virtual void OnUpgradeComplete() noexcept = 0;
+};
+
+/**
+ * Listens on the "upgrade_socket" for a new process.  Only for a
+ * single event loop (no "workers").
+ */
+class UpgradeServer {
+    Instance &instance;
+    UpgradeHandler &handler;
+
+    const std::string path;
+
+    int fd;
+    struct event listener_event;
+
+    /**
+     * The connection to the new process after a complete handover.
+     * Closing it tells the new process that this one has released
+     * all listeners.
+     */
+    int peer_fd = -1;
+
+public:
+    UpgradeServer(Instance &_instance, const char *_path,
+                  UpgradeHandler &_handler);
+    ~UpgradeServer() noexcept;
+
+    UpgradeServer(const UpgradeServer &) = delete;
+    UpgradeServer &operator=(const UpgradeServer &) = delete;
+
+private:
+    /**
+     * Send the connections and the listener to the new process.
+     * Connections which have been sent are destroyed.
+     *
+     * @return true if everything has been sent
+     */
+    bool HandOver(int peer) noexcept;
+
+    static void ListenerCallback(int fd, short, void *ctx) noexcept;
+};
+
+/**
+ * Take over the listener socket and the connections of the previous
+ * process, if one is listening on the specified path.  Returns after
+ * the previous process has released everything.
+ *
+ * @return true if the listener socket has been taken over (i.e.
+ * instance_setup_server_socket() has been called)
+ */
+bool
+upgrade_takeover(Instance &instance, const char *path);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "Uring.hxx"
+#include "EventBase.hxx"
+#include "Log.hxx"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static thread_local Uring *the_thread_uring;
+
+Uring *
+thread_uring() noexcept
+{
+    return the_thread_uring;
+}
+
+void
+set_thread_uring(Uring *uring) noexcept
+{
+    the_thread_uring = uring;
+}
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *params) noexcept
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags) noexcept
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, nullptr, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, const void *arg,
+                  unsigned nr_args) noexcept
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *
+map_ring(int fd, size_t size, off_t offset) noexcept
+{
+    void *p = mmap(nullptr, size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, fd, offset);
+    return p != MAP_FAILED ? p : nullptr;
+}
+
+static void *
+map_anonymous(size_t size) noexcept
+{
+    void *p = mmap(nullptr, size, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    return p != MAP_FAILED ? p : nullptr;
+}
+
+inline
+Uring::Uring(int _fd, const struct io_uring_params &params)
+    :fd(_fd),
+     sq_ring_size(params.sq_off.array + params.sq_entries * sizeof(unsigned)),
+     sq_entries(params.sq_entries),
+     sqes_size(params.sq_entries * sizeof(struct io_uring_sqe)),
+     sq_local_tail(0),
+     cq_ring_size(params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe))
+{
+    /* with IORING_FEAT_SINGLE_MMAP, both rings share one mapping */
+    if (cq_ring_size > sq_ring_size)
+        sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+
+    sq_ring = map_ring(fd, sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = sq_ring;
+    sqes = (struct io_uring_sqe *)map_ring(fd, sqes_size, IORING_OFF_SQES);
+    buf_ring = (struct io_uring_buf *)
+        map_anonymous(N_BUFFERS * sizeof(struct io_uring_buf));
+    buffers = (uint8_t *)map_anonymous(N_BUFFERS * BUFFER_SIZE);
+
+    if (sq_ring == nullptr)
+        return;
+
+    auto *sq = (uint8_t *)sq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_flags = (unsigned *)(sq + params.sq_off.flags);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+
+    /* the SQ index array is the identity; it is never modified
+       again */
+    auto *sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i)
+        sq_array[i] = i;
+
+    sq_local_tail = *sq_tail;
+
+    auto *cq = (uint8_t *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    thread_event_set(&event, fd, EV_READ|EV_PERSIST, EventCallback, this);
+}
+
+Uring::~Uring() noexcept
+{
+    assert(n_users == 0);
+
+    if (sq_ring != nullptr)
+        event_del(&event);
+
+    if (buffers != nullptr)
+        munmap(buffers, N_BUFFERS * BUFFER_SIZE);
+    if (buf_ring != nullptr)
+        munmap(buf_ring, N_BUFFERS * sizeof(struct io_uring_buf));
+    if (sqes != nullptr)
+        munmap(sqes, sqes_size);
+    if (sq_ring != nullptr)
+        munmap(sq_ring, sq_ring_size);
+
+    close(fd);
+}
+
+inline bool
+Uring::InitBuffers() noexcept
+{
+    if (sq_ring == nullptr || sqes == nullptr ||
+        buf_ring == nullptr || buffers == nullptr)
+        return false;
+
+    struct io_uring_buf_reg reg{};
+    reg.ring_addr = (uintptr_t)buf_ring;
+    reg.ring_entries = N_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for (unsigned i = 0; i < N_BUFFERS; ++i)
+        RecycleBuffer(i);
+
+    return true;
+}
+
+std::unique_ptr<Uring>
+Uring::Create() noexcept
+{
+    struct io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+
+    /* each socket has at most one receive and one send in flight,
+       but a multishot receive may post many completions */
+    params.cq_entries = 4096;
+
+    int fd = io_uring_setup(256, &params);
+    if (fd < 0) {
+        LogFormat(1, "io_uring_setup() failed: %s; using libevent\n",
+                  strerror(errno));
+        return nullptr;
+    }
+
+    if ((params.features & (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP)) !=
+        (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP)) {
+        LogFormat(1, "io_uring is too old; using libevent\n");
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<Uring> uring(new Uring(fd, params));
+    if (!uring->InitBuffers()) {
+        LogFormat(1, "io_uring provided buffers are not available: %s; using libevent\n",
+                  strerror(errno));
+        return nullptr;
+    }
+
+    LogFormat(2, "using io_uring\n");
+    return uring;
+}
+
+void
+Uring::AddUser() noexcept
+{
+    if (n_users++ == 0)
+        event_add(&event, nullptr);
+}
+
+void
+Uring::RemoveUser() noexcept
+{
+    assert(n_users > 0);
+
+    if (--n_users == 0)
+        event_del(&event);
+}
+
+struct io_uring_sqe &
+Uring::Prepare(UringOperation *operation) noexcept
+{
+    while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        /* the queue is full */
+        Submit();
+
+    auto &sqe = sqes[sq_local_tail++ & sq_mask];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = (uintptr_t)operation;
+
+    ScheduleFlush();
+    return sqe;
+}
+
+void
+Uring::CancelOperation(const UringOperation &operation) noexcept
+{
+    auto &sqe = Prepare(nullptr);
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = (uintptr_t)&operation;
+}
+
+void
+Uring::Submit() noexcept
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+    /* all SQEs between the kernel's head and our tail, including
+       those left over by an earlier short submission */
+    const unsigned n = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (n == 0)
+        return;
+
+    if (io_uring_enter(fd, n, 0, 0) < 0 && errno != EINTR)
+        log_errno("io_uring_enter() failed");
+}
+
+void
+Uring::RecycleBuffer(unsigned bid) noexcept
+{
+    assert(bid < N_BUFFERS);
+
+    /* don't touch "resv"; the first one is the ring tail */
+    auto &buf = buf_ring[buf_tail & (N_BUFFERS - 1)];
+    buf.addr = (uintptr_t)(buffers + bid * BUFFER_SIZE);
+    buf.len = BUFFER_SIZE;
+    buf.bid = bid;
+
+    __atomic_store_n(&buf_ring[0].resv, ++buf_tail, __ATOMIC_RELEASE);
+}
+
+inline void
+Uring::Dispatch(const struct io_uring_cqe &cqe) noexcept
+{
+    auto *operation = (UringOperation *)(uintptr_t)cqe.user_data;
+    if (operation == nullptr)
+        /* the result of a cancellation */
+        return;
+
+    operation->OnUringCompletion(cqe.res, cqe.flags);
+}
+
+void
+Uring::WaitOne(const UringOperation &a, const UringOperation &b) noexcept
+{
+    Submit();
+
+    bool found = false;
+    while (!found) {
+        if (io_uring_enter(fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            log_errno("io_uring_enter() failed");
+            break;
+        }
+
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            const auto cqe = cqes[head++ & cq_mask];
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            const auto *operation = (const UringOperation *)(uintptr_t)cqe.user_data;
+            if (operation == &a || operation == &b) {
+                found = true;
+                Dispatch(cqe);
+            } else if (operation != nullptr)
+                deferred.push_back(cqe);
+        }
+    }
+
+    if (!deferred.empty())
+        event_active(&event, EV_READ, 0);
+}
+
+inline void
+Uring::DispatchCompletions() noexcept
+{
+    if (!deferred.empty()) {
+        auto d = std::move(deferred);
+        deferred.clear();
+        for (const auto &cqe : d)
+            Dispatch(cqe);
+    }
+
+    /* don't starve the rest of the event loop: at most one ring's
+       worth of completions per call; the fd stays readable if there
+       are more */
+    for (unsigned i = 0; i <= cq_mask; ++i) {
+        /* reload it each time: a handler may have called WaitOne() */
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+                /* let the kernel move its overflow list to the
+                   ring; we get here again when it's readable */
+                io_uring_enter(fd, 0, 0, IORING_ENTER_GETEVENTS);
+            break;
+        }
+
+        /* copy it before releasing the slot to the kernel */
+        const auto cqe = cqes[head++ & cq_mask];
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        Dispatch(cqe);
+    }
+}
+
+void
+Uring::EventCallback(int, short, void *ctx) noexcept
+{
+    auto &uring = *(Uring *)ctx;
+    uring.DispatchCompletions();
+}
+
+void
+Uring::DoFlush() noexcept
+{
+    Submit();
+}
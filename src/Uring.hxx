@@ -0,0 +1,186 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A minimal io_uring event loop extension, talking to the kernel with
+ * raw system calls.  Each event loop thread may have one ring; its
+ * file descriptor is registered with libevent, and completions are
+ * dispatched from there.  Submissions are queued and handed to the
+ * kernel at once after the current event loop iteration (see
+ * #PendingFlush).
+ */
+
+#ifndef UOPROXY_URING_H
+#define UOPROXY_URING_H
+
+#include "Flush.hxx"
+#include "util/ConstBuffer.hxx"
+
+#include <linux/io_uring.h>
+#include <event.h>
+
+#include <memory>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An operation submitted to the #Uring; its address is the SQE's
+ * user_data.
+ */
+class UringOperation {
+public:
+    /**
+     * @param res the CQE's result (negative errno on error)
+     * @param flags the CQE flags, e.g. IORING_CQE_F_MORE
+     */
+    virtual void OnUringCompletion(int res, unsigned flags) noexcept = 0;
+};
+
+class Uring final : PendingFlush {
+    const int fd;
+
+    /* the submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_flags;
+    unsigned sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /**
+     * Our copy of the SQ tail, ahead of #sq_tail by the number of
+     * SQEs which have not been submitted yet.
+     */
+    unsigned sq_local_tail;
+
+    /* the completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /**
+     * The provided buffer ring (buffer group #BUFFER_GROUP).  This is
+     * not declared as struct io_uring_buf_ring, because in C++, its
+     * flexible array member is moved behind an empty struct, which
+     * breaks the layout; the ring tail is the "resv" field of the
+     * first entry.
+     */
+    struct io_uring_buf *buf_ring;
+    uint8_t *buffers;
+    uint16_t buf_tail = 0;
+
+    struct event event;
+
+    /**
+     * The number of sockets using this ring; #event is only pending
+     * while there are some, so the event loop can finish.
+     */
+    unsigned n_users = 0;
+
+    /**
+     * Completions which were reaped by Wait() on behalf of another
+     * operation; they are dispatched from #event.
+     */
+    std::vector<struct io_uring_cqe> deferred;
+
+    Uring(int _fd, const struct io_uring_params &params);
+
+public:
+    static constexpr uint16_t BUFFER_GROUP = 0;
+    static constexpr unsigned N_BUFFERS = 256;
+    static constexpr size_t BUFFER_SIZE = 4096;
+
+    ~Uring() noexcept;
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    /**
+     * Create a ring for the calling thread's event loop.
+     *
+     * @return nullptr (after logging the reason) if the kernel does
+     * not support what we need
+     */
+    static std::unique_ptr<Uring> Create() noexcept;
+
+    void AddUser() noexcept;
+    void RemoveUser() noexcept;
+
+    /**
+     * Obtain a cleared SQE which will be submitted after the current
+     * event loop iteration.
+     */
+    struct io_uring_sqe &Prepare(UringOperation *operation) noexcept;
+
+    /**
+     * Ask the kernel to cancel the operation; it completes with
+     * -ECANCELED (unless it completes normally first).
+     */
+    void CancelOperation(const UringOperation &operation) noexcept;
+
+    /**
+     * Submit all prepared SQEs now.
+     */
+    void Submit() noexcept;
+
+    /**
+     * Submit and block until a completion for one of the two
+     * operations has been dispatched, deferring all others.  Used to
+     * wait for outstanding operations before handing a socket over
+     * to another thread.
+     */
+    void WaitOne(const UringOperation &a, const UringOperation &b) noexcept;
+
+    ConstBuffer<uint8_t> GetBuffer(unsigned bid, size_t length) const noexcept {
+        return {buffers + bid * BUFFER_SIZE, length};
+    }
+
+    /**
+     * Give a provided buffer back to the kernel.
+     */
+    void RecycleBuffer(unsigned bid) noexcept;
+
+private:
+    bool InitBuffers() noexcept;
+
+    void Dispatch(const struct io_uring_cqe &cqe) noexcept;
+    void DispatchCompletions() noexcept;
+
+    static void EventCallback(int fd, short event, void *ctx) noexcept;
+
+protected:
+    /* virtual methods from PendingFlush */
+    void DoFlush() noexcept override;
+};
+
+/**
+ * Returns the #Uring of the event loop running in the calling thread,
+ * or nullptr if io_uring is not used.
+ */
+Uring *
+thread_uring() noexcept;
+
+void
+set_thread_uring(Uring *uring) noexcept;
+
+#endif
@@ -31,6 +31,10 @@
 #include "PacketType.hxx"
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <assert.h>
 
 static inline bool
@@ -39,11 +43,37 @@ char_is_printable(char ch)
     return (signed char)ch >= 0x20;
 }
 
+#ifdef __SSE2__
+
+/**
+ * Returns a bit mask of the non-printable characters (including the
+ * null terminator) in the 16 bytes at the specified address.
+ */
+static inline unsigned
+sse2_non_printable_mask(const char *p)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    /* signed comparison: bytes 0x80..0xff are negative */
+    return _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+}
+
+#endif
+
 static inline bool
 verify_printable_asciiz(const char *p, size_t length)
 {
-    size_t i;
-    for (i = 0; i < length && p[i] != 0; ++i)
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16) {
+        const unsigned mask = sse2_non_printable_mask(p + i);
+        if (mask != 0)
+            /* the first one must be the null terminator */
+            return p[i + __builtin_ctz(mask)] == 0;
+    }
+#endif
+
+    for (; i < length && p[i] != 0; ++i)
         if (!char_is_printable(p[i]))
             return false;
     return true;
@@ -52,8 +82,15 @@ verify_printable_asciiz(const char *p, size_t length)
 static inline bool
 verify_printable_asciiz_n(const char *p, size_t length)
 {
-    size_t i;
-    for (i = 0; i < length; ++i)
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16)
+        if (sse2_non_printable_mask(p + i) != 0)
+            return false;
+#endif
+
+    for (; i < length; ++i)
         if (!char_is_printable(p[i]))
             return false;
     return p[length] == 0;
@@ -24,59 +24,81 @@
 #include "PacketType.hxx"
 #include "Server.hxx"
 #include "Client.hxx"
+#include "Instance.hxx"
 #include "Log.hxx"
 
 #include <assert.h>
-#include <string.h>
 
+/**
+ * Samples further apart than this are not part of a continuous walk
+ * and are ignored by the interval estimate.
+ */
+static constexpr WalkState::Clock::duration WALK_IDLE = std::chrono::seconds(1);
+
+/**
+ * Update a smoothed estimate with a new sample, weighting it 1/8.
+ */
 static void
-walk_shift(WalkState &state)
+walk_smooth(WalkState::Clock::duration &estimate,
+            WalkState::Clock::duration sample) noexcept
 {
-    assert(state.queue_size > 0);
-
-    --state.queue_size;
-
-    if (state.queue_size == 0)
-        state.server = nullptr;
+    if (estimate == WalkState::Clock::duration::zero())
+        estimate = sample;
     else
-        memmove(state.queue, state.queue + 1,
-                state.queue_size * sizeof(*state.queue));
+        estimate += (sample - estimate) / 8;
 }
 
-static const WalkState::Item *
-find_by_seq(WalkState &state,
-            uint8_t seq)
+/**
+ * How many walk requests may be in flight?  Enough to cover a slow
+ * (90th percentile) round trip at the client's walking speed, plus
+ * some slack; before both have been measured, the configured maximum.
+ */
+static unsigned
+walk_depth(const WalkState &state, const LatencyHistogram &rtt,
+           unsigned limit) noexcept
 {
-    unsigned i;
-
-    for (i = 0; i < state.queue_size; i++)
-        if (state.queue[i].seq == seq)
-            return &state.queue[i];
-
-    return nullptr;
+    if (rtt.IsEmpty() ||
+        state.interval == WalkState::Clock::duration::zero())
+        return limit;
+
+    unsigned depth = unsigned(rtt.Percentile(90) / state.interval) + 2;
+    if (depth < MIN_WALK_QUEUE)
+        depth = MIN_WALK_QUEUE;
+    return depth < limit ? depth : limit;
 }
 
 static void
-remove_item(WalkState &state,
-            const WalkState::Item *item)
+walk_pop(WalkState &state) noexcept
 {
-    unsigned i = item - state.queue;
-
-    assert(i < state.queue_size);
+    assert(state.queue_size > 0);
 
+    state.queue_head = (state.queue_head + 1) % MAX_WALK_QUEUE;
     --state.queue_size;
 
-    if (i < state.queue_size)
-        memmove(state.queue + i, state.queue + 1,
-                (state.queue_size - i) * sizeof(*state.queue));
-    else if (state.queue_size == 0)
+    if (state.queue_size == 0)
         state.server = nullptr;
 }
 
+/**
+ * Returns the position of the item with the specified server
+ * sequence number, or -1 if there is none.
+ */
+static int
+find_by_seq(WalkState &state,
+            uint8_t seq) noexcept
+{
+    for (unsigned i = 0; i < state.queue_size; i++)
+        if (state[i].seq == seq)
+            return (int)i;
+
+    return -1;
+}
+
 static void
-walk_clear(WalkState &state)
+walk_clear(WalkState &state) noexcept
 {
     state.server = nullptr;
+    state.queue_head = 0;
     state.queue_size = 0;
 }
 
@@ -113,6 +135,7 @@ connection_walk_request(LinkedServer &ls,
 {
     auto &connection = *ls.connection;
     auto &state = connection.walk;
+    const auto &config = connection.instance.config;
 
     if (state.queue_size > 0 && &ls != state.server) {
         ls.LogF(2, "rejecting walk");
@@ -120,30 +143,59 @@ connection_walk_request(LinkedServer &ls,
         return;
     }
 
-    if (state.queue_size >= MAX_WALK_QUEUE) {
-        /* XXX */
+    const auto now = WalkState::Clock::now();
+    if (state.queue_size > 0 && now - state.last_request < WALK_IDLE)
+        walk_smooth(state.interval, now - state.last_request);
+    state.last_request = now;
+
+    if (state.queue_size >= walk_depth(state, connection.upstream_rtt,
+                                      config.walk_queue)) {
+        /* reject this step; the client resets its sequence, so the
+           steps still in flight must not be acknowledged to it, and
+           it needs the final position once the server has replied */
         ls.LogF(2, "walk queue full");
-        walk_cancel(connection.client.world, *ls.server,
-                    state.queue[0].packet);
-        walk_shift(state);
+        walk_cancel(connection.client.world, *ls.server, p);
+
+        for (unsigned j = 0; j < state.queue_size; ++j) {
+            auto &i = state[j];
+            i.forward_ack = false;
+            i.resync_owner = true;
+        }
+
+        return;
     }
 
     state.server = &ls;
-    auto *i = &state.queue[state.queue_size++];
-    i->packet = p;
+    auto &i = state.Append();
+    i.packet = p;
+    i.sent = now;
+    i.forward_ack = !config.walk_optimistic_ack;
+    i.resync_owner = false;
 
     ls.LogF(7, "walk seq_from_client=%u seq_to_server=%u",
             p.seq, state.seq_next);
 
     auto walk = p;
-    walk.seq = i->seq = (uint8_t)state.seq_next++;
+    walk.seq = i.seq = (uint8_t)state.seq_next++;
     uo_client_send(connection.client.client, &walk, sizeof(walk));
 
     if (state.seq_next == 0)
         state.seq_next = 1;
+
+    if (config.walk_optimistic_ack) {
+        /* don't wait for the server; if it rejects the step, its
+           WalkCancel moves the client back */
+        const struct uo_packet_walk_ack ack = {
+            .cmd = PCK_WalkAck,
+            .seq = p.seq,
+            .notoriety = state.notoriety,
+        };
+
+        uo_server_send(ls.server, &ack, sizeof(ack));
+    }
 }
 
-static void
+void
 connection_resync(Connection &c)
 {
     walk_clear(c.walk);
@@ -165,21 +217,23 @@ connection_walk_cancel(Connection &c,
 
     state.seq_next = 0;
 
-    auto *i = find_by_seq(state, p.seq);
+    const int n = find_by_seq(state, p.seq);
 
-    if (i != nullptr)
+    if (n >= 0)
         LogFormat(7, "walk_cancel seq_to_client=%u seq_from_server=%u\n",
-                  i->packet.seq, p.seq);
+                  state[n].packet.seq, p.seq);
     else
         LogFormat(7, "walk_cancel seq_from_server=%u\n", p.seq);
 
     c.client.world.WalkCancel(p.x, p.y, p.direction);
 
-    /* only send to requesting client */
+    /* only send to requesting client; even if the step is unknown,
+       or has already been acknowledged optimistically, the client
+       must learn its real position */
 
-    if (i != nullptr && state.server != nullptr) {
+    if (state.server != nullptr) {
         auto cancel = p;
-        cancel.seq = i->packet.seq;
+        cancel.seq = state[n >= 0 ? n : 0].packet.seq;
         uo_server_send(state.server->server, &cancel, sizeof(cancel));
     }
 
@@ -192,21 +246,32 @@ connection_walk_ack(Connection &c,
 {
     auto &state = c.walk;
 
-    auto *i = find_by_seq(state, p.seq);
-    if (i == nullptr) {
+    const int n = find_by_seq(state, p.seq);
+    if (n < 0) {
         LogFormat(1, "WalkAck out of sync\n");
         connection_resync(c);
         return;
     }
 
+    /* acks arrive in order; older steps will never be acknowledged */
+    for (int j = 0; j < n; ++j) {
+        LogFormat(3, "walk seq_to_server=%u lost\n", state.Front().seq);
+        walk_pop(state);
+    }
+
+    const auto &i = state.Front();
+
     LogFormat(7, "walk_ack seq_to_client=%u seq_from_server=%u\n",
-              i->packet.seq, p.seq);
+              i.packet.seq, p.seq);
+
+    c.upstream_rtt.Record(WalkState::Clock::now() - i.sent);
+    state.notoriety = p.notoriety;
 
     unsigned x = c.client.world.packet_start.x;
     unsigned y = c.client.world.packet_start.y;
 
-    if ((c.client.world.packet_start.direction & 0x07) == (i->packet.direction & 0x07)) {
-        switch (i->packet.direction & 0x07) {
+    if ((c.client.world.packet_start.direction & 0x07) == (i.packet.direction & 0x07)) {
+        switch (i.packet.direction & 0x07) {
         case 0: /* north */
             --y;
             break;
@@ -239,12 +304,12 @@ connection_walk_ack(Connection &c,
     }
 
     c.client.world.Walked(x, y,
-                          i->packet.direction, p.notoriety);
+                          i.packet.direction, p.notoriety);
 
     /* forward ack to requesting client */
-    if (state.server != nullptr) {
+    if (state.server != nullptr && i.forward_ack) {
         auto ack = p;
-        ack.seq = i->packet.seq;
+        ack.seq = i.packet.seq;
         uo_server_send(state.server->server, &ack, sizeof(ack));
     }
 
@@ -254,18 +319,18 @@ connection_walk_ack(Connection &c,
     /* unfortunately, this doesn't work anymore with client v7 */
     struct uo_packet_walk_force force = {
         .cmd = PCK_WalkForce,
-        .direction = i->packet.direction & 0x7,
+        .direction = i.packet.direction & 0x7,
     };
 #endif
 
     const struct uo_packet_mobile_update *mu =
         &c.client.world.packet_mobile_update;
 
-    if (state.server != nullptr)
+    if (state.server != nullptr && !i.resync_owner)
         c.BroadcastToInGameClientsExcept(mu, sizeof(*mu),
                                          *state.server);
     else
         c.BroadcastToInGameClients(mu, sizeof(*mu));
 
-    remove_item(state, i);
+    walk_pop(state);
 }
@@ -0,0 +1,98 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "WorkerIndex.hxx"
+#include "PacketStructs.hxx"
+
+#include <assert.h>
+#include <string.h>
+
+/**
+ * How long does an auth_id stay in the index?  This is much longer
+ * than the zombie timeout; a stale entry is harmless.
+ */
+static constexpr std::chrono::seconds AUTH_ID_LIFETIME{60};
+
+/**
+ * Build a map key which compares like CredentialsFragment::operator==.
+ */
+static std::string
+MakeKey(const UO::CredentialsFragment &c) noexcept
+{
+    std::string key(c.username, strnlen(c.username, sizeof(c.username)));
+    key.push_back(0);
+    key.append(c.password, strnlen(c.password, sizeof(c.password)));
+    return key;
+}
+
+unsigned
+WorkerIndex::AcquireCredentials(const UO::CredentialsFragment &c,
+                                unsigned worker) noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    auto i = credentials.emplace(MakeKey(c), Owner{worker, 0}).first;
+    if (i->second.worker == worker)
+        ++i->second.n;
+
+    return i->second.worker;
+}
+
+void
+WorkerIndex::ReleaseCredentials(const UO::CredentialsFragment &c) noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    auto i = credentials.find(MakeKey(c));
+    assert(i != credentials.end());
+    assert(i->second.n > 0);
+
+    if (--i->second.n == 0)
+        credentials.erase(i);
+}
+
+void
+WorkerIndex::AddAuthId(uint32_t auth_id, unsigned worker) noexcept
+{
+    const auto now = Clock::now();
+
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto i = auth_ids.begin(); i != auth_ids.end();) {
+        if (now >= i->second.expires)
+            i = auth_ids.erase(i);
+        else
+            ++i;
+    }
+
+    auth_ids[auth_id] = AuthId{worker, now + AUTH_ID_LIFETIME};
+}
+
+int
+WorkerIndex::FindAuthId(uint32_t auth_id) noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    auto i = auth_ids.find(auth_id);
+    if (i == auth_ids.end() || Clock::now() >= i->second.expires)
+        return -1;
+
+    return (int)i->second.worker;
+}
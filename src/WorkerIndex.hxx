@@ -0,0 +1,90 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_WORKER_INDEX_H
+#define UOPROXY_WORKER_INDEX_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <stdint.h>
+
+namespace UO { struct CredentialsFragment; }
+
+/**
+ * A small thread-safe index shared by all workers.  It records which
+ * worker owns the connections of an account, and which worker holds
+ * the zombie for a Razor redirect, so a client which was accepted by
+ * another worker can be handed over.
+ */
+class WorkerIndex {
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex;
+
+    struct Owner {
+        unsigned worker;
+
+        /**
+         * The number of connections of this worker which have
+         * acquired the credentials.
+         */
+        unsigned n;
+    };
+
+    std::map<std::string, Owner> credentials;
+
+    struct AuthId {
+        unsigned worker;
+        Clock::time_point expires;
+    };
+
+    std::unordered_map<uint32_t, AuthId> auth_ids;
+
+public:
+    /**
+     * Acquire the credentials for the given worker, unless they are
+     * owned by another worker already.
+     *
+     * @return the owning worker; if it is not the given one, nothing
+     * has been acquired
+     */
+    unsigned AcquireCredentials(const UO::CredentialsFragment &c,
+                                unsigned worker) noexcept;
+
+    void ReleaseCredentials(const UO::CredentialsFragment &c) noexcept;
+
+    /**
+     * Remember the worker which has sent a Razor redirect with this
+     * auth_id.  Entries expire automatically.
+     */
+    void AddAuthId(uint32_t auth_id, unsigned worker) noexcept;
+
+    /**
+     * @return the worker which has sent a redirect with this auth_id,
+     * or -1 if unknown
+     */
+    int FindAuthId(uint32_t auth_id) noexcept;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "WorkerPool.hxx"
+#include "Instance.hxx"
+#include "Config.hxx"
+#include "EventBase.hxx"
+#include "Log.hxx"
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+#include "Uring.hxx"
+#endif
+
+#include <assert.h>
+#include <signal.h>
+
+WorkerPool::WorkerPool(Config &config, unsigned n) noexcept
+{
+    assert(n > 0);
+
+    instances.reserve(n);
+    for (unsigned i = 0; i < n; ++i)
+        instances.emplace_back(std::make_unique<Instance>(config, this, i));
+}
+
+WorkerPool::~WorkerPool() noexcept
+{
+    Join();
+}
+
+void
+WorkerPool::Run(Instance &instance) noexcept
+{
+    /* signals are handled by the main thread */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+    struct event_base *event_base = event_base_new();
+    set_thread_event_base(event_base);
+    set_thread_flush_context(&instance.flush);
+    set_thread_timer_wheel(&instance.timer_wheel);
+
+#ifdef HAVE_IO_URING
+    std::unique_ptr<Uring> uring;
+    if (instance.config.io_uring) {
+        uring = Uring::Create();
+        set_thread_uring(uring.get());
+    }
+#endif
+
+    instance.timer_wheel.Init();
+    instance.reconnect_scheduler.Init();
+    instance_setup_mailbox(&instance);
+    instance_setup_server_socket(&instance);
+    instance_setup_metrics(&instance);
+    instance_setup_idle_release(&instance);
+
+    LogFormat(2, "worker %u started\n", instance.worker_id);
+
+    run_event_loop(event_base, instance.flush);
+
+#ifdef HAVE_IO_URING
+    set_thread_uring(nullptr);
+    uring.reset();
+#endif
+
+    set_thread_timer_wheel(nullptr);
+    set_thread_flush_context(nullptr);
+    set_thread_event_base(nullptr);
+    event_base_free(event_base);
+}
+
+void
+WorkerPool::Start()
+{
+    for (size_t i = 1; i < instances.size(); ++i)
+        threads.emplace_back(Run, std::ref(*instances[i]));
+}
+
+void
+WorkerPool::Stop() noexcept
+{
+    for (size_t i = 1; i < instances.size(); ++i)
+        instances[i]->PostQuit();
+}
+
+void
+WorkerPool::Join() noexcept
+{
+    for (auto &i : threads)
+        i.join();
+
+    threads.clear();
+}
@@ -0,0 +1,79 @@
+/*
+ * uoproxy
+ *
+ * Copyright 2005-2020 Max Kellermann <max.kellermann@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef UOPROXY_WORKER_POOL_H
+#define UOPROXY_WORKER_POOL_H
+
+#include "WorkerIndex.hxx"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+struct Config;
+struct Instance;
+
+/**
+ * Runs several #Instance objects, each with its own event loop and
+ * its own SO_REUSEPORT listener.  The first one is run by the main
+ * thread, the others get a thread each.
+ */
+class WorkerPool {
+    std::vector<std::unique_ptr<Instance>> instances;
+    std::vector<std::thread> threads;
+
+public:
+    WorkerIndex index;
+
+    WorkerPool(Config &config, unsigned n) noexcept;
+    ~WorkerPool() noexcept;
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    unsigned GetSize() const noexcept {
+        return instances.size();
+    }
+
+    Instance &Get(unsigned worker_id) noexcept {
+        return *instances[worker_id];
+    }
+
+    /**
+     * Launch the worker threads (all but the first #Instance).
+     */
+    void Start();
+
+    /**
+     * Ask all worker threads to shut down; call this in the main
+     * thread.
+     */
+    void Stop() noexcept;
+
+    /**
+     * Wait for all worker threads to finish.
+     */
+    void Join() noexcept;
+
+private:
+    static void Run(Instance &instance) noexcept;
+};
+
+#endif
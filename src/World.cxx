@@ -22,8 +22,13 @@
 #include "Log.hxx"
 #include "Bridge.hxx"
 #include "PacketLengths.hxx"
+#include "Serialize.hxx"
+
+#include <stdexcept>
+#include <vector>
 
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 
 inline void
@@ -35,11 +40,7 @@ Item::Apply(const struct uo_packet_world_item &p) noexcept
 Item *
 World::FindItem(uint32_t serial) noexcept
 {
-    for (auto &i : items)
-        if (i.serial == serial)
-            return &i;
-
-    return nullptr;
+    return items_by_serial.Find(serial);
 }
 
 Item &
@@ -49,18 +50,189 @@ World::MakeItem(uint32_t serial) noexcept
     if (i != nullptr)
         return *i;
 
-    i = new Item(serial);
+    i = item_allocator.New(serial);
     items.push_front(*i);
+    items_by_serial.Insert(*i);
     return *i;
 }
 
+void
+World::UnlinkParent(Item &item) noexcept
+{
+    if (item.indexed_parent_serial == 0)
+        return;
+
+    auto c = children.find(item.indexed_parent_serial);
+    assert(c != children.end());
+
+    static_cast<IntrusiveListTaggedHook<ItemSiblingTag> &>(item).tagged_hook.unlink();
+    if (c->second.empty())
+        children.erase(c);
+
+    item.indexed_parent_serial = 0;
+}
+
+void
+World::UpdateParent(Item &item) noexcept
+{
+    const uint32_t parent_serial = item.GetParentSerial();
+    if (parent_serial == item.indexed_parent_serial)
+        return;
+
+    UnlinkParent(item);
+
+    if (parent_serial != 0) {
+        children[parent_serial].push_back(item);
+        item.indexed_parent_serial = parent_serial;
+    }
+}
+
+void
+World::UnlinkGrid(Item &item) noexcept
+{
+    if (item.grid_cell == NO_GRID_CELL)
+        return;
+
+    auto c = grid.find(item.grid_cell);
+    assert(c != grid.end());
+
+    static_cast<IntrusiveListTaggedHook<WorldGridTag> &>(item).tagged_hook.unlink();
+    if (c->second.empty())
+        grid.erase(c);
+
+    item.grid_cell = NO_GRID_CELL;
+}
+
+void
+World::UpdateGrid(Item &item) noexcept
+{
+    const uint32_t cell = view_range > 0 && item.socket.cmd == PCK_WorldItem7
+        ? MakeGridCell(item.socket.ground.x, item.socket.ground.y)
+        : NO_GRID_CELL;
+    if (cell == item.grid_cell)
+        return;
+
+    UnlinkGrid(item);
+
+    if (cell != NO_GRID_CELL) {
+        grid[cell].items.push_back(item);
+        item.grid_cell = cell;
+    }
+}
+
+void
+World::UnlinkGrid(Mobile &mobile) noexcept
+{
+    if (mobile.grid_cell == NO_GRID_CELL)
+        return;
+
+    auto c = grid.find(mobile.grid_cell);
+    assert(c != grid.end());
+
+    static_cast<IntrusiveListTaggedHook<WorldGridTag> &>(mobile).tagged_hook.unlink();
+    if (c->second.empty())
+        grid.erase(c);
+
+    mobile.grid_cell = NO_GRID_CELL;
+}
+
+void
+World::UpdateGrid(Mobile &mobile) noexcept
+{
+    /* the player is never evicted */
+    const uint32_t cell = view_range > 0 &&
+        mobile.serial != packet_start.serial &&
+        mobile.packet_mobile_incoming != nullptr
+        ? MakeGridCell(mobile.packet_mobile_incoming->x,
+                       mobile.packet_mobile_incoming->y)
+        : NO_GRID_CELL;
+    if (cell == mobile.grid_cell)
+        return;
+
+    UnlinkGrid(mobile);
+
+    if (cell != NO_GRID_CELL) {
+        grid[cell].mobiles.push_back(mobile);
+        mobile.grid_cell = cell;
+    }
+}
+
+/**
+ * The distance of a coordinate to the nearest tile of a grid cell
+ * along one axis.
+ */
+static constexpr unsigned
+GridDistance(unsigned position, unsigned cell_index) noexcept
+{
+    const unsigned low = cell_index << World::GRID_SHIFT;
+    const unsigned high = low + (1u << World::GRID_SHIFT) - 1;
+
+    return position < low
+        ? low - position
+        : (position > high ? position - high : 0);
+}
+
+void
+World::EvictCell(uint32_t cell) noexcept
+{
+    while (true) {
+        auto c = grid.find(cell);
+        if (c == grid.end())
+            break;
+
+        if (!c->second.items.empty()) {
+            const uint32_t serial = c->second.items.front().serial;
+            RemoveItemSerial(serial);
+        } else
+            RemoveMobileSerial(c->second.mobiles.front().serial);
+    }
+}
+
+void
+World::PlayerMoved() noexcept
+{
+    if (view_range == 0)
+        return;
+
+    const unsigned x = packet_start.x, y = packet_start.y;
+    const uint32_t cell = MakeGridCell(x, y);
+    if (cell == player_cell)
+        return;
+
+    player_cell = cell;
+
+    std::vector<uint32_t> far;
+    for (const auto &i : grid) {
+        const unsigned dx = GridDistance(x, i.first >> 16);
+        const unsigned dy = GridDistance(y, i.first & 0xffff);
+        if (dx > view_range || dy > view_range)
+            far.push_back(i.first);
+    }
+
+    if (far.empty())
+        return;
+
+    const size_t n_items = items_by_serial.size(),
+        n_mobiles = mobiles_by_serial.size();
+
+    for (const uint32_t i : far)
+        EvictCell(i);
+
+    LogFormat(7, "evicted %zu items and %zu mobiles out of view range\n",
+              n_items - items_by_serial.size(),
+              n_mobiles - mobiles_by_serial.size());
+}
+
 void
 World::Apply(const struct uo_packet_world_item &p) noexcept
 {
     assert(p.cmd == PCK_WorldItem);
     assert(p.length <= sizeof(p));
 
-    MakeItem(p.serial & PackedBE32(0x7fffffff)).Apply(p);
+    auto &i = MakeItem(p.serial & PackedBE32(0x7fffffff));
+    i.Apply(p);
+    UpdateParent(i);
+    UpdateGrid(i);
 }
 
 void
@@ -68,7 +240,10 @@ World::Apply(const struct uo_packet_world_item_7 &p) noexcept
 {
     assert(p.cmd == PCK_WorldItem7);
 
-    MakeItem(p.serial).Apply(p);
+    auto &i = MakeItem(p.serial);
+    i.Apply(p);
+    UpdateParent(i);
+    UpdateGrid(i);
 }
 
 void
@@ -76,7 +251,10 @@ World::Apply(const struct uo_packet_equip &p) noexcept
 {
     assert(p.cmd == PCK_Equip);
 
-    MakeItem(p.serial).Apply(p);
+    auto &i = MakeItem(p.serial);
+    i.Apply(p);
+    UpdateParent(i);
+    UpdateGrid(i);
 }
 
 void
@@ -92,10 +270,25 @@ World::SweepAfterContainerUpdate(uint32_t parent_serial) noexcept
 {
     const unsigned attach_sequence = item_attach_sequence;
 
-    items.remove_and_dispose_if([parent_serial, attach_sequence](const Item &i){
-        return i.GetParentSerial() == parent_serial &&
-            i.attach_sequence != attach_sequence;
-    }, [](Item *i){ delete i; });
+    auto c = children.find(parent_serial);
+    if (c == children.end())
+        return;
+
+    /* collect first; RemoveItem() may erase the list from the map */
+    ItemChildList obsolete;
+    c->second.remove_and_dispose_if([attach_sequence](const Item &i){
+        return i.attach_sequence != attach_sequence;
+    }, [&obsolete](Item *i){
+        obsolete.push_back(*i);
+    });
+
+    if (c->second.empty())
+        children.erase(c);
+
+    obsolete.clear_and_dispose([this](Item *i){
+        i->indexed_parent_serial = 0;
+        RemoveItem(*i);
+    });
 }
 
 void
@@ -111,7 +304,10 @@ World::Apply(const struct uo_packet_container_update_6 &p) noexcept
 {
     assert(p.cmd == PCK_ContainerUpdate);
 
-    MakeItem(p.item.serial).Apply(p);
+    auto &i = MakeItem(p.item.serial);
+    i.Apply(p);
+    UpdateParent(i);
+    UpdateGrid(i);
 }
 
 void
@@ -129,6 +325,8 @@ World::Apply(const struct uo_packet_container_content_6 &p) noexcept
         i.socket.container.cmd = PCK_ContainerUpdate;
         i.socket.container.item = *pi;
         i.attach_sequence = attach_sequence;
+        UpdateParent(i);
+        UpdateGrid(i);
     }
 
     /* delete obsolete items; assuming that all parent_serials are the
@@ -140,27 +338,46 @@ World::Apply(const struct uo_packet_container_content_6 &p) noexcept
 void
 World::RemoveItem(Item &item) noexcept
 {
+    UnlinkParent(item);
+    UnlinkGrid(item);
+    items_by_serial.Remove(item);
     item.unlink();
-    delete &item;
+    item_allocator.Delete(&item);
+}
+
+void
+World::ClearItems() noexcept
+{
+    for (auto i = grid.begin(); i != grid.end();) {
+        i->second.items.clear();
+        if (i->second.empty())
+            i = grid.erase(i);
+        else
+            ++i;
+    }
+
+    children.clear();
+    items_by_serial.Clear();
+    items.clear();
+    item_allocator.Clear();
 }
 
 void
 World::RemoveItemTree(uint32_t parent_serial) noexcept
 {
-    IntrusiveList<Item> temp;
+    auto c = children.find(parent_serial);
+    if (c == children.end())
+        return;
 
-    /* move all direct children to the temporary list */
-    items.remove_and_dispose_if([parent_serial](const Item &i){
-        return i.GetParentSerial() == parent_serial;
-    }, [&temp](Item *i){
-        /* move to temp list */
-        temp.push_back(*i);
-    });
+    /* detach all direct children from the index */
+    ItemChildList temp(std::move(c->second));
+    children.erase(c);
 
     /* delete these, and recursively delete their children */
     temp.clear_and_dispose([this](Item *i){
+        i->indexed_parent_serial = 0;
         RemoveItemTree(i->serial);
-        delete i;
+        RemoveItem(*i);
     });
 }
 
@@ -179,11 +396,7 @@ World::RemoveItemSerial(uint32_t serial) noexcept
 Mobile *
 World::FindMobile(uint32_t serial) noexcept
 {
-    for (auto &i : mobiles)
-        if (i.serial == serial)
-            return &i;
-
-    return nullptr;
+    return mobiles_by_serial.Find(serial);
 }
 
 Mobile &
@@ -193,8 +406,9 @@ World::MakeMobile(uint32_t serial) noexcept
     if (m != nullptr)
         return *m;
 
-    m = new Mobile(serial);
+    m = mobile_allocator.New(serial);
     mobiles.push_front(*m);
+    mobiles_by_serial.Insert(*m);
     return *m;
 }
 
@@ -254,9 +468,13 @@ World::Apply(const struct uo_packet_mobile_incoming &p) noexcept
     }
 
     auto &m = MakeMobile(p.serial);
-    m.packet_mobile_incoming = {&p, p.length};
+    m.packet_mobile_incoming.assign(&p, p.length);
+    UpdateGrid(m);
 
     read_equipped(this, &p);
+
+    if (p.serial == packet_start.serial)
+        PlayerMoved();
 }
 
 void
@@ -269,7 +487,7 @@ World::Apply(const struct uo_packet_mobile_status &p) noexcept
     /* XXX: check if p.flags is available */
     if (m.packet_mobile_status == nullptr ||
         m.packet_mobile_status->flags <= p.flags)
-        m.packet_mobile_status = {&p, p.length};
+        m.packet_mobile_status.assign(&p, p.length);
 }
 
 void
@@ -284,6 +502,8 @@ World::Apply(const struct uo_packet_mobile_update &p) noexcept
         packet_start.y = p.y;
         packet_start.z = p.z;
         packet_start.direction = p.direction;
+
+        PlayerMoved();
     }
 
     Mobile *m = FindMobile(p.serial);
@@ -302,6 +522,7 @@ World::Apply(const struct uo_packet_mobile_update &p) noexcept
         m->packet_mobile_incoming->direction = p.direction;
         m->packet_mobile_incoming->hue = p.hue;
         m->packet_mobile_incoming->flags = p.flags;
+        UpdateGrid(*m);
     }
 }
 
@@ -323,6 +544,8 @@ World::Apply(const struct uo_packet_mobile_moving &p) noexcept
         packet_mobile_update.y = p.y;
         packet_mobile_update.direction = p.direction;
         packet_mobile_update.z = p.z;
+
+        PlayerMoved();
     }
 
     Mobile *m = FindMobile(p.serial);
@@ -342,6 +565,7 @@ World::Apply(const struct uo_packet_mobile_moving &p) noexcept
         m->packet_mobile_incoming->hue = p.hue;
         m->packet_mobile_incoming->flags = p.flags;
         m->packet_mobile_incoming->notoriety = p.notoriety;
+        UpdateGrid(*m);
     }
 }
 
@@ -355,13 +579,48 @@ World::Apply(const struct uo_packet_zone_change &p) noexcept
     packet_mobile_update.x = p.x;
     packet_mobile_update.y = p.y;
     packet_mobile_update.z = p.z;
+
+    PlayerMoved();
 }
 
 void
 World::RemoveMobile(Mobile &mobile) noexcept
 {
+    UnlinkGrid(mobile);
+    mobiles_by_serial.Remove(mobile);
     mobile.unlink();
-    delete &mobile;
+    mobile_allocator.Delete(&mobile);
+}
+
+void
+World::ClearMobiles() noexcept
+{
+    for (auto i = grid.begin(); i != grid.end();) {
+        i->second.mobiles.clear();
+        if (i->second.empty())
+            i = grid.erase(i);
+        else
+            ++i;
+    }
+
+    mobiles_by_serial.Clear();
+    mobiles.clear_and_dispose([this](Mobile *m){
+        mobile_allocator.Delete(m);
+    });
+}
+
+void
+World::ClearAllButPlayer() noexcept
+{
+    ClearItems();
+
+    for (auto i = mobiles.begin(); i != mobiles.end();) {
+        Mobile &m = *i;
+        ++i;
+
+        if (m.serial != packet_start.serial)
+            RemoveMobile(m);
+    }
 }
 
 void
@@ -404,6 +663,8 @@ World::Walked(uint16_t x, uint16_t y,
         m->packet_mobile_incoming->direction = direction;
         m->packet_mobile_incoming->notoriety = notoriety;
     }
+
+    PlayerMoved();
 }
 
 void
@@ -423,4 +684,184 @@ World::WalkCancel(uint16_t x, uint16_t y, uint8_t direction) noexcept
         m->packet_mobile_incoming->y = y;
         m->packet_mobile_incoming->direction = direction;
     }
+
+    PlayerMoved();
+}
+
+/**
+ * Estimate the memory allocated by a std::unordered_map: one node
+ * (the value and a "next" pointer) per element, and the bucket
+ * array.
+ */
+template<typename M>
+static size_t
+GetHashMapMemoryUsage(const M &m) noexcept
+{
+    return m.size() * (sizeof(typename M::value_type) + sizeof(void *)) +
+        m.bucket_count() * sizeof(void *);
+}
+
+size_t
+World::GetMemoryUsage() const noexcept
+{
+    size_t result = mobile_allocator.GetMemoryUsage() +
+        item_allocator.GetMemoryUsage() +
+        mobiles_by_serial.GetMemoryUsage() +
+        items_by_serial.GetMemoryUsage() +
+        GetHashMapMemoryUsage(children) +
+        GetHashMapMemoryUsage(grid);
+
+    for (const auto &m : mobiles)
+        result += m.packet_mobile_incoming.GetCapacity() +
+            m.packet_mobile_status.GetCapacity();
+
+    return result;
+}
+
+void
+World::Save(Serializer &s) const
+{
+    s.WritePacket(packet_start);
+    s.WritePacket(packet_map_change);
+    s.WritePacket(packet_map_patches);
+    s.WritePacket(packet_season);
+    s.WritePacket(packet_mobile_update);
+    s.WritePacket(packet_global_light_level);
+    s.WritePacket(packet_personal_light_level);
+    s.WritePacket(packet_war_mode);
+    s.WritePacket(packet_target);
+
+    /* the objects are restored with push_front(); save them in
+       reverse order to keep the order of the lists */
+
+    std::vector<const Mobile *> m;
+    for (const auto &i : mobiles)
+        m.push_back(&i);
+
+    s.WriteU32(m.size());
+    for (auto i = m.rbegin(); i != m.rend(); ++i) {
+        s.WriteU32((*i)->serial);
+        s.WriteVarStruct((*i)->packet_mobile_incoming);
+        s.WriteVarStruct((*i)->packet_mobile_status);
+    }
+
+    std::vector<const Item *> v;
+    for (const auto &i : items)
+        v.push_back(&i);
+
+    s.WriteU32(v.size());
+    for (auto i = v.rbegin(); i != v.rend(); ++i) {
+        const Item &item = **i;
+
+        s.WriteU32(item.serial);
+        s.WriteU8(item.socket.cmd);
+
+        switch (item.socket.cmd) {
+        case PCK_WorldItem7:
+            s.WritePacket(item.socket.ground);
+            break;
+
+        case PCK_ContainerUpdate:
+            s.WritePacket(item.socket.container);
+            break;
+
+        case PCK_Equip:
+            s.WritePacket(item.socket.mobile);
+            break;
+        }
+
+        s.WritePacket(item.packet_container_open);
+    }
+}
+
+void
+World::Load(Deserializer &d)
+{
+    assert(mobiles.empty());
+    assert(items.empty());
+
+    d.ReadPacket(packet_start);
+    d.ReadPacket(packet_map_change);
+    d.ReadPacket(packet_map_patches);
+    d.ReadPacket(packet_season);
+    d.ReadPacket(packet_mobile_update);
+    d.ReadPacket(packet_global_light_level);
+    d.ReadPacket(packet_personal_light_level);
+    d.ReadPacket(packet_war_mode);
+    d.ReadPacket(packet_target);
+
+    /* mobiles first: their equipment comes from MobileIncoming, and
+       the item packets which follow are more recent */
+
+    for (uint32_t n = d.ReadU32(); n > 0; --n) {
+        const uint32_t serial = d.ReadU32();
+
+        VarStructPtr<struct uo_packet_mobile_incoming> incoming;
+        d.ReadVarStruct(incoming,
+                        offsetof(struct uo_packet_mobile_incoming, items));
+
+        VarStructPtr<struct uo_packet_mobile_status> status;
+        d.ReadVarStruct(status,
+                        offsetof(struct uo_packet_mobile_status, female));
+
+        if ((incoming && (incoming->cmd != PCK_MobileIncoming ||
+                          incoming->length != incoming.size() ||
+                          incoming->serial != serial)) ||
+            (status && (status->cmd != PCK_MobileStatus ||
+                        status->length != status.size() ||
+                        status->serial != serial)))
+            throw std::runtime_error("malformed mobile in upgrade record");
+
+        MakeMobile(serial);
+        if (incoming)
+            Apply(*incoming);
+        if (status)
+            Apply(*status);
+    }
+
+    for (uint32_t n = d.ReadU32(); n > 0; --n) {
+        const uint32_t serial = d.ReadU32();
+        const uint8_t cmd = d.ReadU8();
+
+        union {
+            struct uo_packet_world_item_7 ground;
+            struct uo_packet_container_update_6 container;
+            struct uo_packet_equip mobile;
+        } u;
+
+        switch (cmd) {
+        case 0:
+            MakeItem(serial);
+            break;
+
+        case PCK_WorldItem7:
+            d.ReadPacket(u.ground);
+            if (u.ground.cmd != cmd || u.ground.serial != serial)
+                throw std::runtime_error("malformed item in upgrade record");
+            Apply(u.ground);
+            break;
+
+        case PCK_ContainerUpdate:
+            d.ReadPacket(u.container);
+            if (u.container.cmd != cmd || u.container.item.serial != serial)
+                throw std::runtime_error("malformed item in upgrade record");
+            Apply(u.container);
+            break;
+
+        case PCK_Equip:
+            d.ReadPacket(u.mobile);
+            if (u.mobile.cmd != cmd || u.mobile.serial != serial)
+                throw std::runtime_error("malformed item in upgrade record");
+            Apply(u.mobile);
+            break;
+
+        default:
+            throw std::runtime_error("malformed item in upgrade record");
+        }
+
+        struct uo_packet_container_open container_open;
+        d.ReadPacket(container_open);
+        if (container_open.cmd == PCK_ContainerOpen)
+            MakeItem(serial).Apply(container_open);
+    }
 }
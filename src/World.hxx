@@ -23,12 +23,48 @@
 
 #include "util/IntrusiveList.hxx"
 #include "util/VarStructPtr.hxx"
+#include "SerialMap.hxx"
+#include "SlabAllocator.hxx"
 #include "PacketStructs.hxx"
 #include "PacketType.hxx"
 
-struct Item final : IntrusiveListHook {
+#include <unordered_map>
+
+class Serializer;
+class Deserializer;
+
+struct ItemSiblingTag {};
+struct WorldGridTag {};
+
+/**
+ * The #World::grid cell of an object which is not in the grid.
+ */
+static constexpr uint32_t NO_GRID_CELL = ~uint32_t(0);
+
+struct Item final : IntrusiveListHook, IntrusiveListTaggedHook<ItemSiblingTag>,
+                    IntrusiveListTaggedHook<WorldGridTag> {
     const uint32_t serial;
 
+    /**
+     * Managed by #SerialMap.
+     */
+    Item *serial_next;
+
+    /**
+     * The parent serial under which this item is registered in
+     * World::children (i.e. the list it is linked in with its
+     * #ItemSiblingTag hook); 0 if none.  Updated by
+     * World::UpdateParent() after the #socket has been modified.
+     */
+    uint32_t indexed_parent_serial = 0;
+
+    /**
+     * The World::grid cell this item is linked in (with its
+     * #WorldGridTag hook) because it lies on the ground, or
+     * #NO_GRID_CELL.
+     */
+    uint32_t grid_cell = NO_GRID_CELL;
+
     union {
         uint8_t cmd;
 
@@ -92,8 +128,19 @@ struct Item final : IntrusiveListHook {
     }
 };
 
-struct Mobile final : IntrusiveListHook {
+struct Mobile final : IntrusiveListHook, IntrusiveListTaggedHook<WorldGridTag> {
     const uint32_t serial;
+
+    /**
+     * Managed by #SerialMap.
+     */
+    Mobile *serial_next;
+
+    /**
+     * The World::grid cell this mobile is linked in, or
+     * #NO_GRID_CELL if its position is unknown.
+     */
+    uint32_t grid_cell = NO_GRID_CELL;
     VarStructPtr<struct uo_packet_mobile_incoming> packet_mobile_incoming;
     VarStructPtr<struct uo_packet_mobile_status> packet_mobile_status;
 
@@ -119,15 +166,74 @@ struct World {
     struct uo_packet_war_mode packet_war_mode{};
     struct uo_packet_target packet_target{};
 
+    SlabAllocator<Mobile> mobile_allocator;
+    SlabAllocator<Item> item_allocator;
+
     /* mobiles in the world */
 
     IntrusiveList<Mobile> mobiles;
+    SerialMap<Mobile> mobiles_by_serial;
 
     /* items in the world */
 
     IntrusiveList<Item> items;
+    SerialMap<Item> items_by_serial;
+
+    using ItemChildList =
+        IntrusiveList<Item, IntrusiveListTaggedHookTraits<Item, ItemSiblingTag>>;
+
+    /**
+     * Maps a parent serial (container item or mobile) to the items
+     * it contains or wears.  The parent does not need to exist.
+     * Entries are removed when their list becomes empty.
+     */
+    std::unordered_map<uint32_t, ItemChildList> children;
+
+    /**
+     * The size of one World::grid cell in tiles (as a power of two).
+     */
+    static constexpr unsigned GRID_SHIFT = 3;
+
+    struct GridCell {
+        IntrusiveList<Item, IntrusiveListTaggedHookTraits<Item, WorldGridTag>> items;
+        IntrusiveList<Mobile, IntrusiveListTaggedHookTraits<Mobile, WorldGridTag>> mobiles;
+
+        bool empty() const noexcept {
+            return items.empty() && mobiles.empty();
+        }
+    };
+
+    /**
+     * Ground items and mobiles by their position, used to evict
+     * those which are out of #view_range.  Cells are keyed by
+     * MakeGridCell(); empty cells are removed.
+     */
+    std::unordered_map<uint32_t, GridCell> grid;
+
+    /**
+     * Items on the ground and mobiles farther away from the player
+     * than this number of tiles (at least; the check is done per
+     * grid cell) are forgotten, just like the client does.  Their
+     * contents and equipment go with them.  0 disables this.
+     */
+    unsigned view_range = 0;
+
+    /**
+     * The grid cell of the player when objects were evicted last.
+     */
+    uint32_t player_cell = NO_GRID_CELL;
+
     unsigned item_attach_sequence = 0;
 
+    World() = default;
+    World(const World &) = delete;
+    World &operator=(const World &) = delete;
+
+    ~World() noexcept {
+        ClearItems();
+        ClearMobiles();
+    }
+
     bool HasStart() const noexcept {
         return packet_start.serial != 0;
     }
@@ -137,6 +243,12 @@ struct World {
 
     void RemoveItem(Item &item) noexcept;
 
+    /**
+     * Delete all items.  This releases the memory slabs at once
+     * without visiting each item.
+     */
+    void ClearItems() noexcept;
+
     /** deep-delete all items contained in the specified serial */
     void RemoveItemTree(uint32_t parent_serial) noexcept;
 
@@ -157,6 +269,16 @@ struct World {
     Mobile &MakeMobile(uint32_t serial) noexcept;
 
     void RemoveMobile(Mobile &mobile) noexcept;
+
+    /**
+     * Delete all mobiles.
+     */
+    void ClearMobiles() noexcept;
+
+    /**
+     * Delete all items and all mobiles except the player's.
+     */
+    void ClearAllButPlayer() noexcept;
     void RemoveMobileSerial(uint32_t serial) noexcept;
 
     void Apply(const struct uo_packet_mobile_incoming &p) noexcept;
@@ -172,6 +294,54 @@ struct World {
                 uint8_t direction, uint8_t notoriety) noexcept;
 
     void WalkCancel(uint16_t x, uint16_t y, uint8_t direction) noexcept;
+
+    /**
+     * The number of bytes allocated for entities, their packets and
+     * the indexes (the hash table nodes are estimated).
+     */
+    size_t GetMemoryUsage() const noexcept;
+
+    /**
+     * Save everything for a new process (see #UpgradeServer).
+     */
+    void Save(Serializer &s) const;
+
+    /**
+     * Restore what Save() has written into this (empty) object.
+     */
+    void Load(Deserializer &d);
+
+private:
+    static constexpr uint32_t MakeGridCell(unsigned x, unsigned y) noexcept {
+        return (uint32_t(x) >> GRID_SHIFT) << 16 | (uint32_t(y) >> GRID_SHIFT);
+    }
+
+    /**
+     * Move the object to the grid cell of its current position.
+     * Call this after every modification of its position.
+     */
+    void UpdateGrid(Item &item) noexcept;
+    void UpdateGrid(Mobile &mobile) noexcept;
+
+    void UnlinkGrid(Item &item) noexcept;
+    void UnlinkGrid(Mobile &mobile) noexcept;
+
+    /**
+     * The player has (possibly) moved: if the player has entered
+     * another grid cell, evict everything which is out of
+     * #view_range now.
+     */
+    void PlayerMoved() noexcept;
+
+    void EvictCell(uint32_t cell) noexcept;
+
+    /**
+     * Move the item to the children list of its (new) parent.  Call
+     * this after every modification of Item::socket.
+     */
+    void UpdateParent(Item &item) noexcept;
+
+    void UnlinkParent(Item &item) noexcept;
 };
 
 #endif
@@ -63,6 +63,8 @@ public:
 
 	DynamicFifoBuffer(const DynamicFifoBuffer &) = delete;
 
+	using ForeignFifoBuffer<T>::IsNull;
+	using ForeignFifoBuffer<T>::IsDefined;
 	using ForeignFifoBuffer<T>::GetCapacity;
 	using ForeignFifoBuffer<T>::Clear;
 	using ForeignFifoBuffer<T>::empty;
@@ -73,6 +75,27 @@ public:
 	using ForeignFifoBuffer<T>::Write;
 	using ForeignFifoBuffer<T>::Append;
 
+	/**
+	 * Allocate a buffer after construction with nullptr or after
+	 * Free().
+	 */
+	void Allocate(size_type _capacity) noexcept {
+		assert(IsNull());
+
+		ForeignFifoBuffer<T>::SetBuffer(new T[_capacity], _capacity);
+	}
+
+	/**
+	 * Free the (empty) buffer; Allocate() must be called before it
+	 * can be used again.
+	 */
+	void Free() noexcept {
+		assert(empty());
+
+		delete[] GetBuffer();
+		ForeignFifoBuffer<T>::SetNull();
+	}
+
 	void Grow(size_type new_capacity) noexcept {
 		assert(new_capacity > GetCapacity());
 
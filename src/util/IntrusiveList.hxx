@@ -45,18 +45,66 @@ struct IntrusiveListHook {
 	}
 };
 
+/**
+ * A hook which allows an object to be in more than one list at a
+ * time: derive from one #IntrusiveListTaggedHook per additional list,
+ * each with a different tag type, and instantiate the list with
+ * #IntrusiveListTaggedHookTraits.
+ */
+template<typename Tag>
+struct IntrusiveListTaggedHook {
+	IntrusiveListHook tagged_hook;
+};
+
+/**
+ * The default hook traits: the object derives from
+ * #IntrusiveListHook.
+ */
 template<typename T>
+struct IntrusiveListBaseHookTraits {
+	static constexpr T *Cast(IntrusiveListHook *hook) noexcept {
+		static_assert(std::is_base_of<IntrusiveListHook, T>::value);
+		return static_cast<T *>(hook);
+	}
+
+	static constexpr IntrusiveListHook &ToHook(T &t) noexcept {
+		return t;
+	}
+};
+
+template<typename T, typename Tag>
+struct IntrusiveListTaggedHookTraits {
+	using Hook = IntrusiveListTaggedHook<Tag>;
+
+	static T *Cast(IntrusiveListHook *hook) noexcept {
+		/* the hook is the first (and only) member of the
+		   standard-layout type "Hook" */
+		return static_cast<T *>(reinterpret_cast<Hook *>(hook));
+	}
+
+	static IntrusiveListHook &ToHook(T &t) noexcept {
+		return static_cast<Hook &>(t).tagged_hook;
+	}
+};
+
+template<typename T, typename HookTraits=IntrusiveListBaseHookTraits<T>>
 class IntrusiveList {
 	IntrusiveListHook head{&head, &head};
 
 	static constexpr T *Cast(IntrusiveListHook *hook) noexcept {
-		static_assert(std::is_base_of<IntrusiveListHook, T>::value);
-		return static_cast<T *>(hook);
+		return HookTraits::Cast(hook);
 	}
 
 	static constexpr const T *Cast(const IntrusiveListHook *hook) noexcept {
-		static_assert(std::is_base_of<IntrusiveListHook, T>::value);
-		return static_cast<const T *>(hook);
+		return HookTraits::Cast(const_cast<IntrusiveListHook *>(hook));
+	}
+
+	static constexpr IntrusiveListHook &ToHook(T &t) noexcept {
+		return HookTraits::ToHook(t);
+	}
+
+	static constexpr const IntrusiveListHook &ToHook(const T &t) noexcept {
+		return HookTraits::ToHook(const_cast<T &>(t));
 	}
 
 public:
@@ -102,7 +150,7 @@ public:
 			n = n->next;
 
 			if (pred(*i)) {
-				i->unlink();
+				ToHook(*i).unlink();
 				dispose(i);
 			}
 		}
@@ -117,7 +165,7 @@ public:
 	}
 
 	void pop_front() noexcept {
-		front().unlink();
+		ToHook(front()).unlink();
 	}
 
 	T &back() noexcept {
@@ -125,7 +173,7 @@ public:
 	}
 
 	void pop_back() noexcept {
-		back().unlink();
+		ToHook(back()).unlink();
 	}
 
 	class const_iterator;
@@ -175,7 +223,7 @@ public:
 	}
 
 	static constexpr iterator iterator_to(T &t) noexcept {
-		return {&t};
+		return {&ToHook(t)};
 	}
 
 	class const_iterator final
@@ -224,21 +272,23 @@ public:
 		return {&head};
 	}
 
-	static constexpr iterator iterator_to(const T &t) noexcept {
-		return {&t};
+	static constexpr const_iterator iterator_to(const T &t) noexcept {
+		return {&ToHook(t)};
 	}
 
 	void push_front(T &t) noexcept {
-		head.next->prev = &t;
-		t.next = head.next;
-		head.next = &t;
-		t.prev = &head;
+		auto &h = ToHook(t);
+		head.next->prev = &h;
+		h.next = head.next;
+		head.next = &h;
+		h.prev = &head;
 	}
 
 	void push_back(T &t) noexcept {
-		head.prev->next = &t;
-		t.prev = head.prev;
-		head.prev = &t;
-		t.next = &head;
+		auto &h = ToHook(t);
+		head.prev->next = &h;
+		h.prev = head.prev;
+		head.prev = &h;
+		h.next = &head;
 	}
 };
@@ -42,6 +42,12 @@ class VarStructPtr {
 
 	std::size_t the_size = 0;
 
+	/**
+	 * The allocated size of #value, which may be larger than
+	 * #the_size after assign().
+	 */
+	std::size_t capacity = 0;
+
 public:
 	VarStructPtr() = default;
 
@@ -49,7 +55,7 @@ public:
 
 	explicit VarStructPtr(std::size_t _size) noexcept
 		:value(std::make_unique<std::byte[]>(_size)),
-		 the_size(_size)
+		 the_size(_size), capacity(_size)
 	{
 		static_assert(alignof(T) == 1);
 	}
@@ -63,14 +69,30 @@ public:
 
 	VarStructPtr(VarStructPtr &&src) noexcept
 		:value(std::move(src.value)),
-		 the_size(src.the_size) {}
+		 the_size(src.the_size), capacity(src.capacity) {}
 
 	VarStructPtr &operator=(VarStructPtr &&src) noexcept {
 		value = std::move(src.value);
 		the_size = src.the_size;
+		capacity = src.capacity;
 		return *this;
 	}
 
+	/**
+	 * Replace the value with a copy of the given struct.  The
+	 * existing allocation is reused if it is large enough.
+	 */
+	void assign(const T *src, std::size_t _size) noexcept {
+		if (_size > capacity) {
+			value = std::make_unique<std::byte[]>(_size);
+			capacity = _size;
+		}
+
+		std::copy_n(reinterpret_cast<const std::byte *>(src),
+			    _size, value.get());
+		the_size = _size;
+	}
+
 	operator bool() const noexcept {
 		return !!value;
 	}
@@ -86,6 +108,7 @@ public:
 	void reset() noexcept {
 		value.reset();
 		the_size = 0;
+		capacity = 0;
 	}
 
 	T *get() const noexcept {
@@ -97,6 +120,14 @@ public:
 		return the_size;
 	}
 
+	/**
+	 * The number of bytes allocated, which may be larger than
+	 * size().
+	 */
+	std::size_t GetCapacity() const noexcept {
+		return capacity;
+	}
+
 	T *operator->() const noexcept {
 		return get();
 	}